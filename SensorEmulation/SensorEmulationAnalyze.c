@@ -0,0 +1,874 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationAnalyze.c is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationAnalyze.c is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationAnalyze.c
+ *
+ * Working:
+ *
+ * Qualifies readings captures - the .rec recordings of
+ * SensorEmulationRecord.h, or text readings logs of "[<sensor>] <ns>ns :
+ * <values>" lines. For every sensor of a capture, it prints
+ *
+ *	the number of readings and their effective rate over the capture,
+ *	the percentiles of the time between readings (all of them with -H),
+ *	the gaps - more than -g ms between readings, or 3 times the median
+ *	interval, or the mean one if the readings come in bursts like the
+ *	HAL's accelerometer and gyroscope batches - and the longest ones,
+ *	the runs of -t or more identical readings in a row, which is what
+ *	makes the HAL reset the connection (MAX_SAME_READING_TOLERANCE
+ *	repeats, so 5 readings by default),
+ *	the skew to the reference sensor (-r, the first one of the capture by
+ *	default) - how far each of its readings is from the nearest reading
+ *	of the reference.
+ *
+ * The capture is mmap()ed and cut into pieces - CHUNK_MB of text at line
+ * boundaries, or the time windows of WINDOW_BLOCKS blocks of a recording
+ * - and a round of as many pieces as there are threads (-j, the number of
+ * cores by default) is analyzed in parallel. Each piece is summed up in a
+ * struct stats per sensor, with its first and last readings and runs,
+ * which are then added up in the order of the pieces, joining the time
+ * between pieces and the runs across them. The skew is only measured
+ * between the reference's readings in the same piece. Only a round's
+ * worth of the capture is in memory at a time.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "SensorEmulationHistogram.h"
+#include "SensorEmulationRecord.h"
+
+#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+
+#define CHUNK_MB 64
+#define WINDOW_BLOCKS 64
+#define MAX_THREADS 64
+
+#define MAX_SAME_READING_TOLERANCE 4 /* As in the HAL. */
+#define GAP_MEDIANS 3
+#define TOP_GAPS 5
+
+struct run {
+	uint64_t len;
+	int64_t at;
+	int columns;
+	float v[EMU_REC_MAX_COLUMNS];
+};
+
+struct gap {
+	int64_t at; /* Of the reading before it. */
+	int64_t ns;
+};
+
+struct skew {
+	uint64_t num;
+	double sum; /* Of the distances, ahead of the other sensor's reading positive. */
+	double sum_abs;
+	int64_t max_abs;
+};
+
+struct stats {
+	uint64_t samples;
+	int64_t first_ns;
+	int64_t last_ns;
+
+	struct emu_hist intervals;
+	uint64_t backwards; /* The clock stepped back. */
+	struct gap top[TOP_GAPS]; /* Longest first. */
+
+	struct run prefix; /* The run of the first reading. */
+	struct run current; /* The run of the last one. */
+	bool one_run; /* prefix is current. */
+	uint64_t runs; /* Of same_min or more, but prefix and current. */
+	uint64_t run_samples;
+	struct run longest;
+
+	struct skew skew[EMU_REC_MAX_SENSORS]; /* To the other sensors. */
+
+	int64_t *ns; /* Of the piece, for the skew. */
+	uint32_t num_ns;
+	uint32_t ns_size;
+};
+
+// A piece of a capture.
+struct piece {
+	const char *start; /* Text. */
+	const char *end;
+	int64_t from_ns; /* Recording. */
+	int64_t to_ns;
+
+	char names[EMU_REC_MAX_SENSORS][EMU_REC_NAME_SIZE]; /* Of the piece's own sensor numbers. */
+	int num_names;
+	struct stats *stats[EMU_REC_MAX_SENSORS];
+	struct emu_rec_samples *samples;
+
+	unsigned long long lines;
+	unsigned long long skipped;
+	bool failed;
+};
+
+static int same_min = MAX_SAME_READING_TOLERANCE + 1;
+
+// Of the recording being analyzed.
+static const struct emu_rec_reader *reader;
+static uint32_t *blocks[EMU_REC_MAX_SENSORS]; /* Its index entries per sensor. */
+static uint32_t num_blocks[EMU_REC_MAX_SENSORS];
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-g gap ms] [-t identical readings] [-r reference sensor] [-H] capture...\n", prog);
+}
+
+// The sensor named name in names, added if it's new. -1 if there are too
+// many.
+static int sensor_of(char names[][EMU_REC_NAME_SIZE], int *num_names, const char *name, size_t len)
+{
+	if (len >= EMU_REC_NAME_SIZE) {
+		len = EMU_REC_NAME_SIZE - 1;
+	}
+
+	int n = 0;
+	while (n < *num_names) {
+		if (!strncmp(names[n], name, len) && names[n][len] == '\0') {
+			return n;
+		}
+		n++;
+	}
+	if (*num_names == EMU_REC_MAX_SENSORS) {
+		return -1;
+	}
+
+	memcpy(names[n], name, len);
+	names[n][len] = '\0';
+	(*num_names)++;
+
+	return n;
+}
+
+static void add_gap(struct stats *s, int64_t at, int64_t ns)
+{
+	int i = TOP_GAPS;
+	while (i > 0 && s->top[i - 1].ns < ns) {
+		if (i < TOP_GAPS) {
+			s->top[i] = s->top[i - 1];
+		}
+		i--;
+	}
+	if (i < TOP_GAPS) {
+		s->top[i].at = at;
+		s->top[i].ns = ns;
+	}
+}
+
+static void add_interval(struct stats *s, int64_t from, int64_t to)
+{
+	if (to < from) {
+		s->backwards++;
+		return;
+	}
+	emu_hist_record(&s->intervals, to - from);
+	add_gap(s, from, to - from);
+}
+
+static bool same_run(const struct run *r, const float *v, int columns)
+{
+	return r->columns == columns && !memcmp(r->v, v, columns * sizeof(*v));
+}
+
+static void end_run(struct stats *s, const struct run *r)
+{
+	if (r->len < (uint64_t)same_min) {
+		return;
+	}
+	s->runs++;
+	s->run_samples += r->len;
+	if (r->len > s->longest.len) {
+		s->longest = *r;
+	}
+}
+
+static void start_run(struct run *r, int64_t ns, const float *v, int columns)
+{
+	r->len = 1;
+	r->at = ns;
+	r->columns = columns;
+	memcpy(r->v, v, columns * sizeof(*v));
+}
+
+static bool add_sample(struct piece *p, int sensor, int64_t ns, const float *v, int columns)
+{
+	struct stats *s = p->stats[sensor];
+	if (!s) {
+		s = (struct stats *)calloc(1, sizeof(*s));
+		if (!s) {
+			return false;
+		}
+		p->stats[sensor] = s;
+	}
+
+	if (!s->samples) {
+		s->first_ns = ns;
+		start_run(&s->prefix, ns, v, columns);
+		s->current = s->prefix;
+		s->one_run = true;
+	} else {
+		add_interval(s, s->last_ns, ns);
+		if (same_run(&s->current, v, columns)) {
+			s->current.len++;
+			if (s->one_run) {
+				s->prefix.len++;
+			}
+		} else {
+			if (s->one_run) {
+				s->one_run = false; // It may go on from the piece before.
+			} else {
+				end_run(s, &s->current);
+			}
+			start_run(&s->current, ns, v, columns);
+		}
+	}
+	s->last_ns = ns;
+	s->samples++;
+
+	if (s->num_ns == s->ns_size) {
+		uint32_t new_size = s->ns_size ? s->ns_size * 2 : 1024;
+		int64_t *new_ns = (int64_t *)realloc(s->ns, new_size * sizeof(*new_ns));
+		if (!new_ns) {
+			return false;
+		}
+		s->ns = new_ns;
+		s->ns_size = new_size;
+	}
+	s->ns[s->num_ns++] = ns;
+
+	return true;
+}
+
+// How far each of a's readings is from the nearest one of b. Those outside
+// of b's readings in the piece may be nearest to one in another piece, and
+// aren't measured.
+static void measure_skew(struct skew *k, const struct stats *a, const struct stats *b)
+{
+	uint32_t j = 0;
+	uint32_t i = 0;
+	while (i < a->num_ns) {
+		int64_t t = a->ns[i];
+		if (t < b->ns[0] || t > b->ns[b->num_ns - 1]) {
+			i++;
+			continue;
+		}
+		while (j + 1 < b->num_ns && b->ns[j + 1] <= t) {
+			j++;
+		}
+		int64_t d = t - b->ns[j];
+		if (j + 1 < b->num_ns && b->ns[j + 1] - t < (d < 0 ? -d : d)) {
+			d = t - b->ns[j + 1];
+		}
+		int64_t abs_d = d < 0 ? -d : d;
+		k->num++;
+		k->sum += d;
+		k->sum_abs += abs_d;
+		if (abs_d > k->max_abs) {
+			k->max_abs = abs_d;
+		}
+		i++;
+	}
+}
+
+static void analyze_text(struct piece *p)
+{
+	const char *line = p->start;
+	while (line < p->end && !p->failed) {
+		const char *eol = (const char *)memchr(line, '\n', p->end - line);
+		if (!eol) {
+			eol = p->end;
+		}
+		const char *name = NULL;
+		size_t len = 0;
+		int64_t ns = 0;
+		float v[EMU_REC_MAX_COLUMNS];
+		int columns = 0;
+		int sensor = -1;
+		if (eol > line) {
+			if (emu_rec_parse_line(line, eol, &name, &len, &ns, v, &columns) &&
+				(sensor = sensor_of(p->names, &p->num_names, name, len)) != -1) {
+				p->failed = !add_sample(p, sensor, ns, v, columns);
+			} else {
+				p->skipped++;
+			}
+		}
+		p->lines++;
+		line = eol + 1;
+	}
+}
+
+// The first of the sensor's blocks that may have readings from ns on.
+static uint32_t first_block(int sensor, int64_t ns)
+{
+	uint32_t lo = 0;
+	uint32_t hi = num_blocks[sensor];
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (reader->index[blocks[sensor][mid]].last_ns < ns) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static void analyze_recording(struct piece *p)
+{
+	memcpy(p->names, reader->header.names, sizeof(p->names));
+	p->num_names = reader->header.num_sensors;
+
+	int n = 0;
+	while (n < p->num_names && !p->failed) {
+		uint32_t b = first_block(n, p->from_ns);
+		while (b < num_blocks[n] && !p->failed) {
+			uint32_t i = blocks[n][b++];
+			if (reader->index[i].first_ns >= p->to_ns) {
+				break;
+			}
+			if (!emu_rec_decode(reader, i, p->samples)) {
+				ERR("Block at %llu is corrupt\n", (unsigned long long)reader->index[i].offset);
+				continue;
+			}
+			const struct emu_rec_samples *s = p->samples;
+			int k = 0;
+			while (k < s->num && !p->failed) {
+				if (s->ns[k] >= p->from_ns && s->ns[k] < p->to_ns) {
+					float v[EMU_REC_MAX_COLUMNS];
+					int c = 0;
+					while (c < s->columns) {
+						v[c] = s->v[c][k];
+						c++;
+					}
+					p->failed = !add_sample(p, n, s->ns[k], v, s->columns);
+				}
+				k++;
+			}
+		}
+		n++;
+	}
+}
+
+static void *analyze_piece(void *arg)
+{
+	struct piece *p = (struct piece *)arg;
+
+	if (p->start) {
+		analyze_text(p);
+	} else {
+		analyze_recording(p);
+	}
+
+	int a = 0;
+	while (a < EMU_REC_MAX_SENSORS) {
+		int b = 0;
+		while (b < EMU_REC_MAX_SENSORS && p->stats[a]) {
+			if (a != b && p->stats[b]) {
+				measure_skew(&p->stats[a]->skew[b], p->stats[a], p->stats[b]);
+			}
+			b++;
+		}
+		a++;
+	}
+
+	return NULL;
+}
+
+static void free_piece(struct piece *p)
+{
+	int n = 0;
+	while (n < EMU_REC_MAX_SENSORS) {
+		if (p->stats[n]) {
+			free(p->stats[n]->ns);
+			free(p->stats[n]);
+		}
+		n++;
+	}
+	free(p->samples);
+}
+
+// Adds the piece's readings of a sensor to those of the pieces before it.
+static void add_stats(struct stats *t, const struct stats *s, const int *map)
+{
+	if (!t->samples) {
+		t->first_ns = s->first_ns;
+		t->prefix = s->prefix;
+		t->current = s->current;
+		t->one_run = s->one_run;
+	} else {
+		add_interval(t, t->last_ns, s->first_ns);
+		if (same_run(&t->current, s->prefix.v, s->prefix.columns)) {
+			t->current.len += s->prefix.len;
+			if (t->one_run) {
+				t->prefix.len += s->prefix.len;
+			}
+			if (!s->one_run) {
+				if (t->one_run) {
+					t->one_run = false;
+				} else {
+					end_run(t, &t->current);
+				}
+				t->current = s->current;
+			}
+		} else {
+			if (t->one_run) {
+				t->one_run = false;
+			} else {
+				end_run(t, &t->current);
+			}
+			if (!s->one_run) {
+				end_run(t, &s->prefix);
+			}
+			t->current = s->current;
+		}
+	}
+	t->last_ns = s->last_ns;
+	t->samples += s->samples;
+
+	emu_hist_merge(&t->intervals, &s->intervals);
+	t->backwards += s->backwards;
+	int i = 0;
+	while (i < TOP_GAPS && s->top[i].ns) {
+		add_gap(t, s->top[i].at, s->top[i].ns);
+		i++;
+	}
+
+	t->runs += s->runs;
+	t->run_samples += s->run_samples;
+	if (s->longest.len > t->longest.len) {
+		t->longest = s->longest;
+	}
+
+	int n = 0;
+	while (n < EMU_REC_MAX_SENSORS) {
+		if (s->skew[n].num) {
+			struct skew *k = &t->skew[map[n]];
+			k->num += s->skew[n].num;
+			k->sum += s->skew[n].sum;
+			k->sum_abs += s->skew[n].sum_abs;
+			if (s->skew[n].max_abs > k->max_abs) {
+				k->max_abs = s->skew[n].max_abs;
+			}
+		}
+		n++;
+	}
+}
+
+static double percentile(const struct stats *s, double q)
+{
+	return emu_hist_percentile(&s->intervals, q) / 1E6;
+}
+
+static void print_stats(char names[][EMU_REC_NAME_SIZE], int n, struct stats *s, int reference, double gap_ms, bool histogram)
+{
+	// The last runs only end with the capture.
+	if (!s->one_run) {
+		end_run(s, &s->prefix);
+	}
+	end_run(s, &s->current);
+
+	double secs = (s->last_ns - s->first_ns) / 1E9;
+	printf("%s: %llu readings in %.3f s, %.2f/s\n", names[n], (unsigned long long)s->samples, secs,
+			secs > 0 ? (s->samples - 1) / secs : 0.0);
+
+	uint64_t num = s->intervals.count;
+	if (!num) {
+		return;
+	}
+
+	double median = percentile(s, 0.5);
+	printf("\tintervals: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms, %llu backwards\n",
+			median, percentile(s, 0.9), percentile(s, 0.99), percentile(s, 0.999),
+			s->top[0].ns / 1E6, (unsigned long long)s->backwards);
+
+	if (histogram) {
+		// A line per power of 2.
+		int b = 0;
+		while (b < EMU_HIST_BUCKETS) {
+			int end = b + EMU_HIST_SUB;
+			uint64_t count = 0;
+			int i = b;
+			while (i < end) {
+				count += s->intervals.buckets[i];
+				i++;
+			}
+			if (count) {
+				printf("\t\t%10.3f - %10.3f ms: %llu (%.2f%%)\n", emu_hist_lowest(b) / 1E6,
+						(emu_hist_highest(end - 1) + 1) / 1E6, (unsigned long long)count, 100.0 * count / num);
+			}
+			b = end;
+		}
+	}
+
+	double usual = secs * 1E3 / num > median ? secs * 1E3 / num : median;
+	double limit = gap_ms > 0 ? gap_ms : GAP_MEDIANS * usual;
+	uint64_t gaps = 0;
+	int b = 0;
+	while (b < EMU_HIST_BUCKETS) {
+		if (emu_hist_lowest(b) > limit * 1E6) {
+			gaps += s->intervals.buckets[b];
+		}
+		b++;
+	}
+	printf("\tgaps over %.3f ms: %llu", limit, (unsigned long long)gaps);
+	int i = 0;
+	while (i < TOP_GAPS && s->top[i].ns > limit * 1E6) {
+		printf("%s%.3f ms at %lldns", i ? ", " : ", longest ", s->top[i].ns / 1E6, (long long)s->top[i].at);
+		i++;
+	}
+	printf("\n");
+
+	printf("\tidentical runs of %d or more: %llu, %llu readings", same_min, (unsigned long long)s->runs,
+			(unsigned long long)s->run_samples);
+	if (s->runs) {
+		printf(", longest %llu at %lldns", (unsigned long long)s->longest.len, (long long)s->longest.at);
+	}
+	printf("\n");
+
+	const struct skew *k = &s->skew[reference];
+	if (reference != n && k->num) {
+		printf("\tskew to %s: mean %.3f ms, mean signed %.3f ms, max %.3f ms\n", names[reference],
+				k->sum_abs / k->num / 1E6, k->sum / k->num / 1E6, k->max_abs / 1E6);
+	}
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// The time windows of a recording, of WINDOW_BLOCKS blocks each, from
+// cuts[i] to cuts[i + 1].
+static int64_t *cut_recording(const struct emu_rec_reader *r, uint32_t *num)
+{
+	int64_t *first = (int64_t *)malloc((r->entries + 1) * sizeof(*first));
+	if (!first) {
+		return NULL;
+	}
+	uint32_t i = 0;
+	while (i < r->entries) {
+		first[i] = r->index[i].first_ns;
+		i++;
+	}
+	qsort(first, r->entries, sizeof(*first), compare_ns);
+
+	*num = 0;
+	i = 0;
+	while (i < r->entries) {
+		first[(*num)++] = i ? first[i] : INT64_MIN;
+		i += WINDOW_BLOCKS;
+	}
+	first[*num] = INT64_MAX;
+
+	return first;
+}
+
+static bool analyze(const char *path, int threads, double gap_ms, const char *reference, bool histogram)
+{
+	bool success = false;
+	int fd = -1;
+	char *map = NULL;
+	size_t size = 0;
+	struct emu_rec_reader r;
+	bool recording = false;
+	int64_t *cuts = NULL;
+	uint32_t num_cuts = 0;
+	uint32_t next_cut = 0;
+	const char *text = NULL;
+	struct piece pieces[MAX_THREADS];
+	pthread_t pth[MAX_THREADS];
+	struct stats *totals[EMU_REC_MAX_SENSORS];
+	char names[EMU_REC_MAX_SENSORS][EMU_REC_NAME_SIZE];
+	int num_names = 0;
+	unsigned long long lines = 0;
+	unsigned long long skipped = 0;
+	unsigned long long samples = 0;
+	struct timespec started = { 0, 0 };
+	struct timespec finished = { 0, 0 };
+	struct stat st;
+	double secs = 0;
+	int ref = 0;
+	int i = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	memset(totals, 0, sizeof(totals));
+	memset(blocks, 0, sizeof(blocks));
+	memset(num_blocks, 0, sizeof(num_blocks));
+
+	if (emu_rec_map(&r, path)) {
+		recording = true;
+		reader = &r;
+		size = r.size;
+		uint32_t e = 0;
+		while (e < r.entries) {
+			if (r.index[e].sensor < r.header.num_sensors) {
+				num_blocks[r.index[e].sensor]++;
+			}
+			e++;
+		}
+		i = 0;
+		while (i < (int)r.header.num_sensors) {
+			blocks[i] = (uint32_t *)malloc((num_blocks[i] + 1) * sizeof(*blocks[i]));
+			if (!blocks[i]) {
+				ERR("malloc - %s\n", strerror(errno));
+				goto done;
+			}
+			num_blocks[i] = 0;
+			i++;
+		}
+		e = 0;
+		while (e < r.entries) {
+			int n = r.index[e].sensor;
+			if (n < (int)r.header.num_sensors) {
+				blocks[n][num_blocks[n]++] = e;
+			}
+			e++;
+		}
+		cuts = cut_recording(&r, &num_cuts);
+		if (!cuts) {
+			ERR("malloc - %s\n", strerror(errno));
+			goto done;
+		}
+	} else if (errno != EINVAL) {
+		ERR("%s - %s\n", path, strerror(errno));
+		return false;
+	} else {
+		fd = open(path, O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) == -1) {
+			ERR("%s - %s\n", path, strerror(errno));
+			goto done;
+		}
+		size = st.st_size;
+		if (size) {
+			map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map == MAP_FAILED) {
+				map = NULL;
+				ERR("mmap %s - %s\n", path, strerror(errno));
+				goto done;
+			}
+			madvise(map, size, MADV_SEQUENTIAL);
+		}
+		text = map;
+	}
+
+	while (recording ? next_cut < num_cuts : text < map + size) {
+		int num = 0;
+		while (num < threads && (recording ? next_cut < num_cuts : text < map + size)) {
+			struct piece *p = &pieces[num];
+			memset(p, 0, sizeof(*p));
+			if (recording) {
+				p->from_ns = cuts[next_cut];
+				p->to_ns = cuts[next_cut + 1];
+				next_cut++;
+				p->samples = (struct emu_rec_samples *)malloc(sizeof(*p->samples));
+				p->failed = !p->samples;
+			} else {
+				p->start = text;
+				p->end = (size_t)(map + size - text) > CHUNK_MB * 1024UL * 1024 ?
+						text + CHUNK_MB * 1024UL * 1024 : map + size;
+				// Up to the end of the line it's in the middle of.
+				const char *eol = (const char *)memchr(p->end, '\n', map + size - p->end);
+				if (p->end < map + size) {
+					p->end = eol ? eol + 1 : map + size;
+				}
+				text = p->end;
+			}
+			num++;
+		}
+
+		i = 0;
+		while (i < num) {
+			if (pieces[i].failed || pthread_create(&pth[i], NULL, analyze_piece, &pieces[i])) {
+				if (!pieces[i].failed) {
+					analyze_piece(&pieces[i]); // Here instead.
+				}
+				pth[i] = 0;
+			}
+			i++;
+		}
+
+		bool failed = false;
+		i = 0;
+		while (i < num) {
+			struct piece *p = &pieces[i];
+			if (pth[i]) {
+				pthread_join(pth[i], NULL);
+			}
+			failed = failed || p->failed;
+
+			// The sensors are numbered in the order they're in the
+			// capture, whichever thread saw them first.
+			int sensor_map[EMU_REC_MAX_SENSORS];
+			int n = 0;
+			while (n < p->num_names && !failed) {
+				sensor_map[n] = sensor_of(names, &num_names, p->names[n], strlen(p->names[n]));
+				if (sensor_map[n] == -1) {
+					ERR("%s has more than %d sensors\n", path, EMU_REC_MAX_SENSORS);
+					failed = true;
+				} else if (!totals[sensor_map[n]]) {
+					totals[sensor_map[n]] = (struct stats *)calloc(1, sizeof(struct stats));
+					failed = !totals[sensor_map[n]];
+				}
+				n++;
+			}
+			n = 0;
+			while (n < p->num_names && !failed) {
+				if (p->stats[n]) {
+					add_stats(totals[sensor_map[n]], p->stats[n], sensor_map);
+					samples += p->stats[n]->samples;
+				}
+				n++;
+			}
+
+			lines += p->lines;
+			skipped += p->skipped;
+			free_piece(p);
+			i++;
+		}
+		if (failed) {
+			ERR("Failed analyzing %s\n", path);
+			goto done;
+		}
+
+		if (map) {
+			madvise(map, text - map, MADV_DONTNEED); // Done with.
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	secs = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1E9;
+	printf("%s: %llu readings of %d sensors", path, samples, num_names);
+	if (!recording) {
+		printf(", %llu of %llu lines skipped", skipped, lines);
+	}
+	printf(", %zu bytes in %.3f s (%.1f MB/s)\n", size, secs, secs > 0 ? size / secs / 1E6 : 0.0);
+
+	if (reference) {
+		ref = 0;
+		while (ref < num_names && strcmp(names[ref], reference)) {
+			ref++;
+		}
+		if (ref == num_names) {
+			ERR("No %s in %s\n", reference, path);
+			ref = 0;
+		}
+	}
+
+	i = 0;
+	while (i < num_names) {
+		print_stats(names, i, totals[i], ref, gap_ms, histogram);
+		i++;
+	}
+
+	success = true;
+
+done:
+	i = 0;
+	while (i < EMU_REC_MAX_SENSORS) {
+		free(totals[i]);
+		free(blocks[i]);
+		blocks[i] = NULL;
+		i++;
+	}
+	free(cuts);
+	if (recording) {
+		emu_rec_unmap(&r);
+		reader = NULL;
+	}
+	if (map) {
+		munmap(map, size);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+
+	return success;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double gap_ms = 0;
+	const char *reference = NULL;
+	bool histogram = false;
+
+	int opt = -1;
+	while ((opt = getopt(argc, argv, "j:g:t:r:Hh")) != -1) {
+		switch (opt) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'g':
+				gap_ms = atof(optarg);
+				break;
+			case 't':
+				same_min = atoi(optarg);
+				break;
+			case 'r':
+				reference = optarg;
+				break;
+			case 'H':
+				histogram = true;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > MAX_THREADS) {
+		threads = MAX_THREADS;
+	}
+	if (same_min < 2) {
+		same_min = 2;
+	}
+
+	bool success = true;
+	int i = optind;
+	while (i < argc) {
+		success = analyze(argv[i], threads, gap_ms, reference, histogram) && success;
+		i++;
+	}
+
+	return success ? 0 : 1;
+}
@@ -0,0 +1,557 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationBenchmark.c is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationBenchmark.c is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationBenchmark.c
+ *
+ * Working:
+ *
+ * Runs the whole chain on loopback -
+ *
+ *	SensorEmulationRemoteServer -B  ->  SensorEmulationClientServer  ->  sensors_emu_host
+ *	(generator, ports 5010+)            (relay, REMOTE_SERVER_READINGS)   (HAL, ports 5000+)
+ *
+ * in a scratch working directory, with the conf files they read there.
+ *
+ * In benchmark mode, the generator stamps every frame with the time it
+ * was sent at, and the HAL host records the time every event was
+ * delivered by poll() at. Both are on CLOCK_MONOTONIC of the same host,
+ * so their difference is the end-to-end latency. The generator also
+ * writes the number of frames it sent per sensor when it's done.
+ *
+ * Once the run is over, the per-sensor delivered rate, the latency
+ * percentiles (SensorEmulationHistogram.h), the drop rate and the CPU
+ * time all the three processes took per delivered sample are printed as
+ * JSON.
+ *
+ * All of the programs are looked up in the bin directory (-d), where
+ * build-SensorEmulationBenchmark.sh puts them.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "SensorEmulationHistogram.h"
+
+#define LOG(...) (void)(fprintf(stderr, "%s %d: ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+
+#define GENERATOR "SensorEmulationRemoteServer"
+#define RELAY "SensorEmulationClientServer"
+#define HAL_HOST "sensors_emu_host"
+#define HAL_MODULE "sensors_emu.so"
+
+#define BENCH_SENT_FILE "bench_sent"
+#define HAL_EVENTS_FILE "hal_events"
+
+#define BENCH_STAMP_MOD (1LL << 24) /* As in the generator. */
+#define BENCH_DRAIN_S 2 /* The HAL host keeps polling this long after the generator stops. */
+#define BENCH_STARTUP_US 500000 /* Between starting the processes, each being ready. */
+
+#define NUM_SENSORS 5 /* The HAL's. */
+
+static const char *sensors_name[NUM_SENSORS] = {
+						"Accelerometer",
+						"Magnetic",
+						"Light",
+						"Proximity",
+						"Gyroscope",
+					};
+
+static const char *sensors_short_name[NUM_SENSORS] = {
+						"accel",
+						"magnet",
+						"light",
+						"proximity",
+						"gyro",
+					};
+
+struct bench_params {
+	unsigned int sensors_mask;
+	int rate_hz;
+	int batch;
+	const char *transport;
+	int seconds;
+	int poll_delay_us; /* 0 - the HAL's default. */
+	const char *bin_dir;
+	const char *work_dir;
+	const char *json_file;
+};
+
+struct sensor_result {
+	unsigned long long sent;
+	unsigned long long delivered;
+	unsigned long long corrupt;
+	struct emu_hist latency; /* ns. */
+};
+
+struct process {
+	const char *name;
+	pid_t pid;
+	struct rusage usage;
+	bool reaped;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-S sensor,sensor,...] [-r rate Hz] [-b batch] [-t tcp|tcp_nodelay] [-s seconds]\n"
+			"          [-p poll delay us] [-d bin dir] [-w work dir] [-o json file]\n", prog);
+	fprintf(stderr, "\tsensors are any of accel, magnet, light, proximity and gyro (all by default)\n");
+}
+
+static int sensor_of(const char *name, size_t len)
+{
+	int i = 0;
+	while (i < NUM_SENSORS) {
+		bool same = (strlen(sensors_short_name[i]) == len && !strncmp(sensors_short_name[i], name, len)) ||
+				(strlen(sensors_name[i]) == len && !strncmp(sensors_name[i], name, len));
+		if (same) {
+			return i;
+		}
+		i++;
+	}
+
+	return -1;
+}
+
+static bool write_conf(const char *dir, const char *file, const char *value)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+	FILE *fp = fopen(path, "w");
+	if (!fp) {
+		ERR("fopen - %s - %s\n", path, strerror(errno));
+		return false;
+	}
+	fprintf(fp, "%s\n", value);
+	fclose(fp);
+
+	return true;
+}
+
+// Starts argv[0] from the bin dir, in the work dir, with its output going
+// to log (or nowhere).
+static pid_t spawn(const struct bench_params *p, char *const argv[], const char *log)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", p->bin_dir, argv[0]);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		ERR("fork - %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (!pid) {
+		if (chdir(p->work_dir) == -1) {
+			_exit(127);
+		}
+
+		int fd = open(log ? log : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd != -1) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+
+		execv(path, argv);
+		_exit(127);
+	}
+
+	LOG("Started %s (%d)\n", path, pid);
+
+	return pid;
+}
+
+static void reap(struct process *proc, int sig)
+{
+	if (proc->pid <= 0 || proc->reaped) {
+		return;
+	}
+
+	if (sig) {
+		kill(proc->pid, sig);
+	}
+
+	int status = 0;
+	bool reaped = wait4(proc->pid, &status, 0, &proc->usage) == proc->pid;
+	if (!reaped) {
+		ERR("wait4 - %s - %s\n", proc->name, strerror(errno));
+		return;
+	}
+	proc->reaped = true;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status)) {
+		ERR("%s exited with %d\n", proc->name, WEXITSTATUS(status));
+	}
+}
+
+// Waits for proc to exit by itself for up to timeout_s.
+static void reap_in(struct process *proc, int timeout_s)
+{
+	int waited_ms = 0;
+	while (waited_ms < timeout_s * 1000) {
+		int status = 0;
+		pid_t pid = wait4(proc->pid, &status, WNOHANG, &proc->usage);
+		if (pid == proc->pid) {
+			proc->reaped = true;
+			return;
+		}
+		usleep(10000);
+		waited_ms += 10;
+	}
+
+	LOG("%s didn't exit in %ds. Terminating.\n", proc->name, timeout_s);
+	reap(proc, SIGTERM);
+}
+
+static double cpu_s(const struct process *proc)
+{
+	const struct rusage *u = &proc->usage;
+
+	return u->ru_utime.tv_sec + u->ru_utime.tv_usec / 1E6 + u->ru_stime.tv_sec + u->ru_stime.tv_usec / 1E6;
+}
+
+static bool read_sent(const struct bench_params *p, struct sensor_result results[])
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", p->work_dir, BENCH_SENT_FILE);
+
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		ERR("fopen - %s - %s\n", path, strerror(errno));
+		return false;
+	}
+
+	char name[64];
+	unsigned long long sent = 0;
+	while (fscanf(fp, "%63s %llu", name, &sent) == 2) {
+		int n = sensor_of(name, strlen(name));
+		if (n != -1) {
+			results[n].sent = sent;
+		}
+	}
+	fclose(fp);
+
+	return true;
+}
+
+static bool read_events(const struct bench_params *p, struct sensor_result results[])
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", p->work_dir, HAL_EVENTS_FILE);
+
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		ERR("fopen - %s - %s\n", path, strerror(errno));
+		return false;
+	}
+
+	long long delivered_ns = 0;
+	long long timestamp = 0;
+	int handle = -1;
+	int type = 0;
+	double data[3];
+	while (fscanf(fp, "%lld %lld %d %d %lf %lf %lf", &delivered_ns, &timestamp, &handle, &type,
+								&data[0], &data[1], &data[2]) == 7) {
+		if (handle < 0 || handle >= NUM_SENSORS) {
+			continue;
+		}
+		struct sensor_result *r = &results[handle];
+		r->delivered++;
+
+		long long stamp_us = (long long)data[0];
+		bool valid = stamp_us == data[0] && stamp_us >= 0 && stamp_us < BENCH_STAMP_MOD;
+		if (!valid) {
+			r->corrupt++;
+			continue;
+		}
+
+		long long delivered_us = (delivered_ns / 1000) % BENCH_STAMP_MOD;
+		long long latency_us = (delivered_us - stamp_us + BENCH_STAMP_MOD) % BENCH_STAMP_MOD;
+		emu_hist_record(&r->latency, latency_us * 1000);
+	}
+	fclose(fp);
+
+	return true;
+}
+
+static double percentile(const struct sensor_result *r, double pct)
+{
+	return emu_hist_percentile(&r->latency, pct / 100) / 1E3;
+}
+
+static void print_json(FILE *out, const struct bench_params *p, struct sensor_result results[],
+						const struct process procs[], int num_procs)
+{
+	fprintf(out, "{\n");
+	fprintf(out, "  \"params\": {\n");
+	fprintf(out, "    \"sensors\": [");
+	bool first = true;
+	int n = 0;
+	while (n < NUM_SENSORS) {
+		if (p->sensors_mask & (1U << n)) {
+			fprintf(out, "%s\"%s\"", first ? "" : ", ", sensors_name[n]);
+			first = false;
+		}
+		n++;
+	}
+	fprintf(out, "],\n");
+	fprintf(out, "    \"rate_hz\": %d,\n", p->rate_hz);
+	fprintf(out, "    \"batch\": %d,\n", p->batch);
+	fprintf(out, "    \"transport\": \"%s\",\n", p->transport);
+	fprintf(out, "    \"seconds\": %d,\n", p->seconds);
+	fprintf(out, "    \"poll_delay_us\": %d\n", p->poll_delay_us);
+	fprintf(out, "  },\n");
+
+	unsigned long long total_delivered = 0;
+
+	fprintf(out, "  \"sensors\": {\n");
+	first = true;
+	n = 0;
+	while (n < NUM_SENSORS) {
+		if (!(p->sensors_mask & (1U << n))) {
+			n++;
+			continue;
+		}
+
+		struct sensor_result *r = &results[n];
+		total_delivered += r->delivered;
+
+		double drop_rate = r->sent && r->delivered < r->sent ? (double)(r->sent - r->delivered) / r->sent : 0;
+
+		fprintf(out, "%s    \"%s\": {\n", first ? "" : ",\n", sensors_name[n]);
+		fprintf(out, "      \"sent\": %llu,\n", r->sent);
+		fprintf(out, "      \"delivered\": %llu,\n", r->delivered);
+		fprintf(out, "      \"corrupt\": %llu,\n", r->corrupt);
+		fprintf(out, "      \"delivered_rate_hz\": %.1f,\n", (double)r->delivered / p->seconds);
+		fprintf(out, "      \"drop_rate\": %.6f,\n", drop_rate);
+		fprintf(out, "      \"latency_us\": { \"p50\": %.0f, \"p99\": %.0f, \"p99.9\": %.0f, \"max\": %.0f }\n",
+				percentile(r, 50), percentile(r, 99), percentile(r, 99.9), percentile(r, 100));
+		fprintf(out, "    }");
+		first = false;
+		n++;
+	}
+	fprintf(out, "\n  },\n");
+
+	double total_cpu_s = 0;
+	fprintf(out, "  \"cpu_s\": {");
+	int i = 0;
+	while (i < num_procs) {
+		fprintf(out, "%s\"%s\": %.3f", i ? ", " : " ", procs[i].name, cpu_s(&procs[i]));
+		total_cpu_s += cpu_s(&procs[i]);
+		i++;
+	}
+	fprintf(out, " },\n");
+	fprintf(out, "  \"cpu_per_sample_us\": %.3f\n", total_delivered ? total_cpu_s * 1E6 / total_delivered : 0);
+	fprintf(out, "}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_params p = {
+		.sensors_mask = (1U << NUM_SENSORS) - 1,
+		.rate_hz = 200,
+		.batch = 1,
+		.transport = "tcp",
+		.seconds = 10,
+		.poll_delay_us = 0,
+		.bin_dir = ".",
+		.work_dir = NULL,
+		.json_file = NULL,
+	};
+
+	int opt = -1;
+	while ((opt = getopt(argc, argv, "S:r:b:t:s:p:d:w:o:h")) != -1) {
+		switch (opt) {
+			case 'S':
+			{
+				p.sensors_mask = 0;
+				const char *next = optarg;
+				while (*next) {
+					size_t len = strcspn(next, ",");
+					int n = sensor_of(next, len);
+					if (n == -1) {
+						ERR("Unknown sensor %.*s\n", (int)len, next);
+						return 1;
+					}
+					p.sensors_mask |= 1U << n;
+					next += len + (next[len] == ',');
+				}
+				break;
+			}
+			case 'r':
+				p.rate_hz = atoi(optarg);
+				break;
+			case 'b':
+				p.batch = atoi(optarg);
+				break;
+			case 't':
+				p.transport = optarg;
+				break;
+			case 's':
+				p.seconds = atoi(optarg);
+				break;
+			case 'p':
+				p.poll_delay_us = atoi(optarg);
+				break;
+			case 'd':
+				p.bin_dir = optarg;
+				break;
+			case 'w':
+				p.work_dir = optarg;
+				break;
+			case 'o':
+				p.json_file = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	bool valid = p.sensors_mask && p.rate_hz > 0 && p.batch > 0 && p.seconds > 0 && p.poll_delay_us >= 0 &&
+			(!strcmp(p.transport, "tcp") || !strcmp(p.transport, "tcp_nodelay"));
+	if (!valid) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	char bin_dir[PATH_MAX];
+	if (!realpath(p.bin_dir, bin_dir)) {
+		ERR("realpath - %s - %s\n", p.bin_dir, strerror(errno));
+		return 1;
+	}
+	p.bin_dir = bin_dir;
+
+	char work_dir[] = "/tmp/sensor_emu_bench.XXXXXX";
+	if (!p.work_dir) {
+		if (!mkdtemp(work_dir)) {
+			ERR("mkdtemp - %s\n", strerror(errno));
+			return 1;
+		}
+		p.work_dir = work_dir;
+	} else {
+		(void)mkdir(p.work_dir, 0755);
+	}
+	LOG("Working in %s\n", p.work_dir);
+
+	char poll_delay[32];
+	snprintf(poll_delay, sizeof(poll_delay), "%d", p.poll_delay_us);
+
+	bool configured = write_conf(p.work_dir, "remote_server_ip_port.conf", "127.0.0.1") &&
+				write_conf(p.work_dir, "transport.conf", p.transport) &&
+				(!p.poll_delay_us || write_conf(p.work_dir, "poll_delay.conf", poll_delay));
+	if (!configured) {
+		return 1;
+	}
+
+	// The generator runs for the benchmark's seconds from when it's started.
+	// The HAL host is started before it and stops polling after it, to
+	// drain what's still on the way.
+	char hal_seconds[16];
+	char seconds[16];
+	char rate[16];
+	char batch[16];
+	char sensors[64] = "";
+	char module[PATH_MAX + sizeof("/" HAL_MODULE)];
+	snprintf(hal_seconds, sizeof(hal_seconds), "%d", p.seconds + BENCH_DRAIN_S + 1);
+	snprintf(seconds, sizeof(seconds), "%d", p.seconds);
+	snprintf(rate, sizeof(rate), "%d", p.rate_hz);
+	snprintf(batch, sizeof(batch), "%d", p.batch);
+	snprintf(module, sizeof(module), "%s/%s", p.bin_dir, HAL_MODULE);
+	int n = 0;
+	while (n < NUM_SENSORS) {
+		if (p.sensors_mask & (1U << n)) {
+			size_t len = strlen(sensors);
+			snprintf(sensors + len, sizeof(sensors) - len, "%s%d", len ? "," : "", n);
+		}
+		n++;
+	}
+
+	char *hal_argv[] = { HAL_HOST, "-m", module, "-s", hal_seconds, "-o", HAL_EVENTS_FILE, NULL };
+	char *generator_argv[] = { GENERATOR, "-B", "-r", rate, "-b", batch, "-s", seconds, "-S", sensors, NULL };
+	char *relay_argv[] = { RELAY, NULL };
+
+	struct process procs[] = {
+		{ .name = "generator", .pid = -1, },
+		{ .name = "relay", .pid = -1, },
+		{ .name = "hal", .pid = -1, },
+	};
+	struct process *generator = &procs[0];
+	struct process *relay = &procs[1];
+	struct process *hal = &procs[2];
+
+	char hal_log[PATH_MAX + sizeof("/hal.log")];
+	snprintf(hal_log, sizeof(hal_log), "%s/hal.log", p.work_dir);
+
+	hal->pid = spawn(&p, hal_argv, hal_log);
+	usleep(BENCH_STARTUP_US);
+	generator->pid = spawn(&p, generator_argv, NULL);
+	usleep(BENCH_STARTUP_US);
+	relay->pid = spawn(&p, relay_argv, NULL);
+
+	if (hal->pid == -1 || generator->pid == -1 || relay->pid == -1) {
+		reap(hal, SIGTERM);
+		reap(generator, SIGTERM);
+		reap(relay, SIGTERM);
+		return 1;
+	}
+
+	reap_in(generator, p.seconds + BENCH_DRAIN_S + 2);
+	reap_in(hal, BENCH_DRAIN_S + 2);
+	reap(relay, SIGTERM);
+
+	static struct sensor_result results[NUM_SENSORS];
+
+	bool read = read_sent(&p, results) && read_events(&p, results);
+	if (!read) {
+		return 1;
+	}
+
+	FILE *out = stdout;
+	if (p.json_file) {
+		out = fopen(p.json_file, "w");
+		if (!out) {
+			ERR("fopen - %s - %s\n", p.json_file, strerror(errno));
+			return 1;
+		}
+	}
+
+	print_json(out, &p, results, procs, sizeof(procs) / sizeof(procs[0]));
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	return 0;
+}
@@ -28,15 +28,15 @@
  *
  * When DEVICE_READINGS is enabled.
  * 
- * Servers written as part of real device's sensors' HAL module
- * send the device's sensor readings in a pattern to any
- * connected clients over the network using socket communication. And
- * that pattern is pre-determined.
+ * The exporter of the real device's sensors' HAL module
+ * (SensorEmulationExport.h) sends the readings of all of the device's
+ * sensors to a connected client over one connection, in batches of
+ * frames each tagged with its sensor.
  *
- * This very code implements clients to a real Android device to get a
+ * This very code implements the client to a real Android device to get a
  * real android device's sensors readings over the network via
- * socket communication. These clients send these readings to dummy
- * forever-sleep servers at certain ports. This port is mapped on to the
+ * socket communication. It sends each sensor's readings to the dummy
+ * forever-sleep server of the sensor, at its port. This port is mapped on to the
  * guest(Android-x86)'s ports on Qemu. So, whatever the clients to the real
  * device write to the dummy forver-sleep servers, they all end up
  * in the guest.
@@ -52,6 +52,12 @@
  * Except for the source of readings, which is a remote server in
  * this case, everything else in terms of working is same as it's in
  * the case of DEVICE_READINGS.
+ *
+ * When REPLAY_READINGS is enabled.
+ *
+ * The readings come from a captured session instead, named in
+ * REPLAY_CONF_FILE, and are sent with the timing they were captured
+ * with. See SensorEmulationReplay.h.
  */
 
 
@@ -63,40 +69,73 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <semaphore.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <linux/sockios.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include "SensorEmulationClock.h"
+#include "SensorEmulationTrace.h"
+#include "SensorEmulationLog.h"
+#include "SensorEmulationRecord.h"
+#include "SensorEmulationReplay.h"
+#include "SensorEmulationStats.h"
+#include "SensorEmulationMetrics.h"
+#include "SensorEmulationExport.h"
 
 #define DEBUG
 
 // #define DEVICE_READINGS
 // #define REMOTE_SERVER_READINGS
+// #define REPLAY_READINGS
 
 #ifdef DEBUG
+
+// The readings are recorded in the binary format of SensorEmulationRecord.h,
+// with the time they were received at, unless TEXT_READINGS is defined.
+// #define TEXT_READINGS
+
+#ifdef TEXT_READINGS
 static FILE *readings_fp;
 #define INIT_LOG_READING do {\
 				readings_fp = fopen("./ubuntu_readings", "w");\
 			} while(0)
+#define LOG_READING_OF(readings) EMU_LOG_READING(readings_fp, "%s\n", readings)
+#else
+static struct emu_rec *readings_rec;
+#define INIT_LOG_READING do {\
+				readings_rec = emu_rec_open("./ubuntu_readings.rec", sensors_name, NUM_SENSORS);\
+			} while(0)
+#define LOG_READING_OF(readings) EMU_REC_READING(readings_rec, n, readings)
+#endif
+
 #ifdef DEVICE_READINGS
 
-#define LOG_READING (void)(readings_fp && fprintf(readings_fp, "%s\n", dev_readings) && fflush(readings_fp))
+#define LOG_READING LOG_READING_OF(dev_readings)
 
 #elif defined REMOTE_SERVER_READINGS
 
-#define LOG_READING (void)(readings_fp && fprintf(readings_fp, "%s\n", rs_readings) && fflush(readings_fp))
+#define LOG_READING LOG_READING_OF(rs_readings)
+
+#elif defined REPLAY_READINGS
+
+#define LOG_READING LOG_READING_OF(replay_readings)
 
 #endif
 
-#define LOG(...) (void)(printf("%s %d: ", __func__, __LINE__) && printf(__VA_ARGS__) && fflush(stdout))
-#define LOG1(...) (void)(printf("%s %d: ", __func__, __LINE__) && printf(__VA_ARGS__) && fflush(stdout))
-#define LOG_THREAD(...) (void)(printf("[%s] ", sensors_name[n]), LOG(__VA_ARGS__))
-#define LOG1_THREAD(...) (void)(printf("[%s] ", sensors_name[n]), LOG1(__VA_ARGS__))
-#define LOG_DUMMY_S_THREAD(...) (void)(printf("[%s] ", dummy_server_name[n]), LOG(__VA_ARGS__)) 
-#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
-#define ERR1(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
-#define ERR_THREAD(...) (void)(fprintf(stderr, "[%s] ", sensors_name[n]), ERR(__VA_ARGS__))
-#define ERR1_THREAD(...) (void)(fprintf(stderr, "[%s] ", sensors_name[n]), ERR1(__VA_ARGS__))
-#define ERR_DUMMY_S_THREAD(...) (void)(fprintf(stderr, "[%s] ", dummy_server_name[n]), ERR(__VA_ARGS__)) 
+// LOG1 is for the lines on the path of every frame.
+#define LOG(...) EMU_LOG(stdout, __VA_ARGS__)
+#define LOG1(...) EMU_DEBUG(stdout, __VA_ARGS__)
+#define LOG_THREAD(...) EMU_LOG_TAG(stdout, sensors_name[n], __VA_ARGS__)
+#define LOG1_THREAD(...) EMU_DEBUG_TAG(stdout, sensors_name[n], __VA_ARGS__)
+#define LOG_DUMMY_S_THREAD(...) EMU_LOG_TAG(stdout, dummy_server_name[n], __VA_ARGS__)
+#define ERR(...) EMU_ERR(stderr, __VA_ARGS__)
+#define ERR1(...) EMU_ERR(stderr, __VA_ARGS__)
+#define ERR_THREAD(...) EMU_ERR_TAG(stderr, sensors_name[n], __VA_ARGS__)
+#define ERR1_THREAD(...) EMU_ERR_TAG(stderr, sensors_name[n], __VA_ARGS__)
+#define ERR_DUMMY_S_THREAD(...) EMU_ERR_TAG(stderr, dummy_server_name[n], __VA_ARGS__)
 
 #else
 
@@ -120,10 +159,18 @@ static FILE *readings_fp;
 
 #ifdef DEVICE_READINGS
 #define DEVICE_IP_PORT_CONF_FILE "./dev_ip_port.conf";
+#define DEVICE_RATES_CONF_FILE "./dev_rates.conf"
 #elif defined REMOTE_SERVER_READINGS
 #define REMOTE_SERVER_IP_PORT_CONF_FILE "./remote_server_ip_port.conf";
+#elif defined REPLAY_READINGS
+#define REPLAY_CONF_FILE "./replay.conf"
 #endif
 
+#define TRANSPORT_CONF_FILE "./transport.conf"
+#define LOG_CONF_FILE "./log.conf"
+#define METRICS_CONF_FILE "./metrics.conf"
+#define VIRTUAL_CONF_FILE "./virtual.conf"
+
 #define READINGS_BUF_SIZE (100) /* 3 readings. */
 #define ACCEL_READINGS_BUF_SIZE (50) /* 3 readings. */
 #define GYRO_READINGS_BUF_SIZE (50) /* 3 readings. */
@@ -172,6 +219,105 @@ enum sensors {
 static void cleanup(void);
 static void cleanup_thread(int i);
 
+// TRANSPORT_CONF_FILE has "tcp" (the default) or "tcp_nodelay", which
+// turns Nagle off on both sides of the relay.
+static bool tcp_nodelay;
+
+static void load_transport_conf(void)
+{
+	FILE *fp = fopen(TRANSPORT_CONF_FILE, "r");
+	if (!fp) {
+		return;
+	}
+
+	char transport[32] = "";
+	if (fscanf(fp, "%31s", transport) == 1) {
+		tcp_nodelay = !strcmp(transport, "tcp_nodelay");
+		LOG("Transport : %s\n", transport);
+	}
+
+	fclose(fp);
+}
+
+#if defined DEVICE_READINGS || defined REMOTE_SERVER_READINGS || defined REPLAY_READINGS
+static void set_transport_opts(int fd)
+{
+	if (tcp_nodelay) {
+		int yes = 1;
+		bool set = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) != -1;
+		if (!set) {
+			ERR("setsockopt TCP_NODELAY - %s\n", strerror(errno));
+		}
+	}
+}
+
+#define QUEUE_SAMPLE_NS 10000000LL
+
+// Publishes the bytes of sensor n handed on and not sent yet - pending in
+// the process and in the send queue of the socket to the emulator server
+// - every QUEUE_SAMPLE_NS at most, so the ioctl() isn't one per frame.
+// Only from the thread handing sensor n on.
+static void sample_queue(int n, int fd, size_t pending, int64_t now)
+{
+	static int64_t sampled_ns[NUM_SENSORS];
+	if (now - sampled_ns[n] < QUEUE_SAMPLE_NS) {
+		return;
+	}
+	sampled_ns[n] = now;
+
+	int unsent = 0;
+	if (fd == -1 || ioctl(fd, SIOCOUTQ, &unsent) == -1) {
+		unsent = 0;
+	}
+	emu_stats_queued(n, pending + unsent);
+}
+#endif
+
+// VIRTUAL_CONF_FILE has "relayed" (the default) or "fused". Fused, the
+// orientation, corrected gyroscope, gravity, linear acceleration and
+// rotation vector are worked out in the guest from the raw sensors (see
+// ForVirtualSensors.cpp), and only the sensors before EOrient are relayed.
+static int num_relayed = NUM_SENSORS;
+
+static void load_virtual_conf(void)
+{
+	FILE *fp = fopen(VIRTUAL_CONF_FILE, "r");
+	if (!fp) {
+		return;
+	}
+
+	char mode[32] = "";
+	if (fscanf(fp, "%31s", mode) == 1) {
+		num_relayed = !strcmp(mode, "fused") ? EOrient : NUM_SENSORS;
+		LOG("Virtual sensors : %s\n", mode);
+	}
+
+	fclose(fp);
+}
+
+// METRICS_CONF_FILE has "<port> [<guest>]" to serve the statistics page
+// at http://<host>:<port>/metrics, the guest labelling the relay's series.
+// No conf, no listener.
+static void load_metrics_conf(void)
+{
+	FILE *fp = fopen(METRICS_CONF_FILE, "r");
+	if (!fp) {
+		return;
+	}
+
+	int port = 0;
+	char guest[64] = LOCALHOST_IP;
+	if (fscanf(fp, "%d %63s", &port, guest) >= 1 && port > 0) {
+		if (emu_metrics_start(port, guest)) {
+			LOG("Metrics : port %d, guest %s\n", port, guest);
+		} else {
+			ERR("Metrics on port %d - %s\n", port, strerror(errno));
+		}
+	}
+
+	fclose(fp);
+}
+
 static void sigsegv_handler(int arg)
 {
 	LOG("ATTENTION: **SIGSEGV** Exiting . . .\n");
@@ -247,6 +393,16 @@ static void *dummy_server(void *args)
 	}
 	LOG_DUMMY_S_THREAD("Accepted!\n");
 
+#ifdef VIRTUAL_TIME
+	// Whatever is sent here has to be received, or the virtual clock
+	// would wait for it.
+	LOG_DUMMY_S_THREAD("Draining forever . . .\n");
+	char drain[4096];
+	while (emu_recvfrom(dummy_server_connfd[n], drain, sizeof(drain), 0, NULL, 0) > 0) {
+	}
+	goto done;
+#endif
+
 	LOG_DUMMY_S_THREAD("Sleeping forever . . .\n");
 	sem_t dummy_sem = { { 0 } };
 	bool initzd = sem_init(&dummy_sem, 0, 0) != -1;
@@ -275,41 +431,221 @@ done:
 static int emu_sockfd[NUM_SENSORS];
 
 #ifdef DEVICE_READINGS
-static int client_to_dev_sockfd[NUM_SENSORS];
+static int client_to_dev_sockfd = -1;
 
-struct client_to_device_data {
-	int dev_port;
-	int emu_port;
-	int num;
-};
+#define DEVICE_RECV_BUF_SIZE (64 * 1024)
+#define EMU_RETRY_NS 1000000000LL
+
+// The one thread handing every sensor on never waits for one of the
+// emulator servers: their sockets are non-blocking, a frame that doesn't
+// fit in a socket's buffer is dropped, and the unsent tail of a frame
+// that went out in part is sent ahead of the next one, to keep the stream
+// in whole frames.
+static int64_t emu_retry_ns[NUM_SENSORS]; /* No connecting before. */
+static char emu_pending[NUM_SENSORS][EMU_EXPORT_FRAME_MAX];
+static size_t emu_pending_len[NUM_SENSORS];
+
+static void close_emu(int n)
+{
+	if (emu_sockfd[n] != -1) {
+		emu_close(emu_sockfd[n]);
+		emu_sockfd[n] = -1;
+	}
+	if (emu_pending_len[n]) {
+		EMU_STATS_COUNT(n, queued_out, 1); // Its tail is lost.
+		emu_pending_len[n] = 0;
+	}
+}
+
+// The connection to the emulator server of sensor n, started when it's
+// first needed and again, at most every EMU_RETRY_NS, after it fails.
+// It's used while it's being made - the frames sent before it's up are
+// dropped like any others that don't fit.
+static bool connect_emu(int n)
+{
+	if (emu_sockfd[n] != -1) {
+		return true;
+	}
+
+	int64_t now = emu_stats_now();
+	if (now < emu_retry_ns[n]) {
+		return false;
+	}
+	emu_retry_ns[n] = now + EMU_RETRY_NS;
+
+	struct sockaddr_in client_addr = { 0, };
+	client_addr.sin_family = AF_INET;
+	client_addr.sin_port = htons(BASE_PORT + n);
+	inet_pton(AF_INET, LOCALHOST_IP, &client_addr.sin_addr);
+
+	LOG1_THREAD("Opening emu socket . . .\n");
+	emu_sockfd[n] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (emu_sockfd[n] == -1) {
+		ERR1_THREAD("socket - %s\n", strerror(errno));
+		return false;
+	}
+	set_transport_opts(emu_sockfd[n]);
+
+	LOG1_THREAD("Connecting . . .\n");
+	bool connecting = connect(emu_sockfd[n], (struct sockaddr *)&client_addr, sizeof(client_addr)) != -1 ||
+				errno == EINPROGRESS;
+	if (!connecting) {
+		ERR1_THREAD("connect - %s\n", strerror(errno));
+		close_emu(n);
+		return false;
+	}
+	LOG1_THREAD("Connecting in the background!\n");
+
+	return true;
+}
+
+// Sends what it can of size bytes at data to the emulator server of
+// sensor n, without waiting. -1 if the connection failed and was closed.
+static ssize_t send_emu(int n, const char *data, size_t size)
+{
+	ssize_t bytes_sent = emu_sendto(emu_sockfd[n], data, size, MSG_DONTWAIT | MSG_NOSIGNAL, NULL, 0);
+	if (bytes_sent == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		ERR1_THREAD("sendto - %s\n", strerror(errno));
+		close_emu(n);
+	}
+
+	return bytes_sent;
+}
+
+// One frame of sensor n off the device, on to the emulator.
+static void hand_on(int n, char *dev_readings, size_t readings_size)
+{
+	LOG1_THREAD("Device readings: %s\n", dev_readings);
+	LOG_READING;
 
+	int64_t in_ns = emu_stats_now();
+	emu_stats_received(n, 1, readings_size, in_ns);
+	EMU_TRACE_STAMP(dev_readings, readings_size - EMU_TRACE_SIZE, EMU_HOP_RELAY_RECV);
+
+	if (n >= num_relayed) {
+		return; // Fused in the guest.
+	}
+
+	if (!connect_emu(n)) {
+		EMU_STATS_COUNT(n, drops, 1);
+		return;
+	}
+
+	if (emu_pending_len[n]) {
+		size_t len = emu_pending_len[n];
+		ssize_t bytes_sent = send_emu(n, emu_pending[n], len);
+		if (bytes_sent > 0 && (size_t)bytes_sent < len) {
+			memmove(emu_pending[n], emu_pending[n] + bytes_sent, len - bytes_sent);
+		}
+		if (bytes_sent > 0) {
+			emu_pending_len[n] -= bytes_sent;
+			if (!emu_pending_len[n]) {
+				EMU_STATS_COUNT(n, queued_out, 1);
+			}
+		}
+		if (emu_pending_len[n] || emu_sockfd[n] == -1) {
+			EMU_STATS_COUNT(n, drops, 1); // Still behind.
+			sample_queue(n, emu_sockfd[n], emu_pending_len[n], in_ns);
+			return;
+		}
+	}
+
+	LOG1_THREAD("Sending to emulator via port redirection!\n");
+	EMU_TRACE_STAMP(dev_readings, readings_size - EMU_TRACE_SIZE, EMU_HOP_RELAY_SEND);
+	ssize_t bytes_sent = send_emu(n, dev_readings, readings_size);
+	if (bytes_sent <= 0) {
+		EMU_STATS_COUNT(n, drops, 1);
+		sample_queue(n, emu_sockfd[n], 0, in_ns);
+		return;
+	}
+	if ((size_t)bytes_sent < readings_size) {
+		emu_pending_len[n] = readings_size - bytes_sent;
+		memcpy(emu_pending[n], dev_readings + bytes_sent, emu_pending_len[n]);
+		EMU_STATS_COUNT(n, queued_in, 1);
+	}
+	emu_stats_handed_on(n, 1, bytes_sent, in_ns);
+	sample_queue(n, emu_sockfd[n], emu_pending_len[n], in_ns);
+	LOG1_THREAD("%zd bytes wrote!\n", bytes_sent);
+}
+
+// DEVICE_RATES_CONF_FILE has a "<sensor> <Hz> [average]" line for each
+// sensor the device is to send less often than it reads it: a reading
+// every 1/<Hz>s, the last of them or, with "average", their mean.
+static void load_rates_conf(struct emu_export_subscription *subscription)
+{
+	FILE *fp = fopen(DEVICE_RATES_CONF_FILE, "r");
+	if (!fp) {
+		return;
+	}
+
+	char line[128];
+	while (fgets(line, sizeof(line), fp)) {
+		char name[32] = "";
+		double hz = 0;
+		char filter[16] = "";
+		int fields = sscanf(line, "%31s %lf %15s", name, &hz, filter);
+		if (fields <= 0) {
+			continue;
+		}
+
+		int n = 0;
+		while (n < NUM_SENSORS && strcmp(sensors_name[n], name)) {
+			n++;
+		}
+		if (fields < 2 || hz <= 0 || n == NUM_SENSORS) {
+			ERR("Something probably wrong with %s - %s", DEVICE_RATES_CONF_FILE, line);
+			continue;
+		}
+
+		subscription->period_us[n] = (uint32_t)(1E6 / hz);
+		subscription->filter[n] = !strcmp(filter, "average") ? EMU_EXPORT_AVERAGE : EMU_EXPORT_LATEST;
+		LOG("%s : from the device at %gHz, %s\n", sensors_name[n], hz,
+			subscription->filter[n] == EMU_EXPORT_AVERAGE ? "averaged" : "the latest");
+	}
+
+	fclose(fp);
+}
+
+// The device's exporter (SensorEmulationExport.h) sends the frames of all
+// its sensors over one connection, each behind a struct emu_export_record.
+// They're received as many at a time as have arrived and handed on to the
+// emulator server of their sensor.
 static void *client_to_device(void *arg)
 {
-	struct client_to_device_data *d = arg;
-	int n = d->num;
+	(void)arg;
 
-	LOG1_THREAD("** Client for getting readings from a device - Started! **\n");
+	LOG1("** Client for getting readings from a device - Started! **\n");
 
 	char ip[sizeof("xxx:xxx:xxx:xxx")] = "0.0.0.0";
-	int dev_port = d->dev_port;
+	int dev_port = EMU_EXPORT_PORT;
+	int policy = EMU_EXPORT_DROP;
+	static char buf[DEVICE_RECV_BUF_SIZE];
 
 	const char *dev_ip_port_file = DEVICE_IP_PORT_CONF_FILE;
 	FILE *dev_ip_port_fp = fopen(dev_ip_port_file, "r");
 	if (dev_ip_port_fp) {
-		LOG1_THREAD("Reading device's server ip and port from %s\n", dev_ip_port_file);
+		LOG1("Reading device's server ip and port from %s\n", dev_ip_port_file);
 
-		bool fine = fscanf(dev_ip_port_fp, "%s", ip) == 1;
+		bool fine = fscanf(dev_ip_port_fp, "%15s", ip) == 1;
 		if (!fine) {
-			ERR1_THREAD("Something probably wrong with device ip or port - fscanf - %s\n", strerror(errno));
+			ERR1("Something probably wrong with device ip or port - fscanf - %s\n", strerror(errno));
 			goto done;
 		}
-		fgetc(dev_ip_port_fp); // Skip space
-
+		if (fscanf(dev_ip_port_fp, "%d", &dev_port) != 1) { // The port is optional.
+			dev_port = EMU_EXPORT_PORT;
+		}
+		char wants[sizeof("lossless")] = "";
+		if (fscanf(dev_ip_port_fp, "%8s", wants) == 1 && !strcmp(wants, "lossless")) { // So is this.
+			policy = EMU_EXPORT_LOSSLESS;
+		}
 
 		fclose(dev_ip_port_fp);
 		dev_ip_port_fp = NULL;
 	} else {
-		ERR1_THREAD("Failed to read %s. fopen - %s\n", dev_ip_port_file, strerror(errno));
+		ERR1("Failed to read %s. fopen - %s\n", dev_ip_port_file, strerror(errno));
 		goto done;
 	}
 
@@ -317,146 +653,139 @@ static void *client_to_device(void *arg)
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_port = htons(dev_port);
 	
-	LOG1_THREAD("Converting server on device ip . . .\n");
-	LOG1_THREAD("Device port: %d\n", dev_port);
+	LOG1("Converting server on device ip . . .\n");
+	LOG1("Device port: %d\n", dev_port);
 	int af = AF_INET;
 	int convert_ret = inet_pton(af, ip, &serv_addr.sin_addr);
 	bool invalid_ip_str = convert_ret == 0;
 	bool invalid_af_family = convert_ret == -1;
 	if (invalid_ip_str) {
-		ERR1_THREAD("Invalid ip str - %s\n", ip);
+		ERR1("Invalid ip str - %s\n", ip);
 		goto done;
 	} else if(invalid_af_family) {
-		ERR1_THREAD("Invalid af family - %d\n", af);
+		ERR1("Invalid af family - %d\n", af);
 		goto done;
 	}
-	LOG1_THREAD("Given device ip(%s) converted . . .\n", ip);
+	LOG1("Given device ip(%s) converted . . .\n", ip);
 
-	strcpy(ip, LOCALHOST_IP);
-	int emu_port = d->emu_port;
+	struct emu_export_subscription subscription;
+	emu_export_subscription_init(&subscription, policy);
+	load_rates_conf(&subscription);
 
-	free(d);
-	d = NULL;
-
-	struct sockaddr_in client_addr = { 0, };
-	client_addr.sin_family = AF_INET;
-	client_addr.sin_port = htons(emu_port);
-	
-	LOG1_THREAD("Converting emu ip . . .\n");
-	LOG1_THREAD("Emu port: %d\n", emu_port);
-	convert_ret = inet_pton(af, ip, &client_addr.sin_addr);
-	invalid_ip_str = convert_ret == 0;
-	invalid_af_family = convert_ret == -1;
-	if (invalid_ip_str) {
-		ERR1_THREAD("Invalid ip str - %s\n", ip);
-		goto done;
-	} else if(invalid_af_family) {
-		ERR1_THREAD("Invalid af family - %d\n", af);
-		goto done;
-	}
-	LOG1_THREAD("Given emulator ip(%s) converted . . .\n", ip);
-	
+	bool reconnect = false;
 	while (1) {
-		if (client_to_dev_sockfd[n] != -1) {
-			LOG1_THREAD("Closing socket . . .\n");
-			close(client_to_dev_sockfd[n]);
-			client_to_dev_sockfd[n] = -1;
-			LOG1_THREAD("Closed!\n");
+		if (client_to_dev_sockfd != -1) {
+			LOG1("Closing socket . . .\n");
+			emu_close(client_to_dev_sockfd);
+			client_to_dev_sockfd = -1;
+			LOG1("Closed!\n");
 		}
 
-		LOG1_THREAD("Opening device socket . . .\n");
-		client_to_dev_sockfd[n] = socket(AF_INET, SOCK_STREAM, 0);
-		if (client_to_dev_sockfd[n] == -1) {
-			ERR1_THREAD("socket - %s\n", strerror(errno));
+		LOG1("Opening device socket . . .\n");
+		client_to_dev_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (client_to_dev_sockfd == -1) {
+			ERR1("socket - %s\n", strerror(errno));
+			emu_sleep(1);
 			continue;
 		}
-		LOG1_THREAD("Device socket opened . . .\n");
+		LOG1("Device socket opened . . .\n");
+		set_transport_opts(client_to_dev_sockfd);
 
-		LOG1_THREAD("Connecting . . .\n");
-		bool connected = connect(client_to_dev_sockfd[n], (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != -1;
+		LOG1("Connecting . . .\n");
+		bool connected = connect(client_to_dev_sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != -1;
 		if (!connected) {
-			ERR1_THREAD("connect - %s\n", strerror(errno));
-			sleep(1);
+			ERR1("connect - %s\n", strerror(errno));
+			emu_sleep(1);
 			continue;
 		}
-		LOG1_THREAD("Connected . . .\n");
-
-		if (emu_sockfd[n] != -1) {
-			LOG1_THREAD("Closing emu socket . . .\n");
-			close(emu_sockfd[n]);
-			emu_sockfd[n] = -1;
-			LOG1_THREAD("Closed!\n");
-		}
+		LOG1("Connected . . .\n");
 
-		LOG1_THREAD("Opening emu socket . . .\n");
-		emu_sockfd[n] = socket(AF_INET, SOCK_STREAM, 0);
-		if (emu_sockfd[n] == -1) {
-			ERR1_THREAD("socket - %s\n", strerror(errno));
+		ssize_t bytes_sent = send(client_to_dev_sockfd, &subscription, sizeof(subscription), MSG_NOSIGNAL);
+		if (bytes_sent != sizeof(subscription)) {
+			ERR1("send - %s\n", bytes_sent == -1 ? strerror(errno) : "short write");
+			emu_sleep(1);
 			continue;
 		}
-		LOG1_THREAD("Emu socket opened!\n");
-
-		LOG1_THREAD("Connecting . . .\n");
-		connected = connect(emu_sockfd[n], (struct sockaddr *)&client_addr, sizeof(client_addr)) != -1;
-		if (!connected) {
-			ERR1_THREAD("connect - %s\n", strerror(errno));
-			continue;
+		LOG1("Subscribed for %s . . .\n", policy == EMU_EXPORT_LOSSLESS ? "all or nothing" : "the readings live");
+
+		int n = 0;
+		while (n < num_relayed) {
+			close_emu(n);
+			emu_retry_ns[n] = 0;
+			(void)connect_emu(n);
+			if (reconnect) {
+				EMU_STATS_COUNT(n, reconnects, 1);
+			}
+			n++;
 		}
-		LOG1_THREAD("Connected!\n");
-
-		while (1) {
-			size_t readings_size = n == EAccel ? ACCEL_READINGS_BUF_SIZE + 1 :
-						n == EGyro ? GYRO_READINGS_BUF_SIZE + 1 : READINGS_BUF_SIZE + 1;
-			char dev_readings[readings_size];
-			memset(dev_readings, 0, sizeof(dev_readings));
+		reconnect = true;
 
-			LOG1_THREAD("Reading . . .\n");
-			ssize_t bytes_received = recvfrom(client_to_dev_sockfd[n], dev_readings, readings_size, MSG_WAITALL, NULL, 0);
+		size_t have = 0;
+		bool bad = false;
+		while (!bad) {
+			LOG1("Reading . . .\n");
+			ssize_t bytes_received = emu_recvfrom(client_to_dev_sockfd, buf + have, sizeof(buf) - have, 0, NULL, 0);
 			if (bytes_received == -1) {
-				ERR1_THREAD("recvfrom - %s\n", strerror(errno));
+				ERR1("recvfrom - %s\n", strerror(errno));
 				break;
 			}
-			LOG1_THREAD("%zd bytes read!\n", bytes_received);
-			LOG1_THREAD("Device readings: %s\n", dev_readings);
-
-			LOG_READING;
-
 			if (!bytes_received) {
-				LOG1_THREAD("Seems like connection to device server is lost. Will reconnect.\n");
+				LOG1("Seems like connection to device server is lost. Will reconnect.\n");
 				break;
 			}
-
-			if (bytes_received != readings_size) {
-				LOG1_THREAD("Partial data. Ignoring\n");
-				continue;
+			LOG1("%zd bytes read!\n", bytes_received);
+			have += bytes_received;
+
+			size_t at = 0;
+			while (have - at >= sizeof(struct emu_export_record)) {
+				struct emu_export_record r;
+				memcpy(&r, buf + at, sizeof(r));
+				if (r.sensor >= NUM_SENSORS || r.size != emu_export_frame_size(r.sensor)) {
+					ERR1("Unexpected record of sensor %d, %d bytes - is only one side built with TRACE_HOPS?\n",
+						r.sensor, r.size);
+					bad = true;
+					break;
+				}
+				if (have - at < sizeof(r) + r.size) {
+					break;
+				}
+
+				if (r.dropped) { // On the device, its ring full.
+					EMU_STATS_COUNT(r.sensor, drops, r.dropped);
+				}
+				hand_on(r.sensor, buf + at + sizeof(r), r.size);
+				at += sizeof(r) + r.size;
 			}
+			memmove(buf, buf + at, have - at);
+			have -= at;
+		}
 
-			LOG1_THREAD("Sending to emulator via port redirection!\n");
-			ssize_t bytes_sent = sendto(emu_sockfd[n], dev_readings, readings_size, 0, NULL, 0);
-			if (bytes_sent == -1) {
-				ERR1_THREAD("sendto - %s\n", strerror(errno));
-				break;
+		if (!bad && have >= sizeof(struct emu_export_record)) {
+			struct emu_export_record r;
+			memcpy(&r, buf, sizeof(r));
+			if (r.sensor < NUM_SENSORS) {
+				LOG1("Partial data. Ignoring\n");
+				EMU_STATS_COUNT(r.sensor, partial_frames, 1);
+				EMU_STATS_COUNT(r.sensor, drops, 1);
 			}
-			LOG1_THREAD("%zd bytes wrote!\n", bytes_sent);
-
-			usleep(1000);
+		}
+		if (bad) {
+			emu_sleep(1); // It would only happen again right away.
 		}
 	}
 
 done:
-	if (client_to_dev_sockfd[n] != -1) {
-		close(client_to_dev_sockfd[n]);
-		client_to_dev_sockfd[n] = -1;
+	if (client_to_dev_sockfd != -1) {
+		emu_close(client_to_dev_sockfd);
+		client_to_dev_sockfd = -1;
 	}
 
-	LOG1_THREAD("** Client for %s meant for getting readings from a device - Terminated! **\n", sensors_name[n]);
-
-	cleanup_thread(n);
+	LOG1("** Client meant for getting readings from a device - Terminated! **\n");
 
 	return 0;
 }
 
-pthread_t client_to_dev_pth[NUM_SENSORS];
+pthread_t client_to_dev_pth = -1;
 
 #elif defined REMOTE_SERVER_READINGS
 
@@ -539,11 +868,12 @@ static void *client_to_remote_server(void *arg)
 		goto done;
 	}
 	LOG1_THREAD("Given emulator ip(%s) converted . . .\n", ip);
-	
+
+	bool reconnect = false;
 	while (1) {
 		if (client_to_rs_sockfd[n] != -1) {
 			LOG1_THREAD("Closing client to remote server socket . . .\n");
-			close(client_to_rs_sockfd[n]);
+			emu_close(client_to_rs_sockfd[n]);
 			client_to_rs_sockfd[n] = -1;
 			LOG1_THREAD("Closed!\n");
 		}
@@ -555,19 +885,20 @@ static void *client_to_remote_server(void *arg)
 			goto done;
 		}
 		LOG1_THREAD("Remote server socket opened . . .\n");
+		set_transport_opts(client_to_rs_sockfd[n]);
 
 		LOG1_THREAD("Connecting . . .\n");
 		bool connected = connect(client_to_rs_sockfd[n], (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != -1;
 		if (!connected) {
 			ERR1_THREAD("Connect - %s\n", strerror(errno));
-			sleep(1);
+			emu_sleep(1);
 			continue;
 		}
 		LOG1_THREAD("Connected . . .\n");
 
 		if (emu_sockfd[n] != -1) {
 			LOG1_THREAD("Closing emu socket . . .\n");
-			close(emu_sockfd[n]);
+			emu_close(emu_sockfd[n]);
 			emu_sockfd[n] = -1;
 			LOG1_THREAD("Closed!\n");
 		}
@@ -579,6 +910,7 @@ static void *client_to_remote_server(void *arg)
 			goto done;
 		}
 		LOG1_THREAD("Emu socket opened!\n");
+		set_transport_opts(emu_sockfd[n]);
 
 		LOG1_THREAD("Connecting . . .\n");
 		connected = connect(emu_sockfd[n], (struct sockaddr *)&client_addr, sizeof(client_addr)) != -1;
@@ -587,6 +919,10 @@ static void *client_to_remote_server(void *arg)
 			goto done;
 		}
 		LOG1_THREAD("Connected!\n");
+		if (reconnect) {
+			EMU_STATS_COUNT(n, reconnects, 1);
+		}
+		reconnect = true;
 
 		time_t seed = time(NULL);
 		if (seed == -1) {
@@ -596,14 +932,15 @@ static void *client_to_remote_server(void *arg)
 		srand(seed);
 
 		while (1) {
-			size_t readings_size = n == EAccel ? ACCEL_READINGS_BUF_SIZE + 1 :
+			size_t text_size = n == EAccel ? ACCEL_READINGS_BUF_SIZE + 1 :
 						n == EGyro ? GYRO_READINGS_BUF_SIZE + 1 : READINGS_BUF_SIZE + 1;
+			size_t readings_size = text_size + EMU_TRACE_SIZE;
 
 			char rs_readings[readings_size];
 			memset(rs_readings, 0, sizeof(rs_readings));
 
 			LOG1_THREAD("Receiving . . .\n");
-			ssize_t bytes_received = recvfrom(client_to_rs_sockfd[n], rs_readings, readings_size, MSG_WAITALL, NULL, 0);
+			ssize_t bytes_received = emu_recvfrom(client_to_rs_sockfd[n], rs_readings, readings_size, MSG_WAITALL, NULL, 0);
 			if (bytes_received == -1) {
 				ERR1_THREAD("recvFrom - %s\n", strerror(errno));
 				break;
@@ -618,27 +955,36 @@ static void *client_to_remote_server(void *arg)
 				break;
 			}
 
+			int64_t in_ns = emu_stats_now();
+			emu_stats_received(n, bytes_received == readings_size, bytes_received, in_ns);
 			if (bytes_received != readings_size) {
 				LOG1_THREAD("Partial data. Ignoring\n");
+				EMU_STATS_COUNT(n, partial_frames, 1);
+				EMU_STATS_COUNT(n, drops, 1);
 				continue;
 			}
+			EMU_TRACE_STAMP(rs_readings, text_size, EMU_HOP_RELAY_RECV);
 
 			LOG1_THREAD("Sending to emulator via port redirection!\n");
-			ssize_t bytes_sent = sendto(emu_sockfd[n], rs_readings, readings_size, 0, NULL, 0);
+			EMU_TRACE_STAMP(rs_readings, text_size, EMU_HOP_RELAY_SEND);
+			ssize_t bytes_sent = emu_sendto(emu_sockfd[n], rs_readings, readings_size, 0, NULL, 0);
 			if (bytes_sent == -1) {
 				ERR1_THREAD("sendto - %s\n", strerror(errno));
+				EMU_STATS_COUNT(n, drops, 1);
 				break;
 			} else {
+				emu_stats_handed_on(n, 1, bytes_sent, in_ns);
+				sample_queue(n, emu_sockfd[n], 0, in_ns);
 				LOG1_THREAD("%zd bytes wrote!\n", bytes_sent);
 			}
 
-			usleep(1000);
+			emu_usleep(1000);
 		}
 	}
 
 done:
 	if (client_to_rs_sockfd[n] != -1) {
-		close(client_to_rs_sockfd[n]);
+		emu_close(client_to_rs_sockfd[n]);
 		client_to_rs_sockfd[n] = -1;
 	}
 
@@ -650,19 +996,159 @@ done:
 }
 
 pthread_t client_to_rs_pth[NUM_SENSORS];
+
+#elif defined REPLAY_READINGS
+
+// REPLAY_CONF_FILE has "<capture> [<speed> [<from seconds> [loop]]]".
+static char replay_capture[256];
+static double replay_speed = 1.0;
+static double replay_seek_s;
+static bool replay_loop;
+
+static struct emu_replay replay;
+
+static bool load_replay_conf(void)
+{
+	FILE *fp = fopen(REPLAY_CONF_FILE, "r");
+	if (!fp) {
+		ERR("Failed to read %s. fopen - %s\n", REPLAY_CONF_FILE, strerror(errno));
+		return false;
+	}
+
+	char loop[16] = "";
+	int fields = fscanf(fp, "%255s %lf %lf %15s", replay_capture, &replay_speed, &replay_seek_s, loop);
+	fclose(fp);
+
+	if (fields < 1 || replay_speed <= 0 || replay_seek_s < 0) {
+		ERR("Something probably wrong with %s\n", REPLAY_CONF_FILE);
+		return false;
+	}
+	replay_loop = !strcmp(loop, "loop");
+
+	bool opened = emu_replay_open(&replay, replay_capture, sensors_name, NUM_SENSORS,
+					replay_speed, replay_loop, replay_seek_s);
+	if (!opened) {
+		ERR("Replay of %s - %s\n", replay_capture, strerror(errno));
+		return false;
+	}
+	LOG("Replaying %s, %.3fs long, at %gx from %gs%s\n", replay_capture, (replay.last_ns - replay.first_ns) / 1E9,
+			replay_speed, replay_seek_s, replay_loop ? ", looped" : "");
+
+	return true;
+}
+
+struct replay_data {
+	int emu_port;
+	int num;
+};
+
+static void *replayer(void *arg)
+{
+	struct replay_data *r = arg;
+	int emu_port = r->emu_port;
+	int n = r->num;
+	free(r);
+	r = NULL;
+
+	struct emu_replay_cursor c;
+	memset(&c, 0, sizeof(c));
+
+	LOG1_THREAD("** Replayer for %s - Started! **\n", sensors_name[n]);
+
+	if (!replay.streams[n].num) {
+		LOG1_THREAD("Nothing of %s in the capture.\n", sensors_name[n]);
+		goto done;
+	}
+
+	struct sockaddr_in client_addr = { 0, };
+	client_addr.sin_family = AF_INET;
+	client_addr.sin_port = htons(emu_port);
+	inet_pton(AF_INET, LOCALHOST_IP, &client_addr.sin_addr);
+
+	bool reconnect = false;
+	while (1) {
+		if (emu_sockfd[n] != -1) {
+			LOG1_THREAD("Closing emu socket . . .\n");
+			emu_close(emu_sockfd[n]);
+			emu_sockfd[n] = -1;
+			LOG1_THREAD("Closed!\n");
+		}
+
+		LOG1_THREAD("Opening emu socket . . .\n");
+		emu_sockfd[n] = socket(AF_INET, SOCK_STREAM, 0);
+		if (emu_sockfd[n] == -1) {
+			ERR1_THREAD("socket - %s\n", strerror(errno));
+			goto done;
+		}
+		set_transport_opts(emu_sockfd[n]);
+
+		LOG1_THREAD("Connecting . . .\n");
+		bool connected = connect(emu_sockfd[n], (struct sockaddr *)&client_addr, sizeof(client_addr)) != -1;
+		if (!connected) {
+			ERR1_THREAD("connect - %s\n", strerror(errno));
+			goto done;
+		}
+		LOG1_THREAD("Connected!\n");
+		if (reconnect) {
+			EMU_STATS_COUNT(n, reconnects, 1);
+		}
+		reconnect = true;
+
+		emu_replay_cursor_free(&c);
+		if (!emu_replay_cursor_init(&replay, &c, n)) {
+			ERR1_THREAD("Replay of %s - %s\n", replay_capture, strerror(errno));
+			goto done;
+		}
+
+		uint32_t seq = 0;
+		while (1) {
+			size_t text_size = n == EAccel ? ACCEL_READINGS_BUF_SIZE + 1 :
+						n == EGyro ? GYRO_READINGS_BUF_SIZE + 1 : READINGS_BUF_SIZE + 1;
+			size_t readings_size = text_size + EMU_TRACE_SIZE;
+
+			char replay_readings[readings_size];
+			memset(replay_readings, 0, sizeof(replay_readings));
+
+			int64_t due_ns = emu_replay_next(&replay, &c, replay_readings, text_size);
+			if (due_ns == -1) {
+				LOG1_THREAD("End of the capture.\n");
+				goto done;
+			}
+			emu_replay_sleep_until(due_ns);
+			emu_stats_received(n, 1, readings_size, emu_stats_now());
+
+			LOG_READING;
+
+			EMU_TRACE_INIT(replay_readings, text_size, seq++, 0);
+			EMU_TRACE_STAMP(replay_readings, text_size, EMU_HOP_RELAY_SEND);
+			ssize_t bytes_sent = emu_sendto(emu_sockfd[n], replay_readings, readings_size, 0, NULL, 0);
+			if (bytes_sent == -1) {
+				ERR1_THREAD("sendto - %s\n", strerror(errno));
+				EMU_STATS_COUNT(n, drops, 1);
+				break;
+			}
+			emu_stats_handed_on(n, 1, bytes_sent, due_ns); // Late by.
+			sample_queue(n, emu_sockfd[n], 0, emu_stats_now());
+			LOG1_THREAD("%zd bytes wrote!\n", bytes_sent);
+		}
+	}
+
+done:
+	emu_replay_cursor_free(&c);
+
+	LOG1_THREAD("** Replayer for %s - Terminated! **\n", sensors_name[n]);
+
+	return 0;
+}
+
+pthread_t replay_pth[NUM_SENSORS];
 #endif
 
 static void cleanup_thread(int i)
 {
-#ifdef DEVICE_READINGS
-	i = 0;
-	if (client_to_dev_sockfd[i] != -1) {
-		close(client_to_dev_sockfd[i]);
-		client_to_dev_sockfd[i] = -1;
-	}
-#elif defined REMOTE_SERVER_READINGS
+#ifdef REMOTE_SERVER_READINGS
 	if (client_to_rs_sockfd[i] != -1) {
-		close(client_to_rs_sockfd[i]);
+		emu_close(client_to_rs_sockfd[i]);
 		client_to_rs_sockfd[i] = -1;
 	}
 #endif
@@ -673,24 +1159,24 @@ static void cleanup_thread(int i)
 	}
 
 	if (dummy_server_connfd[i] != -1) {
-		close(dummy_server_connfd[i]);
+		emu_close(dummy_server_connfd[i]);
 		dummy_server_connfd[i] = -1;
 	}
 
-#ifdef DEVICE_READINGS
-	if (client_to_dev_pth[i] != -1) {
-		pthread_cancel(client_to_dev_pth[i]);
-		client_to_dev_pth[i] = -1;
-	}
-#elif defined REMOTE_SERVER_READINGS
+#ifdef REMOTE_SERVER_READINGS
 	if (client_to_rs_pth[i] != -1) {
 		pthread_cancel(client_to_rs_pth[i]);
 		client_to_rs_pth[i] = -1;
 	}
+#elif defined REPLAY_READINGS
+	if (replay_pth[i] != -1) {
+		pthread_cancel(replay_pth[i]);
+		replay_pth[i] = -1;
+	}
 #endif
 
 	if (emu_sockfd[i] != -1) {
-		close(emu_sockfd[i]);
+		emu_close(emu_sockfd[i]);
 		emu_sockfd[i] = -1;
 	}
 
@@ -703,6 +1189,17 @@ static void cleanup(void)
 {
 	LOG("Cleaning up . . .\n");
 
+#ifdef DEVICE_READINGS
+	if (client_to_dev_pth != -1) {
+		pthread_cancel(client_to_dev_pth);
+		client_to_dev_pth = -1;
+	}
+	if (client_to_dev_sockfd != -1) {
+		emu_close(client_to_dev_sockfd);
+		client_to_dev_sockfd = -1;
+	}
+#endif
+
 	int i = 0;
 	while (i < NUM_SENSORS) {
 		cleanup_thread(i);
@@ -722,12 +1219,11 @@ static void init_fds_pth(void)
 	int i = 0;
 	while (i < NUM_SENSORS) {
 		dummy_server_listenfd[i] = dummy_server_connfd[i] = -1;
-#ifdef DEVICE_READINGS
-		client_to_dev_sockfd[i] = -1;
-		client_to_dev_pth[i] = -1;
-#elif defined REMOTE_SERVER_READINGS
+#ifdef REMOTE_SERVER_READINGS
 		client_to_rs_sockfd[i] = -1;
 		client_to_rs_pth[i] = -1;
+#elif defined REPLAY_READINGS
+		replay_pth[i] = -1;
 #endif
 		emu_sockfd[i] = -1;
 
@@ -749,23 +1245,43 @@ int main(void)
 	(void)signal(SIGSEGV, sigsegv_handler);
 	(void)signal(SIGABRT, sigabrt_handler);
 
+	emu_log_conf(LOG_CONF_FILE);
+
 	LOG("** SensorEmulationClientServer - Started! **\n");
 
 #ifdef DEVICE_READINGS
 	LOG("DEVICE_READINGS!\n");
 #elif defined REMOTE_SERVER_READINGS
 	LOG("REMOTE_SERVER_READINGS!\n");
+#elif defined REPLAY_READINGS
+	LOG("REPLAY_READINGS!\n");
 #else
-	LOG("NOTE: Neither DEVICE_READINGS nor REMOTE_SERVER_READINGS!\n");
+	LOG("NOTE: Neither DEVICE_READINGS, REMOTE_SERVER_READINGS nor REPLAY_READINGS!\n");
 #endif
 
 	INIT_LOG_READING;
 
+	if (!emu_stats_open("relay", sensors_name, NUM_SENSORS)) {
+		ERR("Statistics page in %s - %s\n", EMU_STATS_DIR, strerror(errno));
+	} else {
+		emu_stats_dump_on(SIGUSR1);
+	}
+
+	load_transport_conf();
+	load_metrics_conf();
+	load_virtual_conf();
+
 	init_fds_pth();
 
+#ifdef REPLAY_READINGS
+	if (!load_replay_conf()) {
+		goto done;
+	}
+#endif
+
 	int i = 0;
 
-	while (i < NUM_SENSORS) {
+	while (i < num_relayed) {
 		struct dummy_server_data *d = malloc(sizeof(*d));
 		if (!d) {
 			ERR("malloc - %s\n", strerror(errno));
@@ -784,41 +1300,47 @@ int main(void)
 	}
 
 #ifdef DEVICE_READINGS
+	errno = pthread_create(&client_to_dev_pth, NULL, client_to_device, NULL);
+	bool created = !errno;
+	if (!created) {
+		ERR("pthread_create - Client to device failed - %s\n", strerror(errno));
+		goto done;
+	}
+#elif defined REMOTE_SERVER_READINGS
 	i = 0;
-	while (i < NUM_SENSORS) {
-		struct client_to_device_data *d = malloc(sizeof(*d));
-		if (!d) {
+	while (i < num_relayed) {
+		struct client_to_rs_data *r = malloc(sizeof(*r));
+		if (!r) {
 			ERR("malloc - %s\n", strerror(errno));
 			goto done;
 		}
-		d->dev_port = d->emu_port = BASE_PORT + i;
-		d->num = i;
-
-		errno = pthread_create(&client_to_dev_pth[i], NULL, client_to_device, d);
+		r->emu_port = BASE_PORT + i;
+		r->rs_port = BASE_PORT_EMULATOR + i;
+		r->num = i;
 
+		errno = pthread_create(&client_to_rs_pth[i], NULL, client_to_remote_server, r);
 		bool created = !errno;
 		if (!created) {
-			ERR("pthread_create - Client to device failed - %s\n", strerror(errno));
+			ERR("pthread_create - Client to remote server failed - %s\n", strerror(errno));
 			goto done;
 		}
 		i++;
 	}
-#elif defined REMOTE_SERVER_READINGS
+#elif defined REPLAY_READINGS
 	i = 0;
-	while (i < NUM_SENSORS) {
-		struct client_to_rs_data *r = malloc(sizeof(*r));
+	while (i < num_relayed) {
+		struct replay_data *r = malloc(sizeof(*r));
 		if (!r) {
 			ERR("malloc - %s\n", strerror(errno));
 			goto done;
 		}
 		r->emu_port = BASE_PORT + i;
-		r->rs_port = BASE_PORT_EMULATOR + i;
 		r->num = i;
 
-		errno = pthread_create(&client_to_rs_pth[i], NULL, client_to_remote_server, r);
+		errno = pthread_create(&replay_pth[i], NULL, replayer, r);
 		bool created = !errno;
 		if (!created) {
-			ERR("pthread_create - Client to remote server failed - %s\n", strerror(errno));
+			ERR("pthread_create - Replayer failed - %s\n", strerror(errno));
 			goto done;
 		}
 		i++;
@@ -826,24 +1348,32 @@ int main(void)
 #endif
 
 #ifdef DEVICE_READINGS
+	if (client_to_dev_pth != -1) {
+		bool joined = pthread_join(client_to_dev_pth, NULL) != -1;
+		if (!joined) {
+			ERR("pthread_join - Failed to wait for client to device - %s\n", strerror(errno));
+			goto done;
+		}
+	}
+#elif defined REMOTE_SERVER_READINGS
 	i = 0;
 	while (i < NUM_SENSORS) {
-		if (client_to_dev_pth[i] != -1) {
-			bool joined = pthread_join(client_to_dev_pth[i], NULL) != -1;
+		if (client_to_rs_pth[i] != -1) {
+			bool joined = pthread_join(client_to_rs_pth[i], NULL) != -1;
 			if (!joined) {
-				ERR("pthread_join - Failed to wait for client to device - %s\n", strerror(errno));
+				ERR("pthread_join - Failed to wait for client to remote server - %s\n", strerror(errno));
 				goto done;
 			}
 		}
 		i++;
 	}
-#elif defined REMOTE_SERVER_READINGS
+#elif defined REPLAY_READINGS
 	i = 0;
 	while (i < NUM_SENSORS) {
-		if (client_to_rs_pth[i] != -1) {
-			bool joined = pthread_join(client_to_rs_pth[i], NULL) != -1;
+		if (replay_pth[i] != -1) {
+			bool joined = pthread_join(replay_pth[i], NULL) != -1;
 			if (!joined) {
-				ERR("pthread_join - Failed to wait for client to remote server - %s\n", strerror(errno));
+				ERR("pthread_join - Failed to wait for replayer - %s\n", strerror(errno));
 				goto done;
 			}
 		}
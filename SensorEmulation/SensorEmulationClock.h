@@ -0,0 +1,721 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationClock.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationClock.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationClock.h
+ *
+ * Working:
+ *
+ * The clock, sleep and socket calls of the generator, the relay and the
+ * HAL go through the emu_*() functions below.
+ *
+ * Normally, they are the plain system calls.
+ *
+ * When VIRTUAL_TIME is defined, all of the processes built with it share
+ * a simulated clock living in a POSIX shared memory segment
+ * (EMU_VCLOCK_SHM_NAME, or $SENSOR_EMU_VCLOCK). The clock is advanced in
+ * the classic discrete-event fashion - it jumps straight to the earliest
+ * sleeper's deadline as soon as every participating thread is either
+ * sleeping or blocked on a socket, and no thread blocked in a receive has
+ * bytes sent by a participant on the way to it. So an hour of sensor traffic
+ * runs as fast as the CPU allows, while the timestamps and the pacing
+ * stay exact in virtual time.
+ *
+ * Every process on the data path has to be built with VIRTUAL_TIME for
+ * the in-flight accounting to balance - a real guest wouldn't receive
+ * through emu_recvfrom(). As a safety net, bytes that nobody receives for
+ * EMU_VCLOCK_STALL_MS of real time are written off.
+ *
+ * A thread becomes a participant on its first emu_*() sleep or socket
+ * call and stops being one when it exits. Slots of processes that died
+ * are reclaimed. A connection's accounting is released when a receive on
+ * it finds it closed by the other end, or when it's closed with
+ * emu_close().
+ *
+ * The clock only starts once $SENSOR_EMU_VCLOCK_PARTIES processes (1 by
+ * default) have attached, so that the first one to come up doesn't run
+ * ahead on its own while the others are still starting.
+ */
+
+#ifndef SENSOR_EMULATION_CLOCK_H
+#define SENSOR_EMULATION_CLOCK_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef VIRTUAL_TIME
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EMU_VCLOCK_SHM_NAME "/sensor_emu_vclock"
+#define EMU_VCLOCK_MAGIC 0x564b4c43 /* VKLC */
+#define EMU_VCLOCK_VERSION 2
+#define EMU_VCLOCK_MAX_THREADS 256
+#define EMU_VCLOCK_MAX_PARTIES 16
+#define EMU_VCLOCK_MAX_CONNS 1024 /* Power of 2. */
+#define EMU_VCLOCK_CONN_GONE 1 /* The src of a released connection, no real one's. */
+#define EMU_VCLOCK_STALL_MS 1000
+#define EMU_VCLOCK_NEVER INT64_MAX
+
+enum emu_vclock_slot_state { EMU_SLOT_FREE = 0, EMU_SLOT_ACTIVE = 1, EMU_SLOT_WAITING = 2, };
+
+struct emu_vclock {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t init_state; /* 0 - fresh, 1 - initializing, 2 - ready. */
+
+	pthread_mutex_t lock;
+
+	int64_t now_ns;
+	int64_t realtime_offset_ns; /* CLOCK_REALTIME - CLOCK_MONOTONIC at creation. */
+	int active; /* Participants neither sleeping nor blocked. */
+	int parties; /* Processes to wait for before the clock starts. */
+	int attached; /* Processes attached so far. */
+	pid_t attached_pids[EMU_VCLOCK_MAX_PARTIES];
+	uint64_t progress; /* Bumped on every state change, for stall detection. */
+
+	struct {
+		pid_t pid;
+		int state;
+		int64_t deadline_ns;
+		int conn; /* Connection blocked on in a receive, or -1. */
+		pthread_cond_t wake; /* Signalled when deadline_ns is reached. */
+	} slots[EMU_VCLOCK_MAX_THREADS];
+
+	// One direction of a TCP connection, by its source and destination
+	// (IPv4 address << 16 | port), with the bytes sent by participants
+	// and not received yet. Open addressed - a released one is left
+	// EMU_VCLOCK_CONN_GONE for the lookups to go on past.
+	struct {
+		uint64_t src;
+		uint64_t dst;
+		int64_t in_flight;
+	} conns[EMU_VCLOCK_MAX_CONNS];
+};
+
+static struct emu_vclock *emu_vclock;
+static pthread_once_t emu_vclock_once = PTHREAD_ONCE_INIT;
+static pthread_key_t emu_vclock_slot_key;
+static __thread int emu_vclock_slot = -1;
+
+static inline int64_t emu_real_ns(clockid_t clk)
+{
+	struct timespec t = { 0, 0 };
+	clock_gettime(clk, &t);
+
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static inline void emu_vclock_release(void *arg);
+
+static inline void emu_vclock_attach(void)
+{
+	const char *name = getenv("SENSOR_EMU_VCLOCK");
+	if (!name || !name[0]) {
+		name = EMU_VCLOCK_SHM_NAME;
+	}
+
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+	if (fd == -1) {
+		fprintf(stderr, "%s %d: ERROR - shm_open %s - %s\n", __func__, __LINE__, name, strerror(errno));
+		abort();
+	}
+	(void)ftruncate(fd, sizeof(struct emu_vclock));
+
+	struct emu_vclock *c = (struct emu_vclock *)mmap(NULL, sizeof(*c), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (c == MAP_FAILED) {
+		fprintf(stderr, "%s %d: ERROR - mmap %s - %s\n", __func__, __LINE__, name, strerror(errno));
+		abort();
+	}
+
+	uint32_t fresh = 0;
+	if (__atomic_compare_exchange_n(&c->init_state, &fresh, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		pthread_mutexattr_t ma;
+		pthread_mutexattr_init(&ma);
+		pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+		pthread_mutex_init(&c->lock, &ma);
+		pthread_mutexattr_destroy(&ma);
+
+		pthread_condattr_t ca;
+		pthread_condattr_init(&ca);
+		pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+		pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+		int i = 0;
+		while (i < EMU_VCLOCK_MAX_THREADS) {
+			pthread_cond_init(&c->slots[i].wake, &ca);
+			i++;
+		}
+		pthread_condattr_destroy(&ca);
+
+		const char *parties = getenv("SENSOR_EMU_VCLOCK_PARTIES");
+		c->parties = parties ? atoi(parties) : 1;
+
+		c->now_ns = emu_real_ns(CLOCK_MONOTONIC);
+		c->realtime_offset_ns = emu_real_ns(CLOCK_REALTIME) - c->now_ns;
+		c->magic = EMU_VCLOCK_MAGIC;
+		c->version = EMU_VCLOCK_VERSION;
+		__atomic_store_n(&c->init_state, 2, __ATOMIC_RELEASE);
+	} else {
+		while (__atomic_load_n(&c->init_state, __ATOMIC_ACQUIRE) != 2) {
+			sched_yield();
+		}
+		if (c->magic != EMU_VCLOCK_MAGIC || c->version != EMU_VCLOCK_VERSION) {
+			fprintf(stderr, "%s %d: ERROR - %s isn't a version %d virtual clock!\n", __func__, __LINE__,
+												name, EMU_VCLOCK_VERSION);
+			abort();
+		}
+	}
+
+	// A process may attach more than once - a HAL module and the program
+	// that loads it each have their own copy of this header.
+	pthread_mutex_lock(&c->lock);
+	int i = 0;
+	while (i < c->attached && c->attached_pids[i] != getpid()) {
+		i++;
+	}
+	if (i == c->attached && c->attached < EMU_VCLOCK_MAX_PARTIES) {
+		c->attached_pids[c->attached++] = getpid();
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	pthread_key_create(&emu_vclock_slot_key, emu_vclock_release);
+	emu_vclock = c;
+}
+
+// The direction of the connection of fd the bytes sent (or received) on
+// it travel in, or false if it isn't a TCP/IPv4 one.
+static inline bool emu_vclock_conn_key(int fd, bool sending, uint64_t *src, uint64_t *dst)
+{
+	struct sockaddr_in local = { 0 };
+	struct sockaddr_in peer = { 0 };
+	socklen_t local_len = sizeof(local);
+	socklen_t peer_len = sizeof(peer);
+
+	bool named = getsockname(fd, (struct sockaddr *)&local, &local_len) != -1 &&
+			getpeername(fd, (struct sockaddr *)&peer, &peer_len) != -1 && local.sin_family == AF_INET;
+	if (!named) {
+		return false;
+	}
+
+	uint64_t me = (uint64_t)ntohl(local.sin_addr.s_addr) << 16 | ntohs(local.sin_port);
+	uint64_t other = (uint64_t)ntohl(peer.sin_addr.s_addr) << 16 | ntohs(peer.sin_port);
+	*src = sending ? me : other;
+	*dst = sending ? other : me;
+
+	return true;
+}
+
+// The entry of a connection's direction, taken if it has none and add is
+// set, or -1. Called with the lock held.
+static inline int emu_vclock_conn_find(struct emu_vclock *c, uint64_t src, uint64_t dst, bool add)
+{
+	uint64_t h = (src * 0x9e3779b97f4a7c15ULL) ^ (dst * 0xc2b2ae3d27d4eb4fULL);
+	int gone = -1;
+	int probes = 0;
+	while (probes < EMU_VCLOCK_MAX_CONNS) {
+		int i = (int)((h + probes) & (EMU_VCLOCK_MAX_CONNS - 1));
+		if (c->conns[i].src == src && c->conns[i].dst == dst) {
+			return i;
+		}
+		if (c->conns[i].src == EMU_VCLOCK_CONN_GONE && gone == -1) {
+			gone = i;
+		}
+		if (!c->conns[i].src) {
+			if (gone == -1) {
+				gone = i;
+			}
+			break;
+		}
+		probes++;
+	}
+
+	if (!add || gone == -1) {
+		return -1;
+	}
+	c->conns[gone].src = src;
+	c->conns[gone].dst = dst;
+	c->conns[gone].in_flight = 0;
+
+	return gone;
+}
+
+// The connection the bytes sent or received on fd travel on, or -1 if it
+// isn't a TCP/IPv4 one. Called with the lock held.
+static inline int emu_vclock_conn(struct emu_vclock *c, int fd, bool sending)
+{
+	uint64_t src = 0;
+	uint64_t dst = 0;
+	if (!emu_vclock_conn_key(fd, sending, &src, &dst)) {
+		return -1;
+	}
+
+	return emu_vclock_conn_find(c, src, dst, true);
+}
+
+// Releases the entry of the direction of fd's connection bytes are
+// received in - nothing more will be - and of the one they're sent in if
+// nothing is on the way. The peer releases what it still has to receive.
+// Called with the lock held.
+static inline void emu_vclock_conn_release(struct emu_vclock *c, int fd)
+{
+	uint64_t src = 0;
+	uint64_t dst = 0;
+	if (!emu_vclock_conn_key(fd, false, &src, &dst)) {
+		return;
+	}
+
+	int in = emu_vclock_conn_find(c, src, dst, false);
+	if (in != -1) {
+		c->conns[in].src = EMU_VCLOCK_CONN_GONE;
+		c->conns[in].in_flight = 0;
+	}
+	int out = emu_vclock_conn_find(c, dst, src, false);
+	if (out != -1 && c->conns[out].in_flight <= 0) {
+		c->conns[out].src = EMU_VCLOCK_CONN_GONE;
+	}
+}
+
+// Jumps to the earliest deadline, once nothing can make progress at the
+// current time - no participant running, and none blocked in a receive
+// with bytes on the way to it. Called with the lock held.
+static inline void emu_vclock_advance(struct emu_vclock *c)
+{
+	if (c->active || c->attached < c->parties) {
+		return;
+	}
+
+	int64_t earliest = EMU_VCLOCK_NEVER;
+	int i = 0;
+	while (i < EMU_VCLOCK_MAX_THREADS) {
+		if (c->slots[i].state == EMU_SLOT_WAITING) {
+			int conn = c->slots[i].conn;
+			if (conn != -1 && c->conns[conn].in_flight > 0) {
+				return;
+			}
+			if (c->slots[i].deadline_ns < earliest) {
+				earliest = c->slots[i].deadline_ns;
+			}
+		}
+		i++;
+	}
+
+	if (earliest != EMU_VCLOCK_NEVER && earliest > c->now_ns) {
+		c->now_ns = earliest;
+		c->progress++;
+
+		// Only the sleepers that are due are woken up.
+		i = 0;
+		while (i < EMU_VCLOCK_MAX_THREADS) {
+			if (c->slots[i].state == EMU_SLOT_WAITING && c->slots[i].deadline_ns <= earliest) {
+				pthread_cond_signal(&c->slots[i].wake);
+			}
+			i++;
+		}
+	}
+}
+
+// Frees the slots of dead processes and writes off bytes nobody received.
+// Called with the lock held, when nothing happened for a while.
+static inline void emu_vclock_reap(struct emu_vclock *c)
+{
+	int i = 0;
+	while (i < EMU_VCLOCK_MAX_THREADS) {
+		bool dead = c->slots[i].state != EMU_SLOT_FREE && kill(c->slots[i].pid, 0) == -1 && errno == ESRCH;
+		if (dead) {
+			if (c->slots[i].state == EMU_SLOT_ACTIVE) {
+				c->active--;
+			}
+			c->slots[i].state = EMU_SLOT_FREE;
+			c->slots[i].pid = 0;
+		}
+
+		int conn = c->slots[i].conn;
+		if (!c->active && c->slots[i].state == EMU_SLOT_WAITING && conn != -1 && c->conns[conn].in_flight > 0) {
+			fprintf(stderr, "%s %d: ERROR - %lld bytes in flight never received. Writing off!\n",
+							__func__, __LINE__, (long long)c->conns[conn].in_flight);
+			c->conns[conn].in_flight = 0;
+		}
+		i++;
+	}
+
+	emu_vclock_advance(c);
+}
+
+static inline struct emu_vclock *emu_vclock_get(void)
+{
+	pthread_once(&emu_vclock_once, emu_vclock_attach);
+	struct emu_vclock *c = emu_vclock;
+
+	if (emu_vclock_slot == -1) {
+		pthread_mutex_lock(&c->lock);
+		int i = 0;
+		while (i < EMU_VCLOCK_MAX_THREADS && c->slots[i].state != EMU_SLOT_FREE) {
+			i++;
+		}
+		if (i == EMU_VCLOCK_MAX_THREADS) {
+			pthread_mutex_unlock(&c->lock);
+			fprintf(stderr, "%s %d: ERROR - More than %d virtual time threads!\n", __func__, __LINE__,
+												EMU_VCLOCK_MAX_THREADS);
+			abort();
+		}
+		c->slots[i].pid = getpid();
+		c->slots[i].state = EMU_SLOT_ACTIVE;
+		c->slots[i].conn = -1;
+		c->active++;
+		c->progress++;
+		pthread_mutex_unlock(&c->lock);
+
+		emu_vclock_slot = i;
+		pthread_setspecific(emu_vclock_slot_key, (void *)(intptr_t)(i + 1));
+	}
+
+	return c;
+}
+
+static inline void emu_vclock_release(void *arg)
+{
+	struct emu_vclock *c = emu_vclock;
+	int i = (int)(intptr_t)arg - 1;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->slots[i].state == EMU_SLOT_ACTIVE) {
+		c->active--;
+	}
+	c->slots[i].state = EMU_SLOT_FREE;
+	c->slots[i].pid = 0;
+	c->progress++;
+	emu_vclock_advance(c);
+	pthread_mutex_unlock(&c->lock);
+
+	emu_vclock_slot = -1;
+}
+
+// Stops counting the calling thread as running, till emu_vclock_run().
+// It's waiting for deadline_ns, or for another thread when EMU_VCLOCK_NEVER,
+// on conn if that's a receive. Called with the lock held.
+static inline void emu_vclock_wait(struct emu_vclock *c, int64_t deadline_ns, int conn)
+{
+	int me = emu_vclock_slot;
+
+	c->slots[me].state = EMU_SLOT_WAITING;
+	c->slots[me].deadline_ns = deadline_ns;
+	c->slots[me].conn = conn;
+	c->active--;
+	c->progress++;
+	emu_vclock_advance(c);
+}
+
+static inline void emu_vclock_run(struct emu_vclock *c)
+{
+	int me = emu_vclock_slot;
+
+	c->slots[me].state = EMU_SLOT_ACTIVE;
+	c->slots[me].conn = -1;
+	c->active++;
+	c->progress++;
+}
+
+// Sleeps till the virtual time reaches deadline_ns. Called with the lock held.
+static inline void emu_vclock_sleep(struct emu_vclock *c, int64_t deadline_ns)
+{
+	emu_vclock_wait(c, deadline_ns, -1);
+
+	while (c->now_ns < deadline_ns) {
+		uint64_t progress = c->progress;
+
+		struct timespec until = { 0, 0 };
+		clock_gettime(CLOCK_MONOTONIC, &until);
+		until.tv_sec += EMU_VCLOCK_STALL_MS / 1000;
+		until.tv_nsec += (EMU_VCLOCK_STALL_MS % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+
+		int ret = pthread_cond_timedwait(&c->slots[emu_vclock_slot].wake, &c->lock, &until);
+		if (ret == ETIMEDOUT && c->progress == progress) {
+			emu_vclock_reap(c);
+		}
+	}
+
+	emu_vclock_run(c);
+}
+
+static inline void emu_vclock_sent(struct emu_vclock *c, int conn, ssize_t bytes)
+{
+	if (conn != -1) {
+		c->conns[conn].in_flight += bytes;
+		if (c->conns[conn].in_flight < 0) {
+			c->conns[conn].in_flight = 0; // Sent by a non-participant.
+		}
+	}
+}
+
+// Reading the clock doesn't make a participant - it can't hold it back.
+static inline int emu_clock_gettime(clockid_t clk, struct timespec *t)
+{
+	pthread_once(&emu_vclock_once, emu_vclock_attach);
+	struct emu_vclock *c = emu_vclock;
+
+	pthread_mutex_lock(&c->lock);
+	int64_t ns = c->now_ns + (clk == CLOCK_REALTIME ? c->realtime_offset_ns : 0);
+	pthread_mutex_unlock(&c->lock);
+
+	t->tv_sec = ns / 1000000000LL;
+	t->tv_nsec = ns % 1000000000LL;
+
+	return 0;
+}
+
+static inline int emu_nanosleep(const struct timespec *req)
+{
+	struct emu_vclock *c = emu_vclock_get();
+
+	pthread_mutex_lock(&c->lock);
+	emu_vclock_sleep(c, c->now_ns + (int64_t)req->tv_sec * 1000000000LL + req->tv_nsec);
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+static inline int emu_usleep(useconds_t us)
+{
+	struct timespec t = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000L };
+
+	return emu_nanosleep(&t);
+}
+
+static inline unsigned int emu_sleep(unsigned int s)
+{
+	struct timespec t = { (time_t)s, 0 };
+	emu_nanosleep(&t);
+
+	return 0;
+}
+
+// The socket calls only stop the thread from being counted as running
+// when they would really block - otherwise the clock could jump past the
+// thread's next sleep.
+static inline int emu_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	struct emu_vclock *c = emu_vclock_get();
+
+	struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0, };
+	if (poll(&pfd, 1, 0) == 1) {
+		return accept(fd, addr, addrlen);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	emu_vclock_wait(c, EMU_VCLOCK_NEVER, -1);
+	pthread_mutex_unlock(&c->lock);
+
+	int ret = accept(fd, addr, addrlen);
+	int saved_errno = errno;
+
+	pthread_mutex_lock(&c->lock);
+	emu_vclock_run(c);
+	pthread_mutex_unlock(&c->lock);
+
+	errno = saved_errno;
+
+	return ret;
+}
+
+// MSG_WAITALL is done here, chunk by chunk, so that every received chunk
+// is accounted for before blocking for the rest.
+static inline ssize_t emu_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen)
+{
+	struct emu_vclock *c = emu_vclock_get();
+
+	bool wait_all = flags & MSG_WAITALL;
+	bool dont_wait = flags & MSG_DONTWAIT;
+	flags &= ~MSG_WAITALL;
+
+	pthread_mutex_lock(&c->lock);
+	int conn = emu_vclock_conn(c, fd, false);
+	pthread_mutex_unlock(&c->lock);
+
+	size_t got = 0;
+	do {
+		ssize_t ret = recvfrom(fd, (char *)buf + got, len - got, flags | MSG_DONTWAIT, addr, addrlen);
+		bool would_block = ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+		if (would_block && !dont_wait) {
+			pthread_mutex_lock(&c->lock);
+			emu_vclock_wait(c, EMU_VCLOCK_NEVER, conn);
+			pthread_mutex_unlock(&c->lock);
+
+			ret = recvfrom(fd, (char *)buf + got, len - got, flags, addr, addrlen);
+			int saved_errno = errno;
+
+			pthread_mutex_lock(&c->lock);
+			emu_vclock_run(c);
+			pthread_mutex_unlock(&c->lock);
+
+			errno = saved_errno;
+		}
+
+		if (!ret) {
+			pthread_mutex_lock(&c->lock);
+			emu_vclock_conn_release(c, fd); // Closed by the other end.
+			pthread_mutex_unlock(&c->lock);
+		}
+		if (ret <= 0) {
+			return got ? (ssize_t)got : ret;
+		}
+
+		pthread_mutex_lock(&c->lock);
+		emu_vclock_sent(c, conn, -ret);
+		pthread_mutex_unlock(&c->lock);
+
+		got += ret;
+	} while (wait_all && got < len);
+
+	return got;
+}
+
+static inline ssize_t emu_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct emu_vclock *c = emu_vclock_get();
+
+	pthread_mutex_lock(&c->lock);
+	int conn = emu_vclock_conn(c, fd, true);
+	emu_vclock_sent(c, conn, len);
+	pthread_mutex_unlock(&c->lock);
+
+	ssize_t ret = sendto(fd, buf, len, flags | MSG_DONTWAIT, addr, addrlen);
+	bool would_block = ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	size_t sent = ret > 0 ? ret : 0;
+
+	if ((would_block || (ret > 0 && sent < len)) && !(flags & MSG_DONTWAIT)) {
+		pthread_mutex_lock(&c->lock);
+		emu_vclock_wait(c, EMU_VCLOCK_NEVER, -1);
+		pthread_mutex_unlock(&c->lock);
+
+		ret = sendto(fd, (const char *)buf + sent, len - sent, flags, addr, addrlen);
+		sent += ret > 0 ? ret : 0;
+		if (ret != -1) {
+			ret = sent;
+		}
+		int saved_errno = errno;
+
+		pthread_mutex_lock(&c->lock);
+		emu_vclock_run(c);
+		pthread_mutex_unlock(&c->lock);
+
+		errno = saved_errno;
+	}
+
+	if (sent < len) {
+		int saved_errno = errno;
+		pthread_mutex_lock(&c->lock);
+		emu_vclock_sent(c, conn, -(ssize_t)(len - sent));
+		pthread_mutex_unlock(&c->lock);
+		errno = saved_errno;
+	}
+
+	return ret;
+}
+
+static inline ssize_t emu_write(int fd, const void *buf, size_t len)
+{
+	return emu_sendto(fd, buf, len, 0, NULL, 0);
+}
+
+// For the sockets sent or received on with the calls above, so that their
+// connections' accounting is released. Closing doesn't make the thread a
+// participant.
+static inline int emu_close(int fd)
+{
+	pthread_once(&emu_vclock_once, emu_vclock_attach);
+	struct emu_vclock *c = emu_vclock;
+
+	pthread_mutex_lock(&c->lock);
+	emu_vclock_conn_release(c, fd);
+	pthread_mutex_unlock(&c->lock);
+
+	return close(fd);
+}
+
+#else
+
+static inline int emu_clock_gettime(clockid_t clk, struct timespec *t)
+{
+	return clock_gettime(clk, t);
+}
+
+static inline int emu_nanosleep(const struct timespec *req)
+{
+	return nanosleep(req, NULL);
+}
+
+static inline int emu_usleep(useconds_t us)
+{
+	return usleep(us);
+}
+
+static inline unsigned int emu_sleep(unsigned int s)
+{
+	return sleep(s);
+}
+
+static inline int emu_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	return accept(fd, addr, addrlen);
+}
+
+static inline ssize_t emu_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen)
+{
+	return recvfrom(fd, buf, len, flags, addr, addrlen);
+}
+
+static inline ssize_t emu_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addrlen)
+{
+	return sendto(fd, buf, len, flags, addr, addrlen);
+}
+
+static inline ssize_t emu_write(int fd, const void *buf, size_t len)
+{
+	return write(fd, buf, len);
+}
+
+static inline int emu_close(int fd)
+{
+	return close(fd);
+}
+
+#endif /* VIRTUAL_TIME */
+
+#endif /* SENSOR_EMULATION_CLOCK_H */
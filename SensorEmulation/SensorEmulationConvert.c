@@ -0,0 +1,509 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationConvert.c is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationConvert.c is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationConvert.c
+ *
+ * Working:
+ *
+ * Converts text readings logs of
+ *
+ *	[<sensor>] <ns>ns : <value>|<value>|...
+ *
+ * lines - the /data/<sensor>_readings of TEXT_READINGS, or what
+ * SensorEmulationRecordDump prints - into binary recordings of
+ * SensorEmulationRecord.h, <log>.rec by default. The recording has the
+ * readings of every sensor in blocks of their own, column by column, and
+ * its block index - the sensor and the time span of every block - is the
+ * time index that SensorEmulationRecordDump -i prints and that replaying
+ * and seeking use.
+ *
+ * The log is mmap()ed and cut into CONVERT_CHUNK_MB pieces at line
+ * boundaries. A round of as many pieces as there are threads (-j, the
+ * number of cores by default) is parsed in parallel, each thread into
+ * blocks of its own in memory, with the values parsed by
+ * emu_rec_parse_float() instead of strtof(). The blocks are then written
+ * out in the order of the pieces, so the readings of a sensor stay in
+ * the order of the log, and the next round starts - only a round's worth
+ * of the log and of the blocks is in memory at a time. The sensors are
+ * named in the order they first appear in. Lines that aren't readings,
+ * e.g. of the relay's ubuntu_readings, which have no time, are skipped
+ * and counted.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "SensorEmulationRecord.h"
+
+#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+
+#define CONVERT_CHUNK_MB 64
+#define CONVERT_MAX_THREADS 64
+
+// A piece of the log and the blocks it was converted into.
+struct chunk {
+	const char *start;
+	const char *end;
+
+	unsigned char *out;
+	size_t used;
+	size_t size;
+	struct emu_rec_index *index; /* Offsets are into out. */
+	uint32_t entries;
+	uint32_t index_size;
+
+	struct emu_rec_samples *open[EMU_REC_MAX_SENSORS];
+	char names[EMU_REC_MAX_SENSORS][EMU_REC_NAME_SIZE]; /* Of the piece's own sensor numbers. */
+	int num_names;
+
+	unsigned long long lines;
+	unsigned long long samples;
+	unsigned long long skipped;
+	bool failed;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-o recording] log...\n", prog);
+}
+
+// The sensor named name in names, added if it's new. -1 if there are too
+// many.
+static int sensor_of(char names[][EMU_REC_NAME_SIZE], int *num_names, const char *name, size_t len)
+{
+	if (len >= EMU_REC_NAME_SIZE) {
+		len = EMU_REC_NAME_SIZE - 1;
+	}
+
+	int n = 0;
+	while (n < *num_names) {
+		if (!strncmp(names[n], name, len) && names[n][len] == '\0') {
+			return n;
+		}
+		n++;
+	}
+	if (*num_names == EMU_REC_MAX_SENSORS) {
+		return -1;
+	}
+
+	memcpy(names[n], name, len);
+	names[n][len] = '\0';
+	(*num_names)++;
+
+	return n;
+}
+
+static bool flush_block(struct chunk *c, int sensor)
+{
+	struct emu_rec_samples *s = c->open[sensor];
+	if (!s || !s->num) {
+		return true;
+	}
+
+	size_t need = sizeof(struct emu_rec_block_header) + EMU_REC_MAX_BLOCK_BYTES;
+	if (c->used + need > c->size) {
+		size_t new_size = c->size ? c->size * 2 : 4 * need;
+		while (c->used + need > new_size) {
+			new_size *= 2;
+		}
+		unsigned char *out = (unsigned char *)realloc(c->out, new_size);
+		if (!out) {
+			return false;
+		}
+		c->out = out;
+		c->size = new_size;
+	}
+	if (c->entries == c->index_size) {
+		uint32_t new_size = c->index_size ? c->index_size * 2 : 256;
+		struct emu_rec_index *index = (struct emu_rec_index *)realloc(c->index, new_size * sizeof(*index));
+		if (!index) {
+			return false;
+		}
+		c->index = index;
+		c->index_size = new_size;
+	}
+
+	struct emu_rec_index *e = &c->index[c->entries++];
+	size_t size = emu_rec_build_block(s, c->out + c->used, e);
+	e->offset = c->used;
+	c->used += size;
+	s->num = 0;
+
+	return true;
+}
+
+static bool add_sample(struct chunk *c, int sensor, int64_t ns, const float *v, int columns)
+{
+	struct emu_rec_samples *s = c->open[sensor];
+	if (s && s->num && s->columns != columns && !flush_block(c, sensor)) {
+		return false;
+	}
+	if (!s) {
+		s = (struct emu_rec_samples *)malloc(sizeof(*s));
+		if (!s) {
+			return false;
+		}
+		s->sensor = sensor;
+		s->num = 0;
+		c->open[sensor] = s;
+	}
+
+	s->columns = columns;
+	s->ns[s->num] = ns;
+	int col = 0;
+	while (col < columns) {
+		s->v[col][s->num] = v[col];
+		col++;
+	}
+	s->num++;
+
+	return s->num < EMU_REC_BLOCK_SAMPLES || flush_block(c, sensor);
+}
+
+static bool parse_line(struct chunk *c, const char *p, const char *eol)
+{
+	const char *name = NULL;
+	size_t len = 0;
+	int64_t ns = 0;
+	float v[EMU_REC_MAX_COLUMNS];
+	int columns = 0;
+	if (!emu_rec_parse_line(p, eol, &name, &len, &ns, v, &columns)) {
+		return false;
+	}
+
+	int sensor = sensor_of(c->names, &c->num_names, name, len);
+	if (sensor == -1) {
+		return false;
+	}
+
+	if (!add_sample(c, sensor, ns, v, columns)) {
+		c->failed = true;
+		return false;
+	}
+	c->samples++;
+
+	return true;
+}
+
+static void *convert_chunk(void *arg)
+{
+	struct chunk *c = (struct chunk *)arg;
+
+	const char *p = c->start;
+	while (p < c->end && !c->failed) {
+		const char *eol = (const char *)memchr(p, '\n', c->end - p);
+		if (!eol) {
+			eol = c->end;
+		}
+		if (eol > p && !parse_line(c, p, eol)) {
+			c->skipped++;
+		}
+		c->lines++;
+		p = eol + 1;
+	}
+
+	// The readings in this piece go in its blocks, before the next piece's.
+	int n = 0;
+	while (n < EMU_REC_MAX_SENSORS && !c->failed) {
+		if (!flush_block(c, n)) {
+			c->failed = true;
+		}
+		n++;
+	}
+
+	return NULL;
+}
+
+static void free_chunk(struct chunk *c)
+{
+	free(c->out);
+	free(c->index);
+	int n = 0;
+	while (n < EMU_REC_MAX_SENSORS) {
+		free(c->open[n]);
+		n++;
+	}
+}
+
+static bool convert(const char *in_path, const char *out_path, int threads)
+{
+	bool success = false;
+	int fd = -1;
+	char *map = NULL;
+	size_t size = 0;
+	FILE *fp = NULL;
+	bool created = false;
+	struct emu_rec_index *index = NULL;
+	uint32_t entries = 0;
+	uint32_t index_size = 0;
+	uint64_t offset = sizeof(struct emu_rec_header);
+	unsigned long long lines = 0;
+	unsigned long long samples = 0;
+	unsigned long long skipped = 0;
+	struct emu_rec_header h;
+	char names[EMU_REC_MAX_SENSORS][EMU_REC_NAME_SIZE];
+	int num_names = 0;
+	const char *name_of[EMU_REC_MAX_SENSORS];
+	struct chunk chunks[CONVERT_MAX_THREADS];
+	pthread_t pth[CONVERT_MAX_THREADS];
+	const char *p = NULL;
+	struct timespec started = { 0, 0 };
+	struct timespec finished = { 0, 0 };
+	struct stat st;
+	double secs = 0;
+	int i = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	fd = open(in_path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		ERR("%s - %s\n", in_path, strerror(errno));
+		goto done;
+	}
+	size = st.st_size;
+	if (size) {
+		map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			ERR("mmap %s - %s\n", in_path, strerror(errno));
+			goto done;
+		}
+		madvise(map, size, MADV_SEQUENTIAL);
+	}
+
+	fp = fopen(out_path, "w");
+	if (!fp) {
+		ERR("%s - %s\n", out_path, strerror(errno));
+		goto done;
+	}
+	created = true;
+	setvbuf(fp, NULL, _IOFBF, EMU_REC_WRITE_BUFFER);
+
+	// Its names are only known at the end.
+	memset(&h, 0, sizeof(h));
+	if (fwrite(&h, sizeof(h), 1, fp) != 1) {
+		ERR("%s - %s\n", out_path, strerror(errno));
+		goto done;
+	}
+
+	p = map;
+	while (p < map + size) {
+		int num = 0;
+		while (num < threads && p < map + size) {
+			struct chunk *c = &chunks[num];
+			memset(c, 0, sizeof(*c));
+			c->start = p;
+			c->end = (size_t)(map + size - p) > CONVERT_CHUNK_MB * 1024UL * 1024 ?
+					p + CONVERT_CHUNK_MB * 1024UL * 1024 : map + size;
+			// Up to the end of the line it's in the middle of.
+			const char *eol = (const char *)memchr(c->end, '\n', map + size - c->end);
+			if (c->end < map + size) {
+				c->end = eol ? eol + 1 : map + size;
+			}
+			p = c->end;
+			num++;
+		}
+
+		i = 0;
+		while (i < num) {
+			if (pthread_create(&pth[i], NULL, convert_chunk, &chunks[i])) {
+				convert_chunk(&chunks[i]); // Here instead.
+				pth[i] = 0;
+			}
+			i++;
+		}
+
+		bool failed = false;
+		i = 0;
+		while (i < num) {
+			struct chunk *c = &chunks[i];
+			if (pth[i]) {
+				pthread_join(pth[i], NULL);
+			}
+			failed = failed || c->failed;
+
+			// The sensors are numbered in the order they're in the log,
+			// whichever thread saw them first.
+			int renumber[EMU_REC_MAX_SENSORS];
+			int n = 0;
+			while (n < c->num_names && !failed) {
+				renumber[n] = sensor_of(names, &num_names, c->names[n], strlen(c->names[n]));
+				if (renumber[n] == -1) {
+					ERR("%s has more than %d sensors\n", in_path, EMU_REC_MAX_SENSORS);
+					failed = true;
+				}
+				n++;
+			}
+			uint32_t e = 0;
+			while (e < c->entries && !failed) {
+				struct emu_rec_block_header bh;
+				memcpy(&bh, c->out + c->index[e].offset, sizeof(bh));
+				bh.sensor = c->index[e].sensor = renumber[c->index[e].sensor];
+				memcpy(c->out + c->index[e].offset, &bh, sizeof(bh));
+				e++;
+			}
+
+			if (!failed && c->used && fwrite(c->out, c->used, 1, fp) != 1) {
+				ERR("%s - %s\n", out_path, strerror(errno));
+				failed = true;
+			}
+			if (!failed && entries + c->entries > index_size) {
+				uint32_t new_size = index_size ? index_size : 256;
+				while (entries + c->entries > new_size) {
+					new_size *= 2;
+				}
+				struct emu_rec_index *new_index = (struct emu_rec_index *)realloc(index, new_size * sizeof(*index));
+				if (!new_index) {
+					ERR("realloc - %s\n", strerror(errno));
+					failed = true;
+				} else {
+					index = new_index;
+					index_size = new_size;
+				}
+			}
+			if (!failed) {
+				e = 0;
+				while (e < c->entries) {
+					index[entries] = c->index[e];
+					index[entries].offset += offset;
+					entries++;
+					e++;
+				}
+				offset += c->used;
+			}
+
+			lines += c->lines;
+			samples += c->samples;
+			skipped += c->skipped;
+			free_chunk(c);
+			i++;
+		}
+		if (failed) {
+			ERR("Failed converting %s\n", in_path);
+			goto done;
+		}
+
+		if (map) {
+			madvise((char *)map, p - map, MADV_DONTNEED); // Done with.
+		}
+	}
+
+	if (!emu_rec_write_index(fp, index, entries, offset)) {
+		ERR("%s - %s\n", out_path, strerror(errno));
+		goto done;
+	}
+
+	i = 0;
+	while (i < num_names) {
+		name_of[i] = names[i];
+		i++;
+	}
+	emu_rec_init_header(&h, name_of, num_names);
+	if (fseek(fp, 0, SEEK_SET) == -1 || fwrite(&h, sizeof(h), 1, fp) != 1) {
+		ERR("%s - %s\n", out_path, strerror(errno));
+		goto done;
+	}
+
+	if (fclose(fp)) {
+		fp = NULL;
+		ERR("%s - %s\n", out_path, strerror(errno));
+		goto done;
+	}
+	fp = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	secs = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1E9;
+	printf("%s -> %s : %llu lines, %llu samples of %d sensors, %llu skipped, %zu -> %llu bytes, %.1f MB/s\n",
+			in_path, out_path, lines, samples, num_names, skipped, size,
+			(unsigned long long)(offset + entries * sizeof(*index) + sizeof(struct emu_rec_footer)),
+			secs > 0 ? size / secs / 1E6 : 0.0);
+
+	success = true;
+
+done:
+	if (fp) {
+		fclose(fp);
+	}
+	if (!success && created) {
+		unlink(out_path);
+	}
+	free(index);
+	if (map) {
+		munmap(map, size);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+
+	return success;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *out = NULL;
+
+	int opt = -1;
+	while ((opt = getopt(argc, argv, "j:o:h")) != -1) {
+		switch (opt) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind == argc || (out && optind != argc - 1)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > CONVERT_MAX_THREADS) {
+		threads = CONVERT_MAX_THREADS;
+	}
+
+	bool success = true;
+	int i = optind;
+	while (i < argc) {
+		char path[PATH_MAX];
+		if (!out) {
+			snprintf(path, sizeof(path), "%s.rec", argv[i]);
+		}
+		success = convert(argv[i], out ? out : path, threads) && success;
+		i++;
+	}
+
+	return success ? 0 : 1;
+}
@@ -0,0 +1,696 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationDiff.c is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationDiff.c is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationDiff.c
+ *
+ * Working:
+ *
+ * Compares what was delivered - the guest capture, e.g. the HAL's
+ * readings.rec - with what was sent - the source capture, e.g. the relay's
+ * ubuntu_readings.rec or a device side one. Either is a recording or a
+ * text readings log, read through SensorEmulationIndex.h. The sensors of
+ * both with the same name are compared, and for each it prints how many
+ * readings were
+ *
+ *	sent, and delivered as they were sent,
+ *	delivered changed - and by how much at most and on average,
+ *	delivered more than once, or not sent at all,
+ *	dropped - sent but never delivered,
+ *
+ * and the percentiles of the time they took, from the source's time of a
+ * reading to the guest's.
+ *
+ * The readings are delivered in the order they were sent, so they're
+ * matched first in first out - a delivered reading is the next one sent
+ * with the same values, up to -m ms (MAX_LATENCY_MS) before it and the
+ * ones it skipped were dropped. Of a run of readings with the same values,
+ * it's the one that took as long as the last one matched. One that's the
+ * same as the last one matched is a duplicate. Any other is the next one
+ * sent, changed, or if there's none, one that wasn't sent.
+ *
+ * The two captures are taken to have the same clock, unless the guest's
+ * is -O ms ahead, or -a finds how far: the first ALIGN_READINGS
+ * readings of a sensor of the guest are looked up among all of the
+ * source's by their values, and every pair with the same ones votes for
+ * their difference in time - a cross-correlation of the two over
+ * identical readings. The start of the densest -m ms of the votes is
+ * taken as the offset, so the times are then relative to the fastest
+ * delivery.
+ *
+ * The time of the source is cut into -w second windows per sensor, and
+ * a round of as many as there are threads (-j, the number of cores by
+ * default) is compared in parallel. A window owns the readings sent in
+ * it, and also looks at the ones sent -m ms before and after it, and at
+ * the ones delivered up to -m ms after it, so that readings delivered
+ * across its edges are matched too, but only counted once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "SensorEmulationHistogram.h"
+#include "SensorEmulationIndex.h"
+
+#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+
+#define MAX_THREADS 64
+#define MAX_LATENCY_MS 1000
+#define WINDOW_S 60
+#define EARLY_NS 1000000 /* Delivered before it was sent, by the clocks. */
+#define ALIGN_READINGS 4096
+#define ALIGN_MAX_VOTES (4 * 1024 * 1024)
+#define FIRST_DROPS 3
+
+
+struct reading {
+	int64_t ns;
+	int columns;
+	float v[EMU_REC_MAX_COLUMNS];
+	bool matched;
+};
+
+struct readings {
+	struct reading *r;
+	uint32_t num;
+	uint32_t size;
+	int64_t from_ns; /* Only these are kept. */
+	int64_t to_ns;
+	bool failed;
+};
+
+struct result {
+	uint64_t sent;
+	uint64_t exact;
+	uint64_t changed;
+	uint64_t duplicates;
+	uint64_t extra;
+	uint64_t dropped;
+	double error_sum;
+	double error_max;
+	struct emu_hist latency;
+	int64_t first_drops[FIRST_DROPS];
+	int num_first_drops;
+};
+
+// A window of a sensor.
+struct unit {
+	int source_sensor;
+	int guest_sensor;
+	int64_t from_ns; /* Source time. */
+	int64_t to_ns;
+	struct readings sent;
+	struct readings delivered;
+	struct result result;
+	bool failed;
+};
+
+static struct emu_index source;
+static struct emu_index guest;
+static int64_t offset_ns; /* Of the guest's clock. */
+static int64_t max_latency_ns = MAX_LATENCY_MS * 1000000LL;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-a | -O guest clock ahead ms] [-m max latency ms] [-w window s] source guest\n", prog);
+}
+
+static bool keep_reading(void *arg, int sensor, int64_t ns, const float *v, int columns)
+{
+	struct readings *r = (struct readings *)arg;
+	(void)sensor;
+
+	if (ns < r->from_ns || ns >= r->to_ns) {
+		return true;
+	}
+	if (r->num == r->size) {
+		uint32_t new_size = r->size ? r->size * 2 : 4096;
+		struct reading *new_r = (struct reading *)realloc(r->r, new_size * sizeof(*new_r));
+		if (!new_r) {
+			r->failed = true;
+			return false;
+		}
+		r->r = new_r;
+		r->size = new_size;
+	}
+
+	struct reading *p = &r->r[r->num++];
+	p->ns = ns;
+	p->columns = columns;
+	memcpy(p->v, v, columns * sizeof(*v));
+	p->matched = false;
+
+	return true;
+}
+
+static bool same_values(const struct reading *a, const struct reading *b)
+{
+	return a->columns == b->columns && !memcmp(a->v, b->v, a->columns * sizeof(*a->v));
+}
+
+static double error_of(const struct reading *a, const struct reading *b)
+{
+	double error = 0;
+	int columns = a->columns < b->columns ? a->columns : b->columns;
+	int c = 0;
+	while (c < columns) {
+		double e = a->v[c] > b->v[c] ? a->v[c] - b->v[c] : b->v[c] - a->v[c];
+		if (e > error) {
+			error = e;
+		}
+		c++;
+	}
+
+	return error;
+}
+
+static void count_match(struct unit *u, const struct reading *s, const struct reading *d, bool exact)
+{
+	struct result *res = &u->result;
+	if (s->ns < u->from_ns || s->ns >= u->to_ns) {
+		return; // Counted by the window it was sent in.
+	}
+
+	if (exact) {
+		res->exact++;
+	} else {
+		double error = error_of(s, d);
+		res->changed++;
+		res->error_sum += error;
+		if (error > res->error_max) {
+			res->error_max = error;
+		}
+	}
+
+	int64_t latency = d->ns - offset_ns - s->ns;
+	if (latency < 0) {
+		latency = 0;
+	}
+	emu_hist_record(&res->latency, latency);
+}
+
+static void compare(struct unit *u)
+{
+	struct readings *sent = &u->sent;
+	struct readings *delivered = &u->delivered;
+	struct result *res = &u->result;
+	uint32_t next = 0; /* The first sent that may not be matched yet. */
+	int64_t last = -1; /* The last sent matched. */
+	int64_t latency = 0; /* Of it. */
+
+	uint32_t i = 0;
+	while (i < delivered->num) {
+		struct reading *d = &delivered->r[i];
+		int64_t t = d->ns - offset_ns;
+		bool own = t < u->to_ns; /* Or looked at for the window before. */
+
+		// Too old to be delivered now.
+		while (next < sent->num && (sent->r[next].matched || sent->r[next].ns < t - max_latency_ns)) {
+			next++;
+		}
+
+		uint32_t k = next;
+		while (k < sent->num && sent->r[k].ns <= t + EARLY_NS && !same_values(&sent->r[k], d)) {
+			k++;
+		}
+		if (k < sent->num && sent->r[k].ns <= t + EARLY_NS) {
+			// Of a run of the same values, the one sent when the
+			// last took as long, or the latest if none did yet.
+			int64_t when = last == -1 ? t + EARLY_NS : t - latency;
+			while (k + 1 < sent->num && sent->r[k + 1].ns <= t + EARLY_NS && same_values(&sent->r[k + 1], d) &&
+					llabs(sent->r[k + 1].ns - when) <= llabs(sent->r[k].ns - when)) {
+				k++;
+			}
+			sent->r[k].matched = true;
+			count_match(u, &sent->r[k], d, true);
+			latency = t - sent->r[k].ns;
+			last = k;
+			next = k + 1;
+		} else if (last != -1 && same_values(&sent->r[last], d)) {
+			if (own) {
+				res->duplicates++;
+			}
+		} else if (next < sent->num && sent->r[next].ns <= t + EARLY_NS && (own || sent->r[next].ns < u->to_ns)) {
+			// The latest sent, if none was matched yet.
+			while (last == -1 && next + 1 < sent->num && sent->r[next + 1].ns <= t + EARLY_NS) {
+				next++;
+			}
+			sent->r[next].matched = true;
+			count_match(u, &sent->r[next], d, false);
+			latency = t - sent->r[next].ns;
+			last = next;
+			next++;
+		} else if (own) {
+			res->extra++;
+		}
+		i++;
+	}
+
+	i = 0;
+	while (i < sent->num) {
+		const struct reading *s = &sent->r[i];
+		if (s->ns >= u->from_ns && s->ns < u->to_ns) {
+			res->sent++;
+			if (!s->matched) {
+				res->dropped++;
+				if (res->num_first_drops < FIRST_DROPS) {
+					res->first_drops[res->num_first_drops++] = s->ns;
+				}
+			}
+		}
+		i++;
+	}
+}
+
+static void *compare_unit(void *arg)
+{
+	struct unit *u = (struct unit *)arg;
+
+	u->sent.from_ns = u->from_ns - max_latency_ns;
+	u->sent.to_ns = u->to_ns + max_latency_ns;
+	u->delivered.from_ns = u->from_ns + offset_ns;
+	u->delivered.to_ns = u->to_ns + max_latency_ns + offset_ns;
+
+	if (!emu_index_extract(&source, 1U << u->source_sensor, u->sent.from_ns, u->sent.to_ns, keep_reading, &u->sent) ||
+		!emu_index_extract(&guest, 1U << u->guest_sensor, u->delivered.from_ns, u->delivered.to_ns,
+					keep_reading, &u->delivered) ||
+		u->sent.failed || u->delivered.failed) {
+		u->failed = true;
+		return NULL;
+	}
+
+	compare(u);
+
+	return NULL;
+}
+
+static void add_result(struct result *t, const struct result *r)
+{
+	t->sent += r->sent;
+	t->exact += r->exact;
+	t->changed += r->changed;
+	t->duplicates += r->duplicates;
+	t->extra += r->extra;
+	t->dropped += r->dropped;
+	t->error_sum += r->error_sum;
+	if (r->error_max > t->error_max) {
+		t->error_max = r->error_max;
+	}
+	emu_hist_merge(&t->latency, &r->latency);
+	int i = 0;
+	while (i < r->num_first_drops && t->num_first_drops < FIRST_DROPS) {
+		t->first_drops[t->num_first_drops++] = r->first_drops[i];
+		i++;
+	}
+}
+
+static double percentile(const struct result *r, double q)
+{
+	return emu_hist_percentile(&r->latency, q) / 1E6;
+}
+
+static void print_result(const char *name, const struct result *r)
+{
+	uint64_t matched = r->exact + r->changed;
+	printf("%s: %llu sent, %llu delivered as sent, %llu changed", name, (unsigned long long)r->sent,
+			(unsigned long long)r->exact, (unsigned long long)r->changed);
+	if (r->changed) {
+		printf(" (by %.9g at most, %.9g on average)", r->error_max, r->error_sum / r->changed);
+	}
+	printf(", %llu duplicates, %llu not sent, %llu dropped", (unsigned long long)r->duplicates,
+			(unsigned long long)r->extra, (unsigned long long)r->dropped);
+	int i = 0;
+	while (i < r->num_first_drops) {
+		printf("%s%lldns", i ? ", " : " - first at ", (long long)r->first_drops[i]);
+		i++;
+	}
+	printf("\n");
+
+	if (matched) {
+		printf("\tlatency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+				percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99), percentile(r, 0.999),
+				percentile(r, 1));
+	}
+}
+
+static bool has_readings(const struct emu_index *x, int sensor)
+{
+	uint32_t i = 0;
+	if (x->recording) {
+		while (i < x->reader.entries) {
+			if (x->reader.index[i].sensor == sensor) {
+				return true;
+			}
+			i++;
+		}
+		return false;
+	}
+
+	while (i < x->header.entries) {
+		if (x->strides[i].sensors & (1U << sensor)) {
+			return true;
+		}
+		i++;
+	}
+
+	return false;
+}
+
+/* Alignment. */
+
+struct align {
+	struct readings guest; /* The first ALIGN_READINGS. */
+	int32_t *table; /* Of guest readings by their values, -1 if empty. */
+	uint32_t mask;
+	int64_t *votes;
+	uint32_t num_votes;
+};
+
+static uint32_t hash_of(const float *v, int columns)
+{
+	uint32_t h = 2166136261U;
+	const unsigned char *p = (const unsigned char *)v;
+	size_t i = 0;
+	while (i < columns * sizeof(*v)) {
+		h = (h ^ p[i]) * 16777619U;
+		i++;
+	}
+
+	return h;
+}
+
+static bool vote(void *arg, int sensor, int64_t ns, const float *v, int columns)
+{
+	struct align *a = (struct align *)arg;
+	struct reading s;
+	(void)sensor;
+	s.columns = columns;
+	memcpy(s.v, v, columns * sizeof(*v));
+
+	uint32_t h = hash_of(v, columns) & a->mask;
+	while (a->table[h] != -1) {
+		const struct reading *d = &a->guest.r[a->table[h]];
+		if (same_values(d, &s)) {
+			a->votes[a->num_votes++] = d->ns - ns;
+			return a->num_votes < ALIGN_MAX_VOTES;
+		}
+		h = (h + 1) & a->mask;
+	}
+
+	return true;
+}
+
+static bool take_first(void *arg, int sensor, int64_t ns, const float *v, int columns)
+{
+	struct readings *r = (struct readings *)arg;
+
+	return keep_reading(arg, sensor, ns, v, columns) && r->num < ALIGN_READINGS;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Finds offset_ns from the readings of the sensors.
+static bool align(int source_sensor, int guest_sensor)
+{
+	bool success = false;
+	struct align a;
+	memset(&a, 0, sizeof(a));
+	a.guest.from_ns = INT64_MIN;
+	a.guest.to_ns = INT64_MAX;
+
+	if (!emu_index_extract(&guest, 1U << guest_sensor, INT64_MIN, INT64_MAX, take_first, &a.guest) || a.guest.failed) {
+		ERR("malloc - %s\n", strerror(errno));
+		goto done;
+	}
+
+	a.mask = 2 * ALIGN_READINGS - 1;
+	a.table = (int32_t *)malloc((a.mask + 1) * sizeof(*a.table));
+	a.votes = (int64_t *)malloc(ALIGN_MAX_VOTES * sizeof(*a.votes));
+	if (!a.table || !a.votes) {
+		ERR("malloc - %s\n", strerror(errno));
+		goto done;
+	}
+	memset(a.table, -1, (a.mask + 1) * sizeof(*a.table));
+
+	uint32_t i = 0;
+	while (i < a.guest.num) {
+		uint32_t h = hash_of(a.guest.r[i].v, a.guest.r[i].columns) & a.mask;
+		while (a.table[h] != -1 && !same_values(&a.guest.r[a.table[h]], &a.guest.r[i])) {
+			h = (h + 1) & a.mask;
+		}
+		if (a.table[h] == -1) {
+			a.table[h] = i;
+		}
+		i++;
+	}
+
+	if (!emu_index_extract(&source, 1U << source_sensor, INT64_MIN, INT64_MAX, vote, &a)) {
+		ERR("malloc - %s\n", strerror(errno));
+		goto done;
+	}
+	if (!a.num_votes) {
+		ERR("No readings of %s are the same in both\n", source.header.names[source_sensor]);
+		goto done;
+	}
+
+	// The densest max latency of the votes.
+	qsort(a.votes, a.num_votes, sizeof(*a.votes), compare_ns);
+	uint32_t best = 0;
+	uint32_t best_num = 0;
+	uint32_t end = 0;
+	i = 0;
+	while (i < a.num_votes) {
+		while (end < a.num_votes && a.votes[end] - a.votes[i] <= max_latency_ns) {
+			end++;
+		}
+		if (end - i > best_num) {
+			best = i;
+			best_num = end - i;
+		}
+		i++;
+	}
+	offset_ns = a.votes[best];
+	printf("Aligned on %s by %u of %u readings: the guest's clock is %.3f ms ahead\n",
+			source.header.names[source_sensor], best_num, a.num_votes, offset_ns / 1E6);
+
+	success = true;
+
+done:
+	free(a.guest.r);
+	free(a.table);
+	free(a.votes);
+
+	return success;
+}
+
+// The pair with the most different values among the first guest readings.
+static int most_varied(const int *pairs, int num)
+{
+	int best = -1;
+	uint32_t best_distinct = 0;
+
+	int n = 0;
+	while (n < num) {
+		if (pairs[n] != -1) {
+			struct readings r;
+			memset(&r, 0, sizeof(r));
+			r.from_ns = INT64_MIN;
+			r.to_ns = INT64_MAX;
+			emu_index_extract(&guest, 1U << pairs[n], INT64_MIN, INT64_MAX, take_first, &r);
+			uint32_t distinct = 0;
+			uint32_t i = 0;
+			while (i < r.num) {
+				distinct += !i || !same_values(&r.r[i], &r.r[i - 1]);
+				i++;
+			}
+			free(r.r);
+			if (best == -1 || distinct > best_distinct) {
+				best = n;
+				best_distinct = distinct;
+			}
+		}
+		n++;
+	}
+
+	return best;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	bool auto_align = false;
+	int64_t window_ns = WINDOW_S * 1000000000LL;
+	int pairs[EMU_REC_MAX_SENSORS]; /* Guest sensor of each source one, -1 if none. */
+	struct result results[EMU_REC_MAX_SENSORS];
+	struct unit units[MAX_THREADS];
+	pthread_t pth[MAX_THREADS];
+	int64_t from_ns = 0;
+	int64_t to_ns = 0;
+	int64_t window = 0;
+	int sensor = 0;
+	bool success = false;
+	bool failed = false;
+	int i = 0;
+
+	int opt = -1;
+	while ((opt = getopt(argc, argv, "j:aO:m:w:h")) != -1) {
+		switch (opt) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'a':
+				auto_align = true;
+				break;
+			case 'O':
+				offset_ns = (int64_t)(atof(optarg) * 1E6);
+				break;
+			case 'm':
+				max_latency_ns = (int64_t)(atof(optarg) * 1E6);
+				break;
+			case 'w':
+				window_ns = (int64_t)(atof(optarg) * 1E9);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 2 || window_ns <= 0 || max_latency_ns < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > MAX_THREADS) {
+		threads = MAX_THREADS;
+	}
+
+	if (!emu_index_open(&source, argv[optind])) {
+		ERR("%s - %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	if (!emu_index_open(&guest, argv[optind + 1])) {
+		ERR("%s - %s\n", argv[optind + 1], strerror(errno));
+		emu_index_close(&source);
+		return 1;
+	}
+
+	memset(results, 0, sizeof(results));
+	i = 0;
+	while (i < (int)source.header.num_sensors) {
+		uint32_t matched = emu_index_sensors(&guest, source.header.names[i]);
+		pairs[i] = -1;
+		if (matched && !(matched & (matched - 1)) && has_readings(&source, i)) {
+			pairs[i] = __builtin_ctz(matched);
+			if (!has_readings(&guest, pairs[i])) {
+				pairs[i] = -1;
+				printf("%s: not delivered at all\n", source.header.names[i]);
+			}
+		}
+		i++;
+	}
+
+	if (auto_align) {
+		int n = most_varied(pairs, source.header.num_sensors);
+		if (n == -1) {
+			ERR("No sensors in both %s and %s\n", argv[optind], argv[optind + 1]);
+			goto done;
+		}
+		if (!align(n, pairs[n])) {
+			goto done;
+		}
+	}
+
+	from_ns = source.header.first_ns < guest.header.first_ns - offset_ns ?
+			source.header.first_ns : guest.header.first_ns - offset_ns;
+	to_ns = source.header.last_ns > guest.header.last_ns - offset_ns ?
+			source.header.last_ns : guest.header.last_ns - offset_ns;
+
+	// Sensor by sensor, window by window.
+	while (sensor < (int)source.header.num_sensors) {
+		int num = 0;
+		while (num < threads && sensor < (int)source.header.num_sensors) {
+			if (pairs[sensor] == -1 || from_ns + window * window_ns > to_ns) {
+				sensor++;
+				window = 0;
+				continue;
+			}
+			struct unit *u = &units[num++];
+			memset(u, 0, sizeof(*u));
+			u->source_sensor = sensor;
+			u->guest_sensor = pairs[sensor];
+			u->from_ns = from_ns + window * window_ns;
+			u->to_ns = u->from_ns + window_ns;
+			window++;
+		}
+
+		i = 0;
+		while (i < num) {
+			if (pthread_create(&pth[i], NULL, compare_unit, &units[i])) {
+				compare_unit(&units[i]); // Here instead.
+				pth[i] = 0;
+			}
+			i++;
+		}
+		i = 0;
+		while (i < num) {
+			struct unit *u = &units[i];
+			if (pth[i]) {
+				pthread_join(pth[i], NULL);
+			}
+			failed = failed || u->failed;
+			add_result(&results[u->source_sensor], &u->result);
+			free(u->sent.r);
+			free(u->delivered.r);
+			i++;
+		}
+		if (failed) {
+			ERR("Out of memory\n");
+			goto done;
+		}
+	}
+
+	i = 0;
+	while (i < (int)source.header.num_sensors) {
+		if (pairs[i] != -1) {
+			print_result(source.header.names[i], &results[i]);
+		}
+		i++;
+	}
+
+	success = true;
+
+done:
+	emu_index_close(&source);
+	emu_index_close(&guest);
+
+	return success ? 0 : 1;
+}
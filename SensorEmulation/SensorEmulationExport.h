@@ -0,0 +1,1029 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationExport.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationExport.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationExport.h
+ *
+ * Working:
+ *
+ * The readings of all of the device's sensors - the four of the sensors
+ * HAL (libsensors_dev) and the five of the sensorservice
+ * (sensorservice_dev) - go out of one exporter: one thread, listening on
+ * one port, EMU_EXPORT_PORT, to up to EMU_EXPORT_SUBSCRIBERS connections
+ * at once - relays, recorders - each getting all of them.
+ *
+ * The hooks hand a whole sample - all of a sensor's values, coalesced
+ * up to the input event sync (EV_SYN) that ends it, and the timestamp of
+ * that event - to emu_export_publish(). It's put in the sensor's ring of
+ * EMU_EXPORT_RING_SAMPLES, which has one producer, the thread of the
+ * sensor's hook, and one consumer, the exporter, and takes no lock: the
+ * producer fills the sample at the head and publishes it by moving the
+ * head on, the consumer reads it at the tail and frees it by moving the
+ * tail on. A sample that finds the ring full is dropped, and counted. The
+ * producer makes a system call only to wake the exporter up - a byte down
+ * its pipe - when the exporter has found every ring empty and is waiting.
+ *
+ * Once woken up, the exporter lets EMU_EXPORT_LINGER_US go by, so that
+ * the samples of all the sensors due about then are sent together, and
+ * while it's sending, what's published piles up for the next batch. It
+ * formats the frames of the samples whose text changed - the same frames,
+ * trace trailer included, that a sensor's own server used to send - and
+ * writes them in batches of up to EMU_EXPORT_BATCH_BYTES, each behind a
+ * struct emu_export_record saying whose it is, how long, the timestamp of
+ * its sample and how many of the sensor's samples were dropped since the
+ * one before. So every real sample makes one record, and one enqueue on
+ * the path of the hook.
+ *
+ * A batch is made once, however many subscribers there are, and copied
+ * into the queue of each, of EMU_EXPORT_QUEUE_BYTES, which is sent from
+ * as fast as the subscriber takes it, without ever blocking: the exporter
+ * poll()s its pipe, the listening socket and the subscribers together.
+ * What a subscriber that falls behind gets depends on its policy, which it
+ * may ask for by sending a struct emu_export_subscription:
+ * EMU_EXPORT_DROP, the default, meant for those that want the readings
+ * live, misses the batches that don't fit in its queue, and the next
+ * record of each sensor says how many of the sensor's it missed;
+ * EMU_EXPORT_LOSSLESS, meant for recorders, gets every record or, once
+ * its queue is full, is disconnected, so that it knows. Either way the
+ * others don't wait for it.
+ *
+ * A subscription may also have a period for any sensor, for a subscriber
+ * that wants its readings less often than the device reads them - over
+ * Wi-Fi, the difference between a saturated link and a stable one. Such a
+ * sensor's records aren't taken from the batches for that subscriber:
+ * its samples go through a window of the subscriber's, which makes one
+ * record per period, of the last of them (EMU_EXPORT_LATEST) or of their
+ * mean (EMU_EXPORT_AVERAGE), a box filter, so that what changes faster
+ * than the subscriber reads doesn't alias into what it gets. These
+ * records go to its queue alone, and are sent even if unchanged.
+ *
+ * A subscriber that just connected, or missed a batch, gets the next
+ * sample of each of its sensors even if unchanged: the batch has a record
+ * of it then, marked EMU_EXPORT_REPEAT, that only such subscribers take.
+ *
+ * Nothing is published while nobody's connected.
+ *
+ * The sensors HAL and the sensorservice are different libraries of the
+ * same process (system_server), and must share the exporter. Both are
+ * built with this header; the exporter is the one emu_export_shared()
+ * returns, a weak symbol that's merged within a library. The sensorservice
+ * side, built with EMU_EXPORT_VIA_HAL, takes the HAL's through
+ * hw_get_module() and dlsym() on the HAL's dso, and falls back to its own
+ * only if the HAL doesn't have one. Both have to be built with the same
+ * flags - TRACE_HOPS changes the layout.
+ *
+ * The frames, the records and the order of the sensors are those of the
+ * relay, which includes this header for them.
+ */
+
+#ifndef SENSOR_EMULATION_EXPORT_H
+#define SENSOR_EMULATION_EXPORT_H
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef EMU_EXPORT_VIA_HAL
+#include <dlfcn.h>
+#include <hardware/hardware.h>
+#include <hardware/sensors.h>
+#endif
+
+#include "SensorEmulationTrace.h"
+#include "SensorEmulationLog.h"
+#include "SensorEmulationRecord.h"
+
+#ifndef EMU_EXPORT_PORT
+#define EMU_EXPORT_PORT 5000
+#endif
+#define EMU_EXPORT_LOG "/data/export_log"
+#define EMU_EXPORT_READINGS "/data/device_readings"
+#define EMU_EXPORT_MAX_VALUES 4
+#define EMU_EXPORT_TEXT_SIZE 101 /* The most, with the '\0'. */
+#define EMU_EXPORT_RING_SAMPLES 64 /* Power of 2. */
+#define EMU_EXPORT_LINGER_US 1000
+#define EMU_EXPORT_ACCEPT_BACKOFF_MS 10 /* After running out of fds or memory. */
+#define EMU_EXPORT_BATCH_BYTES (16 * 1024)
+#define EMU_EXPORT_SUBSCRIBERS 8
+#define EMU_EXPORT_QUEUE_BYTES (256 * 1024) /* Per subscriber. */
+
+// In the order of the relay's ports, 5000 on.
+enum emu_export_sensor {
+	EMU_EXPORT_ACCEL = 0,
+	EMU_EXPORT_MAGNETIC = 1,
+	EMU_EXPORT_LIGHT = 2,
+	EMU_EXPORT_PROXIMITY = 3,
+	EMU_EXPORT_GYRO = 4,
+	EMU_EXPORT_ORIENTATION = 5,
+	EMU_EXPORT_CORRECTED_GYRO = 6,
+	EMU_EXPORT_GRAVITY = 7,
+	EMU_EXPORT_LINEAR_ACCELERATION = 8,
+	EMU_EXPORT_ROTATION_VECTOR = 9,
+	EMU_EXPORT_SENSORS = 10,
+};
+
+struct emu_export_format {
+	const char *name;
+	const char *format;
+	int values;
+	size_t text_size; /* With the '\0'. */
+};
+
+// The orientation's fourth value is its status, an int.
+static const struct emu_export_format emu_export_formats[EMU_EXPORT_SENSORS] = {
+	{ "Accelerometer", "%.9f|%.9f|%.9f", 3, 51 },
+	{ "Magnetic", "%f|%f|%f", 3, 101 },
+	{ "Light", "%f", 1, 101 },
+	{ "Proximity", "%f", 1, 101 },
+	{ "Gyroscope", "%.9f|%.9f|%.9f", 3, 51 },
+	{ "Orientation", "%f|%f|%f|%d", 4, 101 },
+	{ "CorrectedGyroscope", "%.9f|%.9f|%.9f", 3, 101 },
+	{ "Gravity", "%.9f|%.9f|%.9f", 3, 101 },
+	{ "LinearAcceleration", "%.9f|%.9f|%.9f", 3, 101 },
+	{ "RotationVector", "%.9f|%.9f|%.9f|%.9f", 4, 101 },
+};
+
+// Before every frame on the wire. The byte order is the device's - ARM
+// and x86 are both little endian.
+struct emu_export_record {
+	uint8_t sensor;
+	uint8_t reserved; /* 0 on the wire. EMU_EXPORT_REPEAT in a batch. */
+	uint16_t size; /* Of the frame that follows. */
+	uint32_t dropped; /* Samples of the sensor dropped since the last record. */
+	int64_t timestamp_ns; /* Of the sample, as the device's kernel had it. */
+};
+
+// A record of a batch whose text is unchanged, for the subscribers that
+// resend its sensor alone.
+#define EMU_EXPORT_REPEAT 1
+
+#define EMU_EXPORT_FRAME_MAX (EMU_EXPORT_TEXT_SIZE + EMU_TRACE_SIZE)
+#define EMU_EXPORT_RECORD_MAX (sizeof(struct emu_export_record) + EMU_EXPORT_FRAME_MAX)
+
+static inline size_t emu_export_frame_size(int sensor)
+{
+	return emu_export_formats[sensor].text_size + EMU_TRACE_SIZE;
+}
+
+#define EMU_EXPORT_SUBSCRIPTION_MAGIC "SEMU"
+
+enum emu_export_policy {
+	EMU_EXPORT_DROP = 0,
+	EMU_EXPORT_LOSSLESS = 1,
+};
+
+enum emu_export_filter {
+	EMU_EXPORT_LATEST = 0,
+	EMU_EXPORT_AVERAGE = 1,
+};
+
+// What a subscriber may send, any time after connecting, to change what
+// it gets. In the same byte order as the records.
+struct emu_export_subscription {
+	char magic[4]; /* EMU_EXPORT_SUBSCRIPTION_MAGIC, without the '\0'. */
+	uint16_t size; /* Of the subscription, so that it can grow. */
+	uint8_t policy; /* enum emu_export_policy */
+	uint8_t reserved;
+	uint32_t period_us[EMU_EXPORT_SENSORS]; /* 0 for every sample. */
+	uint8_t filter[EMU_EXPORT_SENSORS]; /* enum emu_export_filter, with a period. */
+	uint8_t reserved2[2];
+};
+
+#define EMU_EXPORT_SUBSCRIPTION_MIN 8 /* As first sent, with policy. */
+#define EMU_EXPORT_SUBSCRIPTION_MAX 128
+
+static inline void emu_export_subscription_init(struct emu_export_subscription *s, int policy)
+{
+	memset(s, 0, sizeof(*s));
+	memcpy(s->magic, EMU_EXPORT_SUBSCRIPTION_MAGIC, sizeof(s->magic));
+	s->size = sizeof(*s);
+	s->policy = (uint8_t)policy;
+}
+
+struct emu_export_sample {
+	float values[EMU_EXPORT_MAX_VALUES];
+	int64_t timestamp_ns;
+	int64_t captured_ns;
+};
+
+// head and dropped are the producer's, tail the consumer's - each on a
+// cache line of its own.
+struct emu_export_ring {
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t dropped;
+	uint32_t tail __attribute__((aligned(64)));
+	struct emu_export_sample samples[EMU_EXPORT_RING_SAMPLES] __attribute__((aligned(64)));
+};
+
+// The samples of a sensor, for a subscriber that wants them every period.
+struct emu_export_window {
+	int64_t due_ns; /* When its next record is due, as the samples' timestamps go. */
+	double sums[EMU_EXPORT_MAX_VALUES];
+	uint32_t samples;
+	uint32_t dropped; /* Of the ring, as of its last record. */
+};
+
+struct emu_export_subscriber {
+	int fd; /* -1 while the slot's free. */
+	int policy;
+	bool decimated; /* Any sensor with a period. */
+	int64_t period_ns[EMU_EXPORT_SENSORS];
+	int filter[EMU_EXPORT_SENSORS];
+	struct emu_export_window windows[EMU_EXPORT_SENSORS];
+	uint32_t seq[EMU_EXPORT_SENSORS]; /* Of its windows' records. */
+	char *queue; /* Of EMU_EXPORT_QUEUE_BYTES. */
+	size_t sent; /* Bytes of the queue sent... */
+	size_t queued; /* ... of those in it. */
+	uint32_t missed[EMU_EXPORT_SENSORS]; /* Records, for its next ones to say. */
+	uint32_t resend; /* Bits of the sensors whose next samples it gets even if unchanged. */
+	char in[EMU_EXPORT_SUBSCRIPTION_MAX]; /* A subscription being received. */
+	size_t in_size;
+};
+
+struct emu_export {
+	pthread_mutex_t lock; /* For starting. */
+	bool started;
+	bool waiting; /* The exporter, for a sample. */
+	bool connected; /* To anyone. */
+	int wake[2]; /* The pipe to wake the waiting exporter up with. */
+	struct emu_export_ring rings[EMU_EXPORT_SENSORS];
+
+	/* The exporter's. */
+	pthread_t thread;
+	FILE *fp;
+	struct emu_rec *rec;
+	FILE *text_fp;
+	char last[EMU_EXPORT_SENSORS][EMU_EXPORT_TEXT_SIZE];
+	uint32_t seq[EMU_EXPORT_SENSORS];
+	uint32_t dropped[EMU_EXPORT_SENSORS]; /* Of the rings, as last sent. */
+	char batch[EMU_EXPORT_BATCH_BYTES];
+	bool repeats; /* Any EMU_EXPORT_REPEAT record in batch. */
+	struct emu_export_subscriber subscribers[EMU_EXPORT_SUBSCRIBERS];
+	int num_subscribers;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The exporter of the library - merged across its files, and the same
+// for the whole process where the dynamic linker binds them all to one.
+__attribute__((weak, visibility("default"))) struct emu_export *emu_export_shared(void)
+{
+	static struct emu_export e = { PTHREAD_MUTEX_INITIALIZER };
+
+	return &e;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline struct emu_export *emu_export_instance(void)
+{
+#ifdef EMU_EXPORT_VIA_HAL
+	const struct hw_module_t *module = NULL;
+	if (!hw_get_module(SENSORS_HARDWARE_MODULE_ID, &module) && module && module->dso) {
+		struct emu_export *(*hal_shared)(void) = (struct emu_export *(*)(void))dlsym(module->dso, "emu_export_shared");
+		if (hal_shared) {
+			return hal_shared();
+		}
+	}
+#endif
+
+	return emu_export_shared();
+}
+
+// The frame of values into frame, text_size bytes and the trace trailer
+// after them.
+static inline void emu_export_format_frame(int sensor, const float *v, char *frame)
+{
+	const struct emu_export_format *f = &emu_export_formats[sensor];
+
+	memset(frame, 0, f->text_size + EMU_TRACE_SIZE);
+	if (sensor == EMU_EXPORT_ORIENTATION) {
+		snprintf(frame, f->text_size - 1, f->format, v[0], v[1], v[2], (int)v[3]);
+	} else {
+		snprintf(frame, f->text_size - 1, f->format, v[0], v[1], v[2], v[3]);
+	}
+}
+
+static inline void emu_export_log_reading(struct emu_export *e, int sensor, const struct emu_export_sample *s, const char *text)
+{
+#ifdef TEXT_READINGS
+	if (e->text_fp) {
+		EMU_LOG_READING(e->text_fp, "[%s] %lluns : %s\n", emu_export_formats[sensor].name,
+					(unsigned long long)s->timestamp_ns, text);
+	}
+#else
+	(void)text;
+	emu_rec_append(e->rec, sensor, s->timestamp_ns, s->values, emu_export_formats[sensor].values);
+#endif
+}
+
+// Whether any subscriber gets sensor n's next sample from the batches
+// even if unchanged.
+static inline bool emu_export_resending(struct emu_export *e, int n)
+{
+	int i = 0;
+	while (i < EMU_EXPORT_SUBSCRIBERS) {
+		struct emu_export_subscriber *sub = &e->subscribers[i];
+		if (sub->fd != -1 && !sub->period_ns[n] && (sub->resend & (1u << n))) {
+			return true;
+		}
+		i++;
+	}
+
+	return false;
+}
+
+// The record of sample s of sensor n into e->batch at size, if its text
+// changed or a subscriber resends n, and the new size.
+static inline size_t emu_export_add(struct emu_export *e, int n, const struct emu_export_sample *s, size_t size)
+{
+	char *frame = e->batch + size + sizeof(struct emu_export_record);
+
+	emu_export_format_frame(n, s->values, frame);
+	bool repeat = !strcmp(e->last[n], frame);
+	if (repeat && !emu_export_resending(e, n)) {
+		return size;
+	}
+
+	uint32_t dropped = __atomic_load_n(&e->rings[n].dropped, __ATOMIC_RELAXED);
+	struct emu_export_record r;
+	memset(&r, 0, sizeof(r));
+	r.sensor = (uint8_t)n;
+	r.reserved = repeat ? EMU_EXPORT_REPEAT : 0;
+	r.size = (uint16_t)emu_export_frame_size(n);
+	r.dropped = dropped - e->dropped[n];
+	r.timestamp_ns = s->timestamp_ns;
+	memcpy(e->batch + size, &r, sizeof(r));
+	e->repeats |= repeat;
+	if (r.dropped) {
+		EMU_LOG(e->fp, "%s : %u samples dropped, the ring was full\n", emu_export_formats[n].name, r.dropped);
+	}
+	e->dropped[n] = dropped;
+
+	EMU_TRACE_INIT(frame, emu_export_formats[n].text_size, e->seq[n]++, s->captured_ns);
+	EMU_TRACE_STAMP(frame, emu_export_formats[n].text_size, EMU_HOP_DEV_SEND);
+	emu_export_log_reading(e, n, s, frame);
+
+	strcpy(e->last[n], frame);
+
+	return size + sizeof(r) + r.size;
+}
+
+// Sequentially consistent, after waiting is set - see emu_export_serve().
+// An acquire load could be ordered before the store of waiting, and miss a
+// sample whose producer then misses waiting too.
+static inline bool emu_export_rings_empty(struct emu_export *e)
+{
+	int n = 0;
+	while (n < EMU_EXPORT_SENSORS) {
+		struct emu_export_ring *ring = &e->rings[n];
+		if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail) {
+			return false;
+		}
+		n++;
+	}
+
+	return true;
+}
+
+// As much of sub's queue as its socket takes now.
+static inline bool emu_export_flush(struct emu_export *e, struct emu_export_subscriber *sub)
+{
+	while (sub->sent < sub->queued) {
+		ssize_t bytes_wrote = send(sub->fd, sub->queue + sub->sent, sub->queued - sub->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (bytes_wrote == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			}
+			EMU_ERR(e->fp, "send - %s\n", strerror(errno));
+			return false;
+		}
+		sub->sent += bytes_wrote;
+	}
+	sub->sent = 0;
+	sub->queued = 0;
+
+	return true;
+}
+
+// Whether sub takes record r of a batch.
+static inline bool emu_export_wants(struct emu_export_subscriber *sub, const struct emu_export_record *r)
+{
+	if (sub->period_ns[r->sensor]) {
+		return false;
+	}
+
+	return r->reserved != EMU_EXPORT_REPEAT || (sub->resend & (1u << r->sensor));
+}
+
+// The records of the size bytes of e->batch that sub missed, counted per
+// sensor. Their sensors' next samples are sent to sub even if unchanged,
+// for it not to be left with an old reading.
+static inline void emu_export_miss(struct emu_export *e, struct emu_export_subscriber *sub, size_t size)
+{
+	size_t at = 0;
+	while (at < size) {
+		struct emu_export_record r;
+		memcpy(&r, e->batch + at, sizeof(r));
+		if (emu_export_wants(sub, &r)) {
+			sub->missed[r.sensor] += 1 + r.dropped;
+			sub->resend |= 1u << r.sensor;
+		} else if (!sub->period_ns[r.sensor]) {
+			sub->missed[r.sensor] += r.dropped;
+		}
+		at += sizeof(r) + r.size;
+	}
+}
+
+// The records sub missed, added to the first of each sensor's of the size
+// bytes at queued.
+static inline void emu_export_tell_missed(struct emu_export_subscriber *sub, char *queued, size_t size)
+{
+	size_t at = 0;
+	while (at < size) {
+		struct emu_export_record r;
+		memcpy(&r, queued + at, sizeof(r));
+		if (sub->missed[r.sensor]) {
+			r.dropped += sub->missed[r.sensor];
+			sub->missed[r.sensor] = 0;
+			memcpy(queued + at, &r, sizeof(r));
+		}
+		at += sizeof(r) + r.size;
+	}
+}
+
+// Whether sub's queue has room for size bytes more after those queued.
+static inline bool emu_export_room(struct emu_export_subscriber *sub, size_t size)
+{
+	if (sub->queued - sub->sent + size > EMU_EXPORT_QUEUE_BYTES) {
+		return false;
+	}
+
+	if (sub->queued + size > EMU_EXPORT_QUEUE_BYTES) {
+		memmove(sub->queue, sub->queue + sub->sent, sub->queued - sub->sent);
+		sub->queued -= sub->sent;
+		sub->sent = 0;
+	}
+
+	return true;
+}
+
+static inline bool emu_export_behind(struct emu_export *e, struct emu_export_subscriber *sub)
+{
+	EMU_ERR(e->fp, "Subscriber %d fell %zu bytes behind. Disconnecting it, it wants all or nothing.\n",
+		sub->fd, sub->queued - sub->sent);
+
+	return false;
+}
+
+// The records of the size bytes of e->batch that sub takes into its queue,
+// as its policy has it, and whether it's still to be served.
+static inline bool emu_export_queue(struct emu_export *e, struct emu_export_subscriber *sub, size_t size)
+{
+	if (!emu_export_room(sub, size)) {
+		if (sub->policy == EMU_EXPORT_LOSSLESS) {
+			return emu_export_behind(e, sub);
+		}
+		emu_export_miss(e, sub, size);
+		return true;
+	}
+
+	char *queued = sub->queue + sub->queued;
+	size_t queued_size = size;
+	if (sub->decimated || sub->resend || e->repeats) {
+		queued_size = 0;
+		size_t at = 0;
+		while (at < size) {
+			struct emu_export_record r;
+			memcpy(&r, e->batch + at, sizeof(r));
+			if (emu_export_wants(sub, &r)) {
+				r.reserved = 0;
+				r.dropped += sub->missed[r.sensor];
+				sub->missed[r.sensor] = 0;
+				sub->resend &= ~(1u << r.sensor);
+				memcpy(queued + queued_size, &r, sizeof(r));
+				memcpy(queued + queued_size + sizeof(r), e->batch + at + sizeof(r), r.size);
+				queued_size += sizeof(r) + r.size;
+			} else if (!sub->period_ns[r.sensor]) {
+				sub->missed[r.sensor] += r.dropped; // For its next record of the sensor to say.
+			}
+			at += sizeof(r) + r.size;
+		}
+	} else {
+		memcpy(queued, e->batch, size);
+		emu_export_tell_missed(sub, queued, queued_size);
+	}
+	sub->queued += queued_size;
+
+	return emu_export_flush(e, sub);
+}
+
+// Sample s of sensor n into sub's window of it, and the record of the
+// window, once due, into sub's queue. Whether sub's still to be served.
+// The queue is sent from by the next poll().
+static inline bool emu_export_decimate(struct emu_export *e, struct emu_export_subscriber *sub, int n,
+					const struct emu_export_sample *s)
+{
+	const struct emu_export_format *f = &emu_export_formats[n];
+	struct emu_export_window *w = &sub->windows[n];
+
+	int i = 0;
+	while (i < f->values) {
+		w->sums[i] += s->values[i];
+		i++;
+	}
+	w->samples++;
+	if (s->timestamp_ns < w->due_ns) {
+		return true;
+	}
+
+	float values[EMU_EXPORT_MAX_VALUES] = { 0, };
+	if (sub->filter[n] == EMU_EXPORT_AVERAGE) {
+		i = 0;
+		while (i < f->values) {
+			values[i] = (float)(w->sums[i] / w->samples);
+			i++;
+		}
+	} else {
+		memcpy(values, s->values, f->values * sizeof(float));
+	}
+
+	uint32_t dropped = __atomic_load_n(&e->rings[n].dropped, __ATOMIC_RELAXED);
+	struct emu_export_record r;
+	memset(&r, 0, sizeof(r));
+	r.sensor = (uint8_t)n;
+	r.size = (uint16_t)emu_export_frame_size(n);
+	r.dropped = dropped - w->dropped + sub->missed[n];
+	r.timestamp_ns = s->timestamp_ns;
+
+	w->due_ns += sub->period_ns[n];
+	if (w->due_ns <= s->timestamp_ns) { // The first, or after a gap.
+		w->due_ns = s->timestamp_ns + sub->period_ns[n];
+	}
+	memset(w->sums, 0, sizeof(w->sums));
+	w->samples = 0;
+	w->dropped = dropped;
+
+	if (!emu_export_room(sub, sizeof(r) + r.size)) {
+		if (sub->policy == EMU_EXPORT_LOSSLESS) {
+			return emu_export_behind(e, sub);
+		}
+		sub->missed[n] = r.dropped + 1;
+		return true;
+	}
+	sub->missed[n] = 0;
+
+	char *queued = sub->queue + sub->queued;
+	char *frame = queued + sizeof(r);
+	memcpy(queued, &r, sizeof(r));
+	emu_export_format_frame(n, values, frame);
+	EMU_TRACE_INIT(frame, f->text_size, sub->seq[n]++, s->captured_ns);
+	EMU_TRACE_STAMP(frame, f->text_size, EMU_HOP_DEV_SEND);
+	sub->queued += sizeof(r) + r.size;
+
+	return true;
+}
+
+static inline void emu_export_unsubscribe(struct emu_export *e, struct emu_export_subscriber *sub)
+{
+	close(sub->fd);
+	EMU_LOG(e->fp, "Subscriber %d gone!\n", sub->fd);
+	sub->fd = -1;
+	free(sub->queue);
+	sub->queue = NULL;
+
+	e->num_subscribers--;
+	if (!e->num_subscribers) {
+		__atomic_store_n(&e->connected, false, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void emu_export_subscribe(struct emu_export *e, int connfd)
+{
+	struct emu_export_subscriber *sub = NULL;
+	int i = 0;
+	while (i < EMU_EXPORT_SUBSCRIBERS) {
+		if (e->subscribers[i].fd == -1) {
+			sub = &e->subscribers[i];
+			break;
+		}
+		i++;
+	}
+	if (!sub) {
+		EMU_ERR(e->fp, "%d subscribers already. Turning another away.\n", EMU_EXPORT_SUBSCRIBERS);
+		close(connfd);
+		return;
+	}
+
+	memset(sub, 0, sizeof(*sub));
+	sub->queue = (char *)malloc(EMU_EXPORT_QUEUE_BYTES);
+	if (!sub->queue) {
+		EMU_ERR(e->fp, "No memory for the queue of a subscriber.\n");
+		close(connfd);
+		sub->fd = -1;
+		return;
+	}
+	sub->fd = connfd;
+	sub->policy = EMU_EXPORT_DROP;
+	// For it to get every sensor's next sample, even if the others got
+	// its text already.
+	sub->resend = (1u << EMU_EXPORT_SENSORS) - 1;
+
+	// What was published while nobody was connected is left behind.
+	if (!e->num_subscribers) {
+		int n = 0;
+		while (n < EMU_EXPORT_SENSORS) {
+			struct emu_export_ring *ring = &e->rings[n];
+			__atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+			e->dropped[n] = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+			n++;
+		}
+		__atomic_store_n(&e->connected, true, __ATOMIC_RELAXED);
+	}
+	e->num_subscribers++;
+
+	EMU_LOG(e->fp, "Subscriber %d accepted, %d of them now!\n", connfd, e->num_subscribers);
+}
+
+// What sub sent - subscriptions, or its end - and whether it's still to be
+// served.
+static inline bool emu_export_receive(struct emu_export *e, struct emu_export_subscriber *sub)
+{
+	ssize_t bytes_read = recv(sub->fd, sub->in + sub->in_size, sizeof(sub->in) - sub->in_size, MSG_DONTWAIT);
+	if (bytes_read == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return true;
+		}
+		EMU_ERR(e->fp, "recv - %s\n", strerror(errno));
+		return false;
+	}
+	if (!bytes_read) {
+		return false;
+	}
+	sub->in_size += bytes_read;
+
+	while (sub->in_size >= offsetof(struct emu_export_subscription, policy)) {
+		struct emu_export_subscription s;
+		memset(&s, 0, sizeof(s));
+		memcpy(&s, sub->in, offsetof(struct emu_export_subscription, policy));
+		bool fine = !memcmp(s.magic, EMU_EXPORT_SUBSCRIPTION_MAGIC, sizeof(s.magic)) &&
+				s.size >= EMU_EXPORT_SUBSCRIPTION_MIN && s.size <= sizeof(sub->in);
+		if (!fine) {
+			EMU_ERR(e->fp, "Unexpected subscription from %d. Disconnecting it.\n", sub->fd);
+			return false;
+		}
+		if (sub->in_size < s.size) {
+			break;
+		}
+
+		memcpy(&s, sub->in, s.size < sizeof(s) ? s.size : sizeof(s));
+		sub->policy = s.policy == EMU_EXPORT_LOSSLESS ? EMU_EXPORT_LOSSLESS : EMU_EXPORT_DROP;
+		EMU_LOG(e->fp, "Subscriber %d wants %s!\n", sub->fd, sub->policy == EMU_EXPORT_LOSSLESS ? "all or nothing" : "it live");
+
+		sub->decimated = false;
+		memset(sub->windows, 0, sizeof(sub->windows));
+		int n = 0;
+		while (n < EMU_EXPORT_SENSORS) {
+			sub->period_ns[n] = s.period_us[n] * 1000LL;
+			sub->filter[n] = s.filter[n] == EMU_EXPORT_AVERAGE ? EMU_EXPORT_AVERAGE : EMU_EXPORT_LATEST;
+			sub->windows[n].dropped = __atomic_load_n(&e->rings[n].dropped, __ATOMIC_RELAXED);
+			if (sub->period_ns[n]) {
+				sub->decimated = true;
+				EMU_LOG(e->fp, "Subscriber %d wants %s every %uus, %s!\n", sub->fd, emu_export_formats[n].name,
+					s.period_us[n], sub->filter[n] == EMU_EXPORT_AVERAGE ? "averaged" : "the latest");
+			}
+			n++;
+		}
+
+		memmove(sub->in, sub->in + s.size, sub->in_size - s.size);
+		sub->in_size -= s.size;
+	}
+
+	return true;
+}
+
+// The size bytes of e->batch to every subscriber.
+static inline void emu_export_deliver(struct emu_export *e, size_t size)
+{
+	int i = 0;
+	while (i < EMU_EXPORT_SUBSCRIBERS) {
+		struct emu_export_subscriber *sub = &e->subscribers[i];
+		if (sub->fd != -1 && !emu_export_queue(e, sub, size)) {
+			emu_export_unsubscribe(e, sub);
+		}
+		i++;
+	}
+	e->repeats = false;
+}
+
+// The samples in the rings, in batches, to every subscriber.
+static inline void emu_export_drain(struct emu_export *e)
+{
+	size_t size = 0;
+	int n = 0;
+	while (n < EMU_EXPORT_SENSORS) {
+		struct emu_export_ring *ring = &e->rings[n];
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (ring->tail != head) {
+			if (size + EMU_EXPORT_RECORD_MAX > sizeof(e->batch)) {
+				emu_export_deliver(e, size);
+				size = 0;
+			}
+			const struct emu_export_sample *s = &ring->samples[ring->tail & (EMU_EXPORT_RING_SAMPLES - 1)];
+			size = emu_export_add(e, n, s, size);
+			int i = 0;
+			while (i < EMU_EXPORT_SUBSCRIBERS) {
+				struct emu_export_subscriber *sub = &e->subscribers[i];
+				if (sub->fd != -1 && sub->period_ns[n] && !emu_export_decimate(e, sub, n, s)) {
+					emu_export_unsubscribe(e, sub);
+				}
+				i++;
+			}
+			__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+		}
+		n++;
+	}
+	if (size) {
+		emu_export_deliver(e, size);
+	}
+}
+
+// Whether the exporter still serves after accept() failed with err. Those
+// of a connection gone before it was taken, or of fds or memory running out
+// for now, leave the listening socket as good as it was.
+static inline bool emu_export_accept_failed(struct emu_export *e, int err)
+{
+	EMU_ERR(e->fp, "accept - %s\n", strerror(err));
+
+	switch (err) {
+	case EINTR:
+	case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+	case EWOULDBLOCK:
+#endif
+	case ECONNABORTED:
+	case EPROTO:
+	case EPERM:
+		return true;
+	case EMFILE:
+	case ENFILE:
+	case ENOBUFS:
+	case ENOMEM: {
+		// The connection stays in the backlog, and the listening socket
+		// readable - a breath, rather than poll()ing it round and round.
+		struct timespec t = { 0, EMU_EXPORT_ACCEPT_BACKOFF_MS * 1000000L };
+		nanosleep(&t, NULL);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+// Waits for samples, subscribers and subscribers ready to take more, and
+// serves them, till the listening socket fails. The producers wake the
+// exporter up only if they see waiting set, and it sees their samples
+// unless they're after it's set - in which case they see it - hence both
+// sides' sequentially consistent accesses.
+static inline void emu_export_serve(struct emu_export *e, int listenfd)
+{
+	struct pollfd fds[2 + EMU_EXPORT_SUBSCRIBERS];
+	struct emu_export_subscriber *polled[EMU_EXPORT_SUBSCRIBERS];
+
+	while (1) {
+		__atomic_store_n(&e->waiting, true, __ATOMIC_SEQ_CST);
+		bool idle = emu_export_rings_empty(e);
+		if (!idle) {
+			__atomic_store_n(&e->waiting, false, __ATOMIC_RELAXED);
+		}
+
+		fds[0].fd = e->wake[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = listenfd;
+		fds[1].events = POLLIN;
+		int nfds = 2;
+		int i = 0;
+		while (i < EMU_EXPORT_SUBSCRIBERS) {
+			struct emu_export_subscriber *sub = &e->subscribers[i];
+			if (sub->fd != -1) {
+				fds[nfds].fd = sub->fd;
+				fds[nfds].events = POLLIN | (sub->sent < sub->queued ? POLLOUT : 0);
+				polled[nfds - 2] = sub;
+				nfds++;
+			}
+			i++;
+		}
+
+		int ready = poll(fds, nfds, idle ? -1 : 0);
+		__atomic_store_n(&e->waiting, false, __ATOMIC_RELAXED);
+		if (ready == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			EMU_ERR(e->fp, "poll - %s\n", strerror(errno));
+			return;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			char woken[64];
+			while (read(e->wake[0], woken, sizeof(woken)) > 0);
+		}
+
+		i = 2;
+		while (i < nfds) {
+			struct emu_export_subscriber *sub = polled[i - 2];
+			bool served = true;
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				served = emu_export_receive(e, sub);
+			}
+			if (served && (fds[i].revents & POLLOUT)) {
+				served = emu_export_flush(e, sub);
+			}
+			if (!served) {
+				emu_export_unsubscribe(e, sub);
+			}
+			i++;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			int connfd = accept(listenfd, (struct sockaddr *)NULL, NULL);
+			if (connfd != -1) {
+				emu_export_subscribe(e, connfd);
+			} else if (!emu_export_accept_failed(e, errno)) {
+				return;
+			}
+		}
+
+		if (idle && !emu_export_rings_empty(e)) {
+			struct timespec t = { 0, EMU_EXPORT_LINGER_US * 1000L };
+			nanosleep(&t, NULL);
+		}
+		emu_export_drain(e);
+	}
+}
+
+static inline void *emu_export_server(void *arg)
+{
+	struct emu_export *e = (struct emu_export *)arg;
+	int listenfd = -1;
+
+	int i = 0;
+	while (i < EMU_EXPORT_SUBSCRIBERS) {
+		e->subscribers[i].fd = -1;
+		i++;
+	}
+
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd == -1) {
+		EMU_ERR(e->fp, "socket - %s\n", strerror(errno));
+		goto done;
+	}
+
+	{
+		int yes = 1;
+		bool socket_opt_set = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != -1;
+		if (!socket_opt_set) {
+			EMU_ERR(e->fp, "setsockopt - %s\n", strerror(errno));
+			goto done;
+		}
+
+		struct sockaddr_in serv_addr;
+		memset(&serv_addr, 0, sizeof(serv_addr));
+		serv_addr.sin_family = AF_INET;
+		serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		serv_addr.sin_port = htons(EMU_EXPORT_PORT);
+
+		bool bound = bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != -1;
+		if (!bound) {
+			EMU_ERR(e->fp, "bind - %s\n", strerror(errno));
+			goto done;
+		}
+
+		bool listening = listen(listenfd, 10) != -1;
+		if (!listening) {
+			EMU_ERR(e->fp, "listen - %s\n", strerror(errno));
+			goto done;
+		}
+		EMU_LOG(e->fp, "Exporting at port : %d!\n", EMU_EXPORT_PORT);
+	}
+
+	emu_export_serve(e, listenfd);
+
+done:
+	i = 0;
+	while (i < EMU_EXPORT_SUBSCRIBERS) {
+		if (e->subscribers[i].fd != -1) {
+			emu_export_unsubscribe(e, &e->subscribers[i]);
+		}
+		i++;
+	}
+	if (listenfd != -1) {
+		close(listenfd);
+	}
+
+	return NULL;
+}
+
+// The exporter of the process, started the first time it's called.
+static inline struct emu_export *emu_export_start(void)
+{
+	struct emu_export *e = emu_export_instance();
+
+	pthread_mutex_lock(&e->lock);
+	if (!e->started) {
+		e->fp = fopen(EMU_EXPORT_LOG, "w");
+#ifdef TEXT_READINGS
+		e->text_fp = fopen(EMU_EXPORT_READINGS, "w");
+#else
+		const char *names[EMU_EXPORT_SENSORS];
+		int i = 0;
+		while (i < EMU_EXPORT_SENSORS) {
+			names[i] = emu_export_formats[i].name;
+			i++;
+		}
+		e->rec = emu_rec_open(EMU_EXPORT_READINGS ".rec", names, EMU_EXPORT_SENSORS);
+#endif
+
+		bool piped = pipe(e->wake) != -1; // No pipe2() in Android. So, pipe() and unblock by self!
+		if (piped) {
+			(void)fcntl(e->wake[0], F_SETFL, fcntl(e->wake[0], F_GETFL) | O_NONBLOCK);
+			(void)fcntl(e->wake[1], F_SETFL, fcntl(e->wake[1], F_GETFL) | O_NONBLOCK);
+
+			e->started = !(errno = pthread_create(&e->thread, NULL, emu_export_server, e));
+			if (!e->started) {
+				EMU_ERR(e->fp, "Exporter thread *failed* to create - %s\n", strerror(errno));
+			}
+		} else {
+			EMU_ERR(e->fp, "pipe - %s\n", strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return e;
+}
+
+// From the hook of a sensor, on the one thread it's called on: a whole
+// sample, its EMU_EXPORT_MAX_VALUES values at most - as many as its format
+// has - and the timestamp of the event that ended it.
+static inline void emu_export_publish(struct emu_export *e, int sensor, const float *values, int64_t timestamp_ns)
+{
+	if (!e || !__atomic_load_n(&e->connected, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	struct emu_export_ring *ring = &e->rings[sensor];
+	uint32_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == EMU_EXPORT_RING_SAMPLES) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct emu_export_sample *s = &ring->samples[head & (EMU_EXPORT_RING_SAMPLES - 1)];
+	memcpy(s->values, values, emu_export_formats[sensor].values * sizeof(float));
+	s->timestamp_ns = timestamp_ns;
+#ifdef TRACE_HOPS
+	s->captured_ns = emu_trace_now();
+#endif
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&e->waiting, __ATOMIC_SEQ_CST)) {
+		char wake = 0;
+		ssize_t woke = write(e->wake[1], &wake, 1); // Full is as good.
+		(void)woke;
+	}
+}
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationExtract.c is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationExtract.c is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationExtract.c
+ *
+ * Working:
+ *
+ * Prints the readings of some sensors (-s, all of them by default) in a
+ * time range of a capture, -f to -t seconds from its first reading, using
+ * SensorEmulationIndex.h so only that part of it is read. The readings are
+ * printed as CSV -
+ *
+ *	<sensor>,<ns>,<value>,<value>,...
+ *
+ * or, with -o, written as a recording of SensorEmulationRecord.h, to a
+ * file or to stdout with "-o -", for SensorEmulationRecordDump,
+ * SensorEmulationAnalyze or a replay. The recording is written as it
+ * goes, its index and footer at the end, so it can be piped.
+ *
+ * E.g. the gyroscope between minutes 12 and 13 -
+ *
+ *	SensorEmulationExtract -s gyro -f 720 -t 780 readings.rec
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "SensorEmulationIndex.h"
+
+#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+
+// The recording being written.
+struct output {
+	FILE *fp;
+	const struct emu_index *x;
+	int sensor_of[EMU_REC_MAX_SENSORS]; /* In the recording, of the capture's. */
+	struct emu_rec_samples *open[EMU_REC_MAX_SENSORS];
+	unsigned char *encoded;
+	struct emu_rec_index *index;
+	uint32_t entries;
+	uint32_t index_size;
+	uint64_t offset;
+	unsigned long long samples;
+	bool failed;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s sensor]... [-f from seconds] [-t to seconds] [-o recording] capture\n", prog);
+}
+
+static bool print_csv(void *arg, int sensor, int64_t ns, const float *v, int columns)
+{
+	struct output *o = (struct output *)arg;
+
+	printf("%s,%lld", o->x->header.names[sensor], (long long)ns);
+	int c = 0;
+	while (c < columns) {
+		printf(",%.9g", v[c]);
+		c++;
+	}
+	o->samples++;
+
+	return printf("\n") > 0;
+}
+
+static bool write_block(struct output *o, int sensor)
+{
+	struct emu_rec_samples *s = o->open[sensor];
+	if (!s || !s->num) {
+		return true;
+	}
+
+	if (o->entries == o->index_size) {
+		uint32_t new_size = o->index_size ? o->index_size * 2 : 256;
+		struct emu_rec_index *index = (struct emu_rec_index *)realloc(o->index, new_size * sizeof(*index));
+		if (!index) {
+			ERR("realloc - %s\n", strerror(errno));
+			return false;
+		}
+		o->index = index;
+		o->index_size = new_size;
+	}
+
+	struct emu_rec_index *e = &o->index[o->entries];
+	size_t size = emu_rec_build_block(s, o->encoded, e);
+	if (fwrite(o->encoded, size, 1, o->fp) != 1) {
+		ERR("write - %s\n", strerror(errno));
+		return false;
+	}
+	e->offset = o->offset;
+	o->offset += size;
+	o->entries++;
+	s->num = 0;
+
+	return true;
+}
+
+static bool write_recording(void *arg, int sensor, int64_t ns, const float *v, int columns)
+{
+	struct output *o = (struct output *)arg;
+	int n = o->sensor_of[sensor];
+
+	struct emu_rec_samples *s = o->open[n];
+	if (!s) {
+		s = (struct emu_rec_samples *)malloc(sizeof(*s));
+		if (!s) {
+			ERR("malloc - %s\n", strerror(errno));
+			o->failed = true;
+			return false;
+		}
+		s->sensor = n;
+		s->num = 0;
+		o->open[n] = s;
+	}
+	if (s->num && (s->columns != columns || s->num == EMU_REC_BLOCK_SAMPLES) && !write_block(o, n)) {
+		o->failed = true;
+		return false;
+	}
+
+	s->columns = columns;
+	s->ns[s->num] = ns;
+	int c = 0;
+	while (c < columns) {
+		s->v[c][s->num] = v[c];
+		c++;
+	}
+	s->num++;
+	o->samples++;
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t sensors = 0;
+	double from_s = 0;
+	double to_s = -1;
+	const char *out_path = NULL;
+	const char *wanted[EMU_REC_MAX_SENSORS];
+	int num_wanted = 0;
+	struct emu_index x;
+	struct output o;
+	struct emu_rec_header h;
+	const char *names[EMU_REC_MAX_SENSORS];
+	int64_t from_ns = 0;
+	int64_t to_ns = 0;
+	bool success = false;
+	int i = 0;
+
+	memset(&o, 0, sizeof(o));
+
+	int opt = -1;
+	while ((opt = getopt(argc, argv, "s:f:t:o:h")) != -1) {
+		switch (opt) {
+			case 's':
+				if (num_wanted < EMU_REC_MAX_SENSORS) {
+					wanted[num_wanted++] = optarg;
+				}
+				break;
+			case 'f':
+				from_s = atof(optarg);
+				break;
+			case 't':
+				to_s = atof(optarg);
+				break;
+			case 'o':
+				out_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!emu_index_open(&x, argv[optind])) {
+		ERR("%s - %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	o.x = &x;
+
+	i = 0;
+	while (i < num_wanted) {
+		uint32_t matched = emu_index_sensors(&x, wanted[i]);
+		if (!matched) {
+			ERR("No %s in %s\n", wanted[i], argv[optind]);
+			goto done;
+		}
+		sensors |= matched;
+		i++;
+	}
+	if (!num_wanted) {
+		sensors = ~0U;
+	}
+
+	from_ns = x.header.first_ns + (int64_t)(from_s * 1E9);
+	to_ns = to_s < 0 ? INT64_MAX : x.header.first_ns + (int64_t)(to_s * 1E9);
+
+	if (!out_path) {
+		success = emu_index_extract(&x, sensors, from_ns, to_ns, print_csv, &o);
+		goto done;
+	}
+
+	o.fp = strcmp(out_path, "-") ? fopen(out_path, "w") : stdout;
+	if (!o.fp) {
+		ERR("%s - %s\n", out_path, strerror(errno));
+		goto done;
+	}
+	setvbuf(o.fp, NULL, _IOFBF, EMU_REC_WRITE_BUFFER);
+	o.encoded = (unsigned char *)malloc(sizeof(struct emu_rec_block_header) + EMU_REC_MAX_BLOCK_BYTES);
+	if (!o.encoded) {
+		ERR("malloc - %s\n", strerror(errno));
+		goto done;
+	}
+
+	// Only the sensors extracted are in the recording.
+	int num = 0;
+	i = 0;
+	while (i < (int)x.header.num_sensors) {
+		if (sensors & (1U << i)) {
+			o.sensor_of[i] = num;
+			names[num++] = x.header.names[i];
+		}
+		i++;
+	}
+	emu_rec_init_header(&h, names, num);
+	if (fwrite(&h, sizeof(h), 1, o.fp) != 1) {
+		ERR("%s - %s\n", out_path, strerror(errno));
+		goto done;
+	}
+	o.offset = sizeof(h);
+
+	if (!emu_index_extract(&x, sensors, from_ns, to_ns, write_recording, &o) || o.failed) {
+		goto done;
+	}
+	i = 0;
+	while (i < num) {
+		if (!write_block(&o, i)) {
+			goto done;
+		}
+		i++;
+	}
+	if (!emu_rec_write_index(o.fp, o.index, o.entries, o.offset) || fflush(o.fp)) {
+		ERR("%s - %s\n", out_path, strerror(errno));
+		goto done;
+	}
+
+	success = true;
+
+done:
+	if (o.fp && o.fp != stdout) {
+		fclose(o.fp);
+	}
+	i = 0;
+	while (i < EMU_REC_MAX_SENSORS) {
+		free(o.open[i]);
+		i++;
+	}
+	free(o.encoded);
+	free(o.index);
+	emu_index_close(&x);
+
+	if (success && out_path) {
+		fprintf(stderr, "%llu readings\n", o.samples);
+	}
+
+	return success ? 0 : 1;
+}
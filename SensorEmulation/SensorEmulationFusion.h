@@ -0,0 +1,351 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationFusion.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationFusion.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationFusion.h
+ *
+ * Working:
+ *
+ * Madgwick's orientation filter, for the gravity, linear acceleration,
+ * rotation vector, orientation and corrected gyroscope sensors to be
+ * worked out in the guest from the accelerometer, gyroscope and magnetic
+ * field readings rather than relayed as five more streams.
+ *
+ * emu_fusion_accel() and emu_fusion_magnetic() keep the latest of those;
+ * emu_fusion_gyro() steps the filter by the time since the last step: the
+ * gyroscope's rate, less its estimated bias, is integrated and corrected
+ * by a gradient descent step of size beta towards the attitude that the
+ * accelerometer (and, once there's been one, the magnetic field) says -
+ * the MARG filter of Madgwick's report, with its gyroscope bias drift
+ * compensation of gain zeta. A larger beta trusts the accelerometer and
+ * the compass more, a smaller one the gyroscope.
+ *
+ * The quaternion is of the sensor in the filter's frame (x north, y west,
+ * z up); the outputs are in Android's (x east, y north, z up), in its
+ * units: m/s^2, rad/s and degrees for the orientation. A struct
+ * emu_fusion belongs to one thread at a time.
+ */
+
+#ifndef SENSOR_EMULATION_FUSION_H
+#define SENSOR_EMULATION_FUSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#define EMU_FUSION_BETA 0.1f
+#define EMU_FUSION_ZETA 0.015f
+#define EMU_FUSION_GRAVITY 9.80665f
+
+// Steps further apart than this (a pause, a reconnection) integrate
+// EMU_FUSION_DEFAULT_DT instead.
+#define EMU_FUSION_MAX_DT 0.5f
+#define EMU_FUSION_DEFAULT_DT 0.02f
+
+struct emu_fusion {
+	float beta;
+	float zeta;
+
+	float q[4]; /* w, x, y, z. */
+	float bias[3]; /* Of the gyroscope, rad/s. */
+
+	float accel[3];
+	float magnetic[3];
+	float gyro[3]; /* The last, less the bias. */
+	bool have_accel;
+	bool have_magnetic;
+	bool aligned; /* To the first accelerometer and magnetic readings. */
+
+	uint64_t last_ns; /* Of the last step, 0 before the first. */
+};
+
+static inline void emu_fusion_init(struct emu_fusion *f, float beta, float zeta)
+{
+	memset(f, 0, sizeof(*f));
+	f->beta = beta;
+	f->zeta = zeta;
+	f->q[0] = 1;
+}
+
+static inline void emu_fusion_accel(struct emu_fusion *f, float x, float y, float z)
+{
+	f->accel[0] = x;
+	f->accel[1] = y;
+	f->accel[2] = z;
+	f->have_accel = true;
+}
+
+static inline void emu_fusion_magnetic(struct emu_fusion *f, float x, float y, float z)
+{
+	f->magnetic[0] = x;
+	f->magnetic[1] = y;
+	f->magnetic[2] = z;
+	f->have_magnetic = true;
+}
+
+static inline float emu_fusion_inv_norm(float a, float b, float c, float d)
+{
+	float n = sqrtf(a * a + b * b + c * c + d * d);
+
+	return n > 0 ? 1.0f / n : 0;
+}
+
+// The gradient of the error between the measured and the expected
+// directions of gravity (and of the magnetic field) into s, normalised.
+static inline void emu_fusion_gradient(const struct emu_fusion *f, float s[4])
+{
+	float q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+
+	float r = emu_fusion_inv_norm(f->accel[0], f->accel[1], f->accel[2], 0);
+	float ax = f->accel[0] * r, ay = f->accel[1] * r, az = f->accel[2] * r;
+
+	// Gravity only.
+	float fa0 = 2 * (q1 * q3 - q0 * q2) - ax;
+	float fa1 = 2 * (q0 * q1 + q2 * q3) - ay;
+	float fa2 = 2 * (0.5f - q1 * q1 - q2 * q2) - az;
+	s[0] = -2 * q2 * fa0 + 2 * q1 * fa1;
+	s[1] = 2 * q3 * fa0 + 2 * q0 * fa1 - 4 * q1 * fa2;
+	s[2] = -2 * q0 * fa0 + 2 * q3 * fa1 - 4 * q2 * fa2;
+	s[3] = 2 * q1 * fa0 + 2 * q2 * fa1;
+
+	if (f->have_magnetic) {
+		r = emu_fusion_inv_norm(f->magnetic[0], f->magnetic[1], f->magnetic[2], 0);
+		float mx = f->magnetic[0] * r, my = f->magnetic[1] * r, mz = f->magnetic[2] * r;
+
+		// The field in the earth frame, turned into the x-z plane.
+		float hx = mx * (0.5f - q2 * q2 - q3 * q3) + my * (q1 * q2 - q0 * q3) + mz * (q1 * q3 + q0 * q2);
+		float hy = mx * (q1 * q2 + q0 * q3) + my * (0.5f - q1 * q1 - q3 * q3) + mz * (q2 * q3 - q0 * q1);
+		float bx = 2 * sqrtf(hx * hx + hy * hy);
+		float bz = 2 * (mx * (q1 * q3 - q0 * q2) + my * (q2 * q3 + q0 * q1) + mz * (0.5f - q1 * q1 - q2 * q2));
+
+		float fm0 = bx * (0.5f - q2 * q2 - q3 * q3) + bz * (q1 * q3 - q0 * q2) - mx;
+		float fm1 = bx * (q1 * q2 - q0 * q3) + bz * (q0 * q1 + q2 * q3) - my;
+		float fm2 = bx * (q0 * q2 + q1 * q3) + bz * (0.5f - q1 * q1 - q2 * q2) - mz;
+
+		s[0] += -bz * q2 * fm0 + (-bx * q3 + bz * q1) * fm1 + bx * q2 * fm2;
+		s[1] += bz * q3 * fm0 + (bx * q2 + bz * q0) * fm1 + (bx * q3 - 2 * bz * q1) * fm2;
+		s[2] += (-2 * bx * q2 - bz * q0) * fm0 + (bx * q1 + bz * q3) * fm1 + (bx * q0 - 2 * bz * q2) * fm2;
+		s[3] += (-2 * bx * q3 + bz * q1) * fm0 + (-bx * q0 + bz * q2) * fm1 + bx * q1 * fm2;
+	}
+
+	r = emu_fusion_inv_norm(s[0], s[1], s[2], s[3]);
+	s[0] *= r;
+	s[1] *= r;
+	s[2] *= r;
+	s[3] *= r;
+}
+
+// Starts the quaternion off where the accelerometer and the magnetic
+// field say, as SensorManager.getRotationMatrix() would: from the identity
+// the filter would have to turn up to 180 degrees, and can settle short of
+// it when the gyroscope is still.
+static inline bool emu_fusion_align(struct emu_fusion *f)
+{
+	const float *a = f->accel;
+	const float *m = f->magnetic;
+
+	// East, north and up in the sensor's frame.
+	float e[3] = { m[1] * a[2] - m[2] * a[1], m[2] * a[0] - m[0] * a[2], m[0] * a[1] - m[1] * a[0] };
+	float re = emu_fusion_inv_norm(e[0], e[1], e[2], 0);
+	float ru = emu_fusion_inv_norm(a[0], a[1], a[2], 0);
+	if (!re || !ru) {
+		return false;
+	}
+	float u[3] = { a[0] * ru, a[1] * ru, a[2] * ru };
+	e[0] *= re;
+	e[1] *= re;
+	e[2] *= re;
+	float n[3] = { u[1] * e[2] - u[2] * e[1], u[2] * e[0] - u[0] * e[2], u[0] * e[1] - u[1] * e[0] };
+
+	// The rows of the filter's matrix are north, west and up.
+	float r[9] = { n[0], n[1], n[2], -e[0], -e[1], -e[2], u[0], u[1], u[2] };
+	float q[4];
+	float t = r[0] + r[4] + r[8];
+	if (t > 0) {
+		float k = 2 * sqrtf(t + 1);
+		q[0] = k / 4;
+		q[1] = (r[7] - r[5]) / k;
+		q[2] = (r[2] - r[6]) / k;
+		q[3] = (r[3] - r[1]) / k;
+	} else if (r[0] > r[4] && r[0] > r[8]) {
+		float k = 2 * sqrtf(1 + r[0] - r[4] - r[8]);
+		q[0] = (r[7] - r[5]) / k;
+		q[1] = k / 4;
+		q[2] = (r[1] + r[3]) / k;
+		q[3] = (r[2] + r[6]) / k;
+	} else if (r[4] > r[8]) {
+		float k = 2 * sqrtf(1 + r[4] - r[0] - r[8]);
+		q[0] = (r[2] - r[6]) / k;
+		q[1] = (r[1] + r[3]) / k;
+		q[2] = k / 4;
+		q[3] = (r[5] + r[7]) / k;
+	} else {
+		float k = 2 * sqrtf(1 + r[8] - r[0] - r[4]);
+		q[0] = (r[3] - r[1]) / k;
+		q[1] = (r[2] + r[6]) / k;
+		q[2] = (r[5] + r[7]) / k;
+		q[3] = k / 4;
+	}
+
+	float rq = emu_fusion_inv_norm(q[0], q[1], q[2], q[3]);
+	f->q[0] = q[0] * rq;
+	f->q[1] = q[1] * rq;
+	f->q[2] = q[2] * rq;
+	f->q[3] = q[3] * rq;
+	return true;
+}
+
+// A step on a gyroscope reading (rad/s) of time ts_ns.
+static inline void emu_fusion_gyro(struct emu_fusion *f, uint64_t ts_ns, float gx, float gy, float gz)
+{
+	float dt = EMU_FUSION_DEFAULT_DT;
+	if (f->last_ns && ts_ns > f->last_ns) {
+		dt = (ts_ns - f->last_ns) / 1e9f;
+		dt = dt > EMU_FUSION_MAX_DT ? EMU_FUSION_DEFAULT_DT : dt;
+	}
+	f->last_ns = ts_ns;
+
+	if (!f->aligned && f->have_accel && f->have_magnetic) {
+		f->aligned = emu_fusion_align(f);
+	}
+
+	float q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+	float s[4] = { 0, 0, 0, 0 };
+	bool correct = f->have_accel && (f->accel[0] || f->accel[1] || f->accel[2]);
+	if (correct) {
+		emu_fusion_gradient(f, s);
+
+		// The bias is the part of the rate that the correction keeps
+		// undoing.
+		float ex = 2 * (q0 * s[1] - q1 * s[0] - q2 * s[3] + q3 * s[2]);
+		float ey = 2 * (q0 * s[2] + q1 * s[3] - q2 * s[0] - q3 * s[1]);
+		float ez = 2 * (q0 * s[3] - q1 * s[2] + q2 * s[1] - q3 * s[0]);
+		f->bias[0] += ex * dt * f->zeta;
+		f->bias[1] += ey * dt * f->zeta;
+		f->bias[2] += ez * dt * f->zeta;
+	}
+
+	gx -= f->bias[0];
+	gy -= f->bias[1];
+	gz -= f->bias[2];
+	f->gyro[0] = gx;
+	f->gyro[1] = gy;
+	f->gyro[2] = gz;
+
+	float d0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz) - f->beta * s[0];
+	float d1 = 0.5f * (q0 * gx + q2 * gz - q3 * gy) - f->beta * s[1];
+	float d2 = 0.5f * (q0 * gy - q1 * gz + q3 * gx) - f->beta * s[2];
+	float d3 = 0.5f * (q0 * gz + q1 * gy - q2 * gx) - f->beta * s[3];
+
+	q0 += d0 * dt;
+	q1 += d1 * dt;
+	q2 += d2 * dt;
+	q3 += d3 * dt;
+
+	float r = emu_fusion_inv_norm(q0, q1, q2, q3);
+	if (!r) {
+		return;
+	}
+	f->q[0] = q0 * r;
+	f->q[1] = q1 * r;
+	f->q[2] = q2 * r;
+	f->q[3] = q3 * r;
+}
+
+// The attitude in Android's frame: the filter's turned 90 degrees about z.
+static inline void emu_fusion_quaternion(const struct emu_fusion *f, float q[4])
+{
+	const float h = 0.70710678f;
+	q[0] = h * (f->q[0] - f->q[3]);
+	q[1] = h * (f->q[1] - f->q[2]);
+	q[2] = h * (f->q[1] + f->q[2]);
+	q[3] = h * (f->q[3] + f->q[0]);
+}
+
+// The rotation matrix of q, row-major, from the sensor's frame to the
+// world's - that of SensorManager.getRotationMatrix().
+static inline void emu_fusion_matrix(const float q[4], float m[9])
+{
+	float w = q[0], x = q[1], y = q[2], z = q[3];
+
+	m[0] = 1 - 2 * (y * y + z * z);
+	m[1] = 2 * (x * y - w * z);
+	m[2] = 2 * (x * z + w * y);
+	m[3] = 2 * (x * y + w * z);
+	m[4] = 1 - 2 * (x * x + z * z);
+	m[5] = 2 * (y * z - w * x);
+	m[6] = 2 * (x * z - w * y);
+	m[7] = 2 * (y * z + w * x);
+	m[8] = 1 - 2 * (x * x + y * y);
+}
+
+// x, y, z and the scalar part, as SENSOR_TYPE_ROTATION_VECTOR has them.
+static inline void emu_fusion_rotation_vector(const struct emu_fusion *f, float v[4])
+{
+	float q[4];
+	emu_fusion_quaternion(f, q);
+	if (q[0] < 0) { // The same rotation; Android keeps the scalar non-negative.
+		q[0] = -q[0];
+		q[1] = -q[1];
+		q[2] = -q[2];
+		q[3] = -q[3];
+	}
+	v[0] = q[1];
+	v[1] = q[2];
+	v[2] = q[3];
+	v[3] = q[0];
+}
+
+static inline void emu_fusion_gravity(const struct emu_fusion *f, float g[3])
+{
+	// The world's up in the sensor's frame - the third row of the matrix.
+	float q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+	g[0] = EMU_FUSION_GRAVITY * 2 * (q1 * q3 - q0 * q2);
+	g[1] = EMU_FUSION_GRAVITY * 2 * (q2 * q3 + q0 * q1);
+	g[2] = EMU_FUSION_GRAVITY * (1 - 2 * (q1 * q1 + q2 * q2));
+}
+
+static inline void emu_fusion_linear_acceleration(const struct emu_fusion *f, float a[3])
+{
+	float g[3];
+	emu_fusion_gravity(f, g);
+	a[0] = f->accel[0] - g[0];
+	a[1] = f->accel[1] - g[1];
+	a[2] = f->accel[2] - g[2];
+}
+
+// Azimuth (0 - 360), pitch and roll in degrees, as
+// SensorManager.getOrientation() works them out of the matrix.
+static inline void emu_fusion_orientation(const struct emu_fusion *f, float o[3])
+{
+	float q[4];
+	float m[9];
+	emu_fusion_quaternion(f, q);
+	emu_fusion_matrix(q, m);
+
+	const float deg = 57.29577951f;
+	float azimuth = atan2f(m[1], m[4]) * deg;
+	azimuth = azimuth < 0 ? azimuth + 360 : azimuth;
+	o[0] = azimuth < 360 ? azimuth : 0; // -0.000001 + 360 rounds to 360.
+
+	o[1] = asinf(fmaxf(-1, fminf(1, -m[7]))) * deg;
+	o[2] = atan2f(-m[6], m[8]) * deg;
+}
+
+#endif
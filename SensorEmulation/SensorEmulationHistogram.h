@@ -0,0 +1,240 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationHistogram.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationHistogram.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationHistogram.h
+ *
+ * Working:
+ *
+ * A histogram of latencies (or any other non-negative integers, usually
+ * ns), the one that all of the latency and interval figures of the
+ * programs, the HAL, the benchmark and SensorEmulationStat come from, so
+ * that they compare.
+ *
+ * It's log-linear, like an HDR histogram: the values under
+ * EMU_HIST_SUB (32) each have a bucket of their own, and every power of
+ * 2 above that is split into EMU_HIST_SUB buckets of equal width - a
+ * value is known to within 1/32, some 3%, from 1ns to 2^40ns (18
+ * minutes), past which it's counted in the last bucket. The count, the
+ * sum, the minimum and the maximum are kept exactly. It's a fixed
+ * EMU_HIST_SIZE bytes, all of it uint64_t, and fine in shared memory.
+ *
+ * emu_hist_record() is meant for the one thread that owns the histogram
+ * - a relaxed atomic load and store per word it touches, no lock and no
+ * read-modify-write - while any other thread or process reads it
+ * whenever it likes. Histograms of different threads or processes are
+ * combined with emu_hist_merge(), which reads the one merged in with
+ * atomic loads, so a live one can be merged; every word of it is whole,
+ * though not all of them of the same instant.
+ */
+
+#ifndef SENSOR_EMULATION_HISTOGRAM_H
+#define SENSOR_EMULATION_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define EMU_HIST_SUB_BITS 5
+#define EMU_HIST_SUB (1 << EMU_HIST_SUB_BITS)
+#define EMU_HIST_MAX_BITS 40
+#define EMU_HIST_BUCKETS ((EMU_HIST_MAX_BITS - EMU_HIST_SUB_BITS + 1) * EMU_HIST_SUB)
+
+struct emu_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min; /* Of count values, when count is not 0. */
+	uint64_t max;
+	uint64_t buckets[EMU_HIST_BUCKETS];
+};
+
+#define EMU_HIST_SIZE sizeof(struct emu_hist)
+
+static inline int emu_hist_index(uint64_t v)
+{
+	if (v < EMU_HIST_SUB) {
+		return (int)v;
+	}
+
+	int top = 63 - __builtin_clzll(v);
+	if (top >= EMU_HIST_MAX_BITS) {
+		return EMU_HIST_BUCKETS - 1;
+	}
+
+	int group = top - EMU_HIST_SUB_BITS + 1;
+	return group * EMU_HIST_SUB + (int)(v >> (top - EMU_HIST_SUB_BITS)) - EMU_HIST_SUB;
+}
+
+// The smallest value of bucket i.
+static inline uint64_t emu_hist_lowest(int i)
+{
+	int group = i / EMU_HIST_SUB;
+	uint64_t sub = i % EMU_HIST_SUB;
+
+	return group ? (EMU_HIST_SUB + sub) << (group - 1) : sub;
+}
+
+// The largest value of bucket i.
+static inline uint64_t emu_hist_highest(int i)
+{
+	int group = i / EMU_HIST_SUB;
+
+	return emu_hist_lowest(i) + (group ? (1ULL << (group - 1)) : 1) - 1;
+}
+
+static inline uint64_t emu_hist_load(const uint64_t *word)
+{
+	return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+static inline void emu_hist_store(uint64_t *word, uint64_t v)
+{
+	__atomic_store_n(word, v, __ATOMIC_RELAXED);
+}
+
+// n values of v. Only from the histogram's own writer thread.
+static inline void emu_hist_record_n(struct emu_hist *h, uint64_t v, uint64_t n)
+{
+	if (!n) {
+		return;
+	}
+
+	uint64_t count = emu_hist_load(&h->count);
+	if (!count || v < emu_hist_load(&h->min)) {
+		emu_hist_store(&h->min, v);
+	}
+	if (!count || v > emu_hist_load(&h->max)) {
+		emu_hist_store(&h->max, v);
+	}
+	uint64_t *bucket = &h->buckets[emu_hist_index(v)];
+	emu_hist_store(bucket, emu_hist_load(bucket) + n);
+	emu_hist_store(&h->sum, emu_hist_load(&h->sum) + v * n);
+	emu_hist_store(&h->count, count + n);
+}
+
+static inline void emu_hist_record(struct emu_hist *h, uint64_t v)
+{
+	emu_hist_record_n(h, v, 1);
+}
+
+// Adds from to h, which nobody else writes. from can be a live one.
+static inline void emu_hist_merge(struct emu_hist *h, const struct emu_hist *from)
+{
+	uint64_t count = emu_hist_load(&from->count);
+	if (!count) {
+		return;
+	}
+
+	uint64_t min = emu_hist_load(&from->min);
+	uint64_t max = emu_hist_load(&from->max);
+	if (!h->count || min < h->min) {
+		h->min = min;
+	}
+	if (!h->count || max > h->max) {
+		h->max = max;
+	}
+	h->count += count;
+	h->sum += emu_hist_load(&from->sum);
+
+	int i = 0;
+	while (i < EMU_HIST_BUCKETS) {
+		h->buckets[i] += emu_hist_load(&from->buckets[i]);
+		i++;
+	}
+}
+
+// h less an earlier copy of it, before. The minimum and the maximum are
+// of the buckets left.
+static inline void emu_hist_subtract(struct emu_hist *h, const struct emu_hist *before)
+{
+	h->count -= before->count;
+	h->sum -= before->sum;
+
+	int first = -1;
+	int last = -1;
+	int i = 0;
+	while (i < EMU_HIST_BUCKETS) {
+		h->buckets[i] -= before->buckets[i];
+		if (h->buckets[i]) {
+			first = first == -1 ? i : first;
+			last = i;
+		}
+		i++;
+	}
+
+	if (first == -1) {
+		h->min = h->max = 0;
+		return;
+	}
+	h->min = emu_hist_lowest(first) > h->min ? emu_hist_lowest(first) : h->min;
+	h->max = emu_hist_highest(last) < h->max ? emu_hist_highest(last) : h->max;
+}
+
+// The value at or below which q (0 - 1) of the values are, to within its
+// bucket - the largest value of the bucket, but never past the maximum.
+static inline uint64_t emu_hist_percentile(const struct emu_hist *h, double q)
+{
+	if (!h->count) {
+		return 0;
+	}
+	if (q >= 1) {
+		return h->max;
+	}
+
+	uint64_t rank = (uint64_t)(q * h->count); // The values before the one wanted.
+	uint64_t seen = 0;
+	int i = 0;
+	while (i < EMU_HIST_BUCKETS - 1) {
+		seen += h->buckets[i];
+		if (seen > rank) {
+			break;
+		}
+		i++;
+	}
+
+	uint64_t v = emu_hist_highest(i);
+	v = v > h->max ? h->max : v;
+	return v < h->min ? h->min : v;
+}
+
+static inline double emu_hist_mean(const struct emu_hist *h)
+{
+	return h->count ? (double)h->sum / h->count : 0;
+}
+
+// The number of values under v, to within a bucket.
+static inline uint64_t emu_hist_count_below(const struct emu_hist *h, uint64_t v)
+{
+	int end = emu_hist_index(v);
+	uint64_t below = 0;
+	int i = 0;
+	while (i < end) {
+		below += h->buckets[i];
+		i++;
+	}
+
+	return below;
+}
+
+// The number of values no more than v, exact when v + 1 starts a bucket,
+// e.g. for v = 2^n - 1.
+static inline uint64_t emu_hist_count_at_most(const struct emu_hist *h, uint64_t v)
+{
+	return emu_hist_count_below(h, v + 1);
+}
+
+#endif
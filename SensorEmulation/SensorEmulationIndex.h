@@ -0,0 +1,493 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationIndex.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationIndex.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationIndex.h
+ *
+ * Working:
+ *
+ * Pulls a time range of some of the sensors out of a capture without
+ * reading all of it.
+ *
+ * A .rec recording of SensorEmulationRecord.h has its index of blocks
+ * already - the sensor and the time span of every EMU_REC_BLOCK_SAMPLES
+ * readings. A text readings log gets a sparse one, built by reading it
+ * once: a struct emu_index_stride per EMU_INDEX_STRIDE_BYTES of it, at
+ * line boundaries, with the earliest and the latest time in it and the
+ * sensors it has readings of. It's kept beside the log, in <log>.idx,
+ * and used as long as the log's size and modification time are what
+ * they were - otherwise it's built again. If it can't be written, e.g.
+ * in a read-only directory, it's only in memory.
+ *
+ * emu_index_extract() then only decodes the blocks, or parses the
+ * strides, that have readings of the wanted sensors in the range, and
+ * calls back with every reading in it - in time order across the sensors
+ * for a recording, and in the order of the lines for a log.
+ */
+
+#ifndef SENSOR_EMULATION_INDEX_H
+#define SENSOR_EMULATION_INDEX_H
+
+#include <ctype.h>
+#include <limits.h>
+
+#include "SensorEmulationRecord.h"
+
+#define EMU_INDEX_MAGIC "SEMUIDX1"
+#define EMU_INDEX_VERSION 1
+#define EMU_INDEX_SUFFIX ".idx"
+#define EMU_INDEX_STRIDE_BYTES (1024 * 1024)
+
+struct emu_index_stride {
+	uint64_t offset; /* Of its first line. */
+	int64_t first_ns; /* Earliest. */
+	int64_t last_ns; /* Latest. */
+	uint32_t sensors; /* Bit per sensor with readings in it. */
+	uint32_t lines;
+};
+
+struct emu_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_sensors;
+	uint64_t capture_size;
+	int64_t capture_mtime_ns;
+	int64_t first_ns;
+	int64_t last_ns;
+	uint32_t entries; /* Strides following. */
+	uint32_t pad;
+	char names[EMU_REC_MAX_SENSORS][EMU_REC_NAME_SIZE];
+};
+
+struct emu_index {
+	bool recording;
+	struct emu_rec_reader reader;
+
+	const char *map; /* Of the log. */
+	size_t size;
+
+	struct emu_index_header header; /* Its names and time span, a recording's too. */
+	struct emu_index_stride *strides;
+};
+
+// Called with every reading extracted, in v[0 .. columns - 1]. Returns
+// false to stop.
+typedef bool (*emu_index_fn)(void *arg, int sensor, int64_t ns, const float *v, int columns);
+
+static inline bool emu_index_add_stride(struct emu_index *x, uint32_t *size, const struct emu_index_stride *s)
+{
+	if (x->header.entries == *size) {
+		uint32_t new_size = *size ? *size * 2 : 1024;
+		struct emu_index_stride *strides = (struct emu_index_stride *)realloc(x->strides, new_size * sizeof(*strides));
+		if (!strides) {
+			return false;
+		}
+		x->strides = strides;
+		*size = new_size;
+	}
+	x->strides[x->header.entries++] = *s;
+
+	return true;
+}
+
+static inline bool emu_index_build(struct emu_index *x)
+{
+	uint32_t size = 0;
+	struct emu_index_stride s;
+	memset(&s, 0, sizeof(s));
+	x->header.first_ns = INT64_MAX;
+	x->header.last_ns = INT64_MIN;
+
+	const char *p = x->map;
+	const char *end = x->map + x->size;
+	while (p < end) {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (!eol) {
+			eol = end;
+		}
+
+		if ((size_t)(p - x->map) >= s.offset + EMU_INDEX_STRIDE_BYTES) {
+			if (s.lines && !emu_index_add_stride(x, &size, &s)) {
+				return false;
+			}
+			memset(&s, 0, sizeof(s));
+			s.offset = p - x->map;
+		}
+
+		const char *name = NULL;
+		size_t len = 0;
+		int64_t ns = 0;
+		float v[EMU_REC_MAX_COLUMNS];
+		int columns = 0;
+		if (emu_rec_parse_line(p, eol, &name, &len, &ns, v, &columns)) {
+			if (len >= EMU_REC_NAME_SIZE) {
+				len = EMU_REC_NAME_SIZE - 1;
+			}
+			uint32_t n = 0;
+			while (n < x->header.num_sensors &&
+				(strncmp(x->header.names[n], name, len) || x->header.names[n][len] != '\0')) {
+				n++;
+			}
+			if (n == x->header.num_sensors && n < EMU_REC_MAX_SENSORS) {
+				memcpy(x->header.names[n], name, len);
+				x->header.num_sensors++;
+			}
+			if (n < x->header.num_sensors) {
+				if (!s.sensors || ns < s.first_ns) {
+					s.first_ns = ns;
+				}
+				if (!s.sensors || ns > s.last_ns) {
+					s.last_ns = ns;
+				}
+				s.sensors |= 1U << n;
+				if (ns < x->header.first_ns) {
+					x->header.first_ns = ns;
+				}
+				if (ns > x->header.last_ns) {
+					x->header.last_ns = ns;
+				}
+			}
+		}
+		s.lines++;
+
+		p = eol + 1;
+	}
+
+	return !s.lines || emu_index_add_stride(x, &size, &s);
+}
+
+static inline bool emu_index_load(struct emu_index *x, const char *path)
+{
+	bool success = false;
+	struct stat st;
+	struct emu_index_header h;
+
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return false;
+	}
+
+	if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, EMU_INDEX_MAGIC, sizeof(h.magic)) ||
+		h.version != EMU_INDEX_VERSION || h.capture_size != x->header.capture_size ||
+		h.capture_mtime_ns != x->header.capture_mtime_ns || h.num_sensors > EMU_REC_MAX_SENSORS ||
+		fstat(fileno(fp), &st) == -1 ||
+		(uint64_t)st.st_size != sizeof(h) + (uint64_t)h.entries * sizeof(struct emu_index_stride)) {
+		goto done;
+	}
+
+	x->strides = (struct emu_index_stride *)malloc(h.entries * sizeof(struct emu_index_stride) + 1);
+	if (!x->strides) {
+		goto done;
+	}
+	if (fread(x->strides, sizeof(struct emu_index_stride), h.entries, fp) != h.entries) {
+		free(x->strides);
+		x->strides = NULL;
+		goto done;
+	}
+	x->header = h;
+
+	success = true;
+
+done:
+	fclose(fp);
+
+	return success;
+}
+
+static inline void emu_index_save(const struct emu_index *x, const char *path)
+{
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		return;
+	}
+
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) {
+		return;
+	}
+	bool written = fwrite(&x->header, sizeof(x->header), 1, fp) == 1 &&
+			fwrite(x->strides, sizeof(*x->strides), x->header.entries, fp) == x->header.entries;
+	if (fclose(fp) || !written || rename(tmp, path) == -1) {
+		unlink(tmp);
+	}
+}
+
+static inline void emu_index_close(struct emu_index *x)
+{
+	if (x->recording) {
+		emu_rec_unmap(&x->reader);
+	} else if (x->map) {
+		munmap((void *)x->map, x->size);
+	}
+	free(x->strides);
+	memset(x, 0, sizeof(*x));
+}
+
+// Opens the capture at path - a recording, or a log indexed as above.
+static inline bool emu_index_open(struct emu_index *x, const char *path)
+{
+	bool success = false;
+	struct stat st;
+	char index_path[PATH_MAX];
+	void *map = MAP_FAILED;
+	int fd = -1;
+	memset(x, 0, sizeof(*x));
+
+	if (emu_rec_map(&x->reader, path)) {
+		x->recording = true;
+		x->size = x->reader.size;
+		x->header.num_sensors = x->reader.header.num_sensors;
+		memcpy(x->header.names, x->reader.header.names, sizeof(x->header.names));
+		x->header.first_ns = INT64_MAX;
+		x->header.last_ns = INT64_MIN;
+		uint32_t i = 0;
+		while (i < x->reader.entries) {
+			if (x->reader.index[i].first_ns < x->header.first_ns) {
+				x->header.first_ns = x->reader.index[i].first_ns;
+			}
+			if (x->reader.index[i].last_ns > x->header.last_ns) {
+				x->header.last_ns = x->reader.index[i].last_ns;
+			}
+			i++;
+		}
+		return true;
+	}
+	if (errno != EINVAL) {
+		return false;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		goto done;
+	}
+	x->size = st.st_size;
+	if (x->size) {
+		map = mmap(NULL, x->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			goto done;
+		}
+		x->map = (const char *)map;
+	}
+
+	memcpy(x->header.magic, EMU_INDEX_MAGIC, sizeof(x->header.magic));
+	x->header.version = EMU_INDEX_VERSION;
+	x->header.capture_size = st.st_size;
+	x->header.capture_mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+	snprintf(index_path, sizeof(index_path), "%s" EMU_INDEX_SUFFIX, path);
+	if (!emu_index_load(x, index_path)) {
+		madvise((void *)x->map, x->size, MADV_SEQUENTIAL);
+		if (!emu_index_build(x)) {
+			goto done;
+		}
+		emu_index_save(x, index_path);
+		madvise((void *)x->map, x->size, MADV_RANDOM);
+	}
+
+	success = true;
+
+done:
+	if (fd != -1) {
+		close(fd);
+	}
+	if (!success) {
+		int e = errno;
+		emu_index_close(x);
+		errno = e;
+	}
+
+	return success;
+}
+
+// The sensors named name, ignoring case and anything but letters and
+// digits - the one of that name, or else all of those whose names start
+// with it, so "gyro" is the Gyroscope. A bit per sensor, 0 if none.
+static inline uint32_t emu_index_sensors(const struct emu_index *x, const char *name)
+{
+	uint32_t exact = 0;
+	uint32_t prefix = 0;
+
+	uint32_t n = 0;
+	while (n < x->header.num_sensors) {
+		const char *a = name;
+		const char *b = x->header.names[n];
+		const char *b_end = b + strnlen(b, EMU_REC_NAME_SIZE);
+		while (1) {
+			while (*a && !isalnum((unsigned char)*a)) {
+				a++;
+			}
+			while (b < b_end && !isalnum((unsigned char)*b)) {
+				b++;
+			}
+			if (!*a) {
+				if (b == b_end) {
+					exact |= 1U << n;
+				} else {
+					prefix |= 1U << n;
+				}
+				break;
+			}
+			if (b == b_end || tolower((unsigned char)*a) != tolower((unsigned char)*b)) {
+				break;
+			}
+			a++;
+			b++;
+		}
+		n++;
+	}
+
+	return exact ? exact : prefix;
+}
+
+// Of a recording, merged by time across the sensors.
+static inline bool emu_index_extract_recording(const struct emu_index *x, uint32_t sensors,
+						int64_t from_ns, int64_t to_ns, emu_index_fn fn, void *arg)
+{
+	const struct emu_rec_reader *r = &x->reader;
+	struct emu_rec_samples *samples[EMU_REC_MAX_SENSORS];
+	uint32_t block[EMU_REC_MAX_SENSORS]; /* Next in the index to look at. */
+	int next[EMU_REC_MAX_SENSORS];
+	bool success = false;
+	bool go_on = true;
+	int num = x->header.num_sensors;
+	memset(samples, 0, sizeof(samples));
+
+	int n = 0;
+	while (n < num) {
+		block[n] = 0;
+		next[n] = 0;
+		if (sensors & (1U << n)) {
+			samples[n] = (struct emu_rec_samples *)malloc(sizeof(struct emu_rec_samples));
+			if (!samples[n]) {
+				goto done;
+			}
+			samples[n]->num = 0;
+		}
+		n++;
+	}
+
+	while (go_on) {
+		int earliest = -1;
+		n = 0;
+		while (n < num) {
+			struct emu_rec_samples *s = samples[n];
+			// Up to the next reading of the sensor in the range.
+			while (s) {
+				while (next[n] < s->num && s->ns[next[n]] < from_ns) {
+					next[n]++;
+				}
+				if (next[n] < s->num) {
+					break;
+				}
+				while (block[n] < r->entries && (r->index[block[n]].sensor != n ||
+					r->index[block[n]].last_ns < from_ns || r->index[block[n]].first_ns >= to_ns)) {
+					block[n]++;
+				}
+				if (block[n] == r->entries) {
+					s->num = 0;
+					break;
+				}
+				if (!emu_rec_decode(r, block[n]++, s)) {
+					s->num = 0;
+				}
+				next[n] = 0;
+			}
+			if (s && next[n] < s->num && s->ns[next[n]] < to_ns &&
+				(earliest == -1 || s->ns[next[n]] < samples[earliest]->ns[next[earliest]])) {
+				earliest = n;
+			}
+			n++;
+		}
+		if (earliest == -1) {
+			break;
+		}
+
+		struct emu_rec_samples *s = samples[earliest];
+		float v[EMU_REC_MAX_COLUMNS];
+		int c = 0;
+		while (c < s->columns) {
+			v[c] = s->v[c][next[earliest]];
+			c++;
+		}
+		go_on = fn(arg, earliest, s->ns[next[earliest]], v, s->columns);
+		next[earliest]++;
+	}
+
+	success = true;
+
+done:
+	n = 0;
+	while (n < num) {
+		free(samples[n]);
+		n++;
+	}
+
+	return success;
+}
+
+// Calls fn with every reading of sensors (a bit each) from from_ns to
+// before to_ns. False if it ran out of memory.
+static inline bool emu_index_extract(const struct emu_index *x, uint32_t sensors, int64_t from_ns, int64_t to_ns,
+					emu_index_fn fn, void *arg)
+{
+	if (x->recording) {
+		return emu_index_extract_recording(x, sensors, from_ns, to_ns, fn, arg);
+	}
+
+	uint32_t i = 0;
+	while (i < x->header.entries) {
+		const struct emu_index_stride *s = &x->strides[i];
+		if (!(s->sensors & sensors) || s->last_ns < from_ns || s->first_ns >= to_ns) {
+			i++;
+			continue;
+		}
+
+		const char *p = x->map + s->offset;
+		const char *end = i + 1 < x->header.entries ? x->map + x->strides[i + 1].offset : x->map + x->size;
+		while (p < end) {
+			const char *eol = (const char *)memchr(p, '\n', end - p);
+			if (!eol) {
+				eol = end;
+			}
+			const char *name = NULL;
+			size_t len = 0;
+			int64_t ns = 0;
+			float v[EMU_REC_MAX_COLUMNS];
+			int columns = 0;
+			if (emu_rec_parse_line(p, eol, &name, &len, &ns, v, &columns) && ns >= from_ns && ns < to_ns) {
+				if (len >= EMU_REC_NAME_SIZE) {
+					len = EMU_REC_NAME_SIZE - 1;
+				}
+				uint32_t n = 0;
+				while (n < x->header.num_sensors &&
+					(strncmp(x->header.names[n], name, len) || x->header.names[n][len] != '\0')) {
+					n++;
+				}
+				if (n < x->header.num_sensors && (sensors & (1U << n)) && !fn(arg, n, ns, v, columns)) {
+					return true;
+				}
+			}
+			p = eol + 1;
+		}
+		i++;
+	}
+
+	return true;
+}
+
+#endif /* SENSOR_EMULATION_INDEX_H */
@@ -0,0 +1,406 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationLog.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationLog.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationLog.h
+ *
+ * Working:
+ *
+ * The LOG/ERR/LOG_READING macros of the generator, the relay, the HALs and
+ * the sensorservice pieces end up in emu_log_write() instead of a
+ * printf() + fflush() each.
+ *
+ * Every thread formats its lines into a ring of its own - single producer,
+ * single consumer, so no lock and no system call on the logging thread. A
+ * writer thread, started on the first line, drains all of the rings every
+ * EMU_LOG_DRAIN_MS into their FILEs and flushes each FILE once per drain.
+ * When a ring is full, the line is dropped and counted rather than waiting
+ * for the writer. The rings are drained at exit() too, and emu_log_flush()
+ * drains them on demand, e.g. before a FILE that was logged to is closed.
+ *
+ * Lines below the log level are skipped before they're formatted. Every
+ * call site is also limited to a number of lines per second, past which
+ * its lines are counted and reported as suppressed in the next second -
+ * so that a per-frame LOG in a 1 kHz loop doesn't cost more than a few
+ * dozen lines a second. The readings logs aren't rate limited.
+ *
+ * The level and the rate come from $SENSOR_EMU_LOG, or else from the conf
+ * file given to emu_log_conf(), as "<level> [<lines per second per call
+ * site>]", e.g. "info 20". The levels are off, error, info, readings and
+ * debug (the default); a rate of 0 means no limit. The conf file is looked
+ * at again every second, so the level can be changed on a running process.
+ */
+
+#ifndef SENSOR_EMULATION_LOG_H
+#define SENSOR_EMULATION_LOG_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define EMU_LOG_OFF 0
+#define EMU_LOG_ERROR 1
+#define EMU_LOG_INFO 2
+#define EMU_LOG_READINGS 3
+#define EMU_LOG_DEBUG 4
+
+#define EMU_LOG_ENV "SENSOR_EMU_LOG"
+#define EMU_LOG_DEFAULT_RATE 100 /* Lines per second per call site. */
+
+#define EMU_LOG_MAX_THREADS 64
+#define EMU_LOG_RING_SLOTS 256 /* Power of 2. */
+#define EMU_LOG_LINE_MAX 240
+#define EMU_LOG_DRAIN_MS 10
+#define EMU_LOG_MAX_FILES 16 /* Flushed once per drain. */
+
+struct emu_log_line {
+	FILE *fp;
+	int len;
+	char text[EMU_LOG_LINE_MAX];
+};
+
+struct emu_log_ring {
+	uint32_t head; /* Written by the thread. */
+	uint32_t tail; /* Written by the writer. */
+	int exited;
+	unsigned long long dropped;
+	struct emu_log_line lines[EMU_LOG_RING_SLOTS];
+};
+
+// Shared by the threads logging from the site. The window packs the
+// second in the upper half and its lines so far in the lower, so that it
+// is rolled over and counted in one compare-and-swap.
+struct emu_log_site {
+	uint64_t window;
+	unsigned int suppressed;
+};
+
+static int emu_log_level = EMU_LOG_DEBUG;
+static unsigned int emu_log_rate = EMU_LOG_DEFAULT_RATE;
+
+static struct emu_log_ring *emu_log_rings[EMU_LOG_MAX_THREADS];
+static pthread_key_t emu_log_key;
+static pthread_once_t emu_log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t emu_log_drain_lock = PTHREAD_MUTEX_INITIALIZER; /* One consumer at a time. */
+
+static char emu_log_conf_file[256];
+static time_t emu_log_conf_mtime;
+
+static inline long emu_log_now_s(void)
+{
+	struct timespec t = { 0, 0 };
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec;
+}
+
+static inline void emu_log_parse(const char *spec)
+{
+	static const char *names[] = { "off", "error", "info", "readings", "debug", };
+
+	char level[16] = "";
+	unsigned int rate = EMU_LOG_DEFAULT_RATE;
+	if (sscanf(spec, "%15s %u", level, &rate) < 1) {
+		return;
+	}
+
+	int i = 0;
+	while (i < (int)(sizeof(names) / sizeof(names[0]))) {
+		if (!strcasecmp(level, names[i])) {
+			__atomic_store_n(&emu_log_level, i, __ATOMIC_RELAXED);
+			__atomic_store_n(&emu_log_rate, rate, __ATOMIC_RELAXED);
+			return;
+		}
+		i++;
+	}
+}
+
+static inline void emu_log_reload(void)
+{
+	const char *env = getenv(EMU_LOG_ENV);
+	if (env) {
+		emu_log_parse(env);
+		return;
+	}
+
+	struct stat st;
+	if (!emu_log_conf_file[0] || stat(emu_log_conf_file, &st) == -1 || st.st_mtime == emu_log_conf_mtime) {
+		return;
+	}
+	emu_log_conf_mtime = st.st_mtime;
+
+	FILE *conf_fp = fopen(emu_log_conf_file, "r");
+	if (conf_fp) {
+		char spec[64] = "";
+		if (fgets(spec, sizeof(spec), conf_fp)) {
+			emu_log_parse(spec);
+		}
+		fclose(conf_fp);
+	}
+}
+
+// Drains every ring once. The caller holds emu_log_drain_lock.
+static inline void emu_log_drain(void)
+{
+	FILE *touched[EMU_LOG_MAX_FILES];
+	int num_touched = 0;
+
+	int i = 0;
+	while (i < EMU_LOG_MAX_THREADS) {
+		struct emu_log_ring *r = __atomic_load_n(&emu_log_rings[i], __ATOMIC_ACQUIRE);
+		if (!r) {
+			i++;
+			continue;
+		}
+
+		bool exited = __atomic_load_n(&r->exited, __ATOMIC_ACQUIRE);
+		uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = r->tail;
+		while (tail != head) {
+			struct emu_log_line *l = &r->lines[tail % EMU_LOG_RING_SLOTS];
+			fwrite(l->text, 1, l->len, l->fp);
+
+			int t = 0;
+			while (t < num_touched && touched[t] != l->fp) {
+				t++;
+			}
+			if (t == num_touched) {
+				if (num_touched < EMU_LOG_MAX_FILES) {
+					touched[num_touched++] = l->fp;
+				} else {
+					fflush(l->fp);
+				}
+			}
+			tail++;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		unsigned long long dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			fprintf(stderr, "emu_log: %llu lines dropped - the writer fell behind\n", dropped);
+		}
+
+		if (exited) {
+			__atomic_store_n(&emu_log_rings[i], (struct emu_log_ring *)NULL, __ATOMIC_RELEASE);
+			free(r);
+		}
+		i++;
+	}
+
+	int t = 0;
+	while (t < num_touched) {
+		fflush(touched[t]);
+		t++;
+	}
+}
+
+static inline void emu_log_flush(void)
+{
+	pthread_mutex_lock(&emu_log_drain_lock);
+	emu_log_drain();
+	pthread_mutex_unlock(&emu_log_drain_lock);
+}
+
+static inline void *emu_log_writer(void *arg)
+{
+	(void)arg;
+
+	struct timespec t = { 0, EMU_LOG_DRAIN_MS * 1000000L };
+	long reloaded_s = emu_log_now_s();
+
+	while (1) {
+		nanosleep(&t, NULL); // Not emu_nanosleep() - logging isn't part of virtual time.
+
+		emu_log_flush();
+
+		long now_s = emu_log_now_s();
+		if (now_s != reloaded_s) {
+			emu_log_reload();
+			reloaded_s = now_s;
+		}
+	}
+
+	return NULL;
+}
+
+static inline void emu_log_thread_exit(void *arg)
+{
+	struct emu_log_ring *r = (struct emu_log_ring *)arg;
+	__atomic_store_n(&r->exited, 1, __ATOMIC_RELEASE);
+}
+
+static inline void emu_log_init(void)
+{
+	pthread_key_create(&emu_log_key, emu_log_thread_exit);
+	emu_log_reload();
+	atexit(emu_log_flush);
+
+	pthread_t id;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&id, &attr, emu_log_writer, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+// Takes the level and the rate from conf_file, unless $SENSOR_EMU_LOG is set.
+static inline void emu_log_conf(const char *conf_file)
+{
+	pthread_once(&emu_log_once, emu_log_init);
+
+	snprintf(emu_log_conf_file, sizeof(emu_log_conf_file), "%s", conf_file);
+	emu_log_conf_mtime = 0;
+	emu_log_reload();
+}
+
+static inline struct emu_log_ring *emu_log_ring(void)
+{
+	struct emu_log_ring *r = (struct emu_log_ring *)pthread_getspecific(emu_log_key);
+	if (r) {
+		return r;
+	}
+
+	r = (struct emu_log_ring *)calloc(1, sizeof(*r));
+	if (!r) {
+		return NULL;
+	}
+
+	int i = 0;
+	while (i < EMU_LOG_MAX_THREADS) {
+		struct emu_log_ring *none = NULL;
+		if (__atomic_compare_exchange_n(&emu_log_rings[i], &none, r, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			pthread_setspecific(emu_log_key, r);
+			return r;
+		}
+		i++;
+	}
+
+	free(r); // More logging threads than EMU_LOG_MAX_THREADS. Their lines are lost.
+	return NULL;
+}
+
+static inline bool emu_log_enabled(int level)
+{
+	return level <= __atomic_load_n(&emu_log_level, __ATOMIC_RELAXED);
+}
+
+// False if site has had its lines for this second.
+static inline bool emu_log_admit(struct emu_log_site *site, unsigned int *suppressed)
+{
+	unsigned int rate = __atomic_load_n(&emu_log_rate, __ATOMIC_RELAXED);
+	if (!site || !rate) {
+		return true;
+	}
+
+	uint64_t now_s = (uint32_t)emu_log_now_s();
+	uint64_t window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+	while (1) {
+		bool rolled = window >> 32 != now_s;
+		uint64_t count = rolled ? 0 : (uint32_t)window;
+		if (count >= rate) {
+			__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+
+		bool admitted = __atomic_compare_exchange_n(&site->window, &window, now_s << 32 | (count + 1), false,
+								__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		if (admitted) {
+			if (rolled) {
+				*suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+			}
+			return true;
+		}
+	}
+}
+
+// The line is "[tag] func line: ERROR - <fmt>" with the parts that apply,
+// or just fmt for a NULL func.
+static inline void emu_log_write(struct emu_log_site *site, int level, FILE *fp, const char *tag,
+					const char *func, int line, const char *fmt, ...)
+{
+	pthread_once(&emu_log_once, emu_log_init);
+
+	if (!fp || !emu_log_enabled(level)) {
+		return;
+	}
+
+	unsigned int suppressed = 0;
+	if (!emu_log_admit(site, &suppressed)) {
+		return;
+	}
+
+	struct emu_log_ring *r = emu_log_ring();
+	if (!r) {
+		return;
+	}
+
+	uint32_t head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == EMU_LOG_RING_SLOTS) {
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct emu_log_line *l = &r->lines[head % EMU_LOG_RING_SLOTS];
+	int len = 0;
+	if (suppressed) {
+		len += snprintf(l->text, EMU_LOG_LINE_MAX, "(%u lines suppressed) ", suppressed);
+	}
+	if (tag) {
+		len += snprintf(l->text + len, EMU_LOG_LINE_MAX - len, "[%s] ", tag);
+		len = len < EMU_LOG_LINE_MAX ? len : EMU_LOG_LINE_MAX - 1;
+	}
+	if (func) {
+		len += snprintf(l->text + len, EMU_LOG_LINE_MAX - len, "%s %d: %s", func, line,
+									level == EMU_LOG_ERROR ? "ERROR - " : "");
+		len = len < EMU_LOG_LINE_MAX ? len : EMU_LOG_LINE_MAX - 1;
+	}
+
+	va_list ap;
+	va_start(ap, fmt);
+	len += vsnprintf(l->text + len, EMU_LOG_LINE_MAX - len, fmt, ap);
+	va_end(ap);
+
+	l->len = len < EMU_LOG_LINE_MAX ? len : EMU_LOG_LINE_MAX - 1;
+	l->fp = fp;
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#define EMU_LOG_AT(level, fp, tag, ...) do {\
+				static struct emu_log_site emu_log_site_;\
+				emu_log_write(&emu_log_site_, level, fp, tag, __func__, __LINE__, __VA_ARGS__);\
+			} while(0)
+
+#define EMU_ERR(fp, ...) EMU_LOG_AT(EMU_LOG_ERROR, fp, NULL, __VA_ARGS__)
+#define EMU_LOG(fp, ...) EMU_LOG_AT(EMU_LOG_INFO, fp, NULL, __VA_ARGS__)
+#define EMU_DEBUG(fp, ...) EMU_LOG_AT(EMU_LOG_DEBUG, fp, NULL, __VA_ARGS__)
+#define EMU_ERR_TAG(fp, tag, ...) EMU_LOG_AT(EMU_LOG_ERROR, fp, tag, __VA_ARGS__)
+#define EMU_LOG_TAG(fp, tag, ...) EMU_LOG_AT(EMU_LOG_INFO, fp, tag, __VA_ARGS__)
+#define EMU_DEBUG_TAG(fp, tag, ...) EMU_LOG_AT(EMU_LOG_DEBUG, fp, tag, __VA_ARGS__)
+
+// A line of a readings log, as is and never rate limited.
+#define EMU_LOG_READING(fp, ...) emu_log_write(NULL, EMU_LOG_READINGS, fp, NULL, NULL, 0, __VA_ARGS__)
+
+#endif /* SENSOR_EMULATION_LOG_H */
@@ -0,0 +1,376 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationMetrics.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationMetrics.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationMetrics.h
+ *
+ * Working:
+ *
+ * Serves the counters of the statistics page (SensorEmulationStats.h) of
+ * the process over HTTP, as GET /metrics in the Prometheus text format,
+ * from a thread started by emu_metrics_start().
+ *
+ * Every EMU_METRICS_SNAPSHOT_MS the thread copies the counters off the
+ * page and renders the whole of the text once; a scrape only writes out
+ * the last rendering. The threads moving the frames never see the
+ * scrapes - the counters are read the way SensorEmulationStat reads them,
+ * without a lock - and a slow scraper only holds up the next scrape, for
+ * EMU_METRICS_TIMEOUT_S at most.
+ *
+ * Per sensor, labelled with the process, the guest and the sensor:
+ *
+ *	sensor_emu_frames_total, sensor_emu_bytes_total and
+ *	sensor_emu_frames_per_second, with direction="in" or "out" - the
+ *	rate between the last two snapshots,
+ *	sensor_emu_drops_total, sensor_emu_reconnects_total and
+ *	sensor_emu_partial_frames_total,
+ *	sensor_emu_queue_depth and sensor_emu_queue_bytes, the frames and the
+ *	bytes handed on and not sent yet,
+ *	sensor_emu_latency_seconds and sensor_emu_receive_interval_seconds,
+ *	the histograms of the page, with a bucket per power of 2 from 1us on
+ *	(le 2^n - 1 ns, where a bucket of the histograms ends).
+ *
+ * The thread keeps to the wall clock - a scraper is outside of virtual
+ * time - though the latencies are in whatever time the process keeps.
+ */
+
+#ifndef SENSOR_EMULATION_METRICS_H
+#define SENSOR_EMULATION_METRICS_H
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SensorEmulationStats.h"
+
+#define EMU_METRICS_SNAPSHOT_MS 1000
+#define EMU_METRICS_TIMEOUT_S 1
+#define EMU_METRICS_TEXT_MAX (256 * 1024)
+#define EMU_METRICS_FIRST_BUCKET 10 /* le 1.023us. */
+
+struct emu_metrics {
+	int listenfd;
+	char guest[64];
+
+	struct emu_stats_page now;
+	struct emu_stats_page before;
+	int64_t now_ns;
+	int64_t before_ns;
+
+	char text[EMU_METRICS_TEXT_MAX];
+	size_t len;
+};
+
+static struct emu_metrics emu_metrics = { -1 };
+
+static inline int64_t emu_metrics_real_ns(void)
+{
+	struct timespec t = { 0, 0 };
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static inline void emu_metrics_printf(struct emu_metrics *m, const char *fmt, ...)
+{
+	if (m->len >= sizeof(m->text)) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(m->text + m->len, sizeof(m->text) - m->len, fmt, args);
+	va_end(args);
+
+	m->len = len > 0 && (size_t)len < sizeof(m->text) - m->len ? m->len + len : sizeof(m->text);
+}
+
+// The labels of sensor n, without the braces.
+static inline void emu_metrics_labels(struct emu_metrics *m, int n)
+{
+	emu_metrics_printf(m, "process=\"%s\",guest=\"%s\",sensor=\"%s\"", m->now.process, m->guest,
+			m->now.sensors[n].name);
+}
+
+static inline void emu_metrics_family(struct emu_metrics *m, const char *name, const char *type, const char *help)
+{
+	emu_metrics_printf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// name{labels} of every sensor, the counter at offset of each.
+static inline void emu_metrics_counter(struct emu_metrics *m, const char *name, size_t offset, const char *direction)
+{
+	uint32_t n = 0;
+	while (n < m->now.num_sensors) {
+		emu_metrics_printf(m, "%s{", name);
+		emu_metrics_labels(m, n);
+		emu_metrics_printf(m, "%s%s%s} %llu\n", direction ? ",direction=\"" : "", direction ? direction : "",
+				direction ? "\"" : "",
+				(unsigned long long)*(const uint64_t *)((const char *)&m->now.sensors[n] + offset));
+		n++;
+	}
+}
+
+static inline void emu_metrics_rate(struct emu_metrics *m, size_t offset, const char *direction)
+{
+	double seconds = (m->now_ns - m->before_ns) / 1E9;
+
+	uint32_t n = 0;
+	while (n < m->now.num_sensors) {
+		uint64_t now = *(const uint64_t *)((const char *)&m->now.sensors[n] + offset);
+		uint64_t before = *(const uint64_t *)((const char *)&m->before.sensors[n] + offset);
+		emu_metrics_printf(m, "sensor_emu_frames_per_second{");
+		emu_metrics_labels(m, n);
+		emu_metrics_printf(m, ",direction=\"%s\"} %.3f\n", direction,
+				seconds > 0 && now >= before ? (now - before) / seconds : 0.0);
+		n++;
+	}
+}
+
+// The struct emu_hist at offset of every sensor, in ns, as seconds with
+// a bucket per power of 2 from 2^EMU_METRICS_FIRST_BUCKET ns on. A bucket
+// counts the values up to and including its le, so the les are 2^b - 1 ns,
+// the last values of the histogram's buckets, for the counts to be exact.
+static inline void emu_metrics_histogram(struct emu_metrics *m, const char *name, size_t offset)
+{
+	uint32_t n = 0;
+	while (n < m->now.num_sensors) {
+		const struct emu_hist *h = (const struct emu_hist *)((const char *)&m->now.sensors[n] + offset);
+		int b = EMU_METRICS_FIRST_BUCKET;
+		while (b < EMU_HIST_MAX_BITS) {
+			emu_metrics_printf(m, "%s_bucket{", name);
+			emu_metrics_labels(m, n);
+			uint64_t le = (1ULL << b) - 1;
+			emu_metrics_printf(m, ",le=\"%.9g\"} %llu\n", le / 1E9,
+					(unsigned long long)emu_hist_count_at_most(h, le));
+			b++;
+		}
+		emu_metrics_printf(m, "%s_bucket{", name);
+		emu_metrics_labels(m, n);
+		emu_metrics_printf(m, ",le=\"+Inf\"} %llu\n", (unsigned long long)h->count);
+		emu_metrics_printf(m, "%s_sum{", name);
+		emu_metrics_labels(m, n);
+		emu_metrics_printf(m, "} %.9f\n", h->sum / 1E9);
+		emu_metrics_printf(m, "%s_count{", name);
+		emu_metrics_labels(m, n);
+		emu_metrics_printf(m, "} %llu\n", (unsigned long long)h->count);
+		n++;
+	}
+}
+
+static inline void emu_metrics_render(struct emu_metrics *m)
+{
+	m->len = 0;
+
+	emu_metrics_family(m, "sensor_emu_frames_total", "counter", "Frames received (in) and handed on (out).");
+	emu_metrics_counter(m, "sensor_emu_frames_total", offsetof(struct emu_stats_sensor, frames_in), "in");
+	emu_metrics_counter(m, "sensor_emu_frames_total", offsetof(struct emu_stats_sensor, frames_out), "out");
+	emu_metrics_family(m, "sensor_emu_bytes_total", "counter", "Bytes received (in) and handed on (out).");
+	emu_metrics_counter(m, "sensor_emu_bytes_total", offsetof(struct emu_stats_sensor, bytes_in), "in");
+	emu_metrics_counter(m, "sensor_emu_bytes_total", offsetof(struct emu_stats_sensor, bytes_out), "out");
+	emu_metrics_family(m, "sensor_emu_frames_per_second", "gauge", "Frames a second between the last two snapshots.");
+	emu_metrics_rate(m, offsetof(struct emu_stats_sensor, frames_in), "in");
+	emu_metrics_rate(m, offsetof(struct emu_stats_sensor, frames_out), "out");
+	emu_metrics_family(m, "sensor_emu_drops_total", "counter", "Frames dropped.");
+	emu_metrics_counter(m, "sensor_emu_drops_total", offsetof(struct emu_stats_sensor, drops), NULL);
+	emu_metrics_family(m, "sensor_emu_reconnects_total", "counter", "Connections made again after the first.");
+	emu_metrics_counter(m, "sensor_emu_reconnects_total", offsetof(struct emu_stats_sensor, reconnects), NULL);
+	emu_metrics_family(m, "sensor_emu_partial_frames_total", "counter", "Frames received short.");
+	emu_metrics_counter(m, "sensor_emu_partial_frames_total", offsetof(struct emu_stats_sensor, partial_frames), NULL);
+
+	emu_metrics_family(m, "sensor_emu_queue_depth", "gauge", "Frames queued in the process.");
+	uint32_t n = 0;
+	while (n < m->now.num_sensors) {
+		const struct emu_stats_sensor *s = &m->now.sensors[n];
+		int64_t queued = (int64_t)(s->queued_in - s->queued_out);
+		emu_metrics_printf(m, "sensor_emu_queue_depth{");
+		emu_metrics_labels(m, n);
+		emu_metrics_printf(m, "} %lld\n", (long long)(queued > 0 ? queued : 0));
+		n++;
+	}
+	emu_metrics_family(m, "sensor_emu_queue_bytes", "gauge",
+				"Bytes handed on and not sent yet, in the process and in its sockets' send queues.");
+	n = 0;
+	while (n < m->now.num_sensors) {
+		emu_metrics_printf(m, "sensor_emu_queue_bytes{");
+		emu_metrics_labels(m, n);
+		emu_metrics_printf(m, "} %llu\n", (unsigned long long)m->now.sensors[n].queued_bytes);
+		n++;
+	}
+
+	emu_metrics_family(m, "sensor_emu_latency_seconds", "histogram", "Time from a frame coming in to it being handed on.");
+	emu_metrics_histogram(m, "sensor_emu_latency_seconds", offsetof(struct emu_stats_sensor, latency));
+	emu_metrics_family(m, "sensor_emu_receive_interval_seconds", "histogram", "Time between one receive and the next.");
+	emu_metrics_histogram(m, "sensor_emu_receive_interval_seconds", offsetof(struct emu_stats_sensor, interval));
+}
+
+static inline void emu_metrics_snapshot(struct emu_metrics *m)
+{
+	m->before = m->now;
+	m->before_ns = m->now_ns;
+	emu_stats_snapshot(__atomic_load_n(&emu_stats, __ATOMIC_ACQUIRE), &m->now);
+	m->now_ns = emu_metrics_real_ns();
+	if (!m->before_ns) {
+		m->before = m->now;
+		m->before_ns = m->now_ns;
+	}
+
+	emu_metrics_render(m);
+}
+
+static inline bool emu_metrics_send(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+		if (sent <= 0) {
+			return false;
+		}
+		buf += sent;
+		len -= sent;
+	}
+
+	return true;
+}
+
+// Answers the one request on fd with the last rendering.
+static inline void emu_metrics_serve(struct emu_metrics *m, int fd)
+{
+	struct timeval timeout = { EMU_METRICS_TIMEOUT_S, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	char request[1024];
+	size_t len = 0;
+	while (len < sizeof(request) - 1) {
+		ssize_t got = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+		if (got <= 0) {
+			return;
+		}
+		len += got;
+		request[len] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+			break;
+		}
+	}
+	request[len] = '\0';
+
+	char header[256];
+	bool get = !strncmp(request, "GET ", 4);
+	bool metrics = get && (!strncmp(request + 4, "/metrics ", 9) || !strncmp(request + 4, "/metrics?", 9));
+	if (!metrics) {
+		const char *status = get ? "404 Not Found" : "405 Method Not Allowed";
+		int header_len = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Length: 0\r\n"
+				"Connection: close\r\n\r\n", status);
+		emu_metrics_send(fd, header, header_len);
+		return;
+	}
+
+	int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", m->len);
+	if (emu_metrics_send(fd, header, header_len)) {
+		emu_metrics_send(fd, m->text, m->len);
+	}
+}
+
+static inline void *emu_metrics_server(void *arg)
+{
+	struct emu_metrics *m = (struct emu_metrics *)arg;
+
+	emu_metrics_snapshot(m);
+	while (1) {
+		int64_t wait_ms = (m->now_ns + EMU_METRICS_SNAPSHOT_MS * 1000000LL - emu_metrics_real_ns()) / 1000000;
+		struct pollfd p = { m->listenfd, POLLIN, 0 };
+		int ready = wait_ms > 0 ? poll(&p, 1, (int)wait_ms) : 0;
+		if (ready == -1 && errno != EINTR) {
+			break;
+		}
+		if (ready > 0) {
+			int fd = accept(m->listenfd, NULL, NULL);
+			if (fd != -1) {
+				emu_metrics_serve(m, fd);
+				close(fd);
+			}
+		}
+		if (emu_metrics_real_ns() >= m->now_ns + EMU_METRICS_SNAPSHOT_MS * 1000000LL) {
+			emu_metrics_snapshot(m);
+		}
+	}
+
+	close(m->listenfd);
+	m->listenfd = -1;
+
+	return NULL;
+}
+
+// Serves the statistics page on port, for the guest, until the process exits.
+static inline bool emu_metrics_start(int port, const char *guest)
+{
+	struct emu_metrics *m = &emu_metrics;
+	bool success = false;
+
+	snprintf(m->guest, sizeof(m->guest), "%s", guest);
+	m->listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (m->listenfd == -1) {
+		return false;
+	}
+
+	int yes = 1;
+	setsockopt(m->listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(m->listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(m->listenfd, 16) == -1) {
+		goto done;
+	}
+
+	pthread_t id;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	errno = pthread_create(&id, &attr, emu_metrics_server, m);
+	pthread_attr_destroy(&attr);
+	if (errno) {
+		goto done;
+	}
+
+	success = true;
+
+done:
+	if (!success) {
+		int error = errno;
+		close(m->listenfd);
+		m->listenfd = -1;
+		errno = error;
+	}
+
+	return success;
+}
+
+#endif
@@ -0,0 +1,1187 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationRecord.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationRecord.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationRecord.h
+ *
+ * Working:
+ *
+ * The readings captures - ubuntu_readings, /data/accel_readings and the
+ * rest - are recorded in a compact binary format instead of a
+ * "[<sensor>] <ns>ns : <values>" text line per sample.
+ *
+ * A recording is appended to only. It starts with a struct emu_rec_header
+ * naming its sensors, followed by blocks of up to EMU_REC_BLOCK_SAMPLES
+ * samples of one sensor each. A block is a struct emu_rec_block_header and
+ * then its samples column by column -
+ *
+ *	the timestamps, as zigzag varints of the difference from the previous
+ *	one (the first from first_ns),
+ *	then every value column in turn, as varints of the bits of the float
+ *	XORed with the previous value's in the column (the first with 0).
+ *
+ * Consecutive readings of a sensor are close, so their XOR mostly has the
+ * sign, the exponent and the high mantissa bits clear and takes 1-3 bytes,
+ * and a repeated reading takes 1. When the recording is closed, an index
+ * of the blocks (struct emu_rec_index) and a struct emu_rec_footer
+ * pointing to it are appended. A recording that wasn't closed, e.g. of a
+ * process that was killed, is still read, by walking its blocks.
+ *
+ * emu_rec_append() only stores the sample in its sensor's open block,
+ * under a mutex that's held for just that. A writer thread per recording
+ * encodes the full blocks and writes them through a EMU_REC_WRITE_BUFFER
+ * stdio buffer, and writes out the open ones every EMU_REC_SEAL_MS, so at
+ * most that much is lost when the process dies. If the writer falls behind
+ * by more than EMU_REC_MAX_QUEUED blocks, blocks are dropped and counted.
+ *
+ * Alongside, the writer keeps a pyramid of summaries of every sensor in
+ * <recording>.sum - a struct emu_rec_summary, with the minimum, the
+ * maximum and the mean of every value column, per 2^8 of its readings,
+ * per 2^10 of them, and so on up to 2^22 - anything finer is a block or
+ * two of the recording away. Each level is made of four of the one
+ * below, so it costs a few additions per reading, and the summaries take
+ * well under a byte a reading. The summaries are appended as their
+ * readings are written, the unfinished ones as shorter ones when the
+ * recording is closed or the number of columns changes, so hours of a
+ * sensor can be drawn or scanned from a few thousand of them instead of
+ * the readings.
+ *
+ * The values are kept as floats, which is what the HALs parse them into.
+ * The byte order is the host's - x86 and ARM are both little endian.
+ */
+
+#ifndef SENSOR_EMULATION_RECORD_H
+#define SENSOR_EMULATION_RECORD_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SensorEmulationClock.h"
+
+#define EMU_REC_MAGIC "SEMUREC1"
+#define EMU_REC_SUM_MAGIC "SEMUSUM1"
+#define EMU_REC_BLOCK_MAGIC 0x4b4c4253 /* SBLK */
+#define EMU_REC_FOOTER_MAGIC 0x58444e49 /* INDX */
+#define EMU_REC_VERSION 1
+
+#define EMU_REC_MAX_SENSORS 16
+#define EMU_REC_MAX_COLUMNS 8 /* Values per reading. */
+#define EMU_REC_NAME_SIZE 32
+
+#define EMU_REC_BLOCK_SAMPLES 4096
+#define EMU_REC_SEAL_MS 5000
+#define EMU_REC_MAX_QUEUED 64
+#define EMU_REC_WRITE_BUFFER (1 << 20)
+#define EMU_REC_MAX_RECORDINGS 16 /* Closed at exit. */
+
+// At most a 10 byte timestamp and a 5 byte value per column, per sample.
+#define EMU_REC_MAX_BLOCK_BYTES (EMU_REC_BLOCK_SAMPLES * (10 + 5 * EMU_REC_MAX_COLUMNS))
+
+#define EMU_REC_SUM_SUFFIX ".sum"
+#define EMU_REC_SUM_FIRST_LEVEL 8 /* 2^8 readings a summary. */
+#define EMU_REC_SUM_LEVEL_STEP 2 /* Each level 2^2 of the one below. */
+#define EMU_REC_SUM_LEVELS 8 /* Up to 2^22. */
+
+#define EMU_REC_PARSE_DIGITS 15 /* Parsed exactly, in a double. */
+
+struct emu_rec_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_sensors;
+	char names[EMU_REC_MAX_SENSORS][EMU_REC_NAME_SIZE];
+};
+
+struct emu_rec_block_header {
+	uint32_t magic;
+	uint16_t sensor;
+	uint16_t columns;
+	uint32_t samples;
+	uint32_t bytes; /* Of the columns that follow. */
+	int64_t first_ns;
+	int64_t last_ns;
+};
+
+struct emu_rec_index {
+	uint64_t offset; /* Of the block header. */
+	uint16_t sensor;
+	uint16_t columns;
+	uint32_t samples;
+	int64_t first_ns;
+	int64_t last_ns;
+};
+
+struct emu_rec_footer {
+	uint64_t index_offset;
+	uint32_t entries;
+	uint32_t magic;
+};
+
+// Of <recording>.sum, after a struct emu_rec_header with EMU_REC_SUM_MAGIC.
+struct emu_rec_summary {
+	uint16_t sensor;
+	uint8_t level; /* Of 2^level readings - fewer in the last ones. */
+	uint8_t columns;
+	uint32_t samples;
+	int64_t first_ns;
+	int64_t last_ns;
+	float min[EMU_REC_MAX_COLUMNS];
+	float max[EMU_REC_MAX_COLUMNS];
+	float mean[EMU_REC_MAX_COLUMNS];
+};
+
+// A summary being made.
+struct emu_rec_sum_level {
+	uint32_t samples;
+	int columns;
+	int64_t first_ns;
+	int64_t last_ns;
+	float min[EMU_REC_MAX_COLUMNS];
+	float max[EMU_REC_MAX_COLUMNS];
+	double sum[EMU_REC_MAX_COLUMNS];
+};
+
+// One block's samples, as appended and as decoded.
+struct emu_rec_samples {
+	int sensor;
+	int columns;
+	int num;
+	int64_t ns[EMU_REC_BLOCK_SAMPLES];
+	float v[EMU_REC_MAX_COLUMNS][EMU_REC_BLOCK_SAMPLES];
+	struct emu_rec_samples *next;
+};
+
+struct emu_rec {
+	FILE *fp;
+	int num_sensors;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct emu_rec_samples *open[EMU_REC_MAX_SENSORS];
+	struct emu_rec_samples *sealed; /* Oldest first, for the writer. */
+	struct emu_rec_samples *sealed_tail;
+	struct emu_rec_samples *free_blocks;
+	int queued;
+	bool closing; /* From then on, the samples appended are dropped. */
+	int appending; /* The threads in emu_rec_append(). */
+	unsigned long long dropped;
+
+	pthread_t writer;
+
+	/* The writer's. */
+	uint64_t offset;
+	struct emu_rec_index *index;
+	uint32_t entries;
+	uint32_t index_size;
+	unsigned char encoded[sizeof(struct emu_rec_block_header) + EMU_REC_MAX_BLOCK_BYTES];
+	FILE *sum_fp;
+	struct emu_rec_sum_level levels[EMU_REC_MAX_SENSORS][EMU_REC_SUM_LEVELS];
+};
+
+static struct emu_rec *emu_rec_recordings[EMU_REC_MAX_RECORDINGS];
+static pthread_mutex_t emu_rec_recordings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Varints - 7 bits a byte, low first, the top bit set on all but the last. */
+
+static inline unsigned char *emu_rec_put_varint(unsigned char *p, uint64_t u)
+{
+	while (u >= 0x80) {
+		*p++ = (unsigned char)(u | 0x80);
+		u >>= 7;
+	}
+	*p++ = (unsigned char)u;
+
+	return p;
+}
+
+// NULL if the varint runs past end.
+static inline const unsigned char *emu_rec_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *u)
+{
+	uint64_t v = 0;
+	int shift = 0;
+	while (p < end && shift < 64) {
+		unsigned char b = *p++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*u = v;
+			return p;
+		}
+		shift += 7;
+	}
+
+	return NULL;
+}
+
+static inline uint64_t emu_rec_zigzag(int64_t d)
+{
+	return ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+}
+
+static inline int64_t emu_rec_unzigzag(uint64_t u)
+{
+	return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+static inline uint32_t emu_rec_float_bits(float f)
+{
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+
+	return u;
+}
+
+static inline float emu_rec_bits_float(uint32_t u)
+{
+	float f;
+	memcpy(&f, &u, sizeof(f));
+
+	return f;
+}
+
+// Returns the number of bytes of the columns.
+static inline size_t emu_rec_encode(const struct emu_rec_samples *s, unsigned char *out)
+{
+	unsigned char *p = out;
+
+	int64_t prev_ns = s->ns[0];
+	int i = 0;
+	while (i < s->num) {
+		p = emu_rec_put_varint(p, emu_rec_zigzag(s->ns[i] - prev_ns));
+		prev_ns = s->ns[i];
+		i++;
+	}
+
+	int c = 0;
+	while (c < s->columns) {
+		uint32_t prev = 0;
+		i = 0;
+		while (i < s->num) {
+			uint32_t bits = emu_rec_float_bits(s->v[c][i]);
+			p = emu_rec_put_varint(p, bits ^ prev);
+			prev = bits;
+			i++;
+		}
+		c++;
+	}
+
+	return p - out;
+}
+
+/* Writing. */
+
+static inline void emu_rec_init_header(struct emu_rec_header *h, const char **names, int num)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, EMU_REC_MAGIC, sizeof(h->magic));
+	h->version = EMU_REC_VERSION;
+	h->num_sensors = num;
+
+	int i = 0;
+	while (i < num) {
+		snprintf(h->names[i], EMU_REC_NAME_SIZE, "%s", names[i]);
+		i++;
+	}
+}
+
+// Encodes s as a whole block at out, which has room for a block header and
+// EMU_REC_MAX_BLOCK_BYTES. Fills in its index entry e, but for the offset.
+// Returns the size of the block.
+static inline size_t emu_rec_build_block(const struct emu_rec_samples *s, unsigned char *out, struct emu_rec_index *e)
+{
+	struct emu_rec_block_header h;
+	memset(&h, 0, sizeof(h));
+	h.magic = EMU_REC_BLOCK_MAGIC;
+	h.sensor = s->sensor;
+	h.columns = s->columns;
+	h.samples = s->num;
+	h.bytes = emu_rec_encode(s, out + sizeof(h));
+	h.first_ns = s->ns[0];
+	h.last_ns = s->ns[s->num - 1];
+	memcpy(out, &h, sizeof(h));
+
+	memset(e, 0, sizeof(*e));
+	e->sensor = h.sensor;
+	e->columns = h.columns;
+	e->samples = h.samples;
+	e->first_ns = h.first_ns;
+	e->last_ns = h.last_ns;
+
+	return sizeof(h) + h.bytes;
+}
+
+// Appends the index of the blocks and the footer, at index_offset - the end
+// of the blocks.
+static inline bool emu_rec_write_index(FILE *fp, const struct emu_rec_index *index, uint32_t entries, uint64_t index_offset)
+{
+	struct emu_rec_footer f;
+	memset(&f, 0, sizeof(f));
+	f.index_offset = index_offset;
+	f.entries = entries;
+	f.magic = EMU_REC_FOOTER_MAGIC;
+
+	return fwrite(index, sizeof(*index), entries, fp) == entries && fwrite(&f, sizeof(f), 1, fp) == 1;
+}
+
+/* Summaries. */
+
+static inline int emu_rec_sum_level_of(int i)
+{
+	return EMU_REC_SUM_FIRST_LEVEL + i * EMU_REC_SUM_LEVEL_STEP;
+}
+
+// Adds level a to level b, the one above it.
+static inline void emu_rec_sum_fold(struct emu_rec_sum_level *b, const struct emu_rec_sum_level *a)
+{
+	int c = 0;
+	if (!b->samples) {
+		*b = *a;
+		return;
+	}
+	while (c < a->columns) {
+		if (a->min[c] < b->min[c]) {
+			b->min[c] = a->min[c];
+		}
+		if (a->max[c] > b->max[c]) {
+			b->max[c] = a->max[c];
+		}
+		b->sum[c] += a->sum[c];
+		c++;
+	}
+	b->samples += a->samples;
+	b->last_ns = a->last_ns;
+}
+
+// Writes out level i of the sensor, adding it to the one above.
+static inline void emu_rec_sum_write(struct emu_rec *rec, int sensor, int i)
+{
+	struct emu_rec_sum_level *l = &rec->levels[sensor][i];
+	struct emu_rec_summary sum;
+	memset(&sum, 0, sizeof(sum));
+	sum.sensor = sensor;
+	sum.level = emu_rec_sum_level_of(i);
+	sum.columns = l->columns;
+	sum.samples = l->samples;
+	sum.first_ns = l->first_ns;
+	sum.last_ns = l->last_ns;
+	int c = 0;
+	while (c < l->columns) {
+		sum.min[c] = l->min[c];
+		sum.max[c] = l->max[c];
+		sum.mean[c] = l->sum[c] / l->samples;
+		c++;
+	}
+	fwrite(&sum, sizeof(sum), 1, rec->sum_fp);
+
+	if (i + 1 < EMU_REC_SUM_LEVELS) {
+		emu_rec_sum_fold(&rec->levels[sensor][i + 1], l);
+	}
+	l->samples = 0;
+}
+
+// Writes out the unfinished summaries of the sensor.
+static inline void emu_rec_sum_flush(struct emu_rec *rec, int sensor)
+{
+	int i = 0;
+	while (i < EMU_REC_SUM_LEVELS) {
+		if (rec->levels[sensor][i].samples) {
+			emu_rec_sum_write(rec, sensor, i);
+		}
+		i++;
+	}
+}
+
+static inline void emu_rec_sum_add(struct emu_rec *rec, const struct emu_rec_samples *s)
+{
+	struct emu_rec_sum_level *levels = rec->levels[s->sensor];
+
+	// The summaries of the old columns end with them, whichever levels
+	// they're still being made in.
+	int i = 0;
+	while (i < EMU_REC_SUM_LEVELS) {
+		if (levels[i].samples && levels[i].columns != s->columns) {
+			emu_rec_sum_flush(rec, s->sensor);
+			break;
+		}
+		i++;
+	}
+
+	int j = 0;
+	while (j < s->num) {
+		struct emu_rec_sum_level *l = &levels[0];
+		int c = 0;
+		if (!l->samples) {
+			l->columns = s->columns;
+			l->first_ns = s->ns[j];
+			while (c < s->columns) {
+				l->min[c] = l->max[c] = s->v[c][j];
+				l->sum[c] = 0;
+				c++;
+			}
+			c = 0;
+		}
+		while (c < s->columns) {
+			float v = s->v[c][j];
+			if (v < l->min[c]) {
+				l->min[c] = v;
+			}
+			if (v > l->max[c]) {
+				l->max[c] = v;
+			}
+			l->sum[c] += v;
+			c++;
+		}
+		l->last_ns = s->ns[j];
+		l->samples++;
+
+		// Up the pyramid as far as it's full.
+		i = 0;
+		while (i < EMU_REC_SUM_LEVELS && levels[i].samples == 1U << emu_rec_sum_level_of(i)) {
+			emu_rec_sum_write(rec, s->sensor, i);
+			i++;
+		}
+		j++;
+	}
+}
+
+static inline void emu_rec_write_block(struct emu_rec *rec, struct emu_rec_samples *s)
+{
+	if (rec->sum_fp) {
+		emu_rec_sum_add(rec, s);
+	}
+
+	struct emu_rec_index e;
+	size_t size = emu_rec_build_block(s, rec->encoded, &e);
+	if (fwrite(rec->encoded, size, 1, rec->fp) != 1) {
+		return;
+	}
+
+	if (rec->entries == rec->index_size) {
+		uint32_t new_size = rec->index_size ? rec->index_size * 2 : 256;
+		struct emu_rec_index *index = (struct emu_rec_index *)realloc(rec->index, new_size * sizeof(*index));
+		if (!index) {
+			return; // Only the index is lost - the block is in the file.
+		}
+		rec->index = index;
+		rec->index_size = new_size;
+	}
+
+	e.offset = rec->offset;
+	rec->index[rec->entries++] = e;
+
+	rec->offset += size;
+}
+
+// With rec->lock held.
+static inline void emu_rec_seal(struct emu_rec *rec, int sensor)
+{
+	struct emu_rec_samples *s = rec->open[sensor];
+	rec->open[sensor] = NULL;
+
+	if (rec->queued == EMU_REC_MAX_QUEUED) {
+		rec->dropped += s->num;
+		s->next = rec->free_blocks;
+		rec->free_blocks = s;
+		return;
+	}
+
+	s->next = NULL;
+	if (rec->sealed_tail) {
+		rec->sealed_tail->next = s;
+	} else {
+		rec->sealed = s;
+	}
+	rec->sealed_tail = s;
+	rec->queued++;
+
+	pthread_cond_signal(&rec->cond);
+}
+
+static inline void *emu_rec_writer(void *arg)
+{
+	struct emu_rec *rec = (struct emu_rec *)arg;
+	bool closing = false;
+
+	while (!closing) {
+		pthread_mutex_lock(&rec->lock);
+
+		if (!rec->sealed && !rec->closing) {
+			// Not emu_clock_gettime() - the writer isn't part of virtual time.
+			struct timespec t = { 0, 0 };
+			clock_gettime(CLOCK_REALTIME, &t);
+			t.tv_sec += EMU_REC_SEAL_MS / 1000;
+			t.tv_nsec += (EMU_REC_SEAL_MS % 1000) * 1000000L;
+			if (t.tv_nsec >= 1000000000L) {
+				t.tv_sec++;
+				t.tv_nsec -= 1000000000L;
+			}
+
+			if (pthread_cond_timedwait(&rec->cond, &rec->lock, &t) == ETIMEDOUT) {
+				int i = 0;
+				while (i < rec->num_sensors) {
+					if (rec->open[i] && rec->open[i]->num) {
+						emu_rec_seal(rec, i);
+					}
+					i++;
+				}
+			}
+		}
+
+		closing = rec->closing;
+		if (closing) {
+			int i = 0;
+			while (i < rec->num_sensors) {
+				if (rec->open[i] && rec->open[i]->num) {
+					rec->queued = 0; // Nothing is dropped at the end.
+					emu_rec_seal(rec, i);
+				}
+				i++;
+			}
+		}
+
+		struct emu_rec_samples *s = rec->sealed;
+		rec->sealed = rec->sealed_tail = NULL;
+		rec->queued = 0;
+
+		pthread_mutex_unlock(&rec->lock);
+
+		if (!s) {
+			continue;
+		}
+
+		struct emu_rec_samples *last = s;
+		while (1) {
+			emu_rec_write_block(rec, last);
+			if (!last->next) {
+				break;
+			}
+			last = last->next;
+		}
+		fflush(rec->fp);
+		if (rec->sum_fp) {
+			fflush(rec->sum_fp);
+		}
+
+		pthread_mutex_lock(&rec->lock);
+		last->next = rec->free_blocks;
+		rec->free_blocks = s;
+		pthread_mutex_unlock(&rec->lock);
+	}
+
+	return NULL;
+}
+
+// Takes rec off the recordings closed at exit. False if it wasn't there,
+// i.e. it's being closed already.
+static inline bool emu_rec_detach(struct emu_rec *rec)
+{
+	bool detached = false;
+
+	pthread_mutex_lock(&emu_rec_recordings_lock);
+	int i = 0;
+	while (i < EMU_REC_MAX_RECORDINGS) {
+		if (emu_rec_recordings[i] == rec) {
+			emu_rec_recordings[i] = NULL;
+			detached = true;
+		}
+		i++;
+	}
+	pthread_mutex_unlock(&emu_rec_recordings_lock);
+
+	return detached;
+}
+
+// Writes what's left, the index and the footer, and closes the files. The
+// threads still appending find rec closing and drop their samples, so it
+// stays allocated.
+static inline void emu_rec_finish(struct emu_rec *rec)
+{
+	pthread_mutex_lock(&rec->lock);
+	rec->closing = true;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+
+	pthread_join(rec->writer, NULL);
+
+	emu_rec_write_index(rec->fp, rec->index, rec->entries, rec->offset);
+	fclose(rec->fp);
+
+	if (rec->sum_fp) {
+		int i = 0;
+		while (i < rec->num_sensors) {
+			emu_rec_sum_flush(rec, i);
+			i++;
+		}
+		fclose(rec->sum_fp);
+	}
+
+	if (rec->dropped) {
+		fprintf(stderr, "emu_rec: %llu samples dropped - the writer fell behind\n", rec->dropped);
+	}
+}
+
+// Closes rec and frees it, once the threads in emu_rec_append() are out.
+// The caller must have stopped passing rec to it.
+static inline void emu_rec_close(struct emu_rec *rec)
+{
+	if (!rec || !emu_rec_detach(rec)) {
+		return;
+	}
+
+	emu_rec_finish(rec);
+
+	while (__atomic_load_n(&rec->appending, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+
+	while (rec->free_blocks) {
+		struct emu_rec_samples *s = rec->free_blocks;
+		rec->free_blocks = s->next;
+		free(s);
+	}
+	pthread_mutex_destroy(&rec->lock);
+	pthread_cond_destroy(&rec->cond);
+	free(rec->index);
+	free(rec);
+}
+
+// At exit, other threads may still be appending, so the recordings are
+// finished but not freed.
+static inline void emu_rec_close_all(void)
+{
+	int i = 0;
+	while (i < EMU_REC_MAX_RECORDINGS) {
+		pthread_mutex_lock(&emu_rec_recordings_lock);
+		struct emu_rec *rec = emu_rec_recordings[i];
+		emu_rec_recordings[i] = NULL;
+		pthread_mutex_unlock(&emu_rec_recordings_lock);
+
+		if (rec) {
+			emu_rec_finish(rec);
+		}
+		i++;
+	}
+}
+
+static inline void emu_rec_init(void)
+{
+	atexit(emu_rec_close_all);
+}
+
+// Starts a recording of num sensors to path, closed at exit() if not before.
+static inline struct emu_rec *emu_rec_open(const char *path, const char **names, int num)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct emu_rec *rec = NULL;
+	struct emu_rec_header h;
+	char sum_path[PATH_MAX];
+	int i = 0;
+
+	if (num > EMU_REC_MAX_SENSORS) {
+		num = EMU_REC_MAX_SENSORS;
+	}
+
+	rec = (struct emu_rec *)calloc(1, sizeof(*rec));
+	if (!rec) {
+		goto done;
+	}
+
+	rec->fp = fopen(path, "w");
+	if (!rec->fp) {
+		free(rec);
+		rec = NULL;
+		goto done;
+	}
+	setvbuf(rec->fp, NULL, _IOFBF, EMU_REC_WRITE_BUFFER);
+
+	rec->num_sensors = num;
+	pthread_mutex_init(&rec->lock, NULL);
+	pthread_cond_init(&rec->cond, NULL);
+
+	emu_rec_init_header(&h, names, num);
+	fwrite(&h, sizeof(h), 1, rec->fp);
+	fflush(rec->fp);
+	rec->offset = sizeof(h);
+
+	// The recording goes on without its summaries if they can't be written.
+	if (snprintf(sum_path, sizeof(sum_path), "%s" EMU_REC_SUM_SUFFIX, path) < (int)sizeof(sum_path)) {
+		rec->sum_fp = fopen(sum_path, "w");
+	}
+	if (rec->sum_fp) {
+		memcpy(h.magic, EMU_REC_SUM_MAGIC, sizeof(h.magic));
+		fwrite(&h, sizeof(h), 1, rec->sum_fp);
+		fflush(rec->sum_fp);
+	}
+
+	if (pthread_create(&rec->writer, NULL, emu_rec_writer, rec)) {
+		if (rec->sum_fp) {
+			fclose(rec->sum_fp);
+		}
+		fclose(rec->fp);
+		free(rec);
+		rec = NULL;
+		goto done;
+	}
+
+	pthread_once(&once, emu_rec_init);
+	pthread_mutex_lock(&emu_rec_recordings_lock);
+	i = 0;
+	while (i < EMU_REC_MAX_RECORDINGS) {
+		if (!emu_rec_recordings[i]) {
+			emu_rec_recordings[i] = rec;
+			break;
+		}
+		i++;
+	}
+	pthread_mutex_unlock(&emu_rec_recordings_lock);
+
+done:
+	return rec;
+}
+
+// With rec->lock held.
+static inline void emu_rec_store(struct emu_rec *rec, int sensor, int64_t ns, const float *v, int columns)
+{
+	struct emu_rec_samples *s = rec->open[sensor];
+	if (s && s->columns != columns) {
+		emu_rec_seal(rec, sensor);
+		s = NULL;
+	}
+
+	if (!s) {
+		s = rec->free_blocks;
+		if (s) {
+			rec->free_blocks = s->next;
+		} else {
+			s = (struct emu_rec_samples *)malloc(sizeof(*s));
+			if (!s) {
+				rec->dropped++;
+				return;
+			}
+		}
+		s->sensor = sensor;
+		s->columns = columns;
+		s->num = 0;
+		rec->open[sensor] = s;
+	}
+
+	s->ns[s->num] = ns;
+	int c = 0;
+	while (c < columns) {
+		s->v[c][s->num] = v[c];
+		c++;
+	}
+	s->num++;
+
+	if (s->num == EMU_REC_BLOCK_SAMPLES) {
+		emu_rec_seal(rec, sensor);
+	}
+}
+
+static inline void emu_rec_append(struct emu_rec *rec, int sensor, int64_t ns, const float *v, int columns)
+{
+	if (!rec || sensor < 0 || sensor >= rec->num_sensors) {
+		return;
+	}
+	if (columns > EMU_REC_MAX_COLUMNS) {
+		columns = EMU_REC_MAX_COLUMNS;
+	}
+
+	__atomic_add_fetch(&rec->appending, 1, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&rec->lock);
+	if (!rec->closing) {
+		emu_rec_store(rec, sensor, ns, v, columns);
+	}
+	pthread_mutex_unlock(&rec->lock);
+	__atomic_sub_fetch(&rec->appending, 1, __ATOMIC_RELEASE);
+}
+
+// For the "<value>|<value>|..." text of the frames.
+static inline void emu_rec_append_text(struct emu_rec *rec, int sensor, int64_t ns, const char *readings)
+{
+	float v[EMU_REC_MAX_COLUMNS];
+	int columns = 0;
+
+	const char *p = readings;
+	while (columns < EMU_REC_MAX_COLUMNS) {
+		char *end = NULL;
+		v[columns] = strtof(p, &end);
+		if (end == p) {
+			break;
+		}
+		columns++;
+		if (*end != '|') {
+			break;
+		}
+		p = end + 1;
+	}
+
+	emu_rec_append(rec, sensor, ns, v, columns);
+}
+
+static inline int64_t emu_rec_now(void)
+{
+	struct timespec t = { 0, 0 };
+	emu_clock_gettime(CLOCK_REALTIME, &t);
+
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// Records a frame's text, if any, with the time now.
+#define EMU_REC_READING(rec, sensor, readings) do {\
+				if ((rec) && (readings)[0]) {\
+					emu_rec_append_text(rec, sensor, emu_rec_now(), readings);\
+				}\
+			} while(0)
+
+/* Text readings logs. */
+
+// Parses the value at p, up to end, into v - "%f" and "%.9g" output have
+// no more than EMU_REC_PARSE_DIGITS digits and small exponents, which a
+// double holds exactly, so one multiplication or division rounds it.
+// Anything else - more digits, inf, nan - is left to strtof(). Returns
+// where the value ends, or p if there's none.
+static inline const char *emu_rec_parse_float(const char *p, const char *end, float *v)
+{
+	static const double pow10_table[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+
+	const char *q = p;
+	bool negative = false;
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exp10 = 0;
+	bool any = false;
+	double d = 0;
+	char text[64];
+	size_t len = 0;
+	char *stop = NULL;
+
+	if (q < end && (*q == '-' || *q == '+')) {
+		negative = *q == '-';
+		q++;
+	}
+
+	while (q < end && *q >= '0' && *q <= '9') {
+		if (mantissa || *q != '0') {
+			mantissa = mantissa * 10 + (*q - '0');
+			digits++;
+		}
+		any = true;
+		q++;
+	}
+	if (q < end && *q == '.') {
+		q++;
+		while (q < end && *q >= '0' && *q <= '9') {
+			if (mantissa || *q != '0') {
+				mantissa = mantissa * 10 + (*q - '0');
+				digits++;
+			}
+			exp10--;
+			any = true;
+			q++;
+		}
+	}
+	if (!any) {
+		goto slow;
+	}
+	if (q < end && (*q == 'e' || *q == 'E')) {
+		const char *e = q + 1;
+		bool negative_exp = false;
+		if (e < end && (*e == '-' || *e == '+')) {
+			negative_exp = *e == '-';
+			e++;
+		}
+		int exp = 0;
+		bool exp_digits = false;
+		while (e < end && *e >= '0' && *e <= '9' && exp < 1000) {
+			exp = exp * 10 + (*e - '0');
+			exp_digits = true;
+			e++;
+		}
+		if (!exp_digits || (e < end && *e >= '0' && *e <= '9')) {
+			goto slow;
+		}
+		exp10 += negative_exp ? -exp : exp;
+		q = e;
+	}
+	if (digits > EMU_REC_PARSE_DIGITS || exp10 < -22 || exp10 > 22) {
+		goto slow;
+	}
+
+	d = (double)mantissa;
+	d = exp10 < 0 ? d / pow10_table[-exp10] : d * pow10_table[exp10];
+	*v = (float)(negative ? -d : d);
+	return q;
+
+slow:
+	len = end - p < (ptrdiff_t)sizeof(text) - 1 ? (size_t)(end - p) : sizeof(text) - 1;
+	memcpy(text, p, len);
+	text[len] = '\0';
+	*v = strtof(text, &stop);
+	return p + (stop - text);
+}
+
+// Parses a "[<sensor>] <ns>ns : <value>|<value>|..." line of a text
+// readings log, up to eol. The name isn't NUL terminated. False if it's not
+// a reading with at least a value.
+static inline bool emu_rec_parse_line(const char *p, const char *eol, const char **name, size_t *len,
+					int64_t *ns, float *v, int *columns)
+{
+	if (eol > p && eol[-1] == '\r') {
+		eol--;
+	}
+	const char *close = p < eol && *p == '[' ? (const char *)memchr(p, ']', eol - p) : NULL;
+	if (!close) {
+		return false;
+	}
+	*name = p + 1;
+	*len = close - p - 1;
+
+	const char *q = close + 1;
+	while (q < eol && *q == ' ') {
+		q++;
+	}
+	bool digits = false;
+	*ns = 0;
+	while (q < eol && *q >= '0' && *q <= '9') {
+		*ns = *ns * 10 + (*q - '0');
+		digits = true;
+		q++;
+	}
+	if (!digits || q + 4 > eol || memcmp(q, "ns :", 4)) {
+		return false;
+	}
+	q += 4;
+	while (q < eol && *q == ' ') {
+		q++;
+	}
+
+	*columns = 0;
+	while (*columns < EMU_REC_MAX_COLUMNS) {
+		const char *end = emu_rec_parse_float(q, eol, &v[*columns]);
+		if (end == q) {
+			break;
+		}
+		(*columns)++;
+		if (end == eol || *end != '|') {
+			break;
+		}
+		q = end + 1;
+	}
+
+	return *columns > 0;
+}
+
+/* Reading. */
+
+struct emu_rec_reader {
+	const unsigned char *map;
+	size_t size;
+	struct emu_rec_header header;
+	struct emu_rec_index *index;
+	uint32_t entries;
+	bool closed; /* Had its footer. */
+};
+
+// Walks the blocks of a recording that has no footer, up to a torn one.
+static inline bool emu_rec_scan(struct emu_rec_reader *r)
+{
+	uint64_t offset = sizeof(struct emu_rec_header);
+	uint32_t size = 0;
+
+	while (offset + sizeof(struct emu_rec_block_header) <= r->size) {
+		struct emu_rec_block_header h;
+		memcpy(&h, r->map + offset, sizeof(h));
+		if (h.magic != EMU_REC_BLOCK_MAGIC || offset + sizeof(h) + h.bytes > r->size) {
+			break;
+		}
+
+		if (r->entries == size) {
+			size = size ? size * 2 : 256;
+			struct emu_rec_index *index = (struct emu_rec_index *)realloc(r->index, size * sizeof(*index));
+			if (!index) {
+				return false;
+			}
+			r->index = index;
+		}
+
+		struct emu_rec_index *e = &r->index[r->entries++];
+		memset(e, 0, sizeof(*e));
+		e->offset = offset;
+		e->sensor = h.sensor;
+		e->columns = h.columns;
+		e->samples = h.samples;
+		e->first_ns = h.first_ns;
+		e->last_ns = h.last_ns;
+
+		offset += sizeof(h) + h.bytes;
+	}
+
+	return true;
+}
+
+static inline void emu_rec_unmap(struct emu_rec_reader *r)
+{
+	if (r->map) {
+		munmap((void *)r->map, r->size);
+	}
+	free(r->index);
+	memset(r, 0, sizeof(*r));
+}
+
+// Maps the recording at path and loads its index. errno is EINVAL if it isn't one.
+static inline bool emu_rec_map(struct emu_rec_reader *r, const char *path)
+{
+	bool success = false;
+	struct stat st;
+	struct emu_rec_footer f;
+	void *map = MAP_FAILED;
+	memset(r, 0, sizeof(*r));
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		goto done;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		goto done;
+	}
+	if ((size_t)st.st_size < sizeof(struct emu_rec_header)) {
+		errno = EINVAL;
+		goto done;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		goto done;
+	}
+	r->map = (const unsigned char *)map;
+	r->size = st.st_size;
+
+	memcpy(&r->header, r->map, sizeof(r->header));
+	if (memcmp(r->header.magic, EMU_REC_MAGIC, sizeof(r->header.magic)) ||
+		r->header.version != EMU_REC_VERSION || r->header.num_sensors > EMU_REC_MAX_SENSORS) {
+		errno = EINVAL;
+		goto done;
+	}
+
+	memset(&f, 0, sizeof(f));
+	if (r->size >= sizeof(r->header) + sizeof(f)) {
+		memcpy(&f, r->map + r->size - sizeof(f), sizeof(f));
+	}
+	if (f.magic == EMU_REC_FOOTER_MAGIC &&
+		f.index_offset + (uint64_t)f.entries * sizeof(struct emu_rec_index) + sizeof(f) == r->size) {
+		r->index = (struct emu_rec_index *)malloc(f.entries * sizeof(struct emu_rec_index) + 1);
+		if (!r->index) {
+			goto done;
+		}
+		memcpy(r->index, r->map + f.index_offset, f.entries * sizeof(struct emu_rec_index));
+		r->entries = f.entries;
+		r->closed = true;
+	} else if (!emu_rec_scan(r)) {
+		goto done;
+	}
+
+	success = true;
+
+done:
+	if (fd != -1) {
+		close(fd);
+	}
+	if (!success) {
+		int e = errno;
+		emu_rec_unmap(r);
+		errno = e;
+	}
+
+	return success;
+}
+
+// Decodes block i of the index into s. False if it's corrupt.
+static inline bool emu_rec_decode(const struct emu_rec_reader *r, uint32_t i, struct emu_rec_samples *s)
+{
+	if (i >= r->entries) {
+		return false;
+	}
+
+	const struct emu_rec_index *e = &r->index[i];
+	struct emu_rec_block_header h;
+	if (e->offset + sizeof(h) > r->size) {
+		return false;
+	}
+	memcpy(&h, r->map + e->offset, sizeof(h));
+	if (h.magic != EMU_REC_BLOCK_MAGIC || h.samples > EMU_REC_BLOCK_SAMPLES || !h.samples ||
+		h.columns > EMU_REC_MAX_COLUMNS || e->offset + sizeof(h) + h.bytes > r->size) {
+		return false;
+	}
+
+	const unsigned char *p = r->map + e->offset + sizeof(h);
+	const unsigned char *end = p + h.bytes;
+
+	s->sensor = h.sensor;
+	s->columns = h.columns;
+	s->num = h.samples;
+
+	int64_t ns = h.first_ns;
+	int j = 0;
+	while (j < s->num) {
+		uint64_t u = 0;
+		p = emu_rec_get_varint(p, end, &u);
+		if (!p) {
+			return false;
+		}
+		ns += emu_rec_unzigzag(u);
+		s->ns[j] = ns;
+		j++;
+	}
+
+	int c = 0;
+	while (c < s->columns) {
+		uint32_t prev = 0;
+		j = 0;
+		while (j < s->num) {
+			uint64_t u = 0;
+			p = emu_rec_get_varint(p, end, &u);
+			if (!p) {
+				return false;
+			}
+			prev ^= (uint32_t)u;
+			s->v[c][j] = emu_rec_bits_float(prev);
+			j++;
+		}
+		c++;
+	}
+
+	return true;
+}
+
+#endif /* SENSOR_EMULATION_RECORD_H */
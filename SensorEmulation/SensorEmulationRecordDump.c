@@ -0,0 +1,287 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationRecordDump.c is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationRecordDump.c is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationRecordDump.c
+ *
+ * Working:
+ *
+ * Prints a binary recording (see SensorEmulationRecord.h) as the text
+ * readings logs used to be -
+ *
+ *	[<sensor>] <ns>ns : <value>|<value>|...
+ *
+ * in time order across all of its sensors, or only those of one sensor
+ * with -s. With -i, it prints the blocks of the recording instead - their
+ * sensor, number of samples, time span and size - and the totals. With
+ * -l <level>, it prints the summaries of 2^level readings from
+ * <recording>.sum instead -
+ *
+ *	[<sensor>] <first ns>ns - <last ns>ns <n> : <min>|... <max>|... <mean>|...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "SensorEmulationRecord.h"
+
+#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+
+// Where a sensor is at in its blocks, while merging them by time.
+struct cursor {
+	uint32_t block; /* Next in the index to decode. */
+	int next; /* In samples. */
+	struct emu_rec_samples *samples;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-i] [-l level] [-s sensor] recording\n", prog);
+}
+
+static int sensor_of(const struct emu_rec_reader *r, const char *name)
+{
+	int i = 0;
+	while (i < (int)r->header.num_sensors) {
+		if (!strcmp(r->header.names[i], name)) {
+			return i;
+		}
+		i++;
+	}
+
+	return -1;
+}
+
+static void print_index(const struct emu_rec_reader *r)
+{
+	unsigned long long samples = 0;
+
+	uint32_t i = 0;
+	while (i < r->entries) {
+		const struct emu_rec_index *e = &r->index[i];
+		uint64_t end = i + 1 < r->entries ? r->index[i + 1].offset : r->size;
+		printf("%8llu %-20s %5u samples %lluns - %lluns %llu bytes\n", (unsigned long long)e->offset,
+				e->sensor < r->header.num_sensors ? r->header.names[e->sensor] : "?", e->samples,
+				(unsigned long long)e->first_ns, (unsigned long long)e->last_ns,
+				(unsigned long long)(end - e->offset));
+		samples += e->samples;
+		i++;
+	}
+
+	printf("%u blocks, %llu samples, %zu bytes (%.1f bytes/sample)%s\n", r->entries, samples, r->size,
+			samples ? (double)r->size / samples : 0.0, r->closed ? "" : ", not closed");
+}
+
+// Decodes the next block of the cursor's sensor. False when there's none.
+static bool advance(const struct emu_rec_reader *r, int sensor, struct cursor *c)
+{
+	while (c->block < r->entries) {
+		uint32_t i = c->block++;
+		if (r->index[i].sensor != sensor) {
+			continue;
+		}
+		if (!emu_rec_decode(r, i, c->samples)) {
+			ERR("Block at %llu is corrupt\n", (unsigned long long)r->index[i].offset);
+			continue;
+		}
+		c->next = 0;
+		return true;
+	}
+
+	return false;
+}
+
+static void print_sample(const struct emu_rec_reader *r, const struct emu_rec_samples *s, int i)
+{
+	printf("[%s] %lluns : ", r->header.names[s->sensor], (unsigned long long)s->ns[i]);
+
+	int c = 0;
+	while (c < s->columns) {
+		printf(c ? "|%.9g" : "%.9g", s->v[c][i]);
+		c++;
+	}
+	printf("\n");
+}
+
+static bool print_samples(const struct emu_rec_reader *r, int only)
+{
+	bool success = false;
+	int num = r->header.num_sensors;
+	struct cursor cursors[EMU_REC_MAX_SENSORS];
+	memset(cursors, 0, sizeof(cursors));
+
+	int n = 0;
+	while (n < num) {
+		cursors[n].samples = (struct emu_rec_samples *)malloc(sizeof(struct emu_rec_samples));
+		if (!cursors[n].samples) {
+			ERR("malloc - %s\n", strerror(errno));
+			goto done;
+		}
+		if (only != -1 && n != only) {
+			cursors[n].block = r->entries; // Nothing to print.
+		}
+		if (!advance(r, n, &cursors[n])) {
+			cursors[n].samples->num = 0;
+		}
+		n++;
+	}
+
+	while (1) {
+		int earliest = -1;
+		n = 0;
+		while (n < num) {
+			const struct cursor *c = &cursors[n];
+			if (c->next < c->samples->num) {
+				if (earliest == -1 ||
+					c->samples->ns[c->next] < cursors[earliest].samples->ns[cursors[earliest].next]) {
+					earliest = n;
+				}
+			}
+			n++;
+		}
+		if (earliest == -1) {
+			break;
+		}
+
+		struct cursor *c = &cursors[earliest];
+		print_sample(r, c->samples, c->next);
+		c->next++;
+		if (c->next == c->samples->num && !advance(r, earliest, c)) {
+			c->samples->num = 0;
+		}
+	}
+
+	success = true;
+
+done:
+	n = 0;
+	while (n < num) {
+		free(cursors[n].samples);
+		n++;
+	}
+
+	return success;
+}
+
+static void print_values(const float *v, int columns)
+{
+	int c = 0;
+	while (c < columns) {
+		printf(c ? "|%.9g" : " %.9g", v[c]);
+		c++;
+	}
+}
+
+static bool print_summaries(const struct emu_rec_reader *r, const char *path, int level, int only)
+{
+	char sum_path[PATH_MAX];
+	snprintf(sum_path, sizeof(sum_path), "%s" EMU_REC_SUM_SUFFIX, path);
+	FILE *fp = fopen(sum_path, "r");
+	if (!fp) {
+		ERR("%s - %s\n", sum_path, strerror(errno));
+		return false;
+	}
+
+	struct emu_rec_header h;
+	if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, EMU_REC_SUM_MAGIC, sizeof(h.magic))) {
+		ERR("%s - Not summaries\n", sum_path);
+		fclose(fp);
+		return false;
+	}
+
+	struct emu_rec_summary sum;
+	while (fread(&sum, sizeof(sum), 1, fp) == 1) {
+		if (sum.level != level || (only != -1 && sum.sensor != only) || sum.sensor >= r->header.num_sensors ||
+			sum.columns > EMU_REC_MAX_COLUMNS) {
+			continue;
+		}
+		printf("[%s] %lluns - %lluns %u :", r->header.names[sum.sensor], (unsigned long long)sum.first_ns,
+				(unsigned long long)sum.last_ns, sum.samples);
+		print_values(sum.min, sum.columns);
+		print_values(sum.max, sum.columns);
+		print_values(sum.mean, sum.columns);
+		printf("\n");
+	}
+	fclose(fp);
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	bool index = false;
+	int level = -1;
+	const char *sensor = NULL;
+
+	int opt = -1;
+	while ((opt = getopt(argc, argv, "il:s:h")) != -1) {
+		switch (opt) {
+			case 'i':
+				index = true;
+				break;
+			case 'l':
+				level = atoi(optarg);
+				break;
+			case 's':
+				sensor = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct emu_rec_reader r;
+	if (!emu_rec_map(&r, argv[optind])) {
+		ERR("%s - %s\n", argv[optind], errno == EINVAL ? "Not a recording" : strerror(errno));
+		return 1;
+	}
+
+	int only = -1;
+	if (sensor) {
+		only = sensor_of(&r, sensor);
+		if (only == -1) {
+			ERR("No %s in %s\n", sensor, argv[optind]);
+			emu_rec_unmap(&r);
+			return 1;
+		}
+	}
+
+	bool success = true;
+	if (index) {
+		print_index(&r);
+	} else if (level != -1) {
+		success = print_summaries(&r, argv[optind], level, only);
+	} else {
+		success = print_samples(&r, only);
+	}
+
+	emu_rec_unmap(&r);
+
+	return success ? 0 : 1;
+}
@@ -28,39 +28,66 @@
  *
  * Simple socket-communication server providing any connected client
  * with randomly generated sensor readings in a pre-defined pattern.
+ *
+ * When started with -L, it instead works as a load generator simulating
+ * a fleet of virtual devices, whose streams are served to the relays that
+ * connect to it. See load_generator() below.
+ *
+ * When started with -R, it serves the readings of a captured session
+ * instead of generated ones. See replay_stream() below.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h> 
+#include <math.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <setjmp.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sched.h>
 
 #include <pthread.h>
+#include "SensorEmulationClock.h"
+#include "SensorEmulationTrace.h"
+#include "SensorEmulationLog.h"
+#include "SensorEmulationReplay.h"
+#include "SensorEmulationStats.h"
 
 #define DEBUG
 
 #ifdef DEBUG
 
-#define LOG(...) (void)(printf("%s %d: ", __func__, __LINE__) && printf(__VA_ARGS__) && fflush(stdout))
-#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+#define LOG(...) EMU_LOG(stdout, __VA_ARGS__)
+#define ERR(...) EMU_ERR(stderr, __VA_ARGS__)
 
-#define LOG_SERVER(...) (void)(printf("[%s] ", sensors_name[n]), LOG(__VA_ARGS__))
-#define ERR_SERVER(...) (void)(fprintf(stderr, "[%s] ", sensors_name[n]), ERR(__VA_ARGS__))
+// LOG1_SERVER is for the lines on the path of every reading.
+#define LOG_SERVER(...) EMU_LOG_TAG(stdout, sensors_name[n], __VA_ARGS__)
+#define LOG1_SERVER(...) EMU_DEBUG_TAG(stdout, sensors_name[n], __VA_ARGS__)
+#define ERR_SERVER(...) EMU_ERR_TAG(stderr, sensors_name[n], __VA_ARGS__)
 
 #else
 
 #define LOG(...)
 #define ERR(...)
 
-#define LOG_SERVER
-#define ERR_SERVER
+#define LOG_SERVER(...)
+#define LOG1_SERVER(...)
+#define ERR_SERVER(...)
 
 #endif
 
@@ -86,6 +113,11 @@
 #define BASE_PORT 5010
 #define SERVER_PORT(num) (BASE_PORT + num)
 
+#define NS_PER_SEC 1000000000ULL
+
+#define TRANSPORT_CONF_FILE "./transport.conf"
+#define LOG_CONF_FILE "./log.conf"
+
 enum sensors { EAccel = 0, EMagnetic = 1, ELight = 2, EProximity = 3, EGyro = 4, EOrient = 5,
 		ECorrectedGyro = 6, EGravity = 7, ELinearAccel = 8, ERotationVector = 9, };
 static const char *sensors_name[NUM_SENSORS] = {
@@ -138,7 +170,7 @@ static void cleanup(void)
 	i = 0;
 	while (i < NUM_SENSORS) {
 		if (connfd[i] != -1) {
-			close(connfd[i]);
+			emu_close(connfd[i]);
 			connfd[i] = -1;
 		}
 		i++;
@@ -188,10 +220,704 @@ static void sigpipe_handler(int sig)
 	}
 }
 
+static size_t readings_size_of(int n)
+{
+	return n == EAccel ? ACCEL_READINGS_BUF_SIZE + 1 :
+		n == EGyro ? GYRO_READINGS_BUF_SIZE + 1 :
+				READINGS_BUF_SIZE + 1;
+}
+
+// Pretty simple logic for the sensors' fake readings. Customize as you need!
+// The caller owns the seed so that every thread can generate independently.
+static bool generate_pattern_readings(int n, char *gen_readings, unsigned int *seed)
+{
+	bool valid = true;
+
+	switch (n) {
+		case EAccel:
+		{
+			int sign = rand_r(seed) % 2 ? 1 : -1;
+			float x = rand_r(seed) % ACCEL_MAX * EARTH_GRAVITY * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;	
+			float y = rand_r(seed) % ACCEL_MAX * EARTH_GRAVITY * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;
+			float z = rand_r(seed) % ACCEL_MAX * EARTH_GRAVITY * sign;
+			sprintf(gen_readings, "%.9f|%.9f|%.9f", x, y, z);
+
+			break;
+		}
+		case EMagnetic:
+		{
+			int sign = rand_r(seed) % 2 ? 1 : -1;
+			float x = rand_r(seed) % MAGNET_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;	
+			float y = rand_r(seed) % MAGNET_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;
+			float z = rand_r(seed) % MAGNET_MAX * SOME_CONSTANT_FACTOR * sign;
+			sprintf(gen_readings, "%f|%f|%f", x, y, z);
+					
+			break;
+		}
+		case ELight:
+		{
+			float l = rand_r(seed) % LIGHT_MAX;
+			sprintf(gen_readings, "%f", l);
+
+			break;
+		}
+		case EProximity:
+		{
+			float p = rand_r(seed) % PROX_MAX;
+			sprintf(gen_readings, "%f", p);
+
+			break;
+		}
+		case EGyro:
+		{
+			int sign = rand_r(seed) % 2 ? 1 : -1;
+			float azimuth = rand_r(seed) % GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;	
+			float pitch = rand_r(seed) % GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;
+			float roll = rand_r(seed) % GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
+			sprintf(gen_readings, "%.9f|%.9f|%.9f", azimuth, pitch, roll);
+			
+			break;
+		}
+		case EOrient:
+		{
+			int sign = rand_r(seed) % 2 ? 1 : -1;
+			float azimuth = rand_r(seed) % ORIENT_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;	
+			float pitch = rand_r(seed) % ORIENT_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;
+			float roll = rand_r(seed) % ORIENT_MAX * SOME_CONSTANT_FACTOR * sign;
+			int status = 3; // SENSOR_STATUS_ACCURACY_HIGH!
+			sprintf(gen_readings, "%f|%f|%f|%d", azimuth, pitch, roll, status);
+			
+			break;
+		}
+		case ECorrectedGyro:
+		{
+			int sign = rand_r(seed) % 2 ? 1 : -1;
+			float azimuth = rand_r(seed) % CORRECTED_GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;	
+			float pitch = rand_r(seed) % CORRECTED_GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;
+			float roll = rand_r(seed) % CORRECTED_GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
+			sprintf(gen_readings, "%f|%f|%f", azimuth, pitch, roll);
+
+			break;
+		}
+		case EGravity:
+		{
+			int sign = rand_r(seed) % 2 ? 1 : -1;
+			float lateral = rand_r(seed) % GRAVITY_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;	
+			float longitudinal = rand_r(seed) % GRAVITY_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;
+			float vertical = rand_r(seed) % GRAVITY_MAX * SOME_CONSTANT_FACTOR * sign;
+			sprintf(gen_readings, "%f|%f|%f", lateral, longitudinal, vertical);
+			
+			break;
+		}
+		case ELinearAccel:
+		{
+			int sign = rand_r(seed) % 2 ? 1 : -1;
+			float lateral = rand_r(seed) % LINEAR_ACCEL_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;	
+			float longitudinal = rand_r(seed) % LINEAR_ACCEL_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;
+			float vertical = rand_r(seed) % LINEAR_ACCEL_MAX * SOME_CONSTANT_FACTOR * sign;
+			sprintf(gen_readings, "%f|%f|%f", lateral, longitudinal, vertical);
+			
+			break;
+		}
+		case ERotationVector:
+		{
+			int sign = rand_r(seed) % 2 ? 1 : -1;
+			float d1 = rand_r(seed) % ROTATION_VECTOR_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;	
+			float d2 = rand_r(seed) % ROTATION_VECTOR_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;
+			float d3 = rand_r(seed) % ROTATION_VECTOR_MAX * SOME_CONSTANT_FACTOR * sign;
+			sign = rand_r(seed) % 2 ? 1 : -1;
+			float d4 = rand_r(seed) % ROTATION_VECTOR_MAX * SOME_CONSTANT_FACTOR * sign;
+			sprintf(gen_readings, "%f|%f|%f|%f", d1, d2, d3, d4);
+
+			break;
+		}
+		default:
+		{
+			valid = false;
+			LOG("Unknown sensor - number : %d\n", n);
+			break;
+		}
+	}
+
+	return valid;
+}
+
+/*
+ * Sensor models.
+ *
+ * Instead of the integer multiples of the pattern above, each sensor's
+ * readings are a smooth baseline (the device lying on a desk, slowly
+ * rocking about its y axis) run through a noise stage that adds white
+ * noise and a random-walk bias, and then quantizes to the resolution and
+ * clamps to the maxRange that the HAL declares for the sensor.
+ *
+ * The noise stage works on blocks of NOISE_BLOCK samples per axis with
+ * 4-wide vectors - SSE on x86, NEON on ARM. The white noise is the sum of
+ * 4 uniforms (Irwin-Hall), so it's a Gaussian truncated at ~3.5 sigma.
+ *
+ * Per sensor, the sigmas can be changed or the model turned off (back to
+ * the pattern) in NOISE_MODEL_CONF_FILE with lines like:
+ *
+ *	Accelerometer 0.02 0.0001
+ *	Light off
+ */
+
+#define NOISE_MODEL_CONF_FILE "./noise_model.conf"
+
+#define NOISE_BLOCK 64 /* Samples per axis. Multiple of 4. */
+
+// In virtual time, runs have to be repeatable, so the seeds are fixed.
+#ifdef VIRTUAL_TIME
+#define READING_STREAM_SEED(n) (0x5eed0000U + (n))
+#else
+#define READING_STREAM_SEED(n) (time(NULL) + (n))
+#endif
+#define MAX_AXES 4
+
+#define TILT_AMPLITUDE 0.2f /* rad */
+#define TILT_FREQUENCY 0.1f /* Hz */
+
+// Same as the sensor_list in hardware/libsensors_emu/sensors_emu.c and the
+// getSensor() notes in frameworks/native/service/sensorservice_emu.
+#define RANGE_A (2 * EARTH_GRAVITY)
+#define CONVERT_A (EARTH_GRAVITY / 64.0f / 8.0f)
+#define CONVERT_M (1.0f / 16.0f)
+#define RANGE_GYRO (2000.0f * (float)M_PI / 180.0f)
+#define CONVERT_GYRO ((70.0f / 1000.0f) * ((float)M_PI / 180.0f))
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef uint32_t v4su __attribute__((vector_size(16)));
+
+struct sensor_model {
+	bool enabled;
+	int axes; /* Noised axes. */
+	float max_range; /* 0 for unbounded. */
+	float resolution; /* 0 for not quantized. */
+	bool unipolar; /* Never negative - light, proximity. */
+	int period_us; /* minDelay, paces the baseline. */
+	float white_sigma; /* Per sample. */
+	float bias_walk_sigma; /* Per sample step. */
+};
+
+static struct sensor_model sensor_models[NUM_SENSORS] = {
+	[EAccel] = { true, 3, RANGE_A, CONVERT_A, false, 20000, 0.02f, 0.0001f, },
+	[EMagnetic] = { true, 3, 2000.0f, CONVERT_M, false, 16667, 0.3f, 0.005f, },
+	[ELight] = { true, 1, 0.0f, 1.0f, true, 200000, 2.0f, 0.01f, },
+	[EProximity] = { true, 1, 5.0f, 5.0f, true, 200000, 0.0f, 0.0f, },
+	[EGyro] = { true, 3, RANGE_GYRO, CONVERT_GYRO, false, 1190, 0.002f, 0.00001f, },
+	[EOrient] = { true, 3, 360.0f, 1.0f / 256.0f, false, 20000, 0.2f, 0.001f, },
+	[ECorrectedGyro] = { true, 3, RANGE_GYRO, CONVERT_GYRO, false, 1190, 0.001f, 0.0f, },
+	[EGravity] = { true, 3, RANGE_A, 0.01954f, false, 20000, 0.005f, 0.0f, },
+	[ELinearAccel] = { true, 3, RANGE_A, CONVERT_A, false, 20000, 0.02f, 0.0001f, },
+	[ERotationVector] = { true, 4, 1.0f, 1.0f / (1 << 24), false, 20000, 0.0005f, 0.0f, },
+};
+
+struct noise_stream {
+	v4su rng; /* 4 xorshift32 lanes. */
+	float bias[MAX_AXES];
+	uint64_t sample; /* Of the next block. */
+	int next; /* In the current block. */
+	float block[MAX_AXES][NOISE_BLOCK] __attribute__((aligned(16)));
+};
+
+// Everything a thread needs to generate one sensor's readings.
+struct reading_stream {
+	unsigned int seed;
+	struct noise_stream noise;
+};
+
+static void init_reading_stream(struct reading_stream *rs, unsigned int seed)
+{
+	memset(rs, 0, sizeof(*rs));
+	rs->seed = seed;
+
+	int i = 0;
+	while (i < 4) {
+		rs->noise.rng[i] = rand_r(&rs->seed) | 1; // xorshift can't start from 0.
+		i++;
+	}
+	rs->noise.next = NOISE_BLOCK;
+}
+
+static void load_noise_models(void)
+{
+	FILE *conf_fp = fopen(NOISE_MODEL_CONF_FILE, "r");
+	if (!conf_fp) {
+		LOG("No %s. Using the default sensor models.\n", NOISE_MODEL_CONF_FILE);
+		return;
+	}
+
+	char line[256] = "";
+	while (fgets(line, sizeof(line), conf_fp)) {
+		char name[64] = "";
+		char first[32] = "";
+		float walk = 0.0f;
+		int fields = sscanf(line, "%63s %31s %f", name, first, &walk);
+		if (fields < 2 || name[0] == '#') {
+			continue;
+		}
+
+		int n = 0;
+		while (n < NUM_SENSORS && strcmp(name, sensors_name[n])) {
+			n++;
+		}
+		if (n == NUM_SENSORS) {
+			ERR("%s - Unknown sensor %s\n", NOISE_MODEL_CONF_FILE, name);
+			continue;
+		}
+
+		if (!strcmp(first, "off")) {
+			sensor_models[n].enabled = false;
+		} else {
+			sensor_models[n].enabled = true;
+			sensor_models[n].white_sigma = atof(first);
+			if (fields == 3) {
+				sensor_models[n].bias_walk_sigma = walk;
+			}
+		}
+		LOG("[%s] Model %s - white sigma %f, bias walk sigma %f\n", sensors_name[n],
+				sensor_models[n].enabled ? "on" : "off",
+				sensor_models[n].white_sigma, sensor_models[n].bias_walk_sigma);
+	}
+
+	fclose(conf_fp);
+}
+
+static void baseline_block(int n, uint64_t first_sample, float block[MAX_AXES][NOISE_BLOCK])
+{
+	const float g = EARTH_GRAVITY;
+	const float field[3] = { 22.0f, 5.0f, -40.0f }; /* uT */
+	double period_s = sensor_models[n].period_us * 1E-6;
+
+	int i = 0;
+	while (i < NOISE_BLOCK) {
+		float t = fmod((first_sample + i) * period_s, 1.0 / TILT_FREQUENCY);
+		float phase = 2.0f * (float)M_PI * TILT_FREQUENCY * t;
+		float tilt = TILT_AMPLITUDE * sinf(phase);
+		float tilt_rate = TILT_AMPLITUDE * 2.0f * (float)M_PI * TILT_FREQUENCY * cosf(phase);
+
+		float b[MAX_AXES] = { 0.0f, 0.0f, 0.0f, 0.0f, };
+		switch (n) {
+			case EAccel:
+			case EGravity:
+				b[0] = g * sinf(tilt);
+				b[2] = g * cosf(tilt);
+				break;
+			case EMagnetic:
+				b[0] = field[0] * cosf(tilt) + field[2] * sinf(tilt);
+				b[1] = field[1];
+				b[2] = -field[0] * sinf(tilt) + field[2] * cosf(tilt);
+				break;
+			case ELight:
+				b[0] = 100.0f;
+				break;
+			case EProximity:
+				b[0] = 5.0f;
+				break;
+			case EGyro:
+			case ECorrectedGyro:
+				b[1] = tilt_rate;
+				break;
+			case EOrient:
+				b[1] = tilt * 180.0f / (float)M_PI;
+				break;
+			case ERotationVector:
+				b[1] = sinf(tilt / 2.0f);
+				b[3] = cosf(tilt / 2.0f);
+				break;
+			default:
+				break;
+		}
+
+		int a = 0;
+		while (a < MAX_AXES) {
+			block[a][i] = b[a];
+			a++;
+		}
+		i++;
+	}
+}
+
+static v4sf v4sf_splat(float f)
+{
+	v4sf v = { f, f, f, f, };
+	return v;
+}
+
+static v4sf v4sf_select(v4si mask, v4sf a, v4sf b)
+{
+	return (v4sf)(((v4si)a & mask) | ((v4si)b & ~mask));
+}
+
+// N(0, 1) truncated at +/-2*sqrt(3) - good enough for sensor noise.
+static v4sf gaussian4(v4su *rng)
+{
+	v4sf sum = v4sf_splat(0.0f);
+
+	int i = 0;
+	while (i < 4) {
+		v4su x = *rng;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		*rng = x;
+		sum += __builtin_convertvector(x >> 8, v4sf) * v4sf_splat(1.0f / (1 << 24));
+		i++;
+	}
+
+	return (sum - v4sf_splat(2.0f)) * v4sf_splat(1.7320508f);
+}
+
+static void noise_block(const struct sensor_model *m, struct noise_stream *ns)
+{
+	const v4sf white = v4sf_splat(m->white_sigma);
+	const v4sf walk = v4sf_splat(m->bias_walk_sigma);
+	const v4sf res = v4sf_splat(m->resolution);
+	const v4sf inv_res = v4sf_splat(m->resolution > 0.0f ? 1.0f / m->resolution : 0.0f);
+	const v4sf hi = v4sf_splat(m->max_range);
+	const v4sf lo = v4sf_splat(m->unipolar ? 0.0f : -m->max_range);
+	const v4sf half = v4sf_splat(0.5f);
+	const v4sf zero = v4sf_splat(0.0f);
+
+	int a = 0;
+	while (a < m->axes) {
+		float bias = ns->bias[a];
+
+		int i = 0;
+		while (i < NOISE_BLOCK) {
+			v4sf x = *(v4sf *)&ns->block[a][i];
+
+			// The random walk is a running sum, so it's the only
+			// sequential part.
+			v4sf steps = gaussian4(&ns->rng) * walk;
+			v4sf b = { bias + steps[0], 0.0f, 0.0f, 0.0f, };
+			b[1] = b[0] + steps[1];
+			b[2] = b[1] + steps[2];
+			b[3] = b[2] + steps[3];
+			bias = b[3];
+
+			x += b + gaussian4(&ns->rng) * white;
+
+			if (m->resolution > 0.0f) {
+				v4sf q = x * inv_res;
+				q += v4sf_select(q >= zero, half, -half);
+				x = __builtin_convertvector(__builtin_convertvector(q, v4si), v4sf) * res;
+			}
+
+			if (m->max_range > 0.0f) {
+				x = v4sf_select(x > hi, hi, x);
+			}
+			if (m->max_range > 0.0f || m->unipolar) {
+				x = v4sf_select(x < lo, lo, x);
+			}
+
+			*(v4sf *)&ns->block[a][i] = x;
+			i += 4;
+		}
+
+		ns->bias[a] = bias;
+		a++;
+	}
+}
+
+static bool generate_modelled_readings(int n, char *gen_readings, struct noise_stream *ns)
+{
+	if (ns->next == NOISE_BLOCK) {
+		baseline_block(n, ns->sample, ns->block);
+		noise_block(&sensor_models[n], ns);
+		ns->sample += NOISE_BLOCK;
+		ns->next = 0;
+	}
+
+	float v[MAX_AXES] = { 0.0f, 0.0f, 0.0f, 0.0f, };
+	int a = 0;
+	while (a < MAX_AXES) {
+		v[a] = ns->block[a][ns->next];
+		a++;
+	}
+	ns->next++;
+
+	bool valid = true;
+	switch (n) {
+		case EAccel:
+		case EGyro:
+			sprintf(gen_readings, "%.9f|%.9f|%.9f", v[0], v[1], v[2]);
+			break;
+		case EMagnetic:
+		case ECorrectedGyro:
+		case EGravity:
+		case ELinearAccel:
+			sprintf(gen_readings, "%f|%f|%f", v[0], v[1], v[2]);
+			break;
+		case ELight:
+		case EProximity:
+			sprintf(gen_readings, "%f", v[0]);
+			break;
+		case EOrient:
+			sprintf(gen_readings, "%f|%f|%f|%d", v[0], v[1], v[2], 3); // SENSOR_STATUS_ACCURACY_HIGH!
+			break;
+		case ERotationVector:
+			sprintf(gen_readings, "%f|%f|%f|%f", v[0], v[1], v[2], v[3]);
+			break;
+		default:
+			valid = false;
+			LOG("Unknown sensor - number : %d\n", n);
+			break;
+	}
+
+	return valid;
+}
+
+static bool generate_readings(int n, char *gen_readings, struct reading_stream *rs)
+{
+	if (sensor_models[n].enabled) {
+		return generate_modelled_readings(n, gen_readings, &rs->noise);
+	}
+
+	return generate_pattern_readings(n, gen_readings, &rs->seed);
+}
+
 struct server_data {
 	int num;
 };
 
+/*
+ * Transport.
+ *
+ * TRANSPORT_CONF_FILE has "tcp" (the default) or "tcp_nodelay", which
+ * turns Nagle off on the connections to the relay.
+ */
+
+static bool tcp_nodelay;
+
+static void load_transport_conf(void)
+{
+	FILE *fp = fopen(TRANSPORT_CONF_FILE, "r");
+	if (!fp) {
+		return;
+	}
+
+	char transport[32] = "";
+	if (fscanf(fp, "%31s", transport) == 1) {
+		tcp_nodelay = !strcmp(transport, "tcp_nodelay");
+		LOG("Transport : %s\n", transport);
+	}
+
+	fclose(fp);
+}
+
+static void set_transport_opts(int fd)
+{
+	if (tcp_nodelay) {
+		int yes = 1;
+		bool set = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) != -1;
+		if (!set) {
+			ERR("setsockopt TCP_NODELAY - %s\n", strerror(errno));
+		}
+	}
+}
+
+/*
+ * Benchmark mode (-B).
+ *
+ * Instead of readings, every frame carries "<send time>|<sequence>|0" -
+ * the CLOCK_MONOTONIC time it was sent at in microseconds and its number
+ * in the stream, both modulo BENCH_STAMP_MOD so that they survive being
+ * parsed into a float by the HAL. Whatever receives the frames on the same
+ * host can tell the latency from the first value, for any of the sensors.
+ *
+ * Only the streams in the sensors mask are served, at rate_hz, in writes
+ * of batch frames, for seconds from when they're connected. Then, the
+ * number of frames sent per stream is written to BENCH_SENT_FILE and the
+ * server exits.
+ */
+
+#define BENCH_SENT_FILE "./bench_sent"
+#define BENCH_STAMP_MOD (1ULL << 24) /* Exact in a float. */
+#define BENCH_MAX_BATCH 64
+
+struct bench_config {
+	bool enabled;
+	unsigned int sensors_mask;
+	int rate_hz;
+	int batch;
+	int seconds;
+};
+
+static struct bench_config bench_conf = {
+	.enabled = false,
+	.sensors_mask = (1U << NUM_SENSORS) - 1,
+	.rate_hz = 0,
+	.batch = 1,
+	.seconds = 0,
+};
+
+static unsigned long long bench_sent[NUM_SENSORS];
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec t = { 0, 0 };
+	emu_clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (uint64_t)t.tv_sec * NS_PER_SEC + t.tv_nsec;
+}
+
+// Returns true once the benchmark is over, false if the connection broke.
+static bool bench_stream(int n, int fd)
+{
+	size_t readings_size = readings_size_of(n);
+	size_t frame_size = readings_size + EMU_TRACE_SIZE;
+	int batch = bench_conf.batch;
+	char frames[BENCH_MAX_BATCH * frame_size];
+
+	uint64_t period_ns = NS_PER_SEC * batch / bench_conf.rate_hz;
+	uint64_t due_ns = bench_now_ns();
+	uint64_t end_ns = due_ns + (uint64_t)bench_conf.seconds * NS_PER_SEC;
+
+	while (1) {
+		uint64_t now_ns = bench_now_ns();
+		if (now_ns >= end_ns) {
+			return true;
+		}
+
+		if (now_ns < due_ns) {
+			struct timespec t = { .tv_sec = (due_ns - now_ns) / NS_PER_SEC, .tv_nsec = (due_ns - now_ns) % NS_PER_SEC, };
+			emu_nanosleep(&t);
+			now_ns = bench_now_ns();
+		}
+
+		unsigned long long stamp_us = (now_ns / 1000) % BENCH_STAMP_MOD;
+
+		memset(frames, 0, batch * frame_size);
+		int i = 0;
+		while (i < batch) {
+			char *frame = frames + i * frame_size;
+			snprintf(frame, readings_size, "%llu|%llu|0", stamp_us, (bench_sent[n] + i) % BENCH_STAMP_MOD);
+			EMU_TRACE_INIT(frame, readings_size, bench_sent[n] + i, (int64_t)now_ns);
+			i++;
+		}
+		EMU_TRACE_STAMP_FRAMES(frames, frame_size, batch, EMU_HOP_DEV_SEND);
+		emu_stats_received(n, batch, batch * frame_size, emu_stats_now());
+
+		ssize_t bytes_wrote = emu_write(fd, frames, batch * frame_size);
+		if (bytes_wrote != (ssize_t)(batch * frame_size)) {
+			ERR_SERVER("write - %s\n", bytes_wrote == -1 ? strerror(errno) : "Partial");
+			EMU_STATS_COUNT(n, drops, batch);
+			return false;
+		}
+		emu_stats_handed_on(n, batch, bytes_wrote, due_ns); // Late by.
+		bench_sent[n] += batch;
+
+		due_ns += period_ns;
+	}
+}
+
+static void bench_write_sent(void)
+{
+	FILE *fp = fopen(BENCH_SENT_FILE, "w");
+	if (!fp) {
+		ERR("fopen - %s - %s\n", BENCH_SENT_FILE, strerror(errno));
+		return;
+	}
+
+	int n = 0;
+	while (n < NUM_SENSORS) {
+		if (bench_conf.sensors_mask & (1U << n)) {
+			fprintf(fp, "%s %llu\n", sensors_name[n], bench_sent[n]);
+		}
+		n++;
+	}
+
+	fclose(fp);
+}
+
+/*
+ * Replay mode (-R).
+ *
+ * The readings of every stream come from a capture - a text readings log
+ * or a binary recording - with the gaps they were captured with, divided
+ * by the speed factor (-x). -f starts the replay that many seconds into
+ * the capture, and -l loops it forever. Streams the capture has no
+ * readings of aren't served. See SensorEmulationReplay.h.
+ */
+
+struct replay_config {
+	const char *capture;
+	double speed;
+	bool loop;
+	double seek_s;
+};
+
+static struct replay_config replay_conf = {
+	.capture = NULL,
+	.speed = 1.0,
+	.loop = false,
+	.seek_s = 0,
+};
+
+static struct emu_replay replay;
+
+// Returns true once the capture is over, false if the connection broke.
+static bool replay_stream(int n, int fd)
+{
+	size_t readings_size = readings_size_of(n);
+	bool over = false;
+
+	struct emu_replay_cursor c;
+	if (!emu_replay_cursor_init(&replay, &c, n)) {
+		ERR_SERVER("Replay of %s - %s\n", replay_conf.capture, strerror(errno));
+		emu_replay_cursor_free(&c);
+		return true;
+	}
+
+	uint32_t seq = 0;
+	while (1) {
+		char frame[readings_size + EMU_TRACE_SIZE];
+		memset(frame, 0, sizeof(frame));
+
+		int64_t due_ns = emu_replay_next(&replay, &c, frame, readings_size);
+		if (due_ns == -1) {
+			LOG_SERVER("End of the capture.\n");
+			over = true;
+			break;
+		}
+		emu_replay_sleep_until(due_ns);
+		emu_stats_received(n, 1, sizeof(frame), emu_stats_now());
+
+		EMU_TRACE_INIT(frame, readings_size, seq++, 0);
+		LOG1_SERVER("Sending replayed readings: %s\n", frame);
+		EMU_TRACE_STAMP(frame, readings_size, EMU_HOP_DEV_SEND);
+		ssize_t bytes_wrote = emu_write(fd, frame, sizeof(frame));
+		if (bytes_wrote == -1) {
+			ERR_SERVER("write - %s\n", strerror(errno));
+			EMU_STATS_COUNT(n, drops, 1);
+			break;
+		}
+		emu_stats_handed_on(n, 1, bytes_wrote, due_ns); // Late by.
+	}
+
+	emu_replay_cursor_free(&c);
+
+	return over;
+}
+
 static void *sensor_emulation_remote_server(void *arg)
 {
 	(void)signal(SIGINT, ctrlc_handler);
@@ -204,8 +930,16 @@ static void *sensor_emulation_remote_server(void *arg)
 
 	int port = SERVER_PORT(n);
 
+	if (bench_conf.enabled && !(bench_conf.sensors_mask & (1U << n))) {
+		return NULL;
+	}
+	if (replay_conf.capture && !replay.streams[n].num) {
+		return NULL;
+	}
+
 	setjmp_d[n].tid = pthread_self();
 
+	volatile bool accepted = false; /* Across the longjmp() of a SIGPIPE. */
 	while (1) {
 		if (!setjmp(setjmp_d[n].sanity)) {
 			LOG_SERVER("Setting up for a longjmp for any possible SIGPIPE!\n");
@@ -260,176 +994,96 @@ static void *sensor_emulation_remote_server(void *arg)
 		LOG_SERVER("Listening!\n");
 
 		struct timespec t = { .tv_sec = 0, .tv_nsec = 10000ULL, };
-		srand(time(NULL));
+		struct reading_stream rs;
+		init_reading_stream(&rs, READING_STREAM_SEED(n));
 
 		while (1) {
 			LOG_SERVER("Waiting to accept . . .\n");
-			connfd[n] = accept(listenfd[n], (struct sockaddr *)NULL, NULL); 
+			connfd[n] = emu_accept(listenfd[n], (struct sockaddr *)NULL, NULL); 
 			if (connfd[n] == -1) {
 				ERR_SERVER("accept - %s\n", strerror(errno));
 				break;
 			}
 			LOG_SERVER("Accepted!\n");
+			if (accepted) {
+				EMU_STATS_COUNT(n, reconnects, 1);
+			}
+			accepted = true;
+
+			set_transport_opts(connfd[n]);
+
+			if (bench_conf.enabled) {
+				bool finished = bench_stream(n, connfd[n]);
+
+				emu_close(connfd[n]);
+				connfd[n] = -1;
+
+				if (finished) {
+					close(listenfd[n]);
+					listenfd[n] = -1;
+					setjmp_d[n].tid = -1;
+					return NULL;
+				}
+				continue;
+			}
+
+			if (replay_conf.capture) {
+				bool over = replay_stream(n, connfd[n]);
 
+				emu_close(connfd[n]);
+				connfd[n] = -1;
 
-			size_t readings_size = n == EAccel ? ACCEL_READINGS_BUF_SIZE + 1 :
-						n == EGyro ? GYRO_READINGS_BUF_SIZE + 1 :
-								READINGS_BUF_SIZE + 1;
+				if (over) {
+					close(listenfd[n]);
+					listenfd[n] = -1;
+					setjmp_d[n].tid = -1;
+					return NULL;
+				}
+				continue;
+			}
+
+			size_t readings_size = readings_size_of(n);
 			char last_readings[readings_size];
 			memset(last_readings, 0, sizeof(last_readings));
 
-			while (1) {
-				LOG_SERVER("Generating readings for %s . . .\n", sensors_name[n]);
+			uint32_t seq = 0;
 
-				// Pretty simple logic for the sensors' fake readings. Customize as you need!
-				bool valid = true;
+			while (1) {
+				LOG1_SERVER("Generating readings for %s . . .\n", sensors_name[n]);
 
-				char gen_readings[readings_size];
+				char gen_readings[readings_size + EMU_TRACE_SIZE];
 				memset(gen_readings, 0, sizeof(gen_readings));
 
-				switch (n) {
-					case EAccel:
-					{
-						int sign = rand() % 2 ? 1 : -1;
-						float x = rand() % ACCEL_MAX * EARTH_GRAVITY * sign;
-						sign = rand() % 2 ? 1 : -1;	
-						float y = rand() % ACCEL_MAX * EARTH_GRAVITY * sign;
-						sign = rand() % 2 ? 1 : -1;
-						float z = rand() % ACCEL_MAX * EARTH_GRAVITY * sign;
-						sprintf(gen_readings, "%.9f|%.9f|%.9f", x, y, z);
-
-						break;
-					}
-					case EMagnetic:
-					{
-						int sign = rand() % 2 ? 1 : -1;
-						float x = rand() % MAGNET_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;	
-						float y = rand() % MAGNET_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;
-						float z = rand() % MAGNET_MAX * SOME_CONSTANT_FACTOR * sign;
-						sprintf(gen_readings, "%f|%f|%f", x, y, z);
-								
-						break;
-					}
-					case ELight:
-					{
-						float l = rand() % LIGHT_MAX;
-						sprintf(gen_readings, "%f", l);
-
-						break;
-					}
-					case EProximity:
-					{
-						float p = rand() % PROX_MAX;
-						sprintf(gen_readings, "%f", p);
-
-						break;
-					}
-					case EGyro:
-					{
-						int sign = rand() % 2 ? 1 : -1;
-						float azimuth = rand() % GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;	
-						float pitch = rand() % GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;
-						float roll = rand() % GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
-						sprintf(gen_readings, "%.9f|%.9f|%.9f", azimuth, pitch, roll);
-						
-						break;
-					}
-					case EOrient:
-					{
-						int sign = rand() % 2 ? 1 : -1;
-						float azimuth = rand() % ORIENT_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;	
-						float pitch = rand() % ORIENT_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;
-						float roll = rand() % ORIENT_MAX * SOME_CONSTANT_FACTOR * sign;
-						int status = 3; // SENSOR_STATUS_ACCURACY_HIGH!
-						sprintf(gen_readings, "%f|%f|%f|%d", azimuth, pitch, roll, status);
-						
-						break;
-					}
-					case ECorrectedGyro:
-					{
-						int sign = rand() % 2 ? 1 : -1;
-						float azimuth = rand() % CORRECTED_GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;	
-						float pitch = rand() % CORRECTED_GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;
-						float roll = rand() % CORRECTED_GYRO_MAX * SOME_CONSTANT_FACTOR * sign;
-						sprintf(gen_readings, "%f|%f|%f", azimuth, pitch, roll);
-
-						break;
-					}
-					case EGravity:
-					{
-						int sign = rand() % 2 ? 1 : -1;
-						float lateral = rand() % GRAVITY_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;	
-						float longitudinal = rand() % GRAVITY_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;
-						float vertical = rand() % GRAVITY_MAX * SOME_CONSTANT_FACTOR * sign;
-						sprintf(gen_readings, "%f|%f|%f", lateral, longitudinal, vertical);
-						
-						break;
-					}
-					case ELinearAccel:
-					{
-						int sign = rand() % 2 ? 1 : -1;
-						float lateral = rand() % LINEAR_ACCEL_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;	
-						float longitudinal = rand() % LINEAR_ACCEL_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;
-						float vertical = rand() % LINEAR_ACCEL_MAX * SOME_CONSTANT_FACTOR * sign;
-						sprintf(gen_readings, "%f|%f|%f", lateral, longitudinal, vertical);
-						
-						break;
-					}
-					case ERotationVector:
-					{
-						int sign = rand() % 2 ? 1 : -1;
-						float d1 = rand() % ROTATION_VECTOR_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;	
-						float d2 = rand() % ROTATION_VECTOR_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;
-						float d3 = rand() % ROTATION_VECTOR_MAX * SOME_CONSTANT_FACTOR * sign;
-						sign = rand() % 2 ? 1 : -1;
-						float d4 = rand() % ROTATION_VECTOR_MAX * SOME_CONSTANT_FACTOR * sign;
-						sprintf(gen_readings, "%f|%f|%f|%f", d1, d2, d3, d4);
-
-						break;
-					}
-					default:
-					{
-						valid = false;
-						LOG_SERVER("Unknown sensor - number : %d\n", n);
-						break;
-					}
-				}
+				bool valid = generate_readings(n, gen_readings, &rs);
 
 				if (valid) {
 					bool not_same = strcmp(gen_readings, last_readings);
 					if (not_same) {					
-						LOG_SERVER("Sending generated readings: %s\n", gen_readings);
-						ssize_t bytes_wrote = write(connfd[n], gen_readings, readings_size);
+						int64_t in_ns = emu_stats_now();
+						emu_stats_received(n, 1, sizeof(gen_readings), in_ns);
+						EMU_TRACE_INIT(gen_readings, readings_size, seq++, 0);
+
+						LOG1_SERVER("Sending generated readings: %s\n", gen_readings);
+						EMU_TRACE_STAMP(gen_readings, readings_size, EMU_HOP_DEV_SEND);
+						ssize_t bytes_wrote = emu_write(connfd[n], gen_readings, sizeof(gen_readings));
 						if (bytes_wrote == -1) {
 							ERR_SERVER("write - %s\n", strerror(errno));
+							EMU_STATS_COUNT(n, drops, 1);
 							break;
 						}
-						LOG_SERVER("Sent %zd bytes . . .!\n", bytes_wrote);
+						emu_stats_handed_on(n, 1, bytes_wrote, in_ns);
+						LOG1_SERVER("Sent %zd bytes . . .!\n", bytes_wrote);
 
 						strcpy(last_readings, gen_readings);
 					} else {
-						LOG_SERVER("Same readings! Not sending.\n");
+						LOG1_SERVER("Same readings! Not sending.\n");
 					}
 				}
 
-				nanosleep(&t, NULL);
+				emu_nanosleep(&t);
 			}
 
-			close(connfd[n]);
+			emu_close(connfd[n]);
 			connfd[n] = -1;
 		}
 	}
@@ -440,10 +1094,729 @@ done:
 }
 
 
-int main(void)
+/*
+ * Load generator.
+ *
+ * Simulates num_devices independent virtual devices, each having all the
+ * NUM_SENSORS streams, and serves them at port (base port + sensor
+ * number), the ports the relay connects to for a remote server's
+ * readings. Every connection to port n takes stream n of the first device
+ * that has it free, so up to num_devices relays - each pointed at this
+ * host by its remote_server_ip_port.conf - are served all their sensors.
+ * A relay's streams needn't be of the same device: they're independent
+ * all the same.
+ *
+ * The devices are sharded across the cores with one epoll event loop per
+ * core, woken up by a timerfd every LOAD_TICK_NS. Every core listens on
+ * all the ports with SO_REUSEPORT, so the kernel spreads the connections
+ * across them, but the streams are claimed from all the devices, whichever
+ * core accepts the connection: it's handed over to the core of the
+ * stream's device, which takes it up in its next tick. The readings that
+ * are due in a tick are written with one writev() per stream. The
+ * aggregate samples per second are reported once a second.
+ */
+
+#define LOAD_DEFAULT_RATE_HZ 100
+#define LOAD_TICK_NS 1000000ULL
+#define LOAD_MAX_FRAMES_PER_TICK 16 /* Per stream. Beyond this, the stream is behind. */
+
+
+struct load_stream {
+	struct reading_stream gen;
+	int fd; /* -1 until a relay connects for it. */
+	int claimed; /* By the core that accepted its connection, till it's closed. */
+	int handoff; /* The accepted connection, for the stream's core to take up, or -1. */
+	uint64_t next_due_ns;
+	size_t pending_len; /* Unsent tail of a partially written frame. */
+	char pending[READINGS_BUF_SIZE + 1];
+};
+
+struct load_device {
+	unsigned int seed;
+	struct load_stream streams[NUM_SENSORS];
+};
+
+struct load_shard {
+	int core;
+	int num_devices;
+	struct load_device *devices;
+	pthread_t tid;
+
+	/* Written only by the shard's thread, read by the reporter. */
+	unsigned long long samples;
+	unsigned long long bytes;
+	unsigned long long drops;
+	unsigned long long streams;
+};
+
+struct load_config {
+	int num_devices;
+	int num_cores;
+	int rate_hz;
+	int base_port;
+	int seconds;
+};
+
+static struct load_config load_conf = {
+	.num_devices = 0,
+	.num_cores = 0,
+	.rate_hz = LOAD_DEFAULT_RATE_HZ,
+	.base_port = BASE_PORT,
+	.seconds = 0,
+};
+
+static volatile sig_atomic_t load_running = 1;
+
+// All the shards' devices, the first load_devices_served of them on
+// running cores.
+static struct load_device *load_devices;
+static int load_devices_served;
+
+static void load_sigint_handler(int sig)
+{
+	load_running = 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec t = { 0, };
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (uint64_t)t.tv_sec * NS_PER_SEC + t.tv_nsec;
+}
+
+static void load_count(unsigned long long *counter, unsigned long long by)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + by, __ATOMIC_RELAXED);
+}
+
+// The shard's listening socket of port (base port + n), non-blocking so
+// that a connection another core took doesn't stall the event loop.
+static int load_listen(int n)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd == -1) {
+		ERR("socket - %s\n", strerror(errno));
+		goto failed;
+	}
+
+	int yes = 1;
+	bool socket_opt_set = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != -1 &&
+				setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) != -1;
+	if (!socket_opt_set) {
+		ERR("setsockopt - %s\n", strerror(errno));
+		goto failed;
+	}
+
+	struct sockaddr_in addr = { 0, };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(load_conf.base_port + n);
+	bool bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != -1;
+	if (!bound) {
+		ERR("bind - port %d - %s\n", load_conf.base_port + n, strerror(errno));
+		goto failed;
+	}
+
+	bool listening = listen(fd, 1024) != -1;
+	if (!listening) {
+		ERR("listen - %s\n", strerror(errno));
+		goto failed;
+	}
+
+	return fd;
+
+failed:
+	if (fd != -1) {
+		close(fd);
+	}
+
+	return -1;
+}
+
+// The connections waiting at port (base port + n), each handed over to
+// stream n of the first device that has it free.
+static void load_accept(int listenfd, int n)
+{
+	while (1) {
+		int connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+		if (connfd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				ERR("accept4 - %s\n", strerror(errno));
+			}
+			return;
+		}
+
+		int num_devices = __atomic_load_n(&load_devices_served, __ATOMIC_ACQUIRE);
+		struct load_stream *s = NULL;
+		int d = 0;
+		while (d < num_devices && !s) {
+			struct load_stream *free_stream = &load_devices[d].streams[n];
+			int unclaimed = 0;
+			if (__atomic_compare_exchange_n(&free_stream->claimed, &unclaimed, 1, false,
+								__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				s = free_stream;
+			}
+			d++;
+		}
+		if (!s) {
+			ERR("No %s stream left. Turning a connection away.\n", sensors_name[n]);
+			close(connfd);
+			continue;
+		}
+
+		__atomic_store_n(&s->handoff, connfd, __ATOMIC_RELEASE);
+	}
+}
+
+// The devices of a shard, before its core serves them.
+static void load_init_shard(struct load_shard *shard)
+{
+	int d = 0;
+	while (d < shard->num_devices) {
+		struct load_device *dev = &shard->devices[d];
+		dev->seed = time(NULL) ^ (shard->core << 16) ^ d;
+
+		int n = 0;
+		while (n < NUM_SENSORS) {
+			struct load_stream *s = &dev->streams[n];
+			init_reading_stream(&s->gen, rand_r(&dev->seed));
+			s->fd = -1;
+			s->claimed = 0;
+			s->handoff = -1;
+			s->pending_len = 0;
+			n++;
+		}
+		d++;
+	}
+}
+
+// Takes up the connection handed over for s, if any.
+static void load_take_stream(struct load_shard *shard, struct load_device *dev, struct load_stream *s, uint64_t now)
+{
+	if (__atomic_load_n(&s->handoff, __ATOMIC_RELAXED) == -1) {
+		return;
+	}
+
+	s->fd = __atomic_exchange_n(&s->handoff, -1, __ATOMIC_ACQUIRE);
+	s->pending_len = 0;
+	// Spread the streams' phases over a period to avoid bursts.
+	s->next_due_ns = now + (uint64_t)rand_r(&dev->seed) % (NS_PER_SEC / load_conf.rate_hz);
+	load_count(&shard->streams, 1);
+}
+
+static void load_close_stream(struct load_shard *shard, struct load_stream *s)
+{
+	if (s->fd != -1) {
+		close(s->fd);
+		s->fd = -1;
+		load_count(&shard->streams, -1ULL);
+		__atomic_store_n(&s->claimed, 0, __ATOMIC_RELEASE);
+	}
+	s->pending_len = 0;
+}
+
+// Generates the readings of stream n that are due by now into frames[],
+// returning how many. Readings that can't be caught up with are dropped.
+static int load_generate_due(struct load_shard *shard, struct load_device *dev, int n, uint64_t now,
+						char frames[][READINGS_BUF_SIZE + 1], int max_frames)
+{
+	struct load_stream *s = &dev->streams[n];
+	uint64_t period_ns = NS_PER_SEC / load_conf.rate_hz;
+
+	int num_frames = 0;
+	while (s->next_due_ns <= now && num_frames < max_frames) {
+		memset(frames[num_frames], 0, readings_size_of(n));
+		if (generate_readings(n, frames[num_frames], &s->gen)) {
+			num_frames++;
+		}
+		s->next_due_ns += period_ns;
+	}
+
+	if (s->next_due_ns <= now) {
+		uint64_t behind = (now - s->next_due_ns) / period_ns + 1;
+		load_count(&shard->drops, behind);
+		s->next_due_ns += behind * period_ns;
+	}
+
+	return num_frames;
+}
+
+static void load_tick(struct load_shard *shard, uint64_t now)
+{
+	char frames[LOAD_MAX_FRAMES_PER_TICK][READINGS_BUF_SIZE + 1];
+	struct iovec iov[LOAD_MAX_FRAMES_PER_TICK + 1];
+
+	int d = 0;
+	while (d < shard->num_devices) {
+		struct load_device *dev = &shard->devices[d];
+
+		int n = 0;
+		while (n < NUM_SENSORS) {
+			struct load_stream *s = &dev->streams[n];
+			size_t frame_size = readings_size_of(n);
+
+			if (s->fd == -1) {
+				load_take_stream(shard, dev, s, now);
+			}
+			if (s->fd == -1) {
+				n++;
+				continue;
+			}
+
+			int num_frames = load_generate_due(shard, dev, n, now, frames, LOAD_MAX_FRAMES_PER_TICK);
+			if (!num_frames && !s->pending_len) {
+				n++;
+				continue;
+			}
+
+			int num_iov = 0;
+			if (s->pending_len) {
+				iov[num_iov].iov_base = s->pending + frame_size - s->pending_len;
+				iov[num_iov].iov_len = s->pending_len;
+				num_iov++;
+			}
+			int i = 0;
+			while (i < num_frames) {
+				iov[num_iov].iov_base = frames[i];
+				iov[num_iov].iov_len = frame_size;
+				num_iov++;
+				i++;
+			}
+
+			ssize_t bytes_wrote = writev(s->fd, iov, num_iov);
+			if (bytes_wrote == -1) {
+				if (errno != EAGAIN) {
+					LOG("%s stream closed - %s\n", sensors_name[n], strerror(errno));
+					load_close_stream(shard, s);
+				}
+				load_count(&shard->drops, num_frames);
+				n++;
+				continue;
+			}
+			load_count(&shard->bytes, bytes_wrote);
+
+			// Account for whole frames. A partially written frame is
+			// finished first thing in the next tick so that the stream
+			// stays frame-aligned. Frames not written at all are stale
+			// by then and are dropped.
+			size_t left = bytes_wrote;
+			unsigned long long sent = 0;
+			i = 0;
+			while (i < num_iov) {
+				bool is_pending = s->pending_len && i == 0;
+				if (left >= iov[i].iov_len) {
+					left -= iov[i].iov_len;
+					sent++;
+					if (is_pending) {
+						s->pending_len = 0;
+					}
+				} else if (left) {
+					if (!is_pending) {
+						memcpy(s->pending, iov[i].iov_base, frame_size);
+					}
+					s->pending_len = iov[i].iov_len - left;
+					left = 0;
+				} else {
+					if (!is_pending) {
+						load_count(&shard->drops, 1);
+					}
+				}
+				i++;
+			}
+			load_count(&shard->samples, sent);
+
+			n++;
+		}
+		d++;
+	}
+}
+
+static void *load_shard_loop(void *arg)
+{
+	struct load_shard *shard = arg;
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(shard->core, &cpus);
+	errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (errno) {
+		ERR("pthread_setaffinity_np - core %d - %s\n", shard->core, strerror(errno));
+		// Not a critical error. So, we continue!
+	}
+
+	int epfd = -1;
+	int tfd = -1;
+	int listenfd[NUM_SENSORS];
+	int n = 0;
+	while (n < NUM_SENSORS) {
+		listenfd[n] = -1;
+		n++;
+	}
+	int d = 0;
+
+	epfd = epoll_create1(0);
+	if (epfd == -1) {
+		ERR("epoll_create1 - %s\n", strerror(errno));
+		goto done;
+	}
+
+	// Tagged with the sensor number, NUM_SENSORS for the timer.
+	struct epoll_event ev = { .events = EPOLLIN, };
+	n = 0;
+	while (n < NUM_SENSORS) {
+		listenfd[n] = load_listen(n);
+		if (listenfd[n] == -1) {
+			goto done;
+		}
+		ev.data.u32 = n;
+		bool added = epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd[n], &ev) != -1;
+		if (!added) {
+			ERR("epoll_ctl - %s\n", strerror(errno));
+			goto done;
+		}
+		n++;
+	}
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (tfd == -1) {
+		ERR("timerfd_create - %s\n", strerror(errno));
+		goto done;
+	}
+
+	struct itimerspec tick = {
+		.it_interval = { .tv_sec = 0, .tv_nsec = LOAD_TICK_NS, },
+		.it_value = { .tv_sec = 0, .tv_nsec = LOAD_TICK_NS, },
+	};
+	bool armed = timerfd_settime(tfd, 0, &tick, NULL) != -1;
+	if (!armed) {
+		ERR("timerfd_settime - %s\n", strerror(errno));
+		goto done;
+	}
+
+	ev.data.u32 = NUM_SENSORS;
+	bool added = epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) != -1;
+	if (!added) {
+		ERR("epoll_ctl - %s\n", strerror(errno));
+		goto done;
+	}
+
+	while (load_running) {
+		struct epoll_event events[NUM_SENSORS + 1];
+		int ready = epoll_wait(epfd, events, NUM_SENSORS + 1, 100);
+		if (ready == -1) {
+			if (errno != EINTR) {
+				ERR("epoll_wait - %s\n", strerror(errno));
+				break;
+			}
+			continue;
+		}
+
+		uint64_t now = now_ns();
+		bool ticked = false;
+		int i = 0;
+		while (i < ready) {
+			n = events[i].data.u32;
+			if (n == NUM_SENSORS) {
+				uint64_t expirations = 0;
+				(void)read(tfd, &expirations, sizeof(expirations));
+				ticked = true;
+			} else {
+				load_accept(listenfd[n], n);
+			}
+			i++;
+		}
+
+		if (ticked) {
+			load_tick(shard, now);
+		}
+	}
+
+done:
+	d = 0;
+	while (d < shard->num_devices) {
+		n = 0;
+		while (n < NUM_SENSORS) {
+			struct load_stream *s = &shard->devices[d].streams[n];
+			load_take_stream(shard, &shard->devices[d], s, 0);
+			load_close_stream(shard, s);
+			n++;
+		}
+		d++;
+	}
+	n = 0;
+	while (n < NUM_SENSORS) {
+		if (listenfd[n] != -1) {
+			close(listenfd[n]);
+		}
+		n++;
+	}
+	if (tfd != -1) {
+		close(tfd);
+	}
+	if (epfd != -1) {
+		close(epfd);
+	}
+
+	return NULL;
+}
+
+static void load_raise_fd_limit(void)
+{
+	struct rlimit lim = { 0, };
+	bool got = getrlimit(RLIMIT_NOFILE, &lim) != -1;
+	if (!got) {
+		ERR("getrlimit - %s\n", strerror(errno));
+		return;
+	}
+
+	rlim_t needed = (rlim_t)load_conf.num_devices * NUM_SENSORS + (rlim_t)load_conf.num_cores * NUM_SENSORS + 64;
+	if (lim.rlim_cur < needed) {
+		lim.rlim_cur = needed < lim.rlim_max ? needed : lim.rlim_max;
+		bool set = setrlimit(RLIMIT_NOFILE, &lim) != -1;
+		if (!set) {
+			ERR("setrlimit - %s\n", strerror(errno));
+		}
+		if (lim.rlim_cur < needed) {
+			ERR("Only %llu descriptors for %llu connections!\n",
+					(unsigned long long)lim.rlim_cur, (unsigned long long)needed);
+		}
+	}
+}
+
+static int load_generator(void)
 {
+	LOG("** SensorEmulation Remote Server - Load generator - Started! **\n");
+	LOG("%d devices x %d sensors at %d Hz on %d cores, at ports %d-%d\n",
+			load_conf.num_devices, NUM_SENSORS, load_conf.rate_hz, load_conf.num_cores,
+			load_conf.base_port, load_conf.base_port + NUM_SENSORS - 1);
+
+	(void)signal(SIGINT, load_sigint_handler);
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	load_raise_fd_limit();
+
+	struct load_shard *shards = calloc(load_conf.num_cores, sizeof(*shards));
+	struct load_device *devices = calloc(load_conf.num_devices, sizeof(*devices));
+	if (!shards || !devices) {
+		ERR("calloc - %s\n", strerror(errno));
+		free(shards);
+		free(devices);
+		return 1;
+	}
+
+	load_devices = devices;
+
+	int num_started = 0;
+	int first_device = 0;
+	int i = 0;
+	while (i < load_conf.num_cores) {
+		struct load_shard *shard = &shards[i];
+		shard->core = i;
+		shard->num_devices = load_conf.num_devices / load_conf.num_cores +
+					(i < load_conf.num_devices % load_conf.num_cores);
+		shard->devices = devices + first_device;
+		first_device += shard->num_devices;
+		load_init_shard(shard);
+
+		errno = pthread_create(&shard->tid, NULL, load_shard_loop, shard);
+		bool created = !errno;
+		if (!created) {
+			ERR("pthread_create - Load shard %d - %s\n", i, strerror(errno));
+			break;
+		}
+		// Its devices are up for the taking.
+		__atomic_store_n(&load_devices_served, first_device, __ATOMIC_RELEASE);
+		num_started++;
+		i++;
+	}
+
+	unsigned long long last_samples = 0;
+	unsigned long long last_bytes = 0;
+	unsigned long long last_drops = 0;
+	uint64_t started_ns = now_ns();
+	uint64_t last_ns = started_ns;
+	int elapsed = 0;
+
+	while (load_running && num_started && (!load_conf.seconds || elapsed < load_conf.seconds)) {
+		sleep(1);
+		elapsed++;
+
+		unsigned long long samples = 0;
+		unsigned long long bytes = 0;
+		unsigned long long drops = 0;
+		unsigned long long streams = 0;
+		i = 0;
+		while (i < num_started) {
+			streams += __atomic_load_n(&shards[i].streams, __ATOMIC_RELAXED);
+			samples += __atomic_load_n(&shards[i].samples, __ATOMIC_RELAXED);
+			bytes += __atomic_load_n(&shards[i].bytes, __ATOMIC_RELAXED);
+			drops += __atomic_load_n(&shards[i].drops, __ATOMIC_RELAXED);
+			i++;
+		}
+
+		uint64_t cur_ns = now_ns();
+		double secs = (double)(cur_ns - last_ns) / NS_PER_SEC;
+		printf("[Load] %ds : %llu streams, %.0f samples/s, %.2f MB/s, %.0f drops/s (total %llu samples, %llu drops)\n",
+				elapsed, streams, (samples - last_samples) / secs, (bytes - last_bytes) / secs / 1E6,
+				(drops - last_drops) / secs, samples, drops);
+		fflush(stdout);
+
+		last_samples = samples;
+		last_bytes = bytes;
+		last_drops = drops;
+		last_ns = cur_ns;
+	}
+
+	load_running = 0;
+
+	i = 0;
+	while (i < num_started) {
+		errno = pthread_join(shards[i].tid, NULL);
+		if (errno) {
+			ERR("pthread_join for load shard %d - %s\n", i, strerror(errno));
+		}
+		i++;
+	}
+
+	double total_secs = (double)(now_ns() - started_ns) / NS_PER_SEC;
+	printf("[Load] Average : %.0f samples/s over %.1fs\n", last_samples / total_secs, total_secs);
+
+	free(shards);
+	free(devices);
+
+	LOG("** SensorEmulation Remote Server - Load generator - Terminated! **\n");
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s\n"
+			"       %s -L <devices> [-c cores] [-r rate Hz] [-p base port] [-s seconds]\n"
+			"       %s -B -r <rate Hz> -s <seconds> [-b batch] [-S sensor,sensor,...]\n"
+			"       %s -R <capture> [-x speed] [-f from seconds] [-l]\n",
+			prog, prog, prog, prog);
+}
+
+int main(int argc, char *argv[])
+{
+	emu_log_conf(LOG_CONF_FILE);
+
+	int opt = -1;
+	while ((opt = getopt(argc, argv, "L:c:r:p:s:Bb:S:R:x:f:l")) != -1) {
+		switch (opt) {
+			case 'B':
+				bench_conf.enabled = true;
+				break;
+			case 'b':
+				bench_conf.batch = atoi(optarg);
+				break;
+			case 'S':
+			{
+				// Sensor numbers, as in enum sensors.
+				bench_conf.sensors_mask = 0;
+				char *next = optarg;
+				while (*next) {
+					int sensor = (int)strtol(next, &next, 10);
+					if (sensor >= 0 && sensor < NUM_SENSORS) {
+						bench_conf.sensors_mask |= 1U << sensor;
+					}
+					next += *next == ',';
+				}
+				break;
+			}
+			case 'L':
+				load_conf.num_devices = atoi(optarg);
+				break;
+			case 'c':
+				load_conf.num_cores = atoi(optarg);
+				break;
+			case 'r':
+				load_conf.rate_hz = atoi(optarg);
+				break;
+			case 'p':
+				load_conf.base_port = atoi(optarg);
+				break;
+			case 's':
+				load_conf.seconds = atoi(optarg);
+				break;
+			case 'R':
+				replay_conf.capture = optarg;
+				break;
+			case 'x':
+				replay_conf.speed = atof(optarg);
+				break;
+			case 'f':
+				replay_conf.seek_s = atof(optarg);
+				break;
+			case 'l':
+				replay_conf.loop = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (load_conf.num_devices > 0) {
+		if (load_conf.rate_hz <= 0) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (load_conf.num_cores <= 0) {
+			load_conf.num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+		if (load_conf.num_cores > load_conf.num_devices) {
+			load_conf.num_cores = load_conf.num_devices;
+		}
+
+		load_noise_models();
+
+		return load_generator();
+	}
+
+	if (bench_conf.enabled) {
+		bench_conf.rate_hz = load_conf.rate_hz;
+		bench_conf.seconds = load_conf.seconds;
+
+		bool valid = bench_conf.rate_hz > 0 && bench_conf.seconds > 0 && bench_conf.batch > 0 &&
+						bench_conf.batch <= BENCH_MAX_BATCH && bench_conf.sensors_mask;
+		if (!valid) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (replay_conf.capture) {
+		bool valid = replay_conf.speed > 0 && replay_conf.seek_s >= 0 && !bench_conf.enabled;
+		if (!valid) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		bool opened = emu_replay_open(&replay, replay_conf.capture, sensors_name, NUM_SENSORS,
+						replay_conf.speed, replay_conf.loop, replay_conf.seek_s);
+		if (!opened) {
+			ERR("Replay of %s - %s\n", replay_conf.capture, strerror(errno));
+			return 1;
+		}
+		LOG("Replaying %s, %.3fs long, at %gx from %gs%s\n", replay_conf.capture,
+				(replay.last_ns - replay.first_ns) / 1E9, replay_conf.speed, replay_conf.seek_s,
+				replay_conf.loop ? ", looped" : "");
+	}
+
 	LOG("** SensorEmulation Remote Server - Started! **\n");
 
+	load_noise_models();
+	load_transport_conf();
+
+	if (!emu_stats_open("generator", sensors_name, NUM_SENSORS)) {
+		ERR("Statistics page in %s - %s\n", EMU_STATS_DIR, strerror(errno));
+	} else {
+		emu_stats_dump_on(SIGUSR1);
+	}
+
 	init_servers_data();
 
 	int i = 0;
@@ -470,6 +1843,10 @@ int main(void)
 		i++;
 	}
 
+	if (bench_conf.enabled) {
+		bench_write_sent();
+	}
+
 	LOG("** SensorEmulation Remote Server - Terminated! **\n");
 
 	cleanup();
@@ -0,0 +1,513 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationReplay.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationReplay.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationReplay.h
+ *
+ * Working:
+ *
+ * Plays a captured session back as the readings of the sensors, for the
+ * generator and the relay to send instead of generated or received ones.
+ *
+ * The capture is either a text readings log, of
+ *
+ *	[<sensor>] <ns>ns : <value>|<value>|...
+ *
+ * lines (/data/<sensor>_readings, or what SensorEmulationRecordDump
+ * prints), or a binary recording of SensorEmulationRecord.h. It's
+ * mmap()ed and indexed once by emu_replay_open() - for text, the time
+ * and the place of every line per sensor; for a recording, its block
+ * index per sensor. The sensors of the capture are matched to the
+ * caller's by name, ignoring case and anything but letters and digits,
+ * so "Corrected Gyroscope" is "CorrectedGyroscope". The lines of other
+ * sensors are skipped.
+ *
+ * Every sending thread keeps a struct emu_replay_cursor into its sensor.
+ * emu_replay_next() gives the next reading and the time it's due at, on
+ * the emu_clock_gettime() CLOCK_MONOTONIC clock - the same gaps as in the
+ * capture, divided by the speed factor. All of the sensors share the
+ * time the replay started at, the first time a cursor was set up, so
+ * they stay in step with each other as in the capture. A cursor set up
+ * later, e.g. on a reconnection, starts at the reading due then.
+ *
+ * The replay starts seek seconds into the capture. With loop, it starts
+ * over from the beginning of the capture EMU_REPLAY_LOOP_GAP_MS after its
+ * last reading, forever; otherwise emu_replay_next() returns -1 at the end.
+ */
+
+#ifndef SENSOR_EMULATION_REPLAY_H
+#define SENSOR_EMULATION_REPLAY_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SensorEmulationClock.h"
+#include "SensorEmulationRecord.h"
+
+#define EMU_REPLAY_MAX_SENSORS 16
+#define EMU_REPLAY_LOOP_GAP_MS 10
+
+// A sensor's readings in the capture.
+struct emu_replay_stream {
+	uint32_t num;
+	int64_t *ns; /* Text - of every reading, never decreasing. */
+	size_t *values; /* Text - offset of the values in the map. */
+	uint32_t *blocks; /* Recording - its blocks in the index. */
+	uint32_t num_blocks;
+};
+
+struct emu_replay {
+	const char *map; /* Text. */
+	size_t size;
+	bool recording;
+	struct emu_rec_reader reader;
+
+	int num_sensors;
+	struct emu_replay_stream streams[EMU_REPLAY_MAX_SENSORS];
+	int64_t first_ns; /* Of the capture. */
+	int64_t last_ns;
+
+	double speed;
+	bool loop;
+	int64_t from_ns; /* first_ns + seek. */
+	int64_t started_ns; /* On our clock, 0 until the first cursor. */
+};
+
+struct emu_replay_cursor {
+	int sensor;
+	uint64_t pass; /* Times the capture was looped. */
+	uint32_t next; /* Text - next reading. */
+	uint32_t block; /* Recording - next block of the stream to decode. */
+	int pos; /* In samples. */
+	struct emu_rec_samples *samples;
+};
+
+static inline int64_t emu_replay_now(void)
+{
+	struct timespec t = { 0, 0 };
+	emu_clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static inline void emu_replay_sleep_until(int64_t due_ns)
+{
+	int64_t left = due_ns - emu_replay_now();
+	if (left > 0) {
+		struct timespec t = { (time_t)(left / 1000000000LL), (long)(left % 1000000000LL) };
+		emu_nanosleep(&t);
+	}
+}
+
+// Sensor names compare on their letters and digits only, in any case.
+static inline bool emu_replay_same_name(const char *a, size_t a_len, const char *b)
+{
+	const char *a_end = a + a_len;
+	while (1) {
+		while (a < a_end && !isalnum((unsigned char)*a)) {
+			a++;
+		}
+		while (*b && !isalnum((unsigned char)*b)) {
+			b++;
+		}
+		if (a == a_end || !*b) {
+			return a == a_end && !*b;
+		}
+		if (tolower((unsigned char)*a) != tolower((unsigned char)*b)) {
+			return false;
+		}
+		a++;
+		b++;
+	}
+}
+
+static inline int emu_replay_sensor_of(const char *name, size_t len, const char **names, int num)
+{
+	int i = 0;
+	while (i < num) {
+		if (emu_replay_same_name(name, len, names[i])) {
+			return i;
+		}
+		i++;
+	}
+
+	return -1;
+}
+
+static inline bool emu_replay_add(struct emu_replay_stream *s, uint32_t *size, int64_t ns, size_t values)
+{
+	if (s->num == *size) {
+		uint32_t new_size = *size ? *size * 2 : 1024;
+		int64_t *new_ns = (int64_t *)realloc(s->ns, new_size * sizeof(*new_ns));
+		if (!new_ns) {
+			return false;
+		}
+		s->ns = new_ns;
+		size_t *new_values = (size_t *)realloc(s->values, new_size * sizeof(*new_values));
+		if (!new_values) {
+			return false;
+		}
+		s->values = new_values;
+		*size = new_size;
+	}
+
+	// A clock that stepped back mustn't break the binary search.
+	if (s->num && ns < s->ns[s->num - 1]) {
+		ns = s->ns[s->num - 1];
+	}
+	s->ns[s->num] = ns;
+	s->values[s->num] = values;
+	s->num++;
+
+	return true;
+}
+
+static inline bool emu_replay_index_text(struct emu_replay *r, const char **names)
+{
+	uint32_t sizes[EMU_REPLAY_MAX_SENSORS];
+	memset(sizes, 0, sizeof(sizes));
+
+	const char *p = r->map;
+	const char *end = r->map + r->size;
+	while (p < end) {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (!eol) {
+			eol = end;
+		}
+
+		// [<sensor>] <ns>ns : <values>
+		const char *close = p < eol && *p == '[' ? (const char *)memchr(p, ']', eol - p) : NULL;
+		if (close) {
+			int sensor = emu_replay_sensor_of(p + 1, close - p - 1, names, r->num_sensors);
+			const char *q = close + 1;
+			while (q < eol && *q == ' ') {
+				q++;
+			}
+			int64_t ns = 0;
+			bool digits = false;
+			while (q < eol && isdigit((unsigned char)*q)) {
+				ns = ns * 10 + (*q - '0');
+				digits = true;
+				q++;
+			}
+			const char *sep = q + 4 <= eol && !memcmp(q, "ns :", 4) ? q + 4 : NULL;
+			if (sensor != -1 && digits && sep) {
+				while (sep < eol && *sep == ' ') {
+					sep++;
+				}
+				if (!emu_replay_add(&r->streams[sensor], &sizes[sensor], ns, sep - r->map)) {
+					return false;
+				}
+			}
+		}
+
+		p = eol + 1;
+	}
+
+	return true;
+}
+
+static inline bool emu_replay_index_recording(struct emu_replay *r, const char **names)
+{
+	int map[EMU_REC_MAX_SENSORS];
+	uint32_t i = 0;
+	while (i < EMU_REC_MAX_SENSORS) {
+		map[i] = i < r->reader.header.num_sensors ?
+				emu_replay_sensor_of(r->reader.header.names[i], strnlen(r->reader.header.names[i],
+							EMU_REC_NAME_SIZE), names, r->num_sensors) : -1;
+		i++;
+	}
+
+	i = 0;
+	while (i < r->reader.entries) {
+		const struct emu_rec_index *e = &r->reader.index[i];
+		int sensor = e->sensor < EMU_REC_MAX_SENSORS ? map[e->sensor] : -1;
+		if (sensor != -1) {
+			struct emu_replay_stream *s = &r->streams[sensor];
+			uint32_t *blocks = (uint32_t *)realloc(s->blocks, (s->num_blocks + 1) * sizeof(*blocks));
+			if (!blocks) {
+				return false;
+			}
+			s->blocks = blocks;
+			s->blocks[s->num_blocks++] = i;
+			s->num += e->samples;
+		}
+		i++;
+	}
+
+	return true;
+}
+
+static inline void emu_replay_close(struct emu_replay *r)
+{
+	int i = 0;
+	while (i < EMU_REPLAY_MAX_SENSORS) {
+		free(r->streams[i].ns);
+		free(r->streams[i].values);
+		free(r->streams[i].blocks);
+		i++;
+	}
+	if (r->recording) {
+		emu_rec_unmap(&r->reader);
+	} else if (r->map) {
+		munmap((void *)r->map, r->size);
+	}
+	memset(r, 0, sizeof(*r));
+}
+
+static inline int64_t emu_replay_block_first_ns(const struct emu_replay *r, const struct emu_replay_stream *s, uint32_t b)
+{
+	return r->reader.index[s->blocks[b]].first_ns;
+}
+
+static inline int64_t emu_replay_block_last_ns(const struct emu_replay *r, const struct emu_replay_stream *s, uint32_t b)
+{
+	return r->reader.index[s->blocks[b]].last_ns;
+}
+
+// Indexes the capture at path for the num sensors of names. ENODATA if
+// it has none of their readings.
+static inline bool emu_replay_open(struct emu_replay *r, const char *path, const char **names, int num,
+					double speed, bool loop, double seek_s)
+{
+	bool success = false;
+	int fd = -1;
+	struct stat st;
+	void *map = MAP_FAILED;
+	int i = 0;
+
+	memset(r, 0, sizeof(*r));
+	r->num_sensors = num < EMU_REPLAY_MAX_SENSORS ? num : EMU_REPLAY_MAX_SENSORS;
+	r->speed = speed > 0 ? speed : 1.0;
+	r->loop = loop;
+
+	if (emu_rec_map(&r->reader, path)) {
+		r->recording = true;
+		if (!emu_replay_index_recording(r, names)) {
+			goto done;
+		}
+	} else if (errno == EINVAL) {
+		fd = open(path, O_RDONLY);
+		if (fd == -1) {
+			goto done;
+		}
+		if (fstat(fd, &st) == -1) {
+			goto done;
+		}
+		if (!st.st_size) {
+			errno = ENODATA;
+			goto done;
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			goto done;
+		}
+		r->map = (const char *)map;
+		r->size = st.st_size;
+		if (!emu_replay_index_text(r, names)) {
+			goto done;
+		}
+	} else {
+		goto done;
+	}
+
+	r->first_ns = INT64_MAX;
+	r->last_ns = INT64_MIN;
+	while (i < r->num_sensors) {
+		const struct emu_replay_stream *s = &r->streams[i];
+		if (s->num) {
+			int64_t first = r->recording ? emu_replay_block_first_ns(r, s, 0) : s->ns[0];
+			int64_t last = r->recording ? emu_replay_block_last_ns(r, s, s->num_blocks - 1) : s->ns[s->num - 1];
+			r->first_ns = first < r->first_ns ? first : r->first_ns;
+			r->last_ns = last > r->last_ns ? last : r->last_ns;
+		}
+		i++;
+	}
+	if (r->first_ns == INT64_MAX) {
+		errno = ENODATA;
+		goto done;
+	}
+	r->from_ns = r->first_ns + (int64_t)(seek_s * 1E9);
+
+	success = true;
+
+done:
+	if (fd != -1) {
+		close(fd);
+	}
+	if (!success) {
+		int e = errno;
+		emu_replay_close(r);
+		errno = e;
+	}
+
+	return success;
+}
+
+// From the beginning of one pass of the capture to the next.
+static inline int64_t emu_replay_period_ns(const struct emu_replay *r)
+{
+	return r->last_ns - r->first_ns + EMU_REPLAY_LOOP_GAP_MS * 1000000LL;
+}
+
+// Moves the cursor to the first reading of its sensor at or after ns.
+static inline bool emu_replay_seek(const struct emu_replay *r, struct emu_replay_cursor *c, int64_t ns)
+{
+	const struct emu_replay_stream *s = &r->streams[c->sensor];
+
+	if (!r->recording) {
+		uint32_t lo = 0;
+		uint32_t hi = s->num;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (s->ns[mid] < ns) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		c->next = lo;
+		return true;
+	}
+
+	c->block = 0;
+	c->pos = 0;
+	c->samples->num = 0;
+	while (c->block < s->num_blocks && emu_replay_block_last_ns(r, s, c->block) < ns) {
+		c->block++;
+	}
+	if (c->block == s->num_blocks) {
+		return true;
+	}
+	if (!emu_rec_decode(&r->reader, s->blocks[c->block], c->samples)) {
+		return false;
+	}
+	c->block++;
+	while (c->pos < c->samples->num && c->samples->ns[c->pos] < ns) {
+		c->pos++;
+	}
+
+	return true;
+}
+
+// Sets up a cursor into sensor, at the reading due now.
+static inline bool emu_replay_cursor_init(struct emu_replay *r, struct emu_replay_cursor *c, int sensor)
+{
+	memset(c, 0, sizeof(*c));
+	c->sensor = sensor;
+	if (r->recording) {
+		c->samples = (struct emu_rec_samples *)malloc(sizeof(*c->samples));
+		if (!c->samples) {
+			return false;
+		}
+		c->samples->num = 0;
+	}
+
+	int64_t now = emu_replay_now();
+	int64_t none = 0;
+	__atomic_compare_exchange_n(&r->started_ns, &none, now, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	int64_t started = __atomic_load_n(&r->started_ns, __ATOMIC_ACQUIRE);
+
+	int64_t at = r->from_ns + (int64_t)((now - started) * r->speed);
+	if (r->loop && at > r->last_ns) {
+		int64_t period = emu_replay_period_ns(r);
+		c->pass = (at - r->first_ns) / period;
+		at = r->first_ns + (at - r->first_ns) % period;
+	}
+
+	return emu_replay_seek(r, c, at);
+}
+
+static inline void emu_replay_cursor_free(struct emu_replay_cursor *c)
+{
+	free(c->samples);
+	c->samples = NULL;
+}
+
+// Puts the next reading of the cursor's sensor, as "<value>|<value>|...",
+// in text. Returns when it's due, or -1 if the replay is over.
+static inline int64_t emu_replay_next(struct emu_replay *r, struct emu_replay_cursor *c, char *text, size_t size)
+{
+	const struct emu_replay_stream *s = &r->streams[c->sensor];
+	int64_t ns = 0;
+
+	while (1) {
+		if (!r->recording && c->next < s->num) {
+			ns = s->ns[c->next];
+			const char *values = r->map + s->values[c->next];
+			const char *eol = (const char *)memchr(values, '\n', r->map + r->size - values);
+			size_t len = (eol ? eol : r->map + r->size) - values;
+			len = len < size - 1 ? len : size - 1;
+			memcpy(text, values, len);
+			text[len] = '\0';
+			c->next++;
+			break;
+		}
+
+		if (r->recording) {
+			if (c->pos == c->samples->num && c->block < s->num_blocks) {
+				c->pos = 0;
+				c->samples->num = 0;
+				if (!emu_rec_decode(&r->reader, s->blocks[c->block], c->samples)) {
+					c->samples->num = 0;
+				}
+				c->block++;
+				continue;
+			}
+			if (c->pos < c->samples->num) {
+				const struct emu_rec_samples *b = c->samples;
+				ns = b->ns[c->pos];
+				size_t len = 0;
+				int col = 0;
+				text[0] = '\0';
+				while (col < b->columns && len < size) {
+					int wrote = snprintf(text + len, size - len, col ? "|%.9g" : "%.9g", b->v[col][c->pos]);
+					len += wrote > 0 ? wrote : 0;
+					col++;
+				}
+				c->pos++;
+				break;
+			}
+		}
+
+		// The end of the capture.
+		if (!r->loop || !s->num) {
+			return -1;
+		}
+		c->pass++;
+		if (!emu_replay_seek(r, c, r->first_ns)) {
+			return -1;
+		}
+	}
+
+	int64_t capture_ns = (int64_t)c->pass * emu_replay_period_ns(r) + ns - r->from_ns;
+
+	return r->started_ns + (int64_t)(capture_ns / r->speed);
+}
+
+#endif /* SENSOR_EMULATION_REPLAY_H */
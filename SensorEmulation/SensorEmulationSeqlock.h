@@ -0,0 +1,111 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationSeqlock.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationSeqlock.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationSeqlock.h
+ *
+ * Working:
+ *
+ * The last value of a sensor - an event, a frame of readings - handed
+ * from the one thread that receives it to any that want it, without a
+ * lock: a sequence lock. The writer makes the sequence number odd,
+ * copies the value in and makes it even again; a reader copies the value
+ * out between two reads of the number and tries again if it was odd or
+ * changed, so it never gets half of one value and half of another, and
+ * never holds the writer up.
+ *
+ * The value is kept as 32-bit words read and written with relaxed atomic
+ * operations, so that a reader racing the writer reads whole words - the
+ * copy it then throws away included - rather than a data race. The
+ * number emu_seq_read() returns goes up with every value, so a reader
+ * that keeps the one it last saw knows whether there's been a new value
+ * since: the "changed since the last read" the sensors want.
+ *
+ * There must be only one writer at a time; readers are any number.
+ */
+
+#ifndef SENSOR_EMULATION_SEQLOCK_H
+#define SENSOR_EMULATION_SEQLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sched.h>
+
+// The words a value of size bytes takes.
+#define EMU_SEQ_WORDS(size) (((size) + 3) / 4)
+
+// Before any value has been written, emu_seq_read() returns 0 and copies
+// zeroes out, if the words are zeroed like a static.
+struct emu_seq {
+	uint32_t seq; /* Odd while a value is being written. */
+};
+
+static inline uint32_t emu_seq_current(const struct emu_seq *s)
+{
+	return __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) & ~1U;
+}
+
+// Only from the writer.
+static inline void emu_seq_write(struct emu_seq *s, uint32_t *words, const void *from, size_t size)
+{
+	uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	const unsigned char *p = (const unsigned char *)from;
+	size_t i = 0;
+	while (i < EMU_SEQ_WORDS(size)) {
+		uint32_t w = 0;
+		size_t left = size - i * 4;
+		memcpy(&w, p + i * 4, left < 4 ? left : 4);
+		__atomic_store_n(&words[i], w, __ATOMIC_RELAXED);
+		i++;
+	}
+
+	__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// The last value into to, and its number.
+static inline uint32_t emu_seq_read(const struct emu_seq *s, const uint32_t *words, void *to, size_t size)
+{
+	unsigned char *p = (unsigned char *)to;
+	while (1) {
+		uint32_t before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			sched_yield(); // The writer may have been preempted half way.
+			continue;
+		}
+
+		size_t i = 0;
+		while (i < EMU_SEQ_WORDS(size)) {
+			uint32_t w = __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+			size_t left = size - i * 4;
+			memcpy(p + i * 4, &w, left < 4 ? left : 4);
+			i++;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		uint32_t after = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+		if (before == after) {
+			return before;
+		}
+	}
+}
+
+#endif
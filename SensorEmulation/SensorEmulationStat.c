@@ -0,0 +1,360 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationStat.c is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationStat.c is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationStat.c
+ *
+ * Working:
+ *
+ * Prints the statistics pages (SensorEmulationStats.h) of the generator,
+ * the relay and the HAL - the ones named, "relay", "hal", ... or paths to
+ * them or to the copies of them taken on a signal, or else all of the
+ * ones in -d (EMU_STATS_DIR). Only the sensors that saw any frames are
+ * printed. With -m, the pages are added up, sensor by sensor by name,
+ * and printed as one - e.g. the relays of all the guests.
+ *
+ * Without -i, it prints the counters since the process started. With -i
+ * seconds, it reads the pages every interval and prints the difference
+ * between the last two reads instead - per second, and the latency of the
+ * frames handed on in the interval only - -c times, or until interrupted.
+ *
+ * The latencies and the intervals between receives are from the
+ * histograms of the page (SensorEmulationHistogram.h), so a percentile is
+ * to within 3%.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SensorEmulationStats.h"
+
+#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+
+#define MAX_PAGES 16
+
+struct page {
+	char path[512];
+	struct emu_stats_page now;
+	struct emu_stats_page before;
+	bool read;
+	int merged; /* Pages added up into this one, with -m. */
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-d dir] [-i interval seconds] [-c count] [-m] [process | page]...\n", prog);
+}
+
+static bool read_page(struct page *p)
+{
+	bool success = false;
+	struct stat st;
+	void *map = MAP_FAILED;
+
+	int fd = open(p->path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		goto done;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		goto done;
+	}
+	const struct emu_stats_page *page = (const struct emu_stats_page *)map;
+	if (!emu_stats_valid(page, st.st_size)) {
+		errno = EPROTO;
+		goto done;
+	}
+
+	emu_stats_snapshot(page, &p->now);
+
+	success = true;
+
+done:
+	if (map != MAP_FAILED) {
+		munmap(map, st.st_size);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+
+	return success;
+}
+
+static bool running(int pid)
+{
+	return !kill(pid, 0) || errno == EPERM;
+}
+
+static void print_ns(double ns)
+{
+	if (ns < 1E3) {
+		printf(" %7.0fns", ns);
+	} else if (ns < 1E6) {
+		printf(" %7.1fus", ns / 1E3);
+	} else if (ns < 1E9) {
+		printf(" %7.1fms", ns / 1E6);
+	} else {
+		printf(" %7.2fs ", ns / 1E9);
+	}
+}
+
+// The counters of s, less those of before if any, per second over seconds.
+static void print_sensor(const struct emu_stats_sensor *s, const struct emu_stats_sensor *before, double seconds)
+{
+	static struct emu_stats_sensor diff;
+	struct emu_stats_sensor *d = &diff;
+	*d = *s;
+	if (before) {
+		emu_stats_add(d, before, -1);
+	}
+
+	double per = seconds > 0 ? seconds : 1;
+	int64_t queued = (int64_t)(s->queued_in - s->queued_out);
+	printf("%-16.16s %10.0f %10.0f %10.1f %10.1f %7llu %6llu %7llu %6lld", s->name, d->frames_in / per,
+			d->frames_out / per, d->bytes_in / per / 1024, d->bytes_out / per / 1024,
+			(unsigned long long)d->drops, (unsigned long long)d->reconnects,
+			(unsigned long long)d->partial_frames, (long long)(queued > 0 ? queued : 0));
+
+	print_ns(emu_hist_percentile(&d->interval, 0.5));
+	print_ns(emu_hist_percentile(&d->interval, 0.99));
+	if (d->latency.count) {
+		print_ns(emu_hist_mean(&d->latency));
+		print_ns(emu_hist_percentile(&d->latency, 0.5));
+		print_ns(emu_hist_percentile(&d->latency, 0.99));
+		print_ns(emu_hist_percentile(&d->latency, 1));
+	}
+	printf("\n");
+}
+
+static void print_page(const struct page *p, bool diff, double seconds)
+{
+	const struct emu_stats_page *page = &p->now;
+	struct timespec t = { 0, 0 };
+	clock_gettime(CLOCK_REALTIME, &t);
+	double up = ((int64_t)t.tv_sec * 1000000000LL + t.tv_nsec - page->start_ns) / 1E9;
+
+	if (p->merged) {
+		printf("%d pages added up%s\n", p->merged, diff ? "" : " - since they started");
+	} else {
+		printf("%s, pid %d, %s, up %.0f s%s\n", page->process, page->pid,
+				running(page->pid) ? "running" : "exited", up, diff ? "" : " - since it started");
+	}
+	printf("%-16s %10s %10s %10s %10s %7s %6s %7s %6s %9s %9s %9s %9s %9s %9s\n", "sensor",
+			diff ? "in/s" : "in", diff ? "out/s" : "out", diff ? "KB in/s" : "KB in", diff ? "KB out/s" : "KB out",
+			"drops", "reconn", "partial", "queued", "gap p50", "gap p99", "mean", "p50", "p99", "max");
+
+	uint32_t n = 0;
+	while (n < page->num_sensors) {
+		const struct emu_stats_sensor *s = &page->sensors[n];
+		const struct emu_stats_sensor *before = diff ? &p->before.sensors[n] : NULL;
+		if (s->frames_in || s->frames_out || s->reconnects) {
+			print_sensor(s, before, diff ? seconds : 0);
+		}
+		n++;
+	}
+	printf("\n");
+}
+
+// The pages read, added up sensor by sensor by name into merged.
+static void merge_pages(const struct page *pages, int num, struct page *merged)
+{
+	struct emu_stats_page *to = &merged->now;
+	memset(to, 0, sizeof(*to));
+	merged->merged = 0;
+
+	int i = 0;
+	while (i < num) {
+		const struct emu_stats_page *from = &pages[i].now;
+		if (!pages[i].read) {
+			i++;
+			continue;
+		}
+		uint32_t n = 0;
+		while (n < from->num_sensors) {
+			uint32_t k = 0;
+			while (k < to->num_sensors && strcmp(to->sensors[k].name, from->sensors[n].name)) {
+				k++;
+			}
+			if (k == to->num_sensors && k < EMU_STATS_MAX_SENSORS) {
+				memcpy(to->sensors[k].name, from->sensors[n].name, EMU_STATS_NAME_MAX);
+				to->num_sensors++;
+			}
+			if (k < to->num_sensors) {
+				emu_stats_add(&to->sensors[k], &from->sensors[n], 1);
+			}
+			n++;
+		}
+		merged->merged++;
+		i++;
+	}
+}
+
+static int add_page(struct page *pages, int num, const char *dir, const char *name)
+{
+	if (num == MAX_PAGES) {
+		return num;
+	}
+	struct page *p = &pages[num];
+	memset(p, 0, sizeof(*p));
+	if (strchr(name, '/')) {
+		snprintf(p->path, sizeof(p->path), "%s", name);
+	} else {
+		snprintf(p->path, sizeof(p->path), "%s/" EMU_STATS_PREFIX "%s" EMU_STATS_SUFFIX, dir, name);
+	}
+
+	return num + 1;
+}
+
+// All of the pages in dir, but not the ones being set up.
+static int find_pages(struct page *pages, const char *dir)
+{
+	int num = 0;
+	DIR *d = opendir(dir);
+	if (!d) {
+		ERR("%s - %s\n", dir, strerror(errno));
+		return 0;
+	}
+
+	struct dirent *e = NULL;
+	while ((e = readdir(d))) {
+		size_t len = strlen(e->d_name);
+		size_t prefix = strlen(EMU_STATS_PREFIX);
+		size_t suffix = strlen(EMU_STATS_SUFFIX);
+		if (len > prefix + suffix && !strncmp(e->d_name, EMU_STATS_PREFIX, prefix) &&
+				!strcmp(e->d_name + len - suffix, EMU_STATS_SUFFIX)) {
+			char name[256];
+			snprintf(name, sizeof(name), "%.*s", (int)(len - prefix - suffix), e->d_name + prefix);
+			num = add_page(pages, num, dir, name);
+		}
+	}
+	closedir(d);
+
+	return num;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = EMU_STATS_DIR;
+	double interval_s = 0;
+	long count = -1;
+	static struct page pages[MAX_PAGES];
+	static struct page merged;
+	bool merge = false;
+	int num = 0;
+	int i = 0;
+
+	int opt = -1;
+	while ((opt = getopt(argc, argv, "d:i:c:mh")) != -1) {
+		switch (opt) {
+			case 'd':
+				dir = optarg;
+				break;
+			case 'i':
+				interval_s = atof(optarg);
+				break;
+			case 'c':
+				count = atol(optarg);
+				break;
+			case 'm':
+				merge = true;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (interval_s < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	while (optind < argc) {
+		num = add_page(pages, num, dir, argv[optind]);
+		optind++;
+	}
+	if (!num) {
+		num = find_pages(pages, dir);
+	}
+	if (!num) {
+		ERR("No statistics pages in %s\n", dir);
+		return 1;
+	}
+
+	bool any = false;
+	i = 0;
+	while (i < num) {
+		pages[i].read = read_page(&pages[i]);
+		if (!pages[i].read) {
+			ERR("%s - %s\n", pages[i].path, strerror(errno));
+		} else if (!interval_s && !merge) {
+			print_page(&pages[i], false, 0);
+		}
+		any = any || pages[i].read;
+		i++;
+	}
+	if (merge && any) {
+		merge_pages(pages, num, &merged);
+		if (!interval_s) {
+			print_page(&merged, false, 0);
+		}
+	}
+	if (!interval_s || !any) {
+		return any ? 0 : 1;
+	}
+
+	while (count < 0 || count-- > 0) {
+		struct timespec t = { (time_t)interval_s, (long)((interval_s - (time_t)interval_s) * 1E9) };
+		nanosleep(&t, NULL);
+
+		bool same = true;
+		i = 0;
+		while (i < num) {
+			struct page *p = &pages[i];
+			p->before = p->now;
+			bool had = p->read;
+			p->read = read_page(p);
+			// A page of a restarted process starts over.
+			bool restarted = p->read != had || p->now.pid != p->before.pid || p->now.start_ns != p->before.start_ns;
+			if (merge) {
+				same = same && !restarted;
+			} else if (p->read) {
+				print_page(p, !restarted, restarted ? 0 : interval_s);
+			}
+			i++;
+		}
+		if (merge) {
+			merged.before = merged.now;
+			merge_pages(pages, num, &merged);
+			print_page(&merged, same, same ? interval_s : 0);
+		}
+		fflush(stdout);
+	}
+
+	return 0;
+}
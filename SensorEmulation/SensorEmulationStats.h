@@ -0,0 +1,343 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationStats.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationStats.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationStats.h
+ *
+ * Working:
+ *
+ * The generator, the relay and the HAL each publish their counters in a
+ * page of shared memory - a file, EMU_STATS_DIR/sensor_emu_<process>.stats
+ * (/dev/shm by default, DATA_DIR for the HAL), mapped by the process and
+ * read by SensorEmulationStat whenever it likes, without stopping or
+ * slowing the process down.
+ *
+ * The page is a struct emu_stats_page - a header with EMU_STATS_MAGIC,
+ * EMU_STATS_VERSION and the sizes of the structs, so that a reader can
+ * tell a page it doesn't understand, then a struct emu_stats_sensor per
+ * sensor with
+ *
+ *	frames and bytes in and out,
+ *	drops, reconnects and partial frames,
+ *	the frames queued in and out of the process - the queue depth is
+ *	their difference - and the bytes handed on but not sent yet,
+ *	histograms (SensorEmulationHistogram.h) of the time between one
+ *	receive and the next, and of the latency - the time a frame spends
+ *	in the process - in ns.
+ *
+ * Every counter has a single writer thread - the one receiving a sensor's
+ * frames or the one handing them on - so it's updated with a relaxed
+ * atomic load and store, no lock and no read-modify-write, and a sensor's
+ * counters are a cache line apart from the next one's. A reader sees
+ * every counter whole, though not all of them at the same instant.
+ *
+ * The page is set up under another name and renamed into place, so a
+ * reader never sees half of one, and one of an earlier run of the process
+ * stays valid for as long as a reader has it mapped. Until
+ * emu_stats_open() succeeds, the counters go to a page of the process's
+ * own that nobody reads.
+ *
+ * After emu_stats_dump_on(signal), the signal writes a copy of the page,
+ * as it is at the time, to EMU_STATS_DIR/sensor_emu_<process>.<pid>-<n>.snap
+ * for the nth signal. SensorEmulationStat reads the copies like the pages,
+ * and adds up any number of them, of different processes or runs, with -m.
+ */
+
+#ifndef SENSOR_EMULATION_STATS_H
+#define SENSOR_EMULATION_STATS_H
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SensorEmulationClock.h"
+#include "SensorEmulationHistogram.h"
+
+#define EMU_STATS_MAGIC "SEMUSTAT"
+#define EMU_STATS_VERSION 3
+#define EMU_STATS_MAX_SENSORS 16
+#define EMU_STATS_NAME_MAX 32
+
+#ifndef EMU_STATS_DIR
+#define EMU_STATS_DIR "/dev/shm"
+#endif
+#define EMU_STATS_PREFIX "sensor_emu_"
+#define EMU_STATS_SUFFIX ".stats"
+#define EMU_STATS_SNAP_SUFFIX ".snap"
+
+struct emu_stats_sensor {
+	char name[EMU_STATS_NAME_MAX];
+
+	/* The receiving thread's. */
+	uint64_t frames_in;
+	uint64_t bytes_in;
+	uint64_t partial_frames;
+	uint64_t reconnects;
+	uint64_t drops;
+	uint64_t queued_in;
+	uint64_t last_in_ns;
+	struct emu_hist interval;
+
+	/* The handing on thread's. */
+	uint64_t frames_out __attribute__((aligned(64)));
+	uint64_t bytes_out;
+	uint64_t queued_out;
+	uint64_t queued_bytes; /* Not a count - how many there are, as last looked at. */
+	struct emu_hist latency;
+} __attribute__((aligned(64)));
+
+/* The uint64_t counters of a struct emu_stats_sensor, from frames_in on. */
+#define EMU_STATS_COUNTERS ((sizeof(struct emu_stats_sensor) - offsetof(struct emu_stats_sensor, frames_in)) / sizeof(uint64_t))
+
+struct emu_stats_page {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t sensor_size;
+	uint32_t num_sensors;
+	int32_t pid;
+	uint32_t pad;
+	int64_t start_ns; /* CLOCK_REALTIME. */
+	char process[EMU_STATS_NAME_MAX];
+	struct emu_stats_sensor sensors[EMU_STATS_MAX_SENSORS];
+};
+
+static struct emu_stats_page emu_stats_unpublished;
+static struct emu_stats_page *emu_stats = &emu_stats_unpublished;
+static char emu_stats_snap_path[256]; /* Up to the number of the copy. */
+static unsigned int emu_stats_snaps;
+
+static inline bool emu_stats_valid(const struct emu_stats_page *p, size_t size)
+{
+	return size >= sizeof(*p) && !memcmp(p->magic, EMU_STATS_MAGIC, sizeof(p->magic)) &&
+		p->version == EMU_STATS_VERSION && p->page_size == sizeof(*p) &&
+		p->sensor_size == sizeof(struct emu_stats_sensor) && p->num_sensors <= EMU_STATS_MAX_SENSORS;
+}
+
+// A copy of the valid page from, counter by counter.
+static inline void emu_stats_snapshot(const struct emu_stats_page *from, struct emu_stats_page *to)
+{
+	memcpy(to, from, offsetof(struct emu_stats_page, sensors));
+	uint32_t n = 0;
+	while (n < from->num_sensors) {
+		memcpy(to->sensors[n].name, from->sensors[n].name, EMU_STATS_NAME_MAX);
+		const uint64_t *counter = &from->sensors[n].frames_in;
+		uint64_t *copy = &to->sensors[n].frames_in;
+		size_t i = 0;
+		while (i < EMU_STATS_COUNTERS) {
+			copy[i] = __atomic_load_n(&counter[i], __ATOMIC_RELAXED);
+			i++;
+		}
+		n++;
+	}
+}
+
+// Adds the counters of from to s, by sign - 1, or -1 to take an earlier
+// copy of s away.
+static inline void emu_stats_add(struct emu_stats_sensor *s, const struct emu_stats_sensor *from, int sign)
+{
+	s->frames_in += sign * from->frames_in;
+	s->bytes_in += sign * from->bytes_in;
+	s->partial_frames += sign * from->partial_frames;
+	s->reconnects += sign * from->reconnects;
+	s->drops += sign * from->drops;
+	s->queued_in += sign * from->queued_in;
+	s->frames_out += sign * from->frames_out;
+	s->bytes_out += sign * from->bytes_out;
+	s->queued_out += sign * from->queued_out;
+	s->queued_bytes += sign * from->queued_bytes;
+	if (sign > 0) {
+		emu_hist_merge(&s->interval, &from->interval);
+		emu_hist_merge(&s->latency, &from->latency);
+	} else {
+		emu_hist_subtract(&s->interval, &from->interval);
+		emu_hist_subtract(&s->latency, &from->latency);
+	}
+}
+
+// Publishes the page of process with the sensors' names.
+static inline bool emu_stats_open(const char *process, const char **names, int num)
+{
+	char path[256];
+	char tmp[sizeof(path) + 16];
+	bool success = false;
+	struct emu_stats_page *p = MAP_FAILED;
+
+	if (num > EMU_STATS_MAX_SENSORS) {
+		num = EMU_STATS_MAX_SENSORS;
+	}
+	snprintf(path, sizeof(path), EMU_STATS_DIR "/" EMU_STATS_PREFIX "%s" EMU_STATS_SUFFIX, process);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		return false;
+	}
+	if (ftruncate(fd, sizeof(*p)) == -1) {
+		goto done;
+	}
+	p = (struct emu_stats_page *)mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		goto done;
+	}
+
+	memcpy(p, emu_stats, sizeof(*p)); // Whatever was counted so far.
+	memcpy(p->magic, EMU_STATS_MAGIC, sizeof(p->magic));
+	p->version = EMU_STATS_VERSION;
+	p->page_size = sizeof(*p);
+	p->sensor_size = sizeof(struct emu_stats_sensor);
+	p->num_sensors = num;
+	p->pid = getpid();
+
+	struct timespec t = { 0, 0 };
+	emu_clock_gettime(CLOCK_REALTIME, &t);
+	p->start_ns = (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+	strncpy(p->process, process, sizeof(p->process) - 1);
+	int i = 0;
+	while (i < num) {
+		strncpy(p->sensors[i].name, names[i], sizeof(p->sensors[i].name) - 1);
+		i++;
+	}
+
+	if (rename(tmp, path) == -1) {
+		munmap(p, sizeof(*p));
+		goto done;
+	}
+	snprintf(emu_stats_snap_path, sizeof(emu_stats_snap_path), EMU_STATS_DIR "/" EMU_STATS_PREFIX "%s.%d-",
+			process, (int)getpid());
+	__atomic_store_n(&emu_stats, p, __ATOMIC_RELEASE);
+
+	success = true;
+
+done:
+	close(fd);
+	if (!success) {
+		unlink(tmp);
+	}
+
+	return success;
+}
+
+static inline int64_t emu_stats_now(void)
+{
+	struct timespec t = { 0, 0 };
+	emu_clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// Only from the counter's own writer thread.
+static inline void emu_stats_count(uint64_t *counter, uint64_t by)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + by, __ATOMIC_RELAXED);
+}
+
+#define EMU_STATS_COUNT(n, counter, by) \
+	emu_stats_count(&__atomic_load_n(&emu_stats, __ATOMIC_ACQUIRE)->sensors[n].counter, by)
+
+// Frames of sensor n received at in_ns, in one receive.
+static inline void emu_stats_received(int n, uint64_t frames, size_t bytes, int64_t in_ns)
+{
+	struct emu_stats_sensor *s = &__atomic_load_n(&emu_stats, __ATOMIC_ACQUIRE)->sensors[n];
+	uint64_t last_ns = __atomic_load_n(&s->last_in_ns, __ATOMIC_RELAXED);
+
+	emu_stats_count(&s->frames_in, frames);
+	emu_stats_count(&s->bytes_in, bytes);
+	if (last_ns && (uint64_t)in_ns >= last_ns) {
+		emu_hist_record(&s->interval, in_ns - last_ns);
+	}
+	__atomic_store_n(&s->last_in_ns, in_ns, __ATOMIC_RELAXED);
+}
+
+// Frames of sensor n handed on, since_ns after they came in.
+static inline void emu_stats_handed_on(int n, uint64_t frames, size_t bytes, int64_t since_ns)
+{
+	struct emu_stats_sensor *s = &__atomic_load_n(&emu_stats, __ATOMIC_ACQUIRE)->sensors[n];
+	int64_t latency = emu_stats_now() - since_ns;
+	if (latency < 0) {
+		latency = 0;
+	}
+
+	emu_stats_count(&s->frames_out, frames);
+	emu_stats_count(&s->bytes_out, bytes);
+	emu_hist_record_n(&s->latency, latency, frames);
+}
+
+// The bytes of sensor n handed on and not sent yet.
+static inline void emu_stats_queued(int n, uint64_t bytes)
+{
+	struct emu_stats_sensor *s = &__atomic_load_n(&emu_stats, __ATOMIC_ACQUIRE)->sensors[n];
+	__atomic_store_n(&s->queued_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static inline void emu_stats_dump(int sig)
+{
+	(void)sig;
+
+	// Only async-signal-safe calls from here on.
+	int error = errno;
+	char path[sizeof(emu_stats_snap_path) + 32];
+	size_t len = strlen(emu_stats_snap_path);
+	memcpy(path, emu_stats_snap_path, len);
+
+	char digits[12];
+	int num = 0;
+	unsigned int snap = ++emu_stats_snaps;
+	do {
+		digits[num++] = '0' + snap % 10;
+		snap /= 10;
+	} while (snap);
+	while (num) {
+		path[len++] = digits[--num];
+	}
+	memcpy(path + len, EMU_STATS_SNAP_SUFFIX, sizeof(EMU_STATS_SNAP_SUFFIX));
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1) {
+		const char *page = (const char *)emu_stats;
+		size_t left = sizeof(*emu_stats);
+		ssize_t wrote = 0;
+		while (left && (wrote = write(fd, page, left)) > 0) {
+			page += wrote;
+			left -= wrote;
+		}
+		close(fd);
+	}
+	errno = error;
+}
+
+// Copies the page on sig, after emu_stats_open().
+static inline void emu_stats_dump_on(int sig)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = emu_stats_dump;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(sig, &sa, NULL);
+}
+
+#endif
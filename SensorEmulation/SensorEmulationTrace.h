@@ -0,0 +1,219 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   SensorEmulationTrace.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SensorEmulationTrace.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SensorEmulationTrace.h
+ *
+ * Working:
+ *
+ * When TRACE_HOPS is defined, every frame carries a struct emu_trace
+ * right after its fixed-size text readings, i.e. a frame of readings_size
+ * bytes goes on the wire as readings_size + EMU_TRACE_SIZE bytes. Each
+ * stage the frame passes through stamps its CLOCK_MONOTONIC time (through
+ * emu_clock_gettime(), so virtual time too) into the hop's slot -
+ *
+ *	capture     - the device (or the generator) got the reading
+ *	dev_send    - the device server wrote the frame to the socket
+ *	relay_recv  - the relay received it
+ *	relay_send  - the relay sent it on towards the guest
+ *	hal_recv    - the HAL server received it
+ *	hal_handoff - the HAL server wrote it to the pipe / sensor_data[]
+ *	hal_deliver - dummy_poll() returned it to the framework
+ *
+ * On the device, emu_export_publish() (SensorEmulationExport.h) takes the
+ * capture time along with the sample, in its captured_ns, and the
+ * exporter thread stamps it into the frame it makes of the sample.
+ *
+ * The HAL accounts the delivered frames per sensor and writes a line every
+ * EMU_TRACE_REPORT_EVERY of them with the p50, the p99 and the max time
+ * spent getting to each hop from the previous stamped one, and from the
+ * first one to the last - end to end - from histograms of them
+ * (SensorEmulationHistogram.h), so that the device's
+ * nanosleep(), the relay's usleep(1000) and the HAL's usleep(delay_us)
+ * show up in dev_send, relay_recv and hal_deliver respectively.
+ *
+ * All of the processes on the data path have to be built with the same
+ * TRACE_HOPS setting or the frames won't line up. The load generator (-L)
+ * doesn't trace. The hops that cross from one process to the next are
+ * only meaningful when both read the same clock - the same host, or
+ * VIRTUAL_TIME. Across a real device and the host, only the hops within
+ * one side are.
+ *
+ * Without TRACE_HOPS, EMU_TRACE_SIZE is 0 and the EMU_TRACE_*() macros
+ * are no-ops.
+ */
+
+#ifndef SENSOR_EMULATION_TRACE_H
+#define SENSOR_EMULATION_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "SensorEmulationClock.h"
+#include "SensorEmulationHistogram.h"
+
+enum emu_hop {
+	EMU_HOP_CAPTURE = 0,
+	EMU_HOP_DEV_SEND = 1,
+	EMU_HOP_RELAY_RECV = 2,
+	EMU_HOP_RELAY_SEND = 3,
+	EMU_HOP_HAL_RECV = 4,
+	EMU_HOP_HAL_HANDOFF = 5,
+	EMU_HOP_HAL_DELIVER = 6,
+	EMU_HOPS = 7,
+};
+
+static inline int64_t emu_trace_now(void)
+{
+	struct timespec t = { 0, 0 };
+	emu_clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+#ifdef TRACE_HOPS
+
+#define EMU_TRACE_MAGIC 0x54524345 /* TRCE */
+#define EMU_TRACE_REPORT_EVERY 1000
+
+struct emu_trace {
+	uint32_t magic;
+	uint32_t seq; /* Per stream, from the device. */
+	int64_t stamp_ns[EMU_HOPS]; /* 0 if the hop wasn't stamped. */
+};
+
+#define EMU_TRACE_SIZE sizeof(struct emu_trace)
+
+// The trailer of a frame isn't aligned, hence memcpy() in and out of it.
+static inline void emu_trace_init(char *frame, size_t text_size, uint32_t seq, int64_t capture_ns)
+{
+	struct emu_trace t;
+	memset(&t, 0, sizeof(t));
+	t.magic = EMU_TRACE_MAGIC;
+	t.seq = seq;
+	t.stamp_ns[EMU_HOP_CAPTURE] = capture_ns ? capture_ns : emu_trace_now();
+
+	memcpy(frame + text_size, &t, sizeof(t));
+}
+
+static inline void emu_trace_stamp(char *frame, size_t text_size, int hop, int64_t ns)
+{
+	memcpy(frame + text_size + offsetof(struct emu_trace, stamp_ns) + hop * sizeof(int64_t), &ns, sizeof(ns));
+}
+
+// For a run of num frames of frame_size bytes each, trailers included.
+static inline void emu_trace_stamp_frames(char *frames, size_t frame_size, int num, int hop, int64_t ns)
+{
+	int i = 0;
+	while (i < num) {
+		emu_trace_stamp(frames + i * frame_size, frame_size - EMU_TRACE_SIZE, hop, ns);
+		i++;
+	}
+}
+
+// False if the frame wasn't traced by its sender.
+static inline bool emu_trace_read(const char *frame, size_t text_size, struct emu_trace *t)
+{
+	memcpy(t, frame + text_size, sizeof(*t));
+
+	return t->magic == EMU_TRACE_MAGIC;
+}
+
+struct emu_trace_stats {
+	unsigned long long samples;
+	struct emu_hist hop[EMU_HOPS]; /* ns from the previous stamped hop. */
+	struct emu_hist total;
+};
+
+static inline void emu_trace_report(struct emu_trace_stats *s, const char *name, FILE *fp)
+{
+	static const char *emu_hop_name[EMU_HOPS] = {
+							"capture",
+							"dev_send",
+							"relay_recv",
+							"relay_send",
+							"hal_recv",
+							"hal_handoff",
+							"hal_deliver",
+						};
+
+	fprintf(fp, "[%s] %llu samples, p50/p99/max us from the previous hop :", name, s->samples);
+
+	int hop = EMU_HOP_CAPTURE + 1;
+	while (hop < EMU_HOPS) {
+		const struct emu_hist *h = &s->hop[hop];
+		fprintf(fp, " %s %.1f/%.1f/%.1f", emu_hop_name[hop], emu_hist_percentile(h, 0.5) / 1E3,
+				emu_hist_percentile(h, 0.99) / 1E3, emu_hist_percentile(h, 1) / 1E3);
+		hop++;
+	}
+
+	fprintf(fp, " total %.1f/%.1f/%.1f\n", emu_hist_percentile(&s->total, 0.5) / 1E3,
+			emu_hist_percentile(&s->total, 0.99) / 1E3, emu_hist_percentile(&s->total, 1) / 1E3);
+	fflush(fp);
+
+	memset(s, 0, sizeof(*s));
+}
+
+// Accounts a delivered frame, reporting to fp every EMU_TRACE_REPORT_EVERY.
+static inline void emu_trace_account(struct emu_trace_stats *s, const struct emu_trace *t, const char *name, FILE *fp)
+{
+	int64_t first_ns = 0;
+	int64_t last_ns = 0;
+
+	int hop = EMU_HOP_CAPTURE;
+	while (hop < EMU_HOPS) {
+		int64_t ns = t->stamp_ns[hop];
+		if (ns) {
+			if (last_ns) {
+				emu_hist_record(&s->hop[hop], ns > last_ns ? ns - last_ns : 0);
+			} else {
+				first_ns = ns;
+			}
+			last_ns = ns;
+		}
+		hop++;
+	}
+
+	emu_hist_record(&s->total, last_ns > first_ns ? last_ns - first_ns : 0);
+	s->samples++;
+
+	if (fp && s->samples == EMU_TRACE_REPORT_EVERY) {
+		emu_trace_report(s, name, fp);
+	}
+}
+
+#define EMU_TRACE_INIT(frame, text_size, seq, capture_ns) emu_trace_init(frame, text_size, seq, capture_ns)
+#define EMU_TRACE_STAMP(frame, text_size, hop) emu_trace_stamp(frame, text_size, hop, emu_trace_now())
+#define EMU_TRACE_STAMP_FRAMES(frames, frame_size, num, hop) \
+				emu_trace_stamp_frames(frames, frame_size, num, hop, emu_trace_now())
+
+#else
+
+#define EMU_TRACE_SIZE 0
+
+#define EMU_TRACE_INIT(frame, text_size, seq, capture_ns) ((void)(frame), (void)(seq), (void)(capture_ns))
+#define EMU_TRACE_STAMP(frame, text_size, hop) do { } while (0)
+#define EMU_TRACE_STAMP_FRAMES(frames, frame_size, num, hop) do { } while (0)
+
+#endif /* TRACE_HOPS */
+
+#endif /* SENSOR_EMULATION_TRACE_H */
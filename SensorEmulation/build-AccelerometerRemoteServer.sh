@@ -18,4 +18,4 @@
 
 
 set -x
-gcc -Wall -O2 AccelerometerRemoteServer.c -o AccelerometerRemoteServer
+gcc -Wall -O2 AccelerometerRemoteServer.c -lpthread -lm -o AccelerometerRemoteServer
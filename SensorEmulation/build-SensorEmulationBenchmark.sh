@@ -0,0 +1,31 @@
+ #
+ #   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ #   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ #
+ #   build-SensorEmulationBenchmark.sh is free software: you can redistribute it and/or modify
+ #   it under the terms of the GNU General Public License as published by
+ #   the Free Software Foundation, either version 3 of the License, or
+ #   (at your option) any later version.
+ #
+ #   build-SensorEmulationBenchmark.sh is distributed in the hope that it will be useful,
+ #   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ #   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ #   GNU General Public License for more details.
+ #
+ #   You should have received a copy of the GNU General Public License
+ #   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ #
+
+# Builds the benchmark and everything it runs into bench/ - the generator,
+# the relay for remote server readings and the Linux host HAL. Extra
+# flags, like -DVIRTUAL_TIME, are passed on to all of them.
+
+cd "$(dirname "$0")"
+mkdir -p bench
+
+set -x
+gcc -Wall -O2 "$@" SensorEmulationRemoteServer.c -lpthread -lm -lrt -o bench/SensorEmulationRemoteServer
+gcc -Wall -O2 -DREMOTE_SERVER_READINGS "$@" SensorEmulationClientServer.c -lpthread -lrt -o bench/SensorEmulationClientServer
+sh hardware/libsensors_emu/host/build-sensors_emu_host.sh "$@"
+mv hardware/libsensors_emu/host/sensors_emu.so hardware/libsensors_emu/host/sensors_emu_host bench/
+gcc -Wall -O2 SensorEmulationBenchmark.c -o bench/SensorEmulationBenchmark
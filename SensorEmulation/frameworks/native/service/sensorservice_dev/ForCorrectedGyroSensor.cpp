@@ -25,50 +25,29 @@
 
 /************************** Corrected Gyroscope Sensor Emulation **************************/
 
-#include <arpa/inet.h>
-#include <sys/socket.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <errno.h>
-#include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
-#include <signal.h>
-#include <poll.h>
 
-#define ONLY_READING
+// The exporter is the sensors HAL's (libsensors_dev), so that all of the
+// device's sensors go out of one.
+#define EMU_EXPORT_VIA_HAL
+#include "SensorEmulationExport.h"
+#include "SensorEmulationLog.h"
 
-#ifdef ONLY_READING
+// The readings are recorded by the exporter, SensorEmulationExport.h.
 
-static FILE *readings_fp;
-#define INIT_LOG_READING do {\
-				readings_fp = fopen("/data/corrected_gyroscope_readings", "w");\
-			} while(0)
-#define LOG_READING do {\
-			if (readings_fp && send_buf[0]) {\
-				struct timespec t = { 0 };\
-				clock_gettime(CLOCK_REALTIME, &t);\
-				unsigned long long int ts = t.tv_sec * 1E9 + t.tv_nsec;\
-				fprintf(readings_fp, "[Corrected Gyroscope] %lluns : %s\n", ts, send_buf);\
-				fflush(readings_fp);\
-			}\
-		} while (0)
-#else
-
-#define INIT_LOG_READING
-#define LOG_READING
-
-#endif
+static FILE *fp;
 
 #define ONLY_ERROR
 
-static FILE *fp;
 #ifdef ONLY_ERROR
 
 #define INITIALIZE_LOG do {\
 			fp = fopen("/data/corrected_gyro_sensor_log", "w");\
 		} while(0)
-#define ERR(...) (void)(fp && fprintf(fp, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(fp, __VA_ARGS__) && fflush(fp))
+#define ERR(...) EMU_ERR(fp, __VA_ARGS__)
 
 #else
 
@@ -81,7 +60,7 @@ static FILE *fp;
 
 #ifdef ONLY_LOG
 
-#define LOG(...) (void)(fp && fprintf(fp, "%s %d: ", __func__, __LINE__) && fprintf(fp, __VA_ARGS__) && fflush(fp))
+#define LOG(...) EMU_LOG(fp, __VA_ARGS__)
 #define LOG_LINE LOG(" ")
 
 #else
@@ -91,248 +70,17 @@ static FILE *fp;
 
 #endif
 
-#define READINGS_BUF_SIZE 100 /* 1 readings. */
-#define CORRECTED_GYROSCOPE_SERVER_PORT 5006
-
-static int pipefd[2] = { -1, -1 };
-
-struct poll_data {
-	float azimuth;
-	float pitch;
-	float roll;
-};
-
-static int listenfd = -1;
-static int connfd = -1;
-
-static void cleanup(void)
-{
-	LOG("Cleaning up . . .\n");
-
-	if (listenfd != -1) {
-		close(listenfd);
-	}
-	if (connfd != -1) {
-		close(connfd);
-	}
-#ifdef DEBUG
-	if (fp) {
-		fflush(fp);
-	}
-#endif
-
-	LOG("Cleaned!\n");
-}
-
-static bool connected;
-static void *corrected_gyro_readings_server(void *arg)
-{
-	LOG("** Corrected gyroscope device server - Started! **\n");
-
-	(void)arg;
-
-	LOG("Opening socket . . .\n");
-	int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listenfd == -1) {
-		ERR("socket - %s\n", strerror(errno));
-		cleanup();
-		return 0;
-	}
-	LOG("Socket opened!\n");
-
-	LOG("Setting socket options . . .\n");
-	int yes = 1;
-	bool socket_opt_set = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != -1;
-	if (!socket_opt_set) {
-		ERR("setsockopt - %s\n", strerror(errno));
-		cleanup();
-		return 0;
-	}
-	LOG("Set!\n");
-
-	struct sockaddr_in serv_addr = { 0, 0, { 0 }, { 0 } };
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serv_addr.sin_port = htons(CORRECTED_GYROSCOPE_SERVER_PORT);
-
-	int port = CORRECTED_GYROSCOPE_SERVER_PORT;
-
-	LOG("Binding socket . . .\n");
-	bool bound = bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != -1;
-	if (!bound) {
-		ERR("bind error - %s\n", strerror(errno));
-		cleanup();
-		return 0;
-	}
-	LOG("Bound!\n");
-
-	LOG("Trying to listen . . .\n");
-	bool listening = listen(listenfd, 10) != -1;
-	if (!listening) {
-		ERR("listen error - %s\n", strerror(errno));
-		cleanup();
-		return 0;
-	}
-	LOG("Listening at port : %d!\n", port);
-
-	struct timespec t = { .tv_sec = 0, .tv_nsec = 1ULL, };
-
-	int connfd = -1;
-
-	while (1) {
-		connected = false;
-
-		int last_connfd = connfd;
-		if (last_connfd != -1) {
-			LOG("Closing last connection . . .\n");
-			close(last_connfd);
-			LOG("Closed!\n");
-			last_connfd = -1;
-		}
-
-		LOG("Waiting to accept . . .\n");
-		connfd = accept(listenfd, (struct sockaddr *)NULL, NULL);
-		if (connfd == -1) {
-			ERR("accept - %s\n", strerror(errno));
-			cleanup();
-			return 0;
-		}
-		LOG("Accepted!\n");
-
-		connected = true;
-
-		char last_reading[READINGS_BUF_SIZE + 1] = "";
-
-		float azimuth = 0.0f;
-		float pitch = 0.f;
-		float roll = 0.0f;
-
-		struct pollfd fds = { .fd = pipefd[0], .events = POLLIN, 0, };
-
-		while (1) {
-			LOG("Polling . . .\n");
-			bool polled = poll(&fds, 1, -1) != -1;
-			if (!polled) {
-				ERR("poll - %s\n", strerror(errno));
-				continue;
-			}
-			LOG("Polled!\n");
-
-			bool expected = fds.revents == POLLIN;
-			if (!expected) {
-				ERR("Unexpected polling event!\n");
-				continue;
-			}
-			LOG("Expected poll event!\n");
-
-			LOG("Reading poll data . . .\n");
-			struct poll_data p = { 0.0f, 0.0f, 0.0f };
-			int bytes_read = read(pipefd[0], &p, sizeof(p));
-			if (bytes_read == -1) {
-				ERR("read - %s\n", strerror(errno));
-				continue;
-			} else if (!bytes_read) {
-				ERR("Zero bytes read off the pipe.\n");
-			} else {
-				azimuth = p.azimuth;
-				pitch = p.pitch;
-				roll = p.roll;
-
-				LOG(	"Azimuth : %.9f\n"
-					"Pitch : %.9f\n"
-					"Roll : %.9f\n", azimuth, pitch, roll);
-				LOG("Successfully read %d bytes off the pipe!\n", bytes_read);
-			}
-
-			char send_buf[READINGS_BUF_SIZE + 1] = "";
-			snprintf(send_buf, sizeof(send_buf) - 1, "%.9f|%.9f|%.9f",
-							azimuth, pitch, roll); // The version of
-								// libc.so in the device I am using,
-								// seems like having some buffer
-								// overflow problem! It was totally
-								// annoying to confirm the same and
-								// finally after a day long of thinking
-								// about the alternatives for sprintf(),
-								// I ended up using snprintf() which
-								// worked out and hence it was confirmed
-								// to have the guessed buffer overflow
-								// problem.					
-
-			LOG("send_buf: %s\n", send_buf);
-
-			if (strcmp(last_reading, send_buf)) {
-				LOG("Unique readings!\n");
-				int bytes_wrote = write(connfd, send_buf, READINGS_BUF_SIZE + 1);
-				LOG_READING; // Log immediately.
-
-				if (bytes_wrote == -1) {
-					ERR("write - %s\n", strerror(errno));
-					break;
-				}
-				LOG("Wrote %zd bytes!\n", bytes_wrote);
-			} else {
-				LOG("Same device reading. Not writing!\n");
-			}
-
-			strcpy(last_reading, send_buf);
-
-			nanosleep(&t, NULL);
-		}
-			
-		nanosleep(&t, NULL);
-	}
-
-	return NULL;
-}
-
-static pthread_t corrected_gyro_readings_server_th_id = -1;
-static bool initialize_corrected_gyro_readings_server(void)
-{
-	pthread_t id = -1;
-	bool created = !(errno = pthread_create(&id, NULL, corrected_gyro_readings_server, NULL));
-	if (!created) {
-		ERR("Corrected gyroscope readings server thread *failed* to create - %s\n", strerror(errno));
-	} else {
-		LOG("Corrected gyroscope readings server thread created!\\m/\n");
-		corrected_gyro_readings_server_th_id = id;
-	}
-	
-	return created;
-}
-
-static bool terminate_corrected_gyro_readings_server(void)
-{
-	LOG_LINE;
-
-	bool terminated = true;
-
-	/* Assume that this server never gets terminated. You need the sensor as long as the device is on!
-		And hence no destructor called and hence no killing of this server, no resources used by
-		it ever gets freed! */
-
-	return terminated;
-}
+static struct emu_export *exporter;
 
 // To be part of CorrectedGyroSensor().
+	emu_log_conf("/data/log.conf");
 	INITIALIZE_LOG;
-	INIT_LOG_READING;
 
-	LOG("Piping . . .\n");
-	bool piped = pipe(pipefd) != -1;
-	if (piped) {
-		LOG("CorrectedGyro Piped!\n");
-
-		LOG("Initializing Corrected Gyroscope device server . . .\n");
-		bool initialized = initialize_corrected_gyro_readings_server();
-		if (initialized) {
-			LOG("Initialized device server!\n");
-		} else {
-			ERR("Failed to initialize device server.\n");
-		}
-	} else {
-		ERR("pipe - %s\n", strerror(errno));
-	}
+	LOG("Starting the exporter . . .\n");
+	exporter = emu_export_start(); // The device HAL's, or started here if it has none.
 // To be part of CorrectedGyroSensor().
+
+// To be part of process().
 // To be part of event type gyroscope
         float x = // save x here.
         float y = // save y here.
@@ -340,17 +88,9 @@ static bool terminate_corrected_gyro_readings_server(void)
 
 	    LOG("CorrectedGyro event!\n");
 
-	    if (connected) {
-			struct poll_data p = { x, y, z, };
-			(void)write(pipefd[1], &p, sizeof(p));
-			    LOG("Azimuth: %.9f\n"
-				"Pitch: %.9f\n"
-				"Roll: %.9f\n", x, y, z);
-	    } else {
-			LOG("Not connected!\n");
+	    {
+		float v[3] = { x, y, z, };
+		emu_export_publish(exporter, EMU_EXPORT_CORRECTED_GYRO, v, event.timestamp);
 	    }
 // To be part of event type gyroscope
-// To be part of CorrectedGyroSensor().
-
-
-
+// To be part of process().
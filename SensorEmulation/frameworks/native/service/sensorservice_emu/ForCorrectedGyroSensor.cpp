@@ -17,54 +17,19 @@
  */
 
 #include <stdint.h>
-#include <math.h>
-#include <sys/types.h>
-
-#include <hardware/sensors.h>
-
-/************************** Corrected Gyroscope Sensor Emulation *************************/
 #include <errno.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
-#include <hardware/sensors.h>
 #include <stdbool.h>
-#include <signal.h>
-#include <unistd.h>
-#include <math.h>
-
-#include <sys/socket.h>
-#include <arpa/inet.h>
-
-#include <poll.h>
-
-#include <pthread.h>
-
-#define ONLY_READING
-
-#ifdef ONLY_READING
-
-static FILE *readings_fp;
-#define INIT_LOG_READING do {\
-				if (!readings_fp) {\
-					readings_fp = fopen("/data/corrected_gyro_readings", "w");\
-				}\
-			} while(0)
-#define LOG_READING do {\
-			if (readings_fp && readings[0]) {\
-				struct timespec t = { 0 };\
-				clock_gettime(CLOCK_REALTIME, &t);\
-				unsigned long long int ts = t.tv_sec * 1E9 + t.tv_nsec;\
-				fprintf(readings_fp, "[Corrected Gyroscope] %lluns : %s\n", ts, readings);\
-				fflush(readings_fp);\
-			}\
-		} while(0)
-#else
+#include <time.h>
 
-#define INIT_LOG_READING
-#define LOG_READING
+#include <hardware/sensors.h>
 
-#endif
+/************************** Corrected Gyroscope Sensor Emulation *************************/
+// The readings come in through the one receiver of ForVirtualSensors.cpp,
+// which is shared by all of the sensors here.
+#include "ForVirtualSensors.h"
+#include "SensorEmulationLog.h"
 
 #define ONLY_ERROR
 static FILE *fp;
@@ -76,27 +41,11 @@ static FILE *fp;
 					fp = fopen("/data/corrected_gyro_sensor_log", "w");\
 				}\
 			} while(0)
-#define ERR(...) (void)(fp && fprintf(fp, "%s %d: ERROR - ", __func__, __LINE__) \
-								&& fprintf(fp, __VA_ARGS__) && fflush(fp))
-#define ERR_SERVER(...) (void)(fp && fprintf(fp, "%s %d: ERROR - ", __func__, __LINE__) \
-								&& fprintf(fp, __VA_ARGS__) && fflush(fp))
+#define ERR(...) EMU_ERR(fp, __VA_ARGS__)
 #else
 
 #define INITIALIZE_ERR_LOG
 #define ERR(...)
-#define ERR_SERVER(...)
-
-#endif
-
-//#define LOG_HIGH
-
-#ifdef LOG_HIGH
-
-#define LOG_SERVER_HIGH(...) (void)(fp && fprintf(fp, "%s %d: ", __func__, __LINE__) && fprintf(fp, __VA_ARGS__) && fflush(fp))
-
-#else
-
-#define LOG_SERVER_HIGH(...)
 
 #endif
 
@@ -109,312 +58,31 @@ static FILE *fp;
 					fp = fopen("/data/corrected_gyro_sensor_log", "w");\
 				}\
 			} while(0)
-#define LOG(...) (void)(fp && fprintf(fp, "%s %d: ", __func__, __LINE__) && fprintf(fp, __VA_ARGS__) && fflush(fp))
-#define LOG_SERVER(...) (void)(LOG(__VA_ARGS__))
-#define LOG_LINE LOG(" ")
+#define LOG(...) EMU_LOG(fp, __VA_ARGS__)
 
 #else
 
 #define INITIALIZE_LOG
 #define LOG(...)
-#define LOG_SERVER(...)
-#define LOG_LINE
 
 #endif
 
-#define READINGS_BUF_SIZE 100 /* 3 Readings */
-
-#define CORRECTED_GYRO_SERVER_PORT 5006
-#define MAX_TOLERANCE_FOR_SAME_READINGS 4
-
-static void cleanup(void);
-
-static void sigsegv_handler(int sig)
-{
-	LOG("** ATTENTION ** SIGSEGV(%d) raised!\n", sig);
-	cleanup();
-	exit(0);
-}
-
-static void sigabrt_handler(int sig)
-{
-	LOG("** ATTENTION ** SIGABRT(%d) raised!\n", sig);
-	cleanup();
-	exit(0);
-}
-
-static bool initialized;
-
-static int listenfd = -1;
-static int connfd = -1;
-static bool connected;
-static sensors_event_t sensor_data;
-
-static pthread_t corrected_gyro_readings_server_th_id = -1;
-
-static void cleanup_corrected_gyro_server(void)
-{
-	LOG("Cleaning up . . .\n");
-
-	LOG("Closing listeners . . .\n");
-	if (listenfd != -1) {
-		bool closed = close(listenfd) != -1;
-		if (!closed) {
-			ERR("close - %s\n", strerror(errno));
-		} else {
-			LOG("Closed!\n");
-		}
-		listenfd = -1;
-	}
-	LOG("Closing connections . . .\n");
-	if (connfd != -1) {
-		bool closed = close(connfd) != -1;
-		if (!closed) {
-			ERR("close - %s\n", strerror(errno));
-		} else {
-			LOG("Closed!\n");
-		}
-		connfd = -1;
-	}
-	connected = false;
-}
-
-static void cleanup(void)
-{
-	LOG("Cleaning . . .\n");
-	cleanup_corrected_gyro_server();
-	LOG("Cleaned!\n");
-}
-
-struct corrected_gyro_server_data {
-	int sensor_id;
-	int port;
-};
-
-static void *corrected_gyro_readings_server(void *arg)
-{
-	struct corrected_gyro_server_data *data = reinterpret_cast<struct corrected_gyro_server_data *>(arg);
-	int id = data->sensor_id;
-	int port = data->port;
-	struct timespec t = { .tv_sec = 0, .tv_nsec = 100ULL, };
-	int yes = 0;
-	bool socket_opt_set = false;
-	struct sockaddr_in serv_addr;
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	bool bound = false;
-	bool listening = false;
-
-	LOG_SERVER("\n\n** Emulator server for Corrected Gyroscope - Started! **\n");
-	LOG_SERVER("Data : %p\n", (void *)data);
-	LOG_SERVER("Sensor id : %d\n", id);
-	LOG_SERVER("Port : %d\n\n", port);
-
-	free(data);
-	data = NULL;
-
-	LOG_SERVER("Opening socket . . .\n");
-	listenfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listenfd == -1) {
-		ERR_SERVER("socket - %s\n", strerror(errno));
-		goto done;
-	}
-	LOG_SERVER("Opened!\n");
-
-	LOG_SERVER("Setting options . . .\n");
-	yes = 1;
-	socket_opt_set = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != -1;
-	if (!socket_opt_set) {
-		ERR_SERVER("setsockopt - %s\n", strerror(errno));
-		goto done;
-	}
-	LOG_SERVER("Set!\n");
-
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serv_addr.sin_port = htons(port);
-
-	LOG_SERVER("Binding socket . . .\n");
-	bound = bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != -1;
-	if (!bound) {
-		ERR_SERVER("bind - %s\n", strerror(errno));
-		goto done;
-	}
-	LOG_SERVER("Bound!\n");
-
-	LOG_SERVER("Trying to listen . . .\n");
-	listening = listen(listenfd, 10) != -1;
-	if (!listening) {
-		ERR_SERVER("listen - %s\n", strerror(errno));
-		goto done;
-	}
-	LOG_SERVER("Listening!\n");
-
-	connfd = -1;
-
-	while (1) {
-		connected = false;
-
-		LOG_SERVER("Waiting to accept . . .\n");
-		connfd = accept(listenfd, (struct sockaddr *)NULL, NULL);
-		if (connfd == -1) {
-			ERR_SERVER("accept - %s\n", strerror(errno));
-			goto done;
-		}
-		LOG_SERVER("Accepted!\n");
-
-		char last_readings[READINGS_BUF_SIZE + 1] = "";
-		int same_r = 0;
-
-		while (1) {
-			char readings[READINGS_BUF_SIZE + 1] = "";
-
-			LOG_SERVER_HIGH("Receiving . . .\n");
-			ssize_t bytes_received = recvfrom(connfd, readings, READINGS_BUF_SIZE + 1, MSG_WAITALL, NULL, 0);
-			LOG_READING; // Log immediately.
-
-			if (bytes_received == -1) {
-				ERR_SERVER("recvfrom - %s\n", strerror(errno));
-				break;
-			}
-			LOG_SERVER_HIGH("Received %lu bytes!\n", bytes_received);
-			LOG_SERVER_HIGH("Readings: %s\n", readings);
-
-			bool same = !strcmp(readings, last_readings);
-			if (same) {
-				same_r++;
-				if (same_r == MAX_TOLERANCE_FOR_SAME_READINGS) {
-					LOG_SERVER("Same readings %d times. Likely a problem! Resetting connection . . .\n", same_r);
-					ERR_SERVER("Same readings %d times. Likely a problem! Resetting connection . . .\n", same_r);
-					break;
-				}
-			}
-			strcpy(last_readings, readings);
-
-			connected = true;
-
-			bool device_locked = !readings[0];
-			if (device_locked) {
-				LOG_SERVER("Device is likely in locked state!\n");
-				continue;
-			}
-
-			if (bytes_received == 0) {
-				LOG_SERVER("Zero bytes received! Likely a faulty socket. Accepting again.\n");
-				break;
-			}
-
-			sensor_data.sensor = id;
-
-			LOG_SERVER_HIGH("Sensor: Corrected Gyroscope\n");
-			char *f_d = strchr(readings, '|');
-			*f_d = '\0';
-			char *s_d = strchr(f_d + 1, '|');
-			*s_d = '\0';
-
-			sscanf(readings, "%f", &sensor_data.gyro.azimuth);
-			sscanf(f_d + 1, "%f", &sensor_data.gyro.pitch);
-			sscanf(s_d + 1, "%f", &sensor_data.gyro.roll);
-
-			sensor_data.type = SENSOR_TYPE_GYROSCOPE;
-
-			nanosleep(&t, NULL);
-		}
-
-		close(connfd);
-		connfd = -1;
-			
-		nanosleep(&t, NULL);
-	}
-	
-done:
-	cleanup_corrected_gyro_server();
-	LOG_SERVER("** Corrected Gyroscope server - Terminated! **\n");
-
-	return NULL;
-}
-
-static bool create_corrected_gyro_server_threads(void)
-{
-	static bool fine = true;
-
-	int ret = 0;
-	bool created = false;
-
-	LOG("Creating Corrected Gyroscope server . . .\n");
-
-	LOG("Creating thread . . .\n");
-	pthread_t id = -1;
-	struct corrected_gyro_server_data *d = reinterpret_cast<struct corrected_gyro_server_data *>(malloc(sizeof(*d)));
-	if (!d) {
-		ERR("malloc - %s\n", strerror(errno));
-		goto done;
-	}
-
-	memset(d, 0, sizeof(*d));
-	d->sensor_id = '_cgy';
-	d->port =  CORRECTED_GYRO_SERVER_PORT;
-
-	ret = pthread_create(&id, NULL, corrected_gyro_readings_server, d); // No way of stopping
-				// this thread once started, as far as I know!
-				// So, there is no such function which cleans up this
-				// created thread!
-
-	created = ret == 0;
-	if (!created) {
-		fine = false;
-		errno = ret;
-		ERR("pthread_create - Thread *failed* to create - %s\n", strerror(errno));
-	} else {
-		LOG("Thread created!\\m/\n");
-		corrected_gyro_readings_server_th_id = id;
-	}
-	LOG("Created!\n");
-
-	LOG("Created!\n");
-
-done:
-
-	return fine;
-}
-
-static bool initialize_corrected_gyro_readings_server(void)
-{
-	bool success = create_corrected_gyro_server_threads();
-
-	return success;
-}
-
-/************************************************************************************/
-
 // To be part of CorrectedGyroSensor() -- This is the entire function.
-	(void)signal(SIGSEGV, sigsegv_handler);
-	(void)signal(SIGABRT, sigabrt_handler);
-
 	INITIALIZE_LOG;
 	INITIALIZE_ERR_LOG;
-	INIT_LOG_READING;
 
-	if (!initialized) {
-		LOG("Not initialized before. Trying to initialize . . .\n");
-		cleanup();
-		initialized = initialize_corrected_gyro_readings_server();
-		if (!initialized) {
-			LOG("Corrected Gyroscope server failed to initialize.\n");
-		} else {
-			LOG("Corrected Gyroscope server initialized!\n");
-		}
+	if (!emu_virtual_sensors_start()) {
+		LOG("Corrected Gyroscope server failed to initialize.\n");
 	} else {
-		LOG("Corrected Gyroscope server already initialized!\n");
+		LOG("Corrected Gyroscope server initialized!\n");
 	}
 // To be part of CorrectedGyroSensor() -- This is the entire function.
 
 // To be part of process() -- Below code is the entire process() itself.
 	*outEvent = event;
-	*outEvent = sensor_data;
-
-	bool processed = connected;
 
-	connected = false;
+	emu_virtual_sensors_feed(&event);
+	bool processed = emu_virtual_sensor_read(EMU_VIRTUAL_CORRECTED_GYRO, outEvent);
 
 	struct timespec t;
 	memset(&t, 0, sizeof(t));
@@ -434,6 +102,10 @@ done:
 	return processed;
 // To be part of process() -- Above code is the entire process() itself.
 
+// To be part of activate() -- Before the rest of it.
+	emu_virtual_sensor_activate(EMU_VIRTUAL_CORRECTED_GYRO, enabled);
+// To be part of activate() -- Before the rest of it.
+
 // To be part of getSensor().
     // Sensor name is "Corrected Gyroscope Sensor Emulation!!!!"
     // Sensor vendor is "Columbia University - NYC - Thesis - Raghavan Santhanam"
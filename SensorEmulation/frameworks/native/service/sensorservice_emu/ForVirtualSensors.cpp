@@ -0,0 +1,675 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   ForVirtualSensors.cpp is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ForVirtualSensors.cpp is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ForVirtualSensors.cpp
+ *
+ * Working:
+ *
+ * The readings of the orientation, corrected gyroscope, gravity, linear
+ * acceleration and rotation vector sensors come from the relay on ports
+ * 5005 - 5009, a connection per sensor. One thread receives all of them -
+ * it polls the five listeners, or the connection of the ones that have
+ * one, and leaves every whole frame in the sensor's slot, which the
+ * sensor's process() takes through emu_virtual_sensor_read().
+ *
+ * The connections are read without blocking, a frame being put together
+ * over as many receives as it takes, so a slow or stuck sensor doesn't
+ * hold the others up. As before, a connection is reset after
+ * MAX_TOLERANCE_FOR_SAME_READINGS identical frames, and an empty frame -
+ * the device is locked - keeps the last reading.
+ *
+ * With "fused" in /data/virtual.conf (and in the relay's virtual.conf,
+ * which then leaves the five streams out) there are no listeners: the
+ * process() of each sensor hands the raw event it's given to
+ * emu_virtual_sensors_feed(), and the accelerometer, magnetic field and
+ * gyroscope readings go through the filter of SensorEmulationFusion.h.
+ * Each gyroscope reading publishes the filter's state, and each of the
+ * five sensors works its own output out of the latest state when it's
+ * read - so the virtual sensors agree with the raw ones they're worked
+ * out of, and the relay sends half the streams. The sensorservice hands every event to every virtual
+ * sensor, so an event that's been fed already - the same sensor and
+ * timestamp - is skipped.
+ *
+ * Nothing is worked out for a sensor nobody's listening to. Its
+ * activate() tells emu_virtual_sensor_activate() when it's turned on and
+ * off; the frames of an inactive sensor are only checked and recorded,
+ * and those of an active one are decoded in emu_virtual_sensor_read(),
+ * when they're taken - a frame overwritten before that is never parsed.
+ * Fused, a gyroscope reading steps the filter, and each active sensor
+ * works its own output out of the filter when it's read - the
+ * orientation out of the rotation vector's quaternion - so an idle
+ * guest, whose process() is never called, does no sensor work past
+ * draining the sockets.
+ *
+ * The frames (or, fused, the filter) are handed to the readers through
+ * seqlocks (SensorEmulationSeqlock.h): the reader takes a whole copy
+ * without a lock, and whether it's new from its sequence number against
+ * the last one the sensor took.
+ *
+ * The file is added to LOCAL_SRC_FILES of the sensorservice; see MAKEFILE.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <poll.h>
+
+#include <pthread.h>
+
+#include <hardware/sensors.h>
+
+#include "ForVirtualSensors.h"
+#include "SensorEmulationTrace.h"
+#include "SensorEmulationFusion.h"
+#include "SensorEmulationSeqlock.h"
+#include "SensorEmulationLog.h"
+#include "SensorEmulationRecord.h"
+
+#define ONLY_READING
+
+#ifdef ONLY_READING
+
+// The readings are recorded in the binary format of SensorEmulationRecord.h,
+// unless TEXT_READINGS is defined.
+// #define TEXT_READINGS
+
+#ifdef TEXT_READINGS
+
+static FILE *readings_fp[EMU_VIRTUAL_SENSORS];
+#define INIT_LOG_READING do {\
+				int i = 0;\
+				while (i < EMU_VIRTUAL_SENSORS) {\
+					if (!readings_fp[i]) {\
+						readings_fp[i] = fopen(virtual_sensors[i].text_readings, "w");\
+					}\
+					i++;\
+				}\
+			} while(0)
+#define LOG_READING(n, readings) do {\
+			if (readings_fp[n] && (readings)[0]) {\
+				struct timespec t = { 0 };\
+				clock_gettime(CLOCK_REALTIME, &t);\
+				unsigned long long int ts = t.tv_sec * 1E9 + t.tv_nsec;\
+				EMU_LOG_READING(readings_fp[n], "[%s] %lluns : %s\n", virtual_sensors[n].name, ts, readings);\
+			}\
+		} while(0)
+
+#else
+
+static struct emu_rec *readings_rec;
+#define INIT_LOG_READING do {\
+				if (!readings_rec) {\
+					const char *names[EMU_VIRTUAL_SENSORS];\
+					int i = 0;\
+					while (i < EMU_VIRTUAL_SENSORS) {\
+						names[i] = virtual_sensors[i].name;\
+						i++;\
+					}\
+					readings_rec = emu_rec_open("/data/virtual_readings.rec", names, EMU_VIRTUAL_SENSORS);\
+				}\
+			} while(0)
+#define LOG_READING(n, readings) EMU_REC_READING(readings_rec, n, readings)
+
+#endif
+
+#else
+
+#define INIT_LOG_READING
+#define LOG_READING(n, readings)
+
+#endif
+
+#define ONLY_ERROR
+static FILE *fp;
+
+#ifdef ONLY_ERROR
+
+#define INITIALIZE_ERR_LOG do {\
+				if (!fp) {\
+					fp = fopen("/data/virtual_sensors_log", "w");\
+				}\
+			} while(0)
+#define ERR(...) EMU_ERR(fp, __VA_ARGS__)
+#define ERR_SERVER(...) EMU_ERR(fp, __VA_ARGS__)
+#else
+
+#define INITIALIZE_ERR_LOG
+#define ERR(...)
+#define ERR_SERVER(...)
+
+#endif
+
+// #define LOG_HIGH
+
+#ifdef LOG_HIGH
+
+#define LOG_SERVER_HIGH(...) EMU_DEBUG(fp, __VA_ARGS__)
+
+#else
+
+#define LOG_SERVER_HIGH(...)
+
+#endif
+
+#define LOG_BASIC
+
+#ifdef LOG_BASIC
+
+#define INITIALIZE_LOG do {\
+				if (!fp) {\
+					fp = fopen("/data/virtual_sensors_log", "w");\
+				}\
+			} while(0)
+#define LOG(...) EMU_LOG(fp, __VA_ARGS__)
+#define LOG_SERVER(...) LOG(__VA_ARGS__)
+
+#else
+
+#define INITIALIZE_LOG
+#define LOG(...)
+#define LOG_SERVER(...)
+
+#endif
+
+#define READINGS_BUF_SIZE 100 /* 3 Readings */
+#define FRAME_SIZE (READINGS_BUF_SIZE + 1 + EMU_TRACE_SIZE)
+
+#define VIRTUAL_SENSORS_BASE_PORT 5005
+#define MAX_TOLERANCE_FOR_SAME_READINGS 4
+
+struct virtual_sensor {
+	const char *name;
+	const char *text_readings;
+	int handle;
+	int type;
+	int columns; /* The 4th of the orientation is its status. */
+
+	int listenfd;
+	int connfd;
+	char frame[FRAME_SIZE];
+	size_t got; /* Of frame. */
+	char last_readings[READINGS_BUF_SIZE + 1];
+	int same_r;
+
+	int active; /* Set by activate(), read by the receiver. */
+
+	struct emu_seq seq; /* Of the last frame of an active sensor. */
+	uint32_t words[EMU_SEQ_WORDS(READINGS_BUF_SIZE + 1)];
+
+	uint32_t seen; /* The seq process() took last. */
+	sensors_event_t sensor_data; /* Only process()'s. */
+};
+
+static struct virtual_sensor virtual_sensors[EMU_VIRTUAL_SENSORS] = {
+	{ "Orientation", "/data/orient_readings", '_ypr', SENSOR_TYPE_ORIENTATION, 4 },
+	{ "Corrected Gyroscope", "/data/corrected_gyro_readings", '_cgy', SENSOR_TYPE_GYROSCOPE, 3 },
+	{ "Gravity", "/data/gravity_readings", '_grv', SENSOR_TYPE_GRAVITY, 3 },
+	{ "Linear Acceleration", "/data/linear_acceleration_readings", '_lin', SENSOR_TYPE_LINEAR_ACCELERATION, 3 },
+	{ "Rotation Vector", "/data/rotation_vector_readings", '_rov', SENSOR_TYPE_ROTATION_VECTOR, 4 },
+};
+
+#define VIRTUAL_CONF_FILE "/data/virtual.conf"
+
+// VIRTUAL_CONF_FILE has "relayed" (the default) or "fused".
+static bool fused;
+
+static pthread_mutex_t fusion_lock = PTHREAD_MUTEX_INITIALIZER; // Of the feeders.
+static struct emu_fusion fusion;
+
+// The filter after each step, for the readers.
+static struct emu_seq fused_seq;
+static uint32_t fused_words[EMU_SEQ_WORDS(sizeof(struct emu_fusion))];
+
+// Of the last event fed of the accelerometer, the magnetic field and the
+// gyroscope.
+enum { FUSED_ACCEL, FUSED_MAGNETIC, FUSED_GYRO, FUSED_RAW };
+static int64_t fed_ts[FUSED_RAW];
+static int fed_sensor[FUSED_RAW];
+
+static pthread_once_t virtual_sensors_once = PTHREAD_ONCE_INIT;
+static bool initialized;
+
+static pthread_t virtual_sensors_server_th_id = -1;
+
+static void cleanup(void);
+
+static void sigsegv_handler(int sig)
+{
+	LOG("** ATTENTION ** SIGSEGV(%d) raised!\n", sig);
+	cleanup();
+	exit(0);
+}
+
+static void sigabrt_handler(int sig)
+{
+	LOG("** ATTENTION ** SIGABRT(%d) raised!\n", sig);
+	cleanup();
+	exit(0);
+}
+
+static void close_connection(struct virtual_sensor *vs)
+{
+	if (vs->connfd != -1) {
+		bool closed = close(vs->connfd) != -1;
+		if (!closed) {
+			ERR("close - %s\n", strerror(errno));
+		}
+		vs->connfd = -1;
+	}
+}
+
+static void cleanup(void)
+{
+	LOG("Cleaning up . . .\n");
+
+	int n = 0;
+	while (n < EMU_VIRTUAL_SENSORS) {
+		struct virtual_sensor *vs = &virtual_sensors[n];
+		if (vs->listenfd != -1) {
+			bool closed = close(vs->listenfd) != -1;
+			if (!closed) {
+				ERR("close - %s\n", strerror(errno));
+			}
+			vs->listenfd = -1;
+		}
+		close_connection(vs);
+		n++;
+	}
+
+	LOG("Cleaned!\n");
+}
+
+static int open_listener(int port)
+{
+	int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd == -1) {
+		ERR_SERVER("socket - %s\n", strerror(errno));
+		return -1;
+	}
+
+	int yes = 1;
+	bool socket_opt_set = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != -1;
+	if (!socket_opt_set) {
+		ERR_SERVER("setsockopt - %s\n", strerror(errno));
+		goto failed;
+	}
+
+	{
+		struct sockaddr_in serv_addr;
+		memset(&serv_addr, 0, sizeof(serv_addr));
+		serv_addr.sin_family = AF_INET;
+		serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		serv_addr.sin_port = htons(port);
+
+		bool bound = bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != -1;
+		if (!bound) {
+			ERR_SERVER("bind %d - %s\n", port, strerror(errno));
+			goto failed;
+		}
+	}
+
+	{
+		bool listening = listen(listenfd, 10) != -1;
+		if (!listening) {
+			ERR_SERVER("listen %d - %s\n", port, strerror(errno));
+			goto failed;
+		}
+	}
+
+	return listenfd;
+
+failed:
+	close(listenfd);
+	return -1;
+}
+
+// The "v|v|v[|v]" readings into the sensor's slot.
+static void decode(struct virtual_sensor *vs, const char *readings)
+{
+	float v[4] = { 0 };
+	int columns = 0;
+	const char *p = readings;
+	while (columns < vs->columns) {
+		char *end = NULL;
+		v[columns] = strtof(p, &end);
+		if (end == p) {
+			break;
+		}
+		columns++;
+		p = end;
+		if (*p != '|') {
+			break;
+		}
+		p++;
+	}
+
+	sensors_event_t *e = &vs->sensor_data;
+	e->sensor = vs->handle;
+	e->type = vs->type;
+	e->data[0] = v[0];
+	e->data[1] = v[1];
+	e->data[2] = v[2];
+	if (vs->type == SENSOR_TYPE_ORIENTATION) {
+		e->orientation.status = (int8_t)v[3]; // 8-bit data, no loss.
+	} else if (vs->columns > 3) {
+		e->data[3] = v[3];
+	}
+}
+
+// Takes in what's there for the connection of vs. false once it's to be
+// closed.
+static bool receive(int n)
+{
+	struct virtual_sensor *vs = &virtual_sensors[n];
+
+	ssize_t bytes_received = recv(vs->connfd, vs->frame + vs->got, FRAME_SIZE - vs->got, MSG_DONTWAIT);
+	if (bytes_received == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return true;
+		}
+		ERR_SERVER("recv %s - %s\n", vs->name, strerror(errno));
+		return false;
+	}
+	if (bytes_received == 0) {
+		LOG_SERVER("%s - Zero bytes received! Likely a faulty socket. Accepting again.\n", vs->name);
+		return false;
+	}
+	vs->got += bytes_received;
+	if (vs->got < FRAME_SIZE) {
+		return true;
+	}
+	vs->got = 0;
+
+	char *readings = vs->frame;
+	readings[READINGS_BUF_SIZE] = '\0';
+	LOG_READING(n, readings);
+	LOG_SERVER_HIGH("%s - Readings: %s\n", vs->name, readings);
+
+	bool same = !strcmp(readings, vs->last_readings);
+	if (same) {
+		vs->same_r++;
+		if (vs->same_r == MAX_TOLERANCE_FOR_SAME_READINGS) {
+			LOG_SERVER("%s - Same readings %d times. Likely a problem! Resetting connection . . .\n",
+					vs->name, vs->same_r);
+			ERR_SERVER("%s - Same readings %d times. Likely a problem! Resetting connection . . .\n",
+					vs->name, vs->same_r);
+			return false;
+		}
+	}
+	strcpy(vs->last_readings, readings);
+
+	if (!__atomic_load_n(&vs->active, __ATOMIC_RELAXED)) {
+		return true;
+	}
+
+	bool device_locked = !readings[0];
+	if (device_locked) {
+		LOG_SERVER_HIGH("%s - Device is likely in locked state!\n", vs->name);
+	}
+	emu_seq_write(&vs->seq, vs->words, readings, READINGS_BUF_SIZE + 1);
+
+	return true;
+}
+
+static void *virtual_sensors_server(void *arg)
+{
+	(void)arg;
+
+	LOG_SERVER("\n\n** Emulator server for the virtual sensors - Started! **\n");
+
+	while (1) {
+		struct pollfd fds[EMU_VIRTUAL_SENSORS];
+		int n = 0;
+		while (n < EMU_VIRTUAL_SENSORS) {
+			struct virtual_sensor *vs = &virtual_sensors[n];
+			fds[n].fd = vs->connfd != -1 ? vs->connfd : vs->listenfd;
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			n++;
+		}
+
+		int ready = poll(fds, EMU_VIRTUAL_SENSORS, -1);
+		if (ready == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ERR_SERVER("poll - %s\n", strerror(errno));
+			break;
+		}
+
+		n = 0;
+		while (n < EMU_VIRTUAL_SENSORS) {
+			struct virtual_sensor *vs = &virtual_sensors[n];
+			if (!fds[n].revents) {
+				n++;
+				continue;
+			}
+
+			if (vs->connfd == -1) {
+				vs->connfd = accept(vs->listenfd, (struct sockaddr *)NULL, NULL);
+				if (vs->connfd == -1) {
+					ERR_SERVER("accept %s - %s\n", vs->name, strerror(errno));
+				} else {
+					LOG_SERVER("%s - Accepted!\n", vs->name);
+					vs->got = 0;
+					vs->last_readings[0] = '\0';
+					vs->same_r = 0;
+				}
+			} else if (!receive(n)) {
+				close_connection(vs);
+			}
+			n++;
+		}
+	}
+
+	cleanup();
+	LOG_SERVER("** Virtual sensors server - Terminated! **\n");
+
+	return NULL;
+}
+
+static void load_virtual_conf(void)
+{
+	FILE *conf = fopen(VIRTUAL_CONF_FILE, "r");
+	if (!conf) {
+		return;
+	}
+
+	char mode[32] = "";
+	if (fscanf(conf, "%31s", mode) == 1) {
+		fused = !strcmp(mode, "fused");
+		LOG("Virtual sensors : %s\n", mode);
+	}
+
+	fclose(conf);
+}
+
+// Sensor n's output out of a copy of the filter.
+static void evaluate_fused(int n, const struct emu_fusion *f, sensors_event_t *e)
+{
+	struct virtual_sensor *vs = &virtual_sensors[n];
+	e->sensor = vs->handle;
+	e->type = vs->type;
+
+	switch (n) {
+	case EMU_VIRTUAL_ORIENTATION: {
+		float o[3];
+		emu_fusion_orientation(f, o);
+		e->orientation.azimuth = o[0];
+		e->orientation.pitch = o[1];
+		e->orientation.roll = o[2];
+		e->orientation.status = SENSOR_STATUS_ACCURACY_HIGH;
+		break;
+	}
+	case EMU_VIRTUAL_CORRECTED_GYRO:
+		e->gyro.x = f->gyro[0];
+		e->gyro.y = f->gyro[1];
+		e->gyro.z = f->gyro[2];
+		break;
+	case EMU_VIRTUAL_GRAVITY:
+		emu_fusion_gravity(f, e->data);
+		break;
+	case EMU_VIRTUAL_LINEAR_ACCELERATION:
+		emu_fusion_linear_acceleration(f, e->data);
+		break;
+	case EMU_VIRTUAL_ROTATION_VECTOR:
+		emu_fusion_rotation_vector(f, e->data);
+		break;
+	}
+}
+
+static void start(void)
+{
+	(void)signal(SIGSEGV, sigsegv_handler);
+	(void)signal(SIGABRT, sigabrt_handler);
+
+	emu_log_conf("/data/log.conf");
+
+	INITIALIZE_LOG;
+	INITIALIZE_ERR_LOG;
+
+	load_virtual_conf();
+
+	int n = 0;
+	while (n < EMU_VIRTUAL_SENSORS) {
+		struct virtual_sensor *vs = &virtual_sensors[n];
+		vs->connfd = -1;
+		vs->listenfd = fused ? -1 : open_listener(VIRTUAL_SENSORS_BASE_PORT + n);
+		n++;
+	}
+
+	if (fused) {
+		emu_fusion_init(&fusion, EMU_FUSION_BETA, EMU_FUSION_ZETA);
+		LOG("Fusing the virtual sensors in here!\n");
+		initialized = true;
+		return;
+	}
+
+	INIT_LOG_READING;
+
+	LOG("Creating the virtual sensors server . . .\n");
+	pthread_t id = -1;
+	int ret = pthread_create(&id, NULL, virtual_sensors_server, NULL); // No way of stopping
+				// this thread once started, as far as I know!
+	if (ret) {
+		errno = ret;
+		ERR("pthread_create - Thread *failed* to create - %s\n", strerror(errno));
+		cleanup();
+		return;
+	}
+	virtual_sensors_server_th_id = id;
+	LOG("Created!\n");
+
+	initialized = true;
+}
+
+bool emu_virtual_sensors_start(void)
+{
+	pthread_once(&virtual_sensors_once, start);
+
+	return initialized;
+}
+
+bool emu_virtual_sensor_read(int n, sensors_event_t *event)
+{
+	struct virtual_sensor *vs = &virtual_sensors[n];
+
+	struct emu_seq *seq = fused ? &fused_seq : &vs->seq;
+	uint32_t seen = __atomic_load_n(&vs->seen, __ATOMIC_RELAXED);
+	bool processed = emu_seq_current(seq) != seen;
+	if (processed && fused) {
+		struct emu_fusion f;
+		seen = emu_seq_read(seq, fused_words, &f, sizeof(f));
+		evaluate_fused(n, &f, &vs->sensor_data);
+	} else if (processed) {
+		char readings[READINGS_BUF_SIZE + 1];
+		seen = emu_seq_read(seq, vs->words, readings, sizeof(readings));
+		if (readings[0]) { // Else the device is locked; the last one stands.
+			decode(vs, readings);
+		}
+	}
+	__atomic_store_n(&vs->seen, seen, __ATOMIC_RELAXED);
+	*event = vs->sensor_data;
+
+	return processed;
+}
+
+void emu_virtual_sensor_activate(int n, bool enabled)
+{
+	struct virtual_sensor *vs = &virtual_sensors[n];
+
+	LOG("%s %s\n", vs->name, enabled ? "activated" : "deactivated");
+
+	// What came in before it was on is of no use to it.
+	__atomic_store_n(&vs->active, enabled, __ATOMIC_RELAXED);
+	__atomic_store_n(&vs->seen, emu_seq_current(fused ? &fused_seq : &vs->seq), __ATOMIC_RELAXED);
+}
+
+void emu_virtual_sensors_feed(const sensors_event_t *event)
+{
+	if (!fused) {
+		return;
+	}
+
+	int raw = -1;
+	switch (event->type) {
+	case SENSOR_TYPE_ACCELEROMETER:
+		raw = FUSED_ACCEL;
+		break;
+	case SENSOR_TYPE_MAGNETIC_FIELD:
+		raw = FUSED_MAGNETIC;
+		break;
+	case SENSOR_TYPE_GYROSCOPE:
+		raw = event->sensor == virtual_sensors[EMU_VIRTUAL_CORRECTED_GYRO].handle ? -1 : FUSED_GYRO;
+		break;
+	}
+	if (raw == -1) {
+		return;
+	}
+
+	pthread_mutex_lock(&fusion_lock);
+	bool fed = fed_ts[raw] == event->timestamp && fed_sensor[raw] == event->sensor;
+	if (!fed) {
+		fed_ts[raw] = event->timestamp;
+		fed_sensor[raw] = event->sensor;
+		switch (raw) {
+		case FUSED_ACCEL:
+			emu_fusion_accel(&fusion, event->data[0], event->data[1], event->data[2]);
+			break;
+		case FUSED_MAGNETIC:
+			emu_fusion_magnetic(&fusion, event->data[0], event->data[1], event->data[2]);
+			break;
+		case FUSED_GYRO:
+			emu_fusion_gyro(&fusion, event->timestamp, event->data[0], event->data[1], event->data[2]);
+			emu_seq_write(&fused_seq, fused_words, &fusion, sizeof(fusion));
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fusion_lock);
+}
@@ -0,0 +1,51 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   ForVirtualSensors.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ForVirtualSensors.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FOR_VIRTUAL_SENSORS_H
+#define FOR_VIRTUAL_SENSORS_H
+
+#include <hardware/sensors.h>
+
+// The sensors of the sensorservice fed by the relay, in the order of their
+// ports from 5005 on.
+enum emu_virtual_sensor {
+	EMU_VIRTUAL_ORIENTATION = 0,
+	EMU_VIRTUAL_CORRECTED_GYRO = 1,
+	EMU_VIRTUAL_GRAVITY = 2,
+	EMU_VIRTUAL_LINEAR_ACCELERATION = 3,
+	EMU_VIRTUAL_ROTATION_VECTOR = 4,
+	EMU_VIRTUAL_SENSORS = 5,
+};
+
+// Starts the one receiver of all of them, the first time it's called.
+bool emu_virtual_sensors_start(void);
+
+// Sensor n's activate(): nothing is decoded or worked out for it while
+// it's off.
+void emu_virtual_sensor_activate(int n, bool enabled);
+
+// A raw event the sensorservice hands to process(), for the virtual
+// sensors to be fused out of the accelerometer, the magnetic field and the
+// gyroscope. Does nothing unless /data/virtual.conf says "fused".
+void emu_virtual_sensors_feed(const sensors_event_t *event);
+
+// The last reading of sensor n into event, and whether it's new since the
+// last call.
+bool emu_virtual_sensor_read(int n, sensors_event_t *event);
+
+#endif
@@ -0,0 +1,28 @@
+ #
+ #   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ #   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ #
+ #   build-sensors_emu_host.sh is free software: you can redistribute it and/or modify
+ #   it under the terms of the GNU General Public License as published by
+ #   the Free Software Foundation, either version 3 of the License, or
+ #   (at your option) any later version.
+ #
+ #   build-sensors_emu_host.sh is distributed in the hope that it will be useful,
+ #   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ #   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ #   GNU General Public License for more details.
+ #
+ #   You should have received a copy of the GNU General Public License
+ #   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ #
+
+# Builds sensors_emu.c as a Linux shared object, against the stub Android
+# headers under include, and the harness that polls it. Extra flags, like
+# -DVIRTUAL_TIME, are passed on to both. What sensors_emu.c keeps under
+# /data on the guest goes to $DATA_DIR (the current directory by default).
+
+cd "$(dirname "$0")"
+
+set -x
+gcc -Wall -O2 -fPIC -shared -Iinclude -DDATA_DIR=\"${DATA_DIR:-.}\" "$@" ../sensors_emu.c -lpthread -lm -lrt -o sensors_emu.so
+gcc -Wall -O2 -Iinclude "$@" sensors_emu_host.c -ldl -lpthread -lrt -o sensors_emu_host
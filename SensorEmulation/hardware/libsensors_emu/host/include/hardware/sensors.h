@@ -0,0 +1,148 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   sensors.h is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   sensors.h is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * sensors.h
+ *
+ * Stand-in for Android's <hardware/sensors.h>, for building sensors_emu.c
+ * on a Linux host. The structures are laid out like the Jelly Bean header,
+ * so the events the harness gets are what the sensorservice would get.
+ */
+
+#ifndef SENSOR_EMULATION_HOST_SENSORS_H
+#define SENSOR_EMULATION_HOST_SENSORS_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include <hardware/hardware.h>
+
+__BEGIN_DECLS
+
+#define SENSORS_HARDWARE_MODULE_ID "sensors"
+#define SENSORS_HARDWARE_POLL "poll"
+
+#define SENSORS_HANDLE_BASE 0
+#define SENSORS_HANDLE_BITS 8
+#define SENSORS_HANDLE_COUNT (1 << SENSORS_HANDLE_BITS)
+
+#define SENSOR_TYPE_ACCELEROMETER 1
+#define SENSOR_TYPE_MAGNETIC_FIELD 2
+#define SENSOR_TYPE_ORIENTATION 3
+#define SENSOR_TYPE_GYROSCOPE 4
+#define SENSOR_TYPE_LIGHT 5
+#define SENSOR_TYPE_PRESSURE 6
+#define SENSOR_TYPE_TEMPERATURE 7
+#define SENSOR_TYPE_PROXIMITY 8
+#define SENSOR_TYPE_GRAVITY 9
+#define SENSOR_TYPE_LINEAR_ACCELERATION 10
+#define SENSOR_TYPE_ROTATION_VECTOR 11
+#define SENSOR_TYPE_RELATIVE_HUMIDITY 12
+#define SENSOR_TYPE_AMBIENT_TEMPERATURE 13
+
+#define SENSOR_STATUS_UNRELIABLE 0
+#define SENSOR_STATUS_ACCURACY_LOW 1
+#define SENSOR_STATUS_ACCURACY_MEDIUM 2
+#define SENSOR_STATUS_ACCURACY_HIGH 3
+
+#define GRAVITY_SUN (275.0f)
+#define GRAVITY_EARTH (9.80665f)
+
+#define MAGNETIC_FIELD_EARTH_MAX (60.0f)
+#define MAGNETIC_FIELD_EARTH_MIN (30.0f)
+
+typedef struct {
+	union {
+		float v[3];
+		struct {
+			float x;
+			float y;
+			float z;
+		};
+		struct {
+			float azimuth;
+			float pitch;
+			float roll;
+		};
+	};
+	int8_t status;
+	uint8_t reserved[3];
+} sensors_vec_t;
+
+typedef struct sensors_event_t {
+	int32_t version;
+	int32_t sensor;
+	int32_t type;
+	int32_t reserved0;
+	int64_t timestamp;
+	union {
+		float data[16];
+		sensors_vec_t acceleration;
+		sensors_vec_t magnetic;
+		sensors_vec_t orientation;
+		sensors_vec_t gyro;
+		float temperature;
+		float distance;
+		float light;
+		float pressure;
+		float relative_humidity;
+	};
+	uint32_t reserved1[4];
+} sensors_event_t;
+
+struct sensor_t;
+
+struct sensors_module_t {
+	struct hw_module_t common;
+	int (*get_sensors_list)(struct sensors_module_t *module, struct sensor_t const **list);
+};
+
+struct sensor_t {
+	const char *name;
+	const char *vendor;
+	int version;
+	int handle;
+	int type;
+	float maxRange;
+	float resolution;
+	float power;
+	int32_t minDelay;
+	void *reserved[8];
+};
+
+struct sensors_poll_device_t {
+	struct hw_device_t common;
+	int (*activate)(struct sensors_poll_device_t *dev, int handle, int enabled);
+	int (*setDelay)(struct sensors_poll_device_t *dev, int handle, int64_t ns);
+	int (*poll)(struct sensors_poll_device_t *dev, sensors_event_t *data, int count);
+};
+
+static inline int sensors_open(const struct hw_module_t *module, struct sensors_poll_device_t **device)
+{
+	return module->methods->open(module, SENSORS_HARDWARE_POLL, (struct hw_device_t **)device);
+}
+
+static inline int sensors_close(struct sensors_poll_device_t *device)
+{
+	return device->common.close(&device->common);
+}
+
+__END_DECLS
+
+#endif /* SENSOR_EMULATION_HOST_SENSORS_H */
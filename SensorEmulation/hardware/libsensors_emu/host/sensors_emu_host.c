@@ -0,0 +1,277 @@
+/*
+ *   Copyright (C) 2013  Raghavan Santhanam, raghavanil4m@gmail.com, rs3294@columbia.edu
+ *   This was done as part of my MS thesis research at Columbia University, NYC in Fall 2013.
+ *
+ *   sensors_emu_host.c is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   sensors_emu_host.c is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * sensors_emu_host.c
+ *
+ * Working:
+ *
+ * Runs sensors_emu.c, built for the Linux host against the stub headers
+ * under host/include, the way the Android sensorservice does -
+ *
+ * the module is dlopen()ed and found through HAL_MODULE_INFO_SYM, the
+ * poll device is opened, the sensors listed and activated, and poll() is
+ * called in a loop with room for SENSOR_EVENTS_AT_ONCE events.
+ *
+ * Every delivered event is recorded in the events file as
+ *
+ *	<delivery ns> <event timestamp ns> <handle> <type> <data[0]> <data[1]> <data[2]>
+ *
+ * with the delivery time taken on CLOCK_MONOTONIC right after poll()
+ * returns. At the end, the count, the rate and the inter-arrival times of
+ * the events of each sensor are printed.
+ *
+ * Usage: sensors_emu_host [-m module] [-o events file] [-s seconds]
+ *
+ * Built with VIRTUAL_TIME, along with the module, the seconds are virtual.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <hardware/sensors.h>
+
+#include "../../../SensorEmulationClock.h"
+
+#define DEFAULT_MODULE "./sensors_emu.so"
+#define DEFAULT_EVENTS_FILE "./hal_events"
+
+#define SENSOR_EVENTS_AT_ONCE 16 /* As in the sensorservice's thread loop. */
+
+#define LOG(...) (void)(printf("%s %d: ", __func__, __LINE__) && printf(__VA_ARGS__) && fflush(stdout))
+#define ERR(...) (void)(fprintf(stderr, "%s %d: ERROR - ", __func__, __LINE__) && fprintf(stderr, __VA_ARGS__) && fflush(stderr))
+
+struct sensor_stats {
+	unsigned long long events;
+	int64_t first_ns;
+	int64_t last_ns;
+	int64_t min_gap_ns;
+	int64_t max_gap_ns;
+};
+
+static volatile sig_atomic_t stop;
+
+static void sigint_handler(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec t = { 0 };
+	emu_clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-m module] [-o events file] [-s seconds]\n", prog);
+	fprintf(stderr, "\t-m the HAL module (%s)\n", DEFAULT_MODULE);
+	fprintf(stderr, "\t-o the file the delivered events are recorded in (%s)\n", DEFAULT_EVENTS_FILE);
+	fprintf(stderr, "\t-s how long to poll, in seconds (until Ctrl+C)\n");
+}
+
+static int sensor_index(const struct sensor_t *list, int count, int handle)
+{
+	int i = 0;
+	while (i < count) {
+		if (list[i].handle == handle) {
+			return i;
+		}
+		i++;
+	}
+
+	return -1;
+}
+
+static void print_stats(const struct sensor_t *list, int count, const struct sensor_stats *stats)
+{
+	printf("\n%-40s %12s %12s %14s %14s\n", "Sensor", "Events", "Events/s", "Min gap(us)", "Max gap(us)");
+
+	int i = 0;
+	while (i < count) {
+		const struct sensor_stats *s = &stats[i];
+		double span_s = (s->last_ns - s->first_ns) / 1E9;
+		double rate = s->events > 1 && span_s > 0 ? (s->events - 1) / span_s : 0;
+
+		printf("%-40s %12llu %12.1f %14.1f %14.1f\n", list[i].name, s->events, rate,
+				s->events > 1 ? s->min_gap_ns / 1E3 : 0, s->events > 1 ? s->max_gap_ns / 1E3 : 0);
+		i++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = EXIT_FAILURE;
+
+	const char *module_path = DEFAULT_MODULE;
+	const char *events_path = DEFAULT_EVENTS_FILE;
+	long duration_s = 0;
+
+	int opt = -1;
+	while ((opt = getopt(argc, argv, "m:o:s:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			module_path = optarg;
+			break;
+		case 'o':
+			events_path = optarg;
+			break;
+		case 's':
+			duration_s = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	void *dso = NULL;
+	FILE *events_fp = NULL;
+	struct sensors_poll_device_t *dev = NULL;
+	struct sensor_stats *stats = NULL;
+
+	LOG("Loading %s . . .\n", module_path);
+	dso = dlopen(module_path, RTLD_NOW);
+	if (!dso) {
+		ERR("dlopen - %s\n", dlerror());
+		goto done;
+	}
+
+	struct sensors_module_t *module = dlsym(dso, HAL_MODULE_INFO_SYM_AS_STR);
+	if (!module) {
+		ERR("dlsym - %s\n", dlerror());
+		goto done;
+	}
+
+	bool valid = module->common.tag == HARDWARE_MODULE_TAG && module->common.id &&
+					!strcmp(module->common.id, SENSORS_HARDWARE_MODULE_ID);
+	if (!valid) {
+		ERR("%s isn't a sensors HAL module!\n", module_path);
+		goto done;
+	}
+	module->common.dso = dso;
+	LOG("Loaded \"%s\" by %s, version %d.%d\n", module->common.name, module->common.author,
+					module->common.version_major, module->common.version_minor);
+
+	const struct sensor_t *list = NULL;
+	int count = module->get_sensors_list(module, &list);
+	if (count <= 0 || !list) {
+		ERR("get_sensors_list - No sensors!\n");
+		goto done;
+	}
+
+	stats = calloc(count, sizeof(*stats));
+	if (!stats) {
+		ERR("calloc - %s\n", strerror(errno));
+		goto done;
+	}
+
+	bool opened = sensors_open(&module->common, &dev) == 0 && dev;
+	if (!opened) {
+		ERR("open - Failed to open the poll device!\n");
+		goto done;
+	}
+
+	int i = 0;
+	while (i < count) {
+		LOG("%d : %s (handle %d, type %d, maxRange %f, resolution %f, minDelay %dus)\n", i, list[i].name,
+			list[i].handle, list[i].type, list[i].maxRange, list[i].resolution, list[i].minDelay);
+
+		dev->activate(dev, list[i].handle, 1);
+		dev->setDelay(dev, list[i].handle, (int64_t)list[i].minDelay * 1000);
+		stats[i].min_gap_ns = INT64_MAX;
+		i++;
+	}
+
+	events_fp = fopen(events_path, "w");
+	if (!events_fp) {
+		ERR("fopen - %s - %s\n", events_path, strerror(errno));
+		goto done;
+	}
+
+	(void)signal(SIGINT, sigint_handler);
+
+	int64_t start_ns = now_ns();
+	int64_t end_ns = duration_s > 0 ? start_ns + duration_s * 1000000000LL : INT64_MAX;
+
+	LOG("Polling . . .\n");
+	while (!stop) {
+		sensors_event_t events[SENSOR_EVENTS_AT_ONCE];
+		memset(events, 0, sizeof(events));
+
+		int num_events = dev->poll(dev, events, SENSOR_EVENTS_AT_ONCE);
+		int64_t delivered_ns = now_ns();
+
+		if (num_events < 0) {
+			ERR("poll - %d\n", num_events);
+			break;
+		}
+
+		i = 0;
+		while (i < num_events) {
+			const sensors_event_t *e = &events[i];
+			int s = sensor_index(list, count, e->sensor);
+
+			fprintf(events_fp, "%lld %lld %d %d %.9f %.9f %.9f\n", (long long)delivered_ns,
+						(long long)e->timestamp, e->sensor, s != -1 ? list[s].type : 0,
+						e->data[0], e->data[1], e->data[2]);
+
+			if (s != -1) {
+				struct sensor_stats *st = &stats[s];
+				if (st->events) {
+					int64_t gap_ns = delivered_ns - st->last_ns;
+					st->min_gap_ns = gap_ns < st->min_gap_ns ? gap_ns : st->min_gap_ns;
+					st->max_gap_ns = gap_ns > st->max_gap_ns ? gap_ns : st->max_gap_ns;
+				} else {
+					st->first_ns = delivered_ns;
+				}
+				st->last_ns = delivered_ns;
+				st->events++;
+			}
+			i++;
+		}
+
+		if (delivered_ns >= end_ns) {
+			break;
+		}
+	}
+	LOG("Polled for %.3fs\n", (now_ns() - start_ns) / 1E9);
+
+	print_stats(list, count, stats);
+
+	ret = EXIT_SUCCESS;
+
+done:
+	if (events_fp) {
+		fclose(events_fp);
+	}
+	free(stats);
+
+	// The module's server threads can't be stopped, so the module stays
+	// loaded till the process exits.
+
+	return ret;
+}
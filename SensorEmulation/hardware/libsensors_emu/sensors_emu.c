@@ -41,7 +41,10 @@
  * server will interpret the individual components of the readings as needed
  * for the respective sensor and writes the interperted readings onto
  * a global shared data structure which will be read during a periodically
- * initiated poll event from the Android sensor subsystem.
+ * initiated poll event from the Android sensor subsystem - a pipe for the
+ * accelerometer and the gyroscope, and for the rest the last reading,
+ * behind a seqlock (SensorEmulationSeqlock.h) so that the poll takes it
+ * whole and only once.
  *
  * The servers are implemented as separate threads using pthread library.
  */
@@ -57,6 +60,7 @@
 #include <unistd.h>
 #include <math.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -65,7 +69,22 @@
 
 #include <pthread.h>
 
-#define POLL_DELAY_CONF_FILE "/data/poll_delay.conf"
+#include "../../SensorEmulationClock.h"
+#include "../../SensorEmulationTrace.h"
+#include "../../SensorEmulationLog.h"
+#include "../../SensorEmulationSeqlock.h"
+#include "../../SensorEmulationRecord.h"
+
+// /data on the guest. The Linux host build points it elsewhere.
+#ifndef DATA_DIR
+#define DATA_DIR "/data"
+#endif
+
+#define EMU_STATS_DIR DATA_DIR
+#include "../../SensorEmulationStats.h"
+
+#define POLL_DELAY_CONF_FILE DATA_DIR "/poll_delay.conf"
+#define LOG_CONF_FILE DATA_DIR "/log.conf"
 
 #define GYRO_NUM_READINGS_AT_ONCE 40
 #define ACCEL_NUM_READINGS_AT_ONCE 40
@@ -75,17 +94,27 @@
 #define GYRO_READINGS_BUF_SIZE 50 /* 3 Readings */
 #define ACCEL_READINGS_BUF_SIZE 50 /* 3 Readings */
 
+// On the wire, with the trace trailer if any.
+#define READINGS_FRAME_SIZE (READINGS_BUF_SIZE + 1 + EMU_TRACE_SIZE)
+#define GYRO_FRAME_SIZE (GYRO_READINGS_BUF_SIZE + 1 + EMU_TRACE_SIZE)
+#define ACCEL_FRAME_SIZE (ACCEL_READINGS_BUF_SIZE + 1 + EMU_TRACE_SIZE)
+
 #define ONLY_READING
 
 #ifdef ONLY_READING
 
+// All of the sensors' readings are recorded in DATA_DIR/readings.rec, in the
+// binary format of SensorEmulationRecord.h, unless TEXT_READINGS is defined.
+// #define TEXT_READINGS
+
+#ifdef TEXT_READINGS
 static FILE *readings_fp[NUM_SENSORS];
 static const char *sensor_readings_files[NUM_SENSORS] = {
-							"/data/accel_readings",
-							"/data/magnet_readings",
-							"/data/light_readings",
-							"/data/proximity_readings",
-							"/data/gyroscope_readings",
+							DATA_DIR "/accel_readings",
+							DATA_DIR "/magnet_readings",
+							DATA_DIR "/light_readings",
+							DATA_DIR "/proximity_readings",
+							DATA_DIR "/gyroscope_readings",
 							};
 #define INIT_LOG_READING do {\
 				int i = 0;\
@@ -99,28 +128,51 @@ static const char *sensor_readings_files[NUM_SENSORS] = {
 #define LOG_READING do {\
 			if (readings_fp[n] && readings[0]) {\
 				struct timespec t = { 0 };\
-				clock_gettime(CLOCK_REALTIME, &t);\
+				emu_clock_gettime(CLOCK_REALTIME, &t);\
 				unsigned long long int ts = t.tv_sec * 1E9 + t.tv_nsec;\
 				if (n == EGyro) {\
 					int i = 0;\
 					while (i < GYRO_NUM_READINGS_AT_ONCE) {\
-						fprintf(readings_fp[n], "[%s] %lluns : %s\n", sensors_name[n], ts,\
-											readings + i * (GYRO_READINGS_BUF_SIZE + 1));\
+						EMU_LOG_READING(readings_fp[n], "[%s] %lluns : %s\n", sensors_name[n], ts,\
+											readings + i * GYRO_FRAME_SIZE);\
 						i++;\
 					}\
 				} else if (n == EAccel) {\
 					int i = 0;\
 					while (i < ACCEL_NUM_READINGS_AT_ONCE) {\
-						fprintf(readings_fp[n], "[%s] %lluns : %s\n", sensors_name[n], ts,\
-											readings + i * (ACCEL_READINGS_BUF_SIZE + 1));\
+						EMU_LOG_READING(readings_fp[n], "[%s] %lluns : %s\n", sensors_name[n], ts,\
+											readings + i * ACCEL_FRAME_SIZE);\
 						i++;\
 					}\
 				} else {\
-					fprintf(readings_fp[n], "[%s] %lluns : %s\n", sensors_name[n], ts, readings);\
+					EMU_LOG_READING(readings_fp[n], "[%s] %lluns : %s\n", sensors_name[n], ts, readings);\
+				}\
+			}\
+		} while(0)
+#else
+
+static struct emu_rec *readings_rec;
+#define INIT_LOG_READING do {\
+				if (!readings_rec) {\
+					readings_rec = emu_rec_open(DATA_DIR "/readings.rec", sensors_name, NUM_SENSORS);\
+				}\
+			} while(0)
+#define LOG_READING do {\
+			if (readings_rec && readings[0]) {\
+				int64_t ns = emu_rec_now();\
+				int num = n == EGyro ? GYRO_NUM_READINGS_AT_ONCE : n == EAccel ? ACCEL_NUM_READINGS_AT_ONCE : 1;\
+				size_t frame_size = n == EGyro ? GYRO_FRAME_SIZE : n == EAccel ? ACCEL_FRAME_SIZE : READINGS_FRAME_SIZE;\
+				int i = 0;\
+				while (i < num) {\
+					if (readings[i * frame_size]) {\
+						emu_rec_append_text(readings_rec, n, ns, readings + i * frame_size);\
+					}\
+					i++;\
 				}\
-				fflush(readings_fp[n]);\
 			}\
 		} while(0)
+#endif
+
 #else
 
 #define INIT_LOG_READING
@@ -136,20 +188,18 @@ static FILE *fp;
 
 #define INITIALIZE_ERR_LOG do {\
 				if (!fp) {\
-					fp = fopen("/data/sensor_log", "a");\
+					fp = fopen(DATA_DIR "/sensor_log", "a");\
 				}\
 			} while(0)
-#define ERR(...) (void)(fp && fprintf(fp, "%s %d: ERROR - ", __func__, __LINE__) \
-								&& fprintf(fp, __VA_ARGS__) && fflush(fp))
-#define ERR_SERVER(...) (void)(fp && fprintf(fp, "[%s] %s %d: ERROR - ", sensors_name[n], __func__, __LINE__) \
-								&& fprintf(fp, __VA_ARGS__) && fflush(fp))
+#define ERR(...) EMU_ERR(fp, __VA_ARGS__)
+#define ERR_SERVER(...) EMU_ERR_TAG(fp, sensors_name[n], __VA_ARGS__)
 #define ERR_POLL_PIPE ERR_SERVER
 #else
 
 #define INITIALIZE_ERR_LOG
 #define ERR(...)
 #define ERR_SERVER(...)
-#define ERR_POLL_PIPE
+#define ERR_POLL_PIPE(...)
 
 #endif
 
@@ -159,12 +209,12 @@ static FILE *fp;
 
 #define INITIALIZE_LOG do {\
 				if (!fp) {\
-					fp = fopen("/data/sensor_log", "a");\
+					fp = fopen(DATA_DIR "/sensor_log", "a");\
 				}\
 			} while(0)
-#define LOG(...) (void)(fp && fprintf(fp, "%s %d: ", __func__, __LINE__) && fprintf(fp, __VA_ARGS__) && fflush(fp))
-#define LOG_SERVER(...) (void)(fp && fprintf(fp, "[%s] - ", sensors_name[n]), LOG(__VA_ARGS__))
-#define LOG_POLL_PIPE LOG_SERVER
+#define LOG(...) EMU_LOG(fp, __VA_ARGS__)
+#define LOG_SERVER(...) EMU_LOG_TAG(fp, sensors_name[n], __VA_ARGS__)
+#define LOG_POLL_PIPE(...) EMU_DEBUG_TAG(fp, sensors_name[n], __VA_ARGS__) // Every poll.
 #define LOG_LINE LOG(" ")
 
 #else
@@ -172,11 +222,38 @@ static FILE *fp;
 #define INITIALIZE_LOG
 #define LOG(...)
 #define LOG_SERVER(...)
-#define LOG_POLL_PIPE
+#define LOG_POLL_PIPE(...)
 #define LOG_LINE
 
 #endif /* DEBUG */
 
+#ifdef TRACE_HOPS
+
+#define TRACE_HOPS_FILE DATA_DIR "/trace_hops"
+
+static FILE *trace_fp;
+static struct emu_trace_stats trace_stats[NUM_SENSORS]; // Only touched by dummy_poll().
+static char sensor_trace[NUM_SENSORS][EMU_TRACE_SIZE]; // Goes along with sensor_data[].
+
+#define INIT_TRACE_HOPS do {\
+				if (!trace_fp) {\
+					trace_fp = fopen(TRACE_HOPS_FILE, "w");\
+				}\
+			} while(0)
+#define TRACE_HANDOFF(frame) do {\
+				EMU_TRACE_STAMP(frame, READINGS_BUF_SIZE + 1, EMU_HOP_HAL_HANDOFF);\
+				memcpy(sensor_trace[n], (frame) + READINGS_BUF_SIZE + 1, EMU_TRACE_SIZE);\
+			} while(0)
+#define TRACE_DELIVERED(n, trailer) trace_delivered(n, trailer)
+
+#else
+
+#define INIT_TRACE_HOPS
+#define TRACE_HANDOFF(frame)
+#define TRACE_DELIVERED(n, trailer)
+
+#endif /* TRACE_HOPS */
+
 
 #define ID_ACCELERATION (SENSORS_HANDLE_BASE + 0)
 #define ID_MAGNETIC (SENSORS_HANDLE_BASE + 1)
@@ -240,6 +317,37 @@ static int connfd[NUM_SENSORS];
 static bool connected[NUM_SENSORS];
 sensors_event_t sensor_data[NUM_SENSORS];
 
+// The last reading of each of the magnetic, light and proximity sensors,
+// handed whole from its server to dummy_poll() through a seqlock, which
+// tells it whether there's been one since it took the last.
+struct last_reading {
+	sensors_event_t event;
+	int64_t in_ns; /* When it came in, for the statistics. */
+#ifdef TRACE_HOPS
+	char trace[EMU_TRACE_SIZE];
+#endif
+};
+struct on_change {
+	struct emu_seq seq;
+	uint32_t words[EMU_SEQ_WORDS(sizeof(struct last_reading))];
+	uint32_t polled; /* The seq dummy_poll() took last. */
+};
+static struct on_change on_change[NUM_SENSORS];
+
+// When the frames in the pipes came in - a batch of them per
+// write_frames(), the frames it wrote adding up to end[]. in_ns[head] is
+// the batch being written, as dummy_poll() may read it before it's counted.
+#define PIPE_BATCHES 64
+struct pipe_batches {
+	uint64_t end[PIPE_BATCHES];
+	int64_t in_ns[PIPE_BATCHES];
+	uint32_t head; /* Written by the server. */
+	uint64_t in; /* Frames written, by the server. */
+	uint32_t tail; /* By dummy_poll(). */
+	uint64_t out; /* Frames read, by dummy_poll(). */
+};
+static struct pipe_batches pipe_batches[NUM_SENSORS];
+
 static pthread_t emu_readings_server_th_ids[NUM_SENSORS];
 
 static void cleanup_emu_server(int i)
@@ -258,7 +366,7 @@ static void cleanup_emu_server(int i)
 	}
 	LOG("Closing connections . . .\n");
 	if (connfd[i] != -1) {
-		bool closed = close(connfd[i]) != -1;
+		bool closed = emu_close(connfd[i]) != -1;
 		if (!closed) {
 			ERR("close - %s\n", strerror(errno));
 		} else {
@@ -286,6 +394,80 @@ struct emu_server_data {
 	int num;
 };
 
+// The pipes are read a frame at a time by poll_sensor_pipe(). Hence, only
+// whole frames are written, at most PIPE_BUF bytes of them at a time so
+// that no write() to the non-blocking pipe ends up partial.
+static int write_frames(int fd, const char *frames, size_t frame_size, int num)
+{
+	int per_write = PIPE_BUF / frame_size;
+	int bytes_wrote = 0;
+
+	int i = 0;
+	while (i < num) {
+		int count = num - i < per_write ? num - i : per_write;
+		ssize_t wrote = write(fd, frames + i * frame_size, count * frame_size);
+		if (wrote == -1) {
+			return bytes_wrote ? bytes_wrote : -1;
+		}
+		bytes_wrote += wrote;
+		i += count;
+	}
+
+	return bytes_wrote;
+}
+
+// The frames of sensor n received at in_ns, about to be written to the pipe.
+static void count_piping(int n, int64_t in_ns)
+{
+	struct pipe_batches *b = &pipe_batches[n];
+
+	__atomic_store_n(&b->in_ns[b->head % PIPE_BATCHES], in_ns, __ATOMIC_RELEASE);
+}
+
+// How many of the num frames made it to the pipe.
+static void count_piped(int n, int bytes_wrote, size_t frame_size, int num)
+{
+	struct pipe_batches *b = &pipe_batches[n];
+	int piped = bytes_wrote > 0 ? bytes_wrote / frame_size : 0;
+
+	EMU_STATS_COUNT(n, drops, num - piped);
+	if (!piped) {
+		return;
+	}
+	EMU_STATS_COUNT(n, queued_in, piped);
+	b->in += piped;
+	b->end[b->head % PIPE_BATCHES] = b->in;
+	__atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+}
+
+// A frame of sensor n read off its pipe, delivered unless it was empty.
+static void count_unpiped(int n, size_t frame_size, bool delivered)
+{
+	struct pipe_batches *b = &pipe_batches[n];
+	uint32_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+
+	b->out++;
+	while (b->tail != head && b->end[b->tail % PIPE_BATCHES] < b->out) {
+		b->tail++;
+	}
+	EMU_STATS_COUNT(n, queued_out, 1);
+	if (delivered) {
+		int64_t in_ns = __atomic_load_n(&b->in_ns[b->tail % PIPE_BATCHES], __ATOMIC_ACQUIRE);
+		emu_stats_handed_on(n, 1, frame_size, in_ns);
+	}
+}
+
+#ifdef TRACE_HOPS
+static void trace_delivered(int n, const char *trailer)
+{
+	struct emu_trace t;
+	if (emu_trace_read(trailer, 0, &t)) {
+		t.stamp_ns[EMU_HOP_HAL_DELIVER] = emu_trace_now();
+		emu_trace_account(&trace_stats[n], &t, sensors_name[n], trace_fp);
+	}
+}
+#endif
+
 // Common server code for 3 of the real sensors : Magnet, Light, and Proximity.
 // The readings are received one at a time due to low frequencies of these
 // sensors on a real Android device. For remote server scenario, this doesn't
@@ -348,24 +530,30 @@ static void *emu_readings_server(void *arg)
 
 	connfd[n] = -1;
 
+	bool accepted = false;
 	while (1) {
 		connected[n] = false;
 
 		LOG_SERVER("Waiting to accept . . .\n");
-		connfd[n] = accept(listenfd[n], (struct sockaddr *)NULL, NULL);
+		connfd[n] = emu_accept(listenfd[n], (struct sockaddr *)NULL, NULL);
 		if (connfd[n] == -1) {
 			ERR_SERVER("accept - %s\n", strerror(errno));
 			goto done;
 		}
 		LOG_SERVER("Accepted!\n");
+		if (accepted) {
+			EMU_STATS_COUNT(n, reconnects, 1);
+		}
+		accepted = true;
 
 		int same_r_num = 0;	
 		char last_readings[READINGS_BUF_SIZE + 1] = "";
 		while (1) {
-			char readings[READINGS_BUF_SIZE + 1] = "";
+			char readings[READINGS_FRAME_SIZE] = "";
 
 			LOG_SERVER("Receiving . . .\n");
-			ssize_t bytes_received = recvfrom(connfd[n], readings, READINGS_BUF_SIZE + 1, MSG_WAITALL, NULL, 0);
+			ssize_t bytes_received = emu_recvfrom(connfd[n], readings, READINGS_FRAME_SIZE, MSG_WAITALL, NULL, 0);
+			EMU_TRACE_STAMP(readings, READINGS_BUF_SIZE + 1, EMU_HOP_HAL_RECV);
 			LOG_READING;
 
 			if (bytes_received == -1) {
@@ -379,6 +567,11 @@ static void *emu_readings_server(void *arg)
 				LOG_SERVER("Zero bytes received! Likely a faulty socket. Accepting again.\n");
 				break;
 			}
+			int64_t in_ns = emu_stats_now();
+			emu_stats_received(n, 1, bytes_received, in_ns);
+			if (bytes_received != READINGS_FRAME_SIZE) {
+				EMU_STATS_COUNT(n, partial_frames, 1);
+			}
 
 			bool device_locked = !readings[0];
 			if (device_locked) {
@@ -386,6 +579,12 @@ static void *emu_readings_server(void *arg)
 				continue;
 			}
 
+			// The one before wasn't polled yet.
+			if (emu_seq_current(&on_change[n].seq) != __atomic_load_n(&on_change[n].polled, __ATOMIC_RELAXED)) {
+				EMU_STATS_COUNT(n, drops, 1);
+			} else {
+				EMU_STATS_COUNT(n, queued_in, 1);
+			}
 			connected[n] = true;
 
 			bool same_r = !strcmp(readings, last_readings);
@@ -433,15 +632,23 @@ static void *emu_readings_server(void *arg)
 					break;
 				}
 			}
+			TRACE_HANDOFF(readings);
 
+			struct last_reading last;
+			last.event = sensor_data[n];
+			last.in_ns = in_ns;
+#ifdef TRACE_HOPS
+			memcpy(last.trace, sensor_trace[n], EMU_TRACE_SIZE);
+#endif
+			emu_seq_write(&on_change[n].seq, on_change[n].words, &last, sizeof(last));
 
-			nanosleep(&t, NULL);
+			emu_nanosleep(&t);
 		}
 
-		close(connfd[n]);
+		emu_close(connfd[n]);
 		connfd[n] = -1;
 			
-		nanosleep(&t, NULL);
+		emu_nanosleep(&t);
 	}
 	
 done:
@@ -462,13 +669,12 @@ static int gyro_pipefd[2] = { -1, -1 };
 static void *emu_gyro_readings_server(void *arg)
 {
 	struct emu_server_data *data = arg;
-	int id = data->sensor_id;
 	int port = data->port;
 	int n = data->num;
 
 	LOG_SERVER("\n\n** Emulator server for %s - Started! **\n", sensors_name[n]);
 	LOG_SERVER("[%d] Data : %p\n", n, (void *)data);
-	LOG_SERVER("[%d] Sensor id : %d\n", n, id);
+	LOG_SERVER("[%d] Sensor id : %d\n", n, data->sensor_id);
 	LOG_SERVER("[%d] Port : %d\n\n", n, port);
 
 	free(data);
@@ -516,27 +722,33 @@ static void *emu_gyro_readings_server(void *arg)
 
 	connfd[n] = -1;
 
+	bool accepted = false;
 	while (1) {
 		connected[n] = false;
 
 		LOG_SERVER("Waiting to accept . . .\n");
-		connfd[n] = accept(listenfd[n], (struct sockaddr *)NULL, NULL);
+		connfd[n] = emu_accept(listenfd[n], (struct sockaddr *)NULL, NULL);
 		if (connfd[n] == -1) {
 			ERR_SERVER("accept - %s\n", strerror(errno));
 			goto done;
 		}
 		LOG_SERVER("Accepted!\n");
+		if (accepted) {
+			EMU_STATS_COUNT(n, reconnects, 1);
+		}
+		accepted = true;
 
 		connected[n] = true;
 
-		char last_readings[GYRO_NUM_READINGS_AT_ONCE * (GYRO_READINGS_BUF_SIZE + 1)] = "";
+		char last_readings[GYRO_NUM_READINGS_AT_ONCE * GYRO_FRAME_SIZE] = "";
 		int same_r_num = 0;
 		while (1) {
-			char readings[GYRO_NUM_READINGS_AT_ONCE * (GYRO_READINGS_BUF_SIZE + 1)] = "";
+			char readings[GYRO_NUM_READINGS_AT_ONCE * GYRO_FRAME_SIZE] = "";
 
 			LOG_SERVER("Receiving . . .\n");
-			ssize_t bytes_received = recvfrom(connfd[n], readings,
-								GYRO_NUM_READINGS_AT_ONCE * (GYRO_READINGS_BUF_SIZE + 1), MSG_WAITALL, NULL, 0);
+			ssize_t bytes_received = emu_recvfrom(connfd[n], readings,
+								GYRO_NUM_READINGS_AT_ONCE * GYRO_FRAME_SIZE, MSG_WAITALL, NULL, 0);
+			EMU_TRACE_STAMP_FRAMES(readings, GYRO_FRAME_SIZE, GYRO_NUM_READINGS_AT_ONCE, EMU_HOP_HAL_RECV);
 			LOG_READING;
 
 			if (bytes_received == -1) {
@@ -550,6 +762,11 @@ static void *emu_gyro_readings_server(void *arg)
 				LOG_SERVER("Zero bytes received! Likely a faulty socket. Accepting again.\n");
 				break;
 			}
+			int64_t in_ns = emu_stats_now();
+			emu_stats_received(n, bytes_received / GYRO_FRAME_SIZE, bytes_received, in_ns);
+			if (bytes_received != GYRO_NUM_READINGS_AT_ONCE * GYRO_FRAME_SIZE) {
+				EMU_STATS_COUNT(n, partial_frames, 1);
+			}
 
 			bool device_locked = !readings[0];
 			if (device_locked) {
@@ -569,20 +786,23 @@ static void *emu_gyro_readings_server(void *arg)
 			strcpy(last_readings, readings);
 
 			LOG_SERVER("Writing onto gyro pipe . . .\n");
-			int bytes_wrote = write(gyro_pipefd[1], readings, sizeof(readings));
+			EMU_TRACE_STAMP_FRAMES(readings, GYRO_FRAME_SIZE, GYRO_NUM_READINGS_AT_ONCE, EMU_HOP_HAL_HANDOFF);
+			count_piping(n, in_ns);
+			int bytes_wrote = write_frames(gyro_pipefd[1], readings, GYRO_FRAME_SIZE, GYRO_NUM_READINGS_AT_ONCE);
+			count_piped(n, bytes_wrote, GYRO_FRAME_SIZE, GYRO_NUM_READINGS_AT_ONCE);
 			if (bytes_wrote == -1) {
 				ERR_SERVER("write - failed to write onot gyroscope pipe - %s\n", strerror(errno));
 			} else {
 				LOG_SERVER("Wrote %d bytes onto gyroscope pipe!\n", bytes_wrote);
 			}	
 
-			nanosleep(&t, NULL);
+			emu_nanosleep(&t);
 		}
 
-		close(connfd[n]);
+		emu_close(connfd[n]);
 		connfd[n] = -1;
 			
-		nanosleep(&t, NULL);
+		emu_nanosleep(&t);
 	}
 	
 done:
@@ -606,13 +826,12 @@ static int accel_pipefd[2] = { -1, -1 };
 static void *emu_accel_readings_server(void *arg)
 {
 	struct emu_server_data *data = arg;
-	int id = data->sensor_id;
 	int port = data->port;
 	int n = data->num;
 
 	LOG_SERVER("\n\n** Emulator server for %s - Started! **\n", sensors_name[n]);
 	LOG_SERVER("[%d] Data : %p\n", n, (void *)data);
-	LOG_SERVER("[%d] Sensor id : %d\n", n, id);
+	LOG_SERVER("[%d] Sensor id : %d\n", n, data->sensor_id);
 	LOG_SERVER("[%d] Port : %d\n\n", n, port);
 
 	free(data);
@@ -661,28 +880,34 @@ static void *emu_accel_readings_server(void *arg)
 
 	connfd[n] = -1;
 
+	bool accepted = false;
 	while (1) {
 		connected[n] = false;
 
 		LOG_SERVER("Waiting to accept . . .\n");
-		connfd[n] = accept(listenfd[n], (struct sockaddr *)NULL, NULL);
+		connfd[n] = emu_accept(listenfd[n], (struct sockaddr *)NULL, NULL);
 		if (connfd[n] == -1) {
 			ERR_SERVER("accept - %s\n", strerror(errno));
 			goto done;
 		}
 		LOG_SERVER("Accepted!\n");
+		if (accepted) {
+			EMU_STATS_COUNT(n, reconnects, 1);
+		}
+		accepted = true;
 
 		connected[n] = true;
 
-		char last_readings[ACCEL_NUM_READINGS_AT_ONCE * (ACCEL_READINGS_BUF_SIZE + 1)] = "";
+		char last_readings[ACCEL_NUM_READINGS_AT_ONCE * ACCEL_FRAME_SIZE] = "";
 		int same_r_num = 0;
 		while (1) {
-			char readings[ACCEL_NUM_READINGS_AT_ONCE * (ACCEL_READINGS_BUF_SIZE + 1)] = "";
+			char readings[ACCEL_NUM_READINGS_AT_ONCE * ACCEL_FRAME_SIZE] = "";
 
 			LOG_SERVER("Receiving . . .\n");
-			ssize_t bytes_received = recvfrom(connfd[n], readings,
-								ACCEL_NUM_READINGS_AT_ONCE * (ACCEL_READINGS_BUF_SIZE + 1),
+			ssize_t bytes_received = emu_recvfrom(connfd[n], readings,
+								ACCEL_NUM_READINGS_AT_ONCE * ACCEL_FRAME_SIZE,
 														MSG_WAITALL, NULL, 0);
+			EMU_TRACE_STAMP_FRAMES(readings, ACCEL_FRAME_SIZE, ACCEL_NUM_READINGS_AT_ONCE, EMU_HOP_HAL_RECV);
 			LOG_READING;
 
 			if (bytes_received == -1) {
@@ -696,6 +921,11 @@ static void *emu_accel_readings_server(void *arg)
 				LOG_SERVER("Zero bytes received! Likely a faulty socket. Accepting again.\n");
 				break;
 			}
+			int64_t in_ns = emu_stats_now();
+			emu_stats_received(n, bytes_received / ACCEL_FRAME_SIZE, bytes_received, in_ns);
+			if (bytes_received != ACCEL_NUM_READINGS_AT_ONCE * ACCEL_FRAME_SIZE) {
+				EMU_STATS_COUNT(n, partial_frames, 1);
+			}
 
 			bool device_locked = !readings[0];
 			if (device_locked) {
@@ -715,20 +945,23 @@ static void *emu_accel_readings_server(void *arg)
 			strcpy(last_readings, readings);
 
 			LOG_SERVER("Writing onto gyro pipe . . .\n");
-			int bytes_wrote = write(accel_pipefd[1], readings, sizeof(readings));
+			EMU_TRACE_STAMP_FRAMES(readings, ACCEL_FRAME_SIZE, ACCEL_NUM_READINGS_AT_ONCE, EMU_HOP_HAL_HANDOFF);
+			count_piping(n, in_ns);
+			int bytes_wrote = write_frames(accel_pipefd[1], readings, ACCEL_FRAME_SIZE, ACCEL_NUM_READINGS_AT_ONCE);
+			count_piped(n, bytes_wrote, ACCEL_FRAME_SIZE, ACCEL_NUM_READINGS_AT_ONCE);
 			if (bytes_wrote == -1) {
 				ERR_SERVER("write - failed to write onto accelerometer pipe - %s\n", strerror(errno));
 			} else {
 				LOG_SERVER("Wrote %d bytes onto accelerometer pipe!\n", bytes_wrote);
 			}
 
-			nanosleep(&t, NULL);
+			emu_nanosleep(&t);
 		}
 
-		close(connfd[n]);
+		emu_close(connfd[n]);
 		connfd[n] = -1;
 			
-		nanosleep(&t, NULL);
+		emu_nanosleep(&t);
 	}
 	
 done:
@@ -768,7 +1001,7 @@ static bool unblock_pipes(int pipefd[])
 	}
 
 	LOG("Unblocking pipe-back . . .\n");
-	bool back_flags = fcntl(pipefd[1], F_GETFL, 0);
+	int back_flags = fcntl(pipefd[1], F_GETFL, 0);
 	bool back_fcntld = back_flags != -1;
 	if (back_fcntld) {
 		LOG("Got pipe-back flags!\n");
@@ -900,7 +1133,10 @@ static bool poll_sensor_pipe(sensors_event_t sensor_data[], int sensor, int pipe
 		char readings[readings_size];
 		memset(readings, 0, sizeof(readings));
 
-		(void)read(pipefd[0], readings, sizeof(readings));
+		ssize_t bytes_read = read(pipefd[0], readings, sizeof(readings));
+		if (bytes_read > 0) {
+			count_unpiped(n, readings_size, readings[0]);
+		}
 		if (readings[0]) {
 			LOG_POLL_PIPE("pipe reading : %s\n", readings);
 
@@ -914,6 +1150,7 @@ static bool poll_sensor_pipe(sensors_event_t sensor_data[], int sensor, int pipe
 			sscanf(s_d + 1, "%f", &sensor_data[sensor_j].data[2]);
 			sensor_data[sensor_j].sensor = sensor;
 			sensor_data[sensor_j].timestamp = ts;
+			TRACE_DELIVERED(n, readings + readings_size - EMU_TRACE_SIZE);
 
 			LOG_POLL_PIPE("Read poll event data: %.9f|%.9f|%.9f\n", sensor_data[sensor_j].data[0],
 										sensor_data[sensor_j].data[1],
@@ -944,10 +1181,10 @@ static int dummy_poll(struct sensors_poll_device_t *dev, sensors_event_t *data,
 
 	int num_events = 0;
 
-	usleep(delay_us);
+	emu_usleep(delay_us);
 
 	struct timespec t = { 0 };
-	bool timed = clock_gettime(CLOCK_MONOTONIC, &t) != -1;
+	bool timed = emu_clock_gettime(CLOCK_MONOTONIC, &t) != -1;
 	if (!timed) {
 		ERR("clock_gettime - %s\n", strerror(errno));
 		goto done;
@@ -960,7 +1197,7 @@ static int dummy_poll(struct sensors_poll_device_t *dev, sensors_event_t *data,
 
 	if (connected[EAccel]) {
 		LOG("Accelerometer server is connected!\n");
-		bool polled = poll_sensor_pipe(data, EAccel, accel_pipefd, ACCEL_READINGS_BUF_SIZE + 1, j, ts);
+		bool polled = poll_sensor_pipe(data, EAccel, accel_pipefd, ACCEL_FRAME_SIZE, j, ts);
 		if (polled) {
 			LOG("Accelerometer pipe successfully polled and read.\n");
 			num_events++;
@@ -972,21 +1209,17 @@ static int dummy_poll(struct sensors_poll_device_t *dev, sensors_event_t *data,
 
 	i = 1;
 	while (i < NUM_SENSORS - 1) {
-		if (connected[i]) {
-			connected[i] = false; // If in case, the device has closed
-						// the application querying the
-						// specific sensor, then this
-						// will prevent any false readings
-						// from getting given as the poll
-						// data during the next poll.
-						//
-						// There will be a race condition
-						// between this polling thread
-						// and the server thread. But, that's
-						// fine -- speed matters!
-
-			data[j] = sensor_data[i];
+		struct on_change *c = &on_change[i];
+		if (emu_seq_current(&c->seq) != c->polled) { // Each reading is given once.
+			struct last_reading last;
+			uint32_t seq = emu_seq_read(&c->seq, c->words, &last, sizeof(last));
+			__atomic_store_n(&c->polled, seq, __ATOMIC_RELAXED);
+
+			data[j] = last.event;
 			data[j].timestamp = ts;
+			TRACE_DELIVERED(i, last.trace);
+			EMU_STATS_COUNT(i, queued_out, 1);
+			emu_stats_handed_on(i, 1, READINGS_FRAME_SIZE, last.in_ns);
 		
 			j++;
 			
@@ -997,7 +1230,7 @@ static int dummy_poll(struct sensors_poll_device_t *dev, sensors_event_t *data,
 
 	if (connected[EGyro]) {
 		LOG("Gyroscope server is connected!\n");
-		bool polled = poll_sensor_pipe(data, EGyro, gyro_pipefd, GYRO_READINGS_BUF_SIZE + 1, j, ts);
+		bool polled = poll_sensor_pipe(data, EGyro, gyro_pipefd, GYRO_FRAME_SIZE, j, ts);
 		if (polled) {
 			LOG("Gyroscope pipe successfully polled and read.\n");
 			num_events++;
@@ -1046,9 +1279,14 @@ static int initialize_sensor(const struct hw_module_t *module, const char *id, s
 	(void)signal(SIGSEGV, sigsegv_handler);
 	(void)signal(SIGABRT, sigabrt_handler);
 
+	emu_log_conf(LOG_CONF_FILE);
 	INITIALIZE_LOG;
 	INITIALIZE_ERR_LOG;
 	INIT_LOG_READING;
+	INIT_TRACE_HOPS;
+	if (!initialized && !emu_stats_open("hal", sensors_name, NUM_SENSORS)) {
+		ERR("Statistics page in %s - %s\n", EMU_STATS_DIR, strerror(errno));
+	}
 
 	LOG("Opening sensor with id : %s\n", id);
 
@@ -1057,7 +1295,7 @@ static int initialize_sensor(const struct hw_module_t *module, const char *id, s
 	if (poll_delay_conf_fp) {
 		LOG("Yes!\n");
 
-		int64_t delay_spec = 0;
+		long long int delay_spec = 0;
 
 		errno = 0;
 		bool success = fscanf(poll_delay_conf_fp, "%lld", &delay_spec) == 1;